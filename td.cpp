@@ -1,14 +1,34 @@
 
-
 #include <cstdio>
+#include <cstdlib>
+#include <cctype>
 #include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <map>
+#include <mutex>
 
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#else
+#include <glob.h>
+#endif
 
+#include "td_cache.h"
+#include "td_cpu.h"
 #include "td_image.h"
+#include "td_thread.h"
 #include "td.h"
 #include <iostream>
 using namespace td;
 
+// part of the keys of the conversion cache, has to change with the results
+static const char* const TOOL_VERSION = "td 3.1";
+
 struct cmd_data
 {
 	cmd_data()
@@ -17,16 +37,44 @@ struct cmd_data
 		output_image = "result.td";
 		output_format = Format::RGB;
 		output_data_type = DType::UNSIGNED_BYTE;
-		disable_dither = false;
+		dither = Dither::FLOYD_STEINBERG;
+		precision = Precision::FLOAT;
 		generate_mip_maps = false;
+		stream = false;
+		alignment = 16;
+		codec = Codec::NONE;
+		quality = BlockQuality::NORMAL;
+		jobs = 1;
+		threads = 0;
+		isa = active_isa();
+		cache_size = 0;
+		cache_age = 0;
 	}
 	std::string input_image;
 	std::string output_image;
 
 	Format output_format;
 	DType output_data_type;
-	bool disable_dither;
+	Dither dither;
+	Precision precision;
 	bool generate_mip_maps;
+	bool stream;
+	uint32_t alignment;
+	Codec codec;
+	BlockQuality quality;
+	MipSettings mip;
+	unsigned threads;
+	ISA isa;
+
+	// batch mode
+	std::vector<std::string> batch_sources;
+	std::string output_dir;
+	unsigned jobs;
+
+	// conversion cache
+	std::string cache_dir;
+	uint64_t cache_size; // MiB
+	uint32_t cache_age;  // days
 };
 
 
@@ -37,46 +85,145 @@ bool print_help(const std::string& msg="")
 		fprintf(stderr,"%s\n",msg.c_str());
 
 	fprintf(stderr,"-i <f>    Set input file <f>.               | %s\n",cd.input_image.c_str());
-	fprintf(stderr,"-o <f>    Set output file <f>.              | %s\n",cd.input_image.c_str());
+	fprintf(stderr,"-o <f>    Set output file <f>.              | %s\n",cd.output_image.c_str());
+	fprintf(stderr,"\tA .ktx ending writes KTX 1.1 (without -align and -codec).\n");
 
 	fprintf(stderr,"-f <frmt> Set output format to <frmt>.      | %s\n","RGB");
 	fprintf(stderr,"\tOne of: ALPHA, LUMINANCE, LUMINANCE_ALPHA, RGB, RGBA\n");
 	fprintf(stderr,"-dt <dt>  Set output data type to <dT>.     | %s\n","UNSIGNED_BYTE");
 	fprintf(stderr,"\tOne of: UNSIGNED_BYTE, UNSIGNED_SHORT_4_4_4_4,\n\t       UNSIGNED_SHORT_5_5_5_1, UNSIGNED_SHORT_5_6_5\n");
+	fprintf(stderr,"\tor the compressed ETC1_RGB8 (-f RGBA adds ALPHA layers),\n");
+	fprintf(stderr,"\t       ETC2_RGB8, ETC2_RGBA8_EAC, EAC_R11 (LUMINANCE or ALPHA),\n");
+	fprintf(stderr,"\t       EAC_RG11 (LUMINANCE_ALPHA, or red and green of RGB)\n");
+	fprintf(stderr,"\t       ASTC_4x4, ASTC_6x6, ASTC_8x8 (8, 3.56, 2 bits per pixel)\n");
+	fprintf(stderr,"\t       BC1_RGB, BC1_RGBA (1 bit alpha), BC3_RGBA, BC4_R (as EAC_R11),\n");
+	fprintf(stderr,"\t       BC5_RG (as EAC_RG11), PVRTC_RGB_4BPP, PVRTC_RGB_2BPP,\n");
+	fprintf(stderr,"\t       PVRTC_RGBA_4BPP, PVRTC_RGBA_2BPP (resized to a square\n");
+	fprintf(stderr,"\t       power of two)\n");
+	fprintf(stderr,"-q <q>    Set the compression quality.      | %s\n","NORMAL");
+	fprintf(stderr,"\tOne of: FAST, NORMAL, BEST\n");
 	fprintf(stderr,"-mm       Genreate MipMaps.                 | %s\n","false");
+	fprintf(stderr,"-stream   Convert in bands of rows.         | %s\n","false");
+	fprintf(stderr,"\tThe memory needed depends on the width only for PNM inputs\n");
+	fprintf(stderr,"\t(P5, P6, P7), no MipMaps, -p FLOAT only, no KTX outputs.\n");
+	fprintf(stderr,"-align <n> Align the layers to <n> bytes.   | %u\n",cd.alignment);
+	fprintf(stderr,"\tA power of two, e.g. 4096 for direct I/O.\n");
+	fprintf(stderr,"-codec <c> Compress the layers with <c>.    | %s\n","NONE");
+	fprintf(stderr,"\tOne of: NONE, LZ (lossless, fast to decompress),\n");
+	fprintf(stderr,"\t       PREDICTIVE (lossless, smaller for the 16 bit types)\n");
+	fprintf(stderr,"-mf <f>   Set the mip-map filter to <f>.    | %s\n","REFERENCE");
+	fprintf(stderr,"\tOne of: REFERENCE (triangle), FAST (box)\n");
+	fprintf(stderr,"-tf <tf>  Set the input transfer function.  | %s\n","GAMMA_22");
+	fprintf(stderr,"\tOne of: LINEAR, GAMMA_22, SRGB (mip-maps are filtered linearly)\n");
+	fprintf(stderr,"-cm <m>   Set the color conversion method.  | %s\n","SIMD");
+	fprintf(stderr,"\tOne of: REFERENCE (powf), LUT, SIMD\n");
+	fprintf(stderr,"-dither <d> Set the dithering to <d>.     | %s\n","FLOYD_STEINBERG");
+	fprintf(stderr,"\tOne of: NONE, FLOYD_STEINBERG, BAYER, BLUE_NOISE\n");
 	fprintf(stderr,"-dd       Disable dithering on quantization | %s\n","false");
+	fprintf(stderr,"-p <p>    Set the working precision to <p>. | %s\n","FLOAT");
+	fprintf(stderr,"\tOne of: FLOAT, HALF, UNORM16 (16 bit, half the memory)\n");
+	fprintf(stderr,"-t <n>    Use <n> threads per conversion.   | %s\n","all cores");
+	fprintf(stderr,"-isa <i>  Limit the kernels to the ISA <i>. | %s\n",isa_name(cd.isa));
+	fprintf(stderr,"\tOne of: SCALAR, SSE2, SSSE3, AVX2, AVX512\n");
+	fprintf(stderr,"\tThe default is detected, or set by the environment TD_ISA.\n");
+	fprintf(stderr,"\nBatch mode:\n");
+	fprintf(stderr,"-b <src>  Add inputs from <src>, which is   |\n");
+	fprintf(stderr,"\ta directory (searched recursively), a glob pattern or a\n");
+	fprintf(stderr,"\tlist file with one '<input> [options]' entry per line.\n");
+	fprintf(stderr,"\tDirectories and globs skip .td and .ktx files.\n");
+	fprintf(stderr,"\tOptions given in the list override the command line, except\n");
+	fprintf(stderr,"\t-t, -isa and the batch and cache options.\n");
+	fprintf(stderr,"-od <d>   Write batch outputs into dir <d>. | next to input\n");
+	fprintf(stderr,"-j <n>    Convert <n> inputs concurrently.  | %u\n",cd.jobs);
+	fprintf(stderr,"\nConversion cache:\n");
+	fprintf(stderr,"-cache <d> Reuse the results of identical    |\n");
+	fprintf(stderr,"\tconversions (same input bytes and options) stored in dir <d>.\n");
+	fprintf(stderr,"-cache-size <n> Limit the cache to <n> MiB. | unlimited\n");
+	fprintf(stderr,"-cache-age <n> Evict entries unused for <n> days. | never\n");
 
 
 	return false;
 }
-bool parse_cmd(int argc, char** argv, cmd_data& cd)
+
+/**
+ * @brief parse_args applies the options in args to cd. It is used for the
+ * command line as well as for the per-input options of batch list files.
+ */
+bool parse_args(const std::vector<std::string>& args, cmd_data& cd)
 {
-	for(int i  =1 ; i < argc;)
+	for(size_t i = 0 ; i < args.size();)
 	{
-		auto c = std::string(argv[i++]);
-		if(c == "-i")
+		const auto& c = args[i++];
+		const bool has_arg = i < args.size();
+		if(c == "-i" && has_arg)
+		{
+			cd.input_image=args[i++];
+		}
+		else if(c == "-o" && has_arg)
+		{
+			cd.output_image=args[i++];
+		}
+		else if(c == "-stream")
+		{
+			cd.stream = true;
+		}
+		else if(c == "-align" && has_arg)
 		{
-			cd.input_image=argv[i++];
+			const long a = atol(args[i++].c_str());
+			if(a <= 0 || a > (1l<<20) || (a&(a-1)))
+				return print_help("Invalid alignment '"+args[i-1]+"'");
+			cd.alignment = uint32_t(a);
 		}
-		if(c == "-o")
+		else if(c == "-codec" && has_arg)
 		{
-			cd.output_image=argv[i++];
+			const std::string& t = args[i++];
+			if(t == "NONE") cd.codec = Codec::NONE;
+			if(t == "LZ") cd.codec = Codec::LZ;
+			if(t == "PREDICTIVE") cd.codec = Codec::PREDICTIVE;
 		}
-		if(c == "-mm")
+		else if(c == "-mm")
 		{
 			cd.generate_mip_maps = true;
 		}
-		if(c == "-dd")
+		else if(c == "-mf" && has_arg)
+		{
+			const std::string& t = args[i++];
+			if(t == "REFERENCE") cd.mip.filter = MipFilter::REFERENCE;
+			if(t == "FAST") cd.mip.filter = MipFilter::FAST;
+		}
+		else if(c == "-tf" && has_arg)
+		{
+			const std::string& t = args[i++];
+			if(t == "LINEAR") cd.mip.transfer = Transfer::LINEAR;
+			if(t == "GAMMA_22") cd.mip.transfer = Transfer::GAMMA_22;
+			if(t == "SRGB") cd.mip.transfer = Transfer::SRGB;
+		}
+		else if(c == "-cm" && has_arg)
+		{
+			const std::string& t = args[i++];
+			if(t == "REFERENCE") cd.mip.color = ColorMethod::REFERENCE;
+			if(t == "LUT") cd.mip.color = ColorMethod::LUT;
+			if(t == "SIMD") cd.mip.color = ColorMethod::SIMD;
+		}
+		else if(c == "-dd")
 		{
-			cd.disable_dither = true;
+			cd.dither = Dither::NONE;
 		}
-		if(c == "-h")
+		else if(c == "-dither" && has_arg)
+		{
+			const std::string& t = args[i++];
+			if(t == "NONE") cd.dither = Dither::NONE;
+			if(t == "FLOYD_STEINBERG") cd.dither = Dither::FLOYD_STEINBERG;
+			if(t == "BAYER") cd.dither = Dither::BAYER;
+			if(t == "BLUE_NOISE") cd.dither = Dither::BLUE_NOISE;
+		}
+		else if(c == "-h")
 		{
 			return print_help();
 		}
-		if(c == "-f")
+		else if(c == "-f" && has_arg)
 		{
-#define stformat(x) if(std::string(argv[i]) == #x ) cd.output_format = Format:: x
+#define stformat(x) if(args[i] == #x ) cd.output_format = Format:: x
 			stformat(ALPHA);
 			stformat(LUMINANCE);
 			stformat(LUMINANCE_ALPHA);
@@ -85,9 +232,9 @@ bool parse_cmd(int argc, char** argv, cmd_data& cd)
 #undef stformat
 			i++;
 		}
-		if(c == "-dt")
+		else if(c == "-dt" && has_arg)
 		{
-			std::string t(argv[i]);
+			const std::string& t = args[i++];
 			if(t == "UNSIGNED_BYTE" ) cd.output_data_type = DType::UNSIGNED_BYTE;
 			if(t == "UNSIGNED_SHORT_4_4_4_4" )
 			{
@@ -104,21 +251,262 @@ bool parse_cmd(int argc, char** argv, cmd_data& cd)
 				cd.output_data_type = DType::UNSIGNED_SHORT_5_6_5;
 				cd.output_format = Format::RGB;
 			}
+			if(t == "ETC1_RGB8" )
+			{
+				cd.output_data_type = DType::ETC1_RGB8;
+				cd.output_format = Format::RGB;
+			}
+			if(t == "ETC2_RGB8" )
+			{
+				cd.output_data_type = DType::ETC2_RGB8;
+				cd.output_format = Format::RGB;
+			}
+			if(t == "ETC2_RGBA8_EAC" )
+			{
+				cd.output_data_type = DType::ETC2_RGBA8_EAC;
+				cd.output_format = Format::RGBA;
+			}
+			if(t == "EAC_R11" )
+			{
+				cd.output_data_type = DType::EAC_R11;
+				cd.output_format = Format::LUMINANCE;
+			}
+			if(t == "EAC_RG11" )
+			{
+				cd.output_data_type = DType::EAC_RG11;
+				cd.output_format = Format::LUMINANCE_ALPHA;
+			}
+			if(t == "ASTC_4x4" )
+			{
+				cd.output_data_type = DType::ASTC_4x4;
+				cd.output_format = Format::RGBA;
+			}
+			if(t == "ASTC_6x6" )
+			{
+				cd.output_data_type = DType::ASTC_6x6;
+				cd.output_format = Format::RGBA;
+			}
+			if(t == "ASTC_8x8" )
+			{
+				cd.output_data_type = DType::ASTC_8x8;
+				cd.output_format = Format::RGBA;
+			}
+			if(t == "BC1_RGB" )
+			{
+				cd.output_data_type = DType::BC1_RGB;
+				cd.output_format = Format::RGB;
+			}
+			if(t == "BC1_RGBA" )
+			{
+				cd.output_data_type = DType::BC1_RGBA;
+				cd.output_format = Format::RGBA;
+			}
+			if(t == "BC3_RGBA" )
+			{
+				cd.output_data_type = DType::BC3_RGBA;
+				cd.output_format = Format::RGBA;
+			}
+			if(t == "BC4_R" )
+			{
+				cd.output_data_type = DType::BC4_R;
+				cd.output_format = Format::LUMINANCE;
+			}
+			if(t == "BC5_RG" )
+			{
+				cd.output_data_type = DType::BC5_RG;
+				cd.output_format = Format::LUMINANCE_ALPHA;
+			}
+			if(t == "PVRTC_RGB_4BPP" )
+			{
+				cd.output_data_type = DType::PVRTC_RGB_4BPP;
+				cd.output_format = Format::RGB;
+			}
+			if(t == "PVRTC_RGB_2BPP" )
+			{
+				cd.output_data_type = DType::PVRTC_RGB_2BPP;
+				cd.output_format = Format::RGB;
+			}
+			if(t == "PVRTC_RGBA_4BPP" )
+			{
+				cd.output_data_type = DType::PVRTC_RGBA_4BPP;
+				cd.output_format = Format::RGBA;
+			}
+			if(t == "PVRTC_RGBA_2BPP" )
+			{
+				cd.output_data_type = DType::PVRTC_RGBA_2BPP;
+				cd.output_format = Format::RGBA;
+			}
+		}
+		else if(c == "-q" && has_arg)
+		{
+			const std::string& t = args[i++];
+			if(t == "FAST") cd.quality = BlockQuality::FAST;
+			if(t == "NORMAL") cd.quality = BlockQuality::NORMAL;
+			if(t == "BEST") cd.quality = BlockQuality::BEST;
+		}
+		else if(c == "-p" && has_arg)
+		{
+			const std::string& t = args[i++];
+			if(t == "FLOAT") cd.precision = Precision::FLOAT;
+			if(t == "HALF") cd.precision = Precision::HALF;
+			if(t == "UNORM16") cd.precision = Precision::UNORM16;
+		}
+		else if(c == "-t" && has_arg)
+		{
+			cd.threads = std::max(1,atoi(args[i++].c_str()));
+		}
+		else if(c == "-isa" && has_arg)
+		{
+			if(!parse_isa(args[i++],cd.isa))
+				return print_help("Unknown ISA '"+args[i-1]+"'");
+		}
+		else if(c == "-b" && has_arg)
+		{
+			cd.batch_sources.push_back(args[i++]);
+		}
+		else if(c == "-od" && has_arg)
+		{
+			cd.output_dir = args[i++];
+		}
+		else if(c == "-j" && has_arg)
+		{
+			cd.jobs = std::max(1,atoi(args[i++].c_str()));
+		}
+		else if(c == "-cache" && has_arg)
+		{
+			cd.cache_dir = args[i++];
+		}
+		else if(c == "-cache-size" && has_arg)
+		{
+			cd.cache_size = std::max(0ll,atoll(args[i++].c_str()));
+		}
+		else if(c == "-cache-age" && has_arg)
+		{
+			cd.cache_age = std::max(0,atoi(args[i++].c_str()));
 		}
 	}
-	if(cd.input_image.empty())
+	return true;
+}
+
+bool parse_cmd(int argc, char** argv, cmd_data& cd)
+{
+	if(!parse_args(std::vector<std::string>(argv+1,argv+argc),cd))
+		return false;
+	if(cd.input_image.empty() && cd.batch_sources.empty())
 		return print_help("You need to specify an input image");
 	return true;
 };
 
 
-int main(int argc, char** argv)
+static std::string file_ending(const std::string& path)
 {
+	const auto dot = path.find_last_of('.');
+	const auto slash = path.find_last_of('/');
+	if(dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return "";
+	return path.substr(dot+1);
+}
 
-	cmd_data cd;
-	if(!parse_cmd(argc,argv,cd))
-		return -1;
+static std::string strip_ending(const std::string& path)
+{
+	const auto e = file_ending(path);
+	return e.empty() ? path : path.substr(0,path.size()-e.size()-1);
+}
+
+/**
+ * @brief replace_output renames the temporary file tmp to path, if it was
+ * written successfully (ok), and removes it otherwise. The previous file at
+ * path is never modified: it stays in place if the conversion failed, and
+ * hard links to it (e.g. from a conversion cache) keep their contents.
+ */
+static bool replace_output(const std::string& tmp, const std::string& path, bool ok)
+{
+	if(ok && replace_file(tmp,path))
+		return true;
+	remove(tmp.c_str());
+	fprintf(stderr,"Could not write '%s'\n",path.c_str());
+	return false;
+}
+
+/**
+ * @brief write_image writes i to path through a temporary file.
+ */
+static bool write_image(Image& i, const std::string& path)
+{
+	const std::string tmp = temp_name(path);
+	i.write(tmp);
+	struct stat st;
+	return replace_output(tmp,path,stat(tmp.c_str(),&st) == 0);
+}
 
+/**
+ * @brief separate_alpha returns whether the alpha of cd.output_format is
+ * stored in separate ALPHA layers, which is the case for the compressed types
+ * without alpha. The layers of the colors are followed by those of the alpha.
+ */
+static bool separate_alpha(const cmd_data& cd)
+{
+	return cd.output_data_type == DType::ETC1_RGB8 &&
+		   (cd.output_format == Format::RGBA || cd.output_format == Format::LUMINANCE_ALPHA);
+}
+
+/**
+ * @brief convert_levels converts f (a FloatImage or CompactImage) and, if
+ * requested, its mip-map-levels into the layers of td.
+ */
+template<typename I>
+static void convert_levels(const cmd_data& cd, I& f, int* steps, TextureData& td)
+{
+	const bool alpha = separate_alpha(cd);
+	Format color = cd.output_format;
+	if(alpha)
+		color = color == Format::RGBA ? Format::RGB : Format::LUMINANCE;
+	const int levels = cd.generate_mip_maps ? mip_map_levels(f.w,f.h) : 1;
+	td.layers.resize(alpha ? 2*levels : levels);
+
+	// every level is dithered and packed on the thread that generated it
+	auto process = [&](int lvl, I& r)
+	{
+		td.layers[lvl].lvl = lvl;
+		r.to_texture_layer(td.layers[lvl],color,cd.output_data_type,
+						   cd.dither,steps,cd.quality);
+		if(alpha)
+		{
+			td.layers[levels+lvl].lvl = lvl;
+			r.to_texture_layer(td.layers[levels+lvl],Format::ALPHA,cd.output_data_type,
+							   cd.dither,steps,cd.quality);
+		}
+	};
+
+	if(cd.generate_mip_maps)
+		generate_mip_maps(f,std::function<void(int,I&)>(process),cd.mip);
+	else
+		process(0,f);
+}
+
+/**
+ * @brief direct_8bit returns whether cd can be converted without floats (see
+ * Image::to_texture_layer), which is the case for UNSIGNED_BYTE outputs that
+ * need no dithering. Floyd-Steinberg has no errors to diffuse in 8 bit
+ * images, but the mip-map-levels have to be dithered.
+ */
+static bool direct_8bit(const cmd_data& cd)
+{
+	if(cd.output_data_type != DType::UNSIGNED_BYTE)
+		return false;
+	if(cd.generate_mip_maps)
+		return cd.dither == Dither::NONE && cd.mip.filter == MipFilter::FAST;
+	return cd.dither == Dither::NONE || cd.dither == Dither::FLOYD_STEINBERG;
+}
+
+/**
+ * @brief convert runs a single conversion as described by cd.
+ * @param cd
+ * @param pixels - if not null, the number of converted pixels is added.
+ * @return true on success.
+ */
+bool convert(const cmd_data& cd, uint64_t* pixels = nullptr)
+{
 	int b[4] = {8,8,8,8};
 	int steps[4];
 
@@ -147,52 +535,619 @@ int main(int argc, char** argv)
 	FloatImage f;
 
 
-	if(cd.input_image.substr(cd.input_image.find_last_of('.')+1) == "td")
+	// the levels of a KTX file are written as images like the layers of a .td
+	if(file_ending(cd.input_image) == "ktx")
 	{
 		Image i;
-		std::string out_ending = cd.output_image.substr(cd.output_image.find_last_of('.'));
-		std::string out_name = cd.output_image.substr(0,cd.output_image.find_last_of('.'));
-		td.read(cd.input_image);
-		int q= 0 ;
-		for(const auto& tl: td.layers)
+		std::string out_ending = "."+file_ending(cd.output_image);
+		std::string out_name = strip_ending(cd.output_image);
+		if(!td.read(cd.input_image))
+		{
+			fprintf(stderr,"'%s' is no supported KTX file\n",cd.input_image.c_str());
+			return false;
+		}
+		int q = 0;
+		for(const auto& tl: td)
 		{
 			f.from_texture_layer(tl);
 			f.to_image(i);
-			i.write(out_name+"_"+std::to_string(q)+out_ending);
+			if(!write_image(i,out_name+"_"+std::to_string(q)+out_ending))
+				return false;
+			if(pixels)
+				*pixels += uint64_t(tl.w)*tl.h;
 			q++;
 		}
-		return  0;
+		return true;
 	}
 
+	if(file_ending(cd.input_image) == "td")
+	{
+		Image i;
+		std::string out_ending = "."+file_ending(cd.output_image);
+		std::string out_name = strip_ending(cd.output_image);
+		TextureDataView view;
+		if(!view.open(cd.input_image))
+			return false;
+		int q= 0 ;
+		for(const auto& tl: view)
+		{
+			// compressed layers are decompressed into raw
+			const bool packed = tl.codec != Codec::NONE;
+			TextureLayer raw(tl.lvl,tl.w,tl.h,tl.frmt,tl.type);
+			if(packed && (raw.size() > TD_MAX_LAYER_SIZE ||
+						  !(raw.data = malloc(std::max<uint64_t>(1,raw.size())))))
+			{
+				fprintf(stderr,"Could not allocate layer %d of '%s' (%llu bytes)\n",q,
+						cd.input_image.c_str(),(unsigned long long)raw.size());
+				return false;
+			}
+			if(!view.verify(q) || (packed && !view.decompress(q,raw.data)))
+			{
+				fprintf(stderr,"Layer %d of '%s' is corrupted\n",q,cd.input_image.c_str());
+				return false;
+			}
+			if(packed)
+				f.from_texture_layer(raw);
+			else
+				f.from_texture_layer(tl);
+			f.to_image(i);
+			if(!write_image(i,out_name+"_"+std::to_string(q)+out_ending))
+				return false;
+			if(pixels)
+				*pixels += uint64_t(tl.w)*tl.h;
+			q++;
+		}
+		return  true;
+	}
+
+
+	// the output is written to a temporary file which replaces it once it is
+	// complete, see replace_output
+	const std::string tmp = temp_name(cd.output_image);
+
+	const bool ktx = file_ending(cd.output_image) == "ktx";
+	if(ktx && separate_alpha(cd))
+	{
+		fprintf(stderr,"KTX files cannot hold the ALPHA layers of ETC1_RGB8\n");
+		return false;
+	}
+
+	if(cd.stream)
+	{
+		if(ktx)
+		{
+			fprintf(stderr,"-stream does not support KTX outputs\n");
+			return false;
+		}
+		if(cd.generate_mip_maps)
+		{
+			fprintf(stderr,"-stream does not support MipMaps\n");
+			return false;
+		}
+		if(is_compressed(cd.output_data_type))
+		{
+			fprintf(stderr,"-stream does not support compressed types\n");
+			return false;
+		}
+		// the bands are small already, they are always converted to floats
+		if(cd.precision != Precision::FLOAT)
+		{
+			fprintf(stderr,"-stream does not support -p HALF or UNORM16\n");
+			return false;
+		}
+		ImageReader in;
+		if(!in.open(cd.input_image))
+		{
+			fprintf(stderr,"Could not load '%s'\n",cd.input_image.c_str());
+			return false;
+		}
+		std::ofstream out(tmp,std::ios::binary);
+		if(!stream_texture_layer(in,out,cd.output_format,cd.output_data_type,
+								 cd.dither,steps,cd.alignment,cd.codec))
+		{
+			out.close();
+			remove(tmp.c_str());
+			fprintf(stderr,"Could not convert '%s' to '%s'\n",
+					cd.input_image.c_str(),cd.output_image.c_str());
+			return false;
+		}
+		out.close();
+		if(!replace_output(tmp,cd.output_image,bool(out)))
+			return false;
+		if(pixels)
+			*pixels += uint64_t(in.w)*in.h;
+		return true;
+	}
 
 	Image i(cd.input_image);
+	if(!i.data)
+	{
+		fprintf(stderr,"Could not load '%s'\n",cd.input_image.c_str());
+		return false;
+	}
 
-	f.from_image(i);
+	// PVRTC needs square textures with power of two sizes
+	if(is_pvrtc(cd.output_data_type))
+	{
+		int n = 1;
+		while(n < std::max(i.w,i.h))
+			n *= 2;
+		if(n != i.w || n != i.h)
+			resize(i,n,n,cd.mip);
+	}
 
-	std::vector<FloatImage> layers;
-	if(cd.generate_mip_maps)
-		layers = generate_mip_maps(f);
+	const uint64_t n_pixels = uint64_t(i.w)*i.h;
+	if(direct_8bit(cd))
+	{
+		auto process = [&](int lvl, const Image& r)
+		{
+			td.layers[lvl].lvl = lvl;
+			r.to_texture_layer(td.layers[lvl],cd.output_format);
+		};
+		if(cd.generate_mip_maps)
+		{
+			td.layers.resize(mip_map_levels(i.w,i.h));
+			generate_mip_maps(i,process,cd.mip);
+		}
+		else
+		{
+			td.layers.resize(1);
+			process(0,i);
+		}
+	}
+	// the source pixels are not needed anymore
+	else if(cd.precision == Precision::FLOAT)
+	{
+		f.from_image(i);
+		free(i.data);
+		i.data = nullptr;
+		convert_levels(cd,f,steps,td);
+	}
+	else
+	{
+		CompactImage c(cd.precision);
+		c.from_image(i);
+		free(i.data);
+		i.data = nullptr;
+		convert_levels(cd,c,steps,td);
+	}
+
+	std::ofstream out(tmp,std::ios::binary);
+	bool ok = true;
+	if(ktx)
+		ok = td.write_ktx(out);
 	else
-		layers.push_back(f);
+		td.write(out,cd.alignment,cd.codec);
+	out.close();
+	if(!replace_output(tmp,cd.output_image,ok && bool(out)))
+		return false;
+	if(pixels)
+		*pixels += n_pixels;
+
+	return true;
+}
+
+
+/**
+ * @brief conversion_key hashes everything the result of cd depends on: the
+ * bytes of the input, the options (but not the paths, threads or batch
+ * settings) and the tool version.
+ * @return false if the input could not be read.
+ */
+static bool conversion_key(const cmd_data& cd, uint64_t& key)
+{
+	// the ISAs only differ for SCALAR, see README
+	const std::string opts = std::string(TOOL_VERSION)+"|"+file_ending(cd.output_image)+"|"+
+			std::to_string(uint32_t(cd.output_format))+"|"+
+			std::to_string(uint32_t(cd.output_data_type))+"|"+
+			std::to_string(int(cd.dither))+"|"+std::to_string(int(cd.precision))+"|"+
+			std::to_string(cd.generate_mip_maps)+"|"+std::to_string(cd.stream)+"|"+
+			std::to_string(cd.alignment)+"|"+std::to_string(int(cd.codec))+"|"+
+			std::to_string(int(cd.quality))+"|"+std::to_string(int(cd.mip.filter))+"|"+
+			std::to_string(int(cd.mip.transfer))+"|"+std::to_string(int(cd.mip.color))+"|"+
+			std::to_string(active_isa() == ISA::SCALAR);
+	return hash_file(cd.input_image,hash64(opts.data(),opts.size()),key);
+}
+
+/**
+ * @brief convert_cached runs convert, unless cache holds the result of an
+ * identical conversion, which is then linked or copied to cd.output_image.
+ * New results are added to the cache. Inputs converted to images (.td and
+ * .ktx) are not cached.
+ */
+static bool convert_cached(const cmd_data& cd, ConversionCache* cache, uint64_t* pixels)
+{
+	const std::string e = file_ending(cd.input_image);
+	uint64_t key = 0;
+	if(!cache || e == "td" || e == "ktx" || !conversion_key(cd,key))
+		return convert(cd,pixels);
+	if(cache->fetch(key,cd.output_image))
+		return true;
+	if(!convert(cd,pixels))
+		return false;
+	if(!cache->store(key,cd.output_image))
+		fprintf(stderr,"Could not add '%s' to the cache\n",cd.output_image.c_str());
+	return true;
+}
+
+/**
+ * @brief tokenize splits a line of a batch list at whitespace. Double quotes
+ * can be used for paths containing spaces.
+ */
+static std::vector<std::string> tokenize(const std::string& line)
+{
+	std::vector<std::string> res;
+	std::string tok;
+	bool quoted = false, in_tok = false;
+	for(char c : line)
+	{
+		if(c == '"')
+		{
+			quoted = !quoted;
+			in_tok = true;
+		}
+		else if(!quoted && isspace((unsigned char)c))
+		{
+			if(in_tok)
+				res.push_back(tok);
+			tok.clear();
+			in_tok = false;
+		}
+		else
+		{
+			tok += c;
+			in_tok = true;
+		}
+	}
+	if(in_tok)
+		res.push_back(tok);
+	return res;
+}
+
+static bool is_directory(const std::string& path)
+{
+	struct stat st;
+	return stat(path.c_str(),&st) == 0 && (st.st_mode&S_IFMT) == S_IFDIR;
+}
+
+/**
+ * @brief is_texture_file returns whether path is a .td or .ktx file, which
+ * are converted to an image per layer.
+ */
+static bool is_texture_file(const std::string& path)
+{
+	const std::string e = file_ending(path);
+	return e == "td" || e == "ktx";
+}
+
+/**
+ * @brief is_input_file returns whether a directory scan converts path. .td
+ * and .ktx files are only converted if they are given explicitly, as they
+ * are the outputs of td.
+ */
+static bool is_input_file(const std::string& path)
+{
+	std::string e = file_ending(path);
+	for(auto& c : e)
+		c = tolower(c);
+	for(const char* s : {"png","jpg","jpeg","bmp","tga","psd","gif","hdr",
+						 "pic","pgm","ppm","pnm"})
+		if(e == s)
+			return true;
+	return false;
+}
+
+/**
+ * @brief expand_glob returns the sorted paths matching pattern. On Windows
+ * only the last component of pattern may contain wildcards (* and ?).
+ */
+static std::vector<std::string> expand_glob(const std::string& pattern)
+{
+	std::vector<std::string> res;
+#ifdef _WIN32
+	const auto slash = pattern.find_last_of("/\\");
+	const std::string dir = slash == std::string::npos ? "" : pattern.substr(0,slash+1);
+	_finddata_t e;
+	const intptr_t h = _findfirst(pattern.c_str(),&e);
+	if(h == -1)
+		return res;
+	do
+		if(!(e.attrib&_A_SUBDIR))
+			res.push_back(dir+e.name);
+	while(_findnext(h,&e) == 0);
+	_findclose(h);
+	std::sort(res.begin(),res.end());
+#else
+	glob_t g;
+	if(glob(pattern.c_str(),0,nullptr,&g) == 0)
+		res.assign(g.gl_pathv,g.gl_pathv+g.gl_pathc);
+	globfree(&g);
+#endif
+	return res;
+}
+
+/**
+ * @brief The batch_job struct is one conversion of a batch. rel is the path
+ * relative to the batch source, used to mirror directory trees in -od.
+ */
+struct batch_job
+{
+	cmd_data cd;
+	std::string rel;
+};
+
+static void collect_directory(const std::string& root, const std::string& rel,
+							  std::vector<std::string>& res)
+{
+	const std::string path = rel.empty() ? root : root+"/"+rel;
+	for(const auto& n : list_directory(path))
+	{
+		const std::string r = rel.empty() ? n : rel+"/"+n;
+		if(is_directory(root+"/"+r))
+			collect_directory(root,r,res);
+		else if(is_input_file(r))
+			res.push_back(r);
+	}
+}
 
+/**
+ * @brief list_option_error returns why opts cannot be used on a line of a
+ * batch list, or an empty string if they can. The threads, the ISA and the
+ * batch settings apply to the whole process.
+ */
+static std::string list_option_error(const std::vector<std::string>& opts)
+{
+	for(const auto& o : opts)
+	{
+		if(o == "-h")
+			return "'-h' is no conversion option";
+		for(const char* g : {"-t","-isa","-b","-od","-j","-cache","-cache-size","-cache-age"})
+			if(o == g)
+				return "'"+o+"' applies to the whole batch and cannot be set per input";
+	}
+	return "";
+}
 
-	int lvl = 0;
-	for(auto& r : layers)
+/**
+ * @brief collect_jobs expands all batch sources of base into single jobs.
+ * Invalid lines of list files are reported and counted in failed.
+ * @return false if a source could not be read or two jobs have the same
+ * output.
+ */
+static bool collect_jobs(const cmd_data& base, std::vector<batch_job>& jobs, size_t& failed)
+{
+	auto add = [&](const std::string& input, const std::string& rel,
+				   const std::vector<std::string>& opts)
 	{
-		if(!cd.disable_dither)
-			r.dither_floyd_steinberg(steps);
+		batch_job j;
+		j.cd = base;
+		j.cd.batch_sources.clear();
+		j.cd.input_image = input;
+		j.cd.output_image.clear();
+		if(!parse_args(opts,j.cd))
+			return false;
+		j.rel = rel;
+		jobs.push_back(j);
+		return true;
+	};
+
+	if(!base.input_image.empty())
+		add(base.input_image,"",{});
 
-		td.layers.push_back(TextureLayer(lvl));
-		r.to_texture_layer(td.layers.back(),
-						   cd.output_format,
-						   cd.output_data_type);
+	for(const auto& src : base.batch_sources)
+	{
+		if(is_directory(src))
+		{
+			std::vector<std::string> files;
+			collect_directory(src,"",files);
+			for(const auto& f : files)
+				add(src+"/"+f,f,{});
+		}
+		else if(src.find_first_of("*?[") != std::string::npos)
+		{
+			for(const auto& f : expand_glob(src))
+				if(!is_texture_file(f) && !is_directory(f))
+					add(f,"",{});
+		}
+		else
+		{
+			std::ifstream f(src);
+			if(!f.is_open())
+			{
+				fprintf(stderr,"Could not open batch source '%s'\n",src.c_str());
+				return false;
+			}
+			std::string line;
+			for(int n = 1; std::getline(f,line);n++)
+			{
+				auto tok = tokenize(line);
+				if(tok.empty() || tok[0][0] == '#')
+					continue;
+				const std::vector<std::string> opts(tok.begin()+1,tok.end());
+				const std::string err = list_option_error(opts);
+				if(!err.empty() || !add(tok[0],"",opts))
+				{
+					fprintf(stderr,"%s:%d: %s\n",src.c_str(),n,
+							err.empty() ? "invalid options" : err.c_str());
+					failed++;
+				}
+			}
+		}
+	}
+
+	for(auto& j : jobs)
+	{
+		if(!j.cd.output_image.empty())
+			continue;
+		const std::string out_ending = is_texture_file(j.cd.input_image) ? ".png" : ".td";
+		std::string out;
+		if(base.output_dir.empty())
+			out = j.cd.input_image;
+		else if(!j.rel.empty())
+			out = base.output_dir+"/"+j.rel;
+		else
+			out = base.output_dir+"/"+j.cd.input_image.substr(
+						j.cd.input_image.find_last_of('/')+1);
+		j.cd.output_image = strip_ending(out)+out_ending;
+	}
+
+	// concurrent jobs must not write a file another job reads or writes, e.g.
+	// inputs with the same name from different directories in -od. Jobs of
+	// .td and .ktx inputs write <name>_<layer>.<ending>, which is stored as
+	// <name>_*.<ending>.
+	struct use
+	{
+		size_t job;
+		bool written;
+	};
+	std::map<std::string,std::vector<use>> files;
+	std::vector<std::string> level_names;
+	for(size_t k = 0 ; k < jobs.size();k++)
+	{
+		const cmd_data& cd = jobs[k].cd;
+		files[cd.input_image].push_back({k,false});
+		if(!is_texture_file(cd.input_image))
+		{
+			files[cd.output_image].push_back({k,true});
+			continue;
+		}
+		const std::string e = file_ending(cd.output_image);
+		level_names.push_back(strip_ending(cd.output_image)+"_*"+(e.empty() ? "" : "."+e));
+		files[level_names.back()].push_back({k,true});
+	}
+	// the files matching the level names of a job
+	for(const auto& n : level_names)
+	{
+		const size_t star = n.find_last_of('*');
+		const std::string prefix = n.substr(0,star), suffix = n.substr(star+1);
+		const size_t k = files[n][0].job;
+		for(auto it = files.lower_bound(prefix);
+			it != files.end() && it->first.compare(0,prefix.size(),prefix) == 0;it++)
+		{
+			const std::string& f = it->first;
+			if(f.size() <= prefix.size()+suffix.size() ||
+			   f.compare(f.size()-suffix.size(),suffix.size(),suffix) != 0)
+				continue;
+			const std::string q = f.substr(prefix.size(),f.size()-prefix.size()-suffix.size());
+			if(q.find_first_not_of("0123456789") == std::string::npos)
+				it->second.push_back({k,true});
+		}
+	}
 
-		lvl++;
+	bool unique = true;
+	for(const auto& f : files)
+	{
+		const auto& u = f.second;
+		for(size_t a = 0 ; a < u.size();a++)
+		{
+			const auto b = std::find_if(u.begin(),u.end(),[&](const use& o)
+			{
+				return o.job != u[a].job && (o.written || u[a].written);
+			});
+			if(b == u.end())
+				continue;
+			fprintf(stderr,"'%s' would be %s by the conversion of '%s' and %s by that of '%s'\n",
+					f.first.c_str(),u[a].written ? "written" : "read",
+					jobs[u[a].job].cd.input_image.c_str(),b->written ? "written" : "read",
+					jobs[b->job].cd.input_image.c_str());
+			unique = false;
+			break;
+		}
 	}
+	return unique;
+}
+
+/**
+ * @brief make_parent_dirs creates all missing directories on the way to the
+ * file path.
+ */
+static void make_parent_dirs(const std::string& path)
+{
+	for(size_t p = path.find('/',1); p != std::string::npos; p = path.find('/',p+1))
+#ifdef _WIN32
+		_mkdir(path.substr(0,p).c_str());
+#else
+		mkdir(path.substr(0,p).c_str(),0755);
+#endif
+}
+
+int run_batch(const cmd_data& base)
+{
+	std::vector<batch_job> jobs;
+	std::atomic<size_t> failed(0);
+	size_t invalid = 0;
+	if(!collect_jobs(base,jobs,invalid))
+		return -1;
+	failed = invalid;
+
+	const unsigned n_workers = std::min<unsigned>(base.jobs,
+												  std::max<size_t>(1,jobs.size()));
+	// the workers share the cores with the parallel algorithms of each job
+	if(!base.threads)
+		set_thread_count(std::max(1u,hardware_threads()/n_workers));
 
-	td.write(cd.output_image);
+	std::atomic<uint64_t> pixels(0);
+	std::mutex out_mtx;
+	const auto t0 = std::chrono::steady_clock::now();
 
-	return 0;
+	std::unique_ptr<ConversionCache> cache;
+	if(!base.cache_dir.empty())
+		cache.reset(new ConversionCache(base.cache_dir,base.cache_size<<20,
+										int64_t(base.cache_age)*86400));
 
+	parallel_for(0,(int)jobs.size(),[&](int k)
+	{
+		const cmd_data& cd = jobs[k].cd;
+		make_parent_dirs(cd.output_image);
+		uint64_t p = 0;
+		const bool ok = convert_cached(cd,cache.get(),&p);
+		pixels += p;
+		if(!ok)
+			failed++;
+
+		std::lock_guard<std::mutex> lock(out_mtx);
+		fprintf(stderr,"[%s] %s -> %s\n",ok ? " ok " : "FAIL",
+				cd.input_image.c_str(),cd.output_image.c_str());
+	},n_workers);
+
+	const double s = std::chrono::duration<double>(
+				std::chrono::steady_clock::now()-t0).count();
+	const size_t n = jobs.size()+invalid;
+	fprintf(stderr,"%zu files (%zu failed) in %.2f s using %u workers (%s): "
+				   "%.1f files/s, %.1f MPixel/s\n",
+			n,(size_t)failed,s,n_workers,isa_name(active_isa()),
+			s > 0 ? n/s : 0.0, s > 0 ? pixels/s*1e-6 : 0.0);
+	if(cache)
+	{
+		cache->evict();
+		fprintf(stderr,"cache: %llu hits, %llu misses, %llu evicted, %llu entries (%.1f MiB)\n",
+				(unsigned long long)cache->hits(),(unsigned long long)cache->misses(),
+				(unsigned long long)cache->evicted(),(unsigned long long)cache->entries(),
+				cache->bytes()/1048576.0);
+	}
+
+	return failed ? -1 : 0;
 }
 
+
+int main(int argc, char** argv)
+{
+
+	cmd_data cd;
+	if(!parse_cmd(argc,argv,cd))
+		return -1;
+
+	set_thread_count(cd.threads);
+	set_isa(cd.isa);
+	if(!cd.batch_sources.empty())
+		return run_batch(cd);
+
+	if(cd.cache_dir.empty())
+		return convert(cd) ? 0 : -1;
+	ConversionCache cache(cd.cache_dir,cd.cache_size<<20,int64_t(cd.cache_age)*86400);
+	const bool ok = convert_cached(cd,&cache,nullptr);
+	if(cd.cache_size || cd.cache_age)
+		cache.evict();
+	return ok ? 0 : -1;
+
+}
@@ -5,6 +5,10 @@
 #include <fstream>
 #include <vector>
 #include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include "td_codec.h"
+#include "td_rans.h"
 namespace td {
 
 /**
@@ -17,6 +21,25 @@ enum class DType : uint32_t
 	UNSIGNED_SHORT_4_4_4_4	= 0x8033,
 	UNSIGNED_SHORT_5_5_5_1	= 0x8034,
 	UNSIGNED_BYTE			= 0x1401,
+
+	// block compressed types, named after their internal formats
+	ETC1_RGB8				= 0x8D64, // OES_compressed_ETC1_RGB8_texture
+	ETC2_RGB8				= 0x9274, // COMPRESSED_RGB8_ETC2 (ES 3.0)
+	ETC2_RGBA8_EAC			= 0x9278, // COMPRESSED_RGBA8_ETC2_EAC
+	EAC_R11					= 0x9270, // COMPRESSED_R11_EAC
+	EAC_RG11				= 0x9272, // COMPRESSED_RG11_EAC
+	ASTC_4x4				= 0x93B0, // COMPRESSED_RGBA_ASTC_4x4_KHR
+	ASTC_6x6				= 0x93B4, // COMPRESSED_RGBA_ASTC_6x6_KHR
+	ASTC_8x8				= 0x93B7, // COMPRESSED_RGBA_ASTC_8x8_KHR
+	BC1_RGB					= 0x83F0, // COMPRESSED_RGB_S3TC_DXT1_EXT
+	BC1_RGBA				= 0x83F1, // COMPRESSED_RGBA_S3TC_DXT1_EXT
+	BC3_RGBA				= 0x83F3, // COMPRESSED_RGBA_S3TC_DXT5_EXT
+	BC4_R					= 0x8DBB, // COMPRESSED_RED_RGTC1
+	BC5_RG					= 0x8DBD, // COMPRESSED_RG_RGTC2
+	PVRTC_RGB_4BPP			= 0x8C00, // COMPRESSED_RGB_PVRTC_4BPPV1_IMG
+	PVRTC_RGB_2BPP			= 0x8C01, // COMPRESSED_RGB_PVRTC_2BPPV1_IMG
+	PVRTC_RGBA_4BPP			= 0x8C02, // COMPRESSED_RGBA_PVRTC_4BPPV1_IMG
+	PVRTC_RGBA_2BPP			= 0x8C03, // COMPRESSED_RGBA_PVRTC_2BPPV1_IMG
 };
 
 
@@ -34,33 +57,536 @@ enum class Format : uint32_t
 };
 
 
+/**
+ * @brief is_compressed returns true for the block compressed types, which
+ * store blocks of pixels in a fixed number of bytes (see block_bytes).
+ */
+inline constexpr bool is_compressed(const DType t)
+{
+	return t == DType::ETC1_RGB8 || t == DType::ETC2_RGB8 || t == DType::ETC2_RGBA8_EAC ||
+		   t == DType::EAC_R11 || t == DType::EAC_RG11 ||
+		   t == DType::ASTC_4x4 || t == DType::ASTC_6x6 || t == DType::ASTC_8x8 ||
+		   t == DType::BC1_RGB || t == DType::BC1_RGBA || t == DType::BC3_RGBA ||
+		   t == DType::BC4_R || t == DType::BC5_RG ||
+		   t == DType::PVRTC_RGB_4BPP || t == DType::PVRTC_RGB_2BPP ||
+		   t == DType::PVRTC_RGBA_4BPP || t == DType::PVRTC_RGBA_2BPP;
+}
+
+/**
+ * @brief is_pvrtc returns true for the PVRTC types, whose blocks are not
+ * independent: the colors are interpolated between neighbouring blocks, so
+ * they are encoded per layer (see pvrtc_encode).
+ */
+inline constexpr bool is_pvrtc(const DType t)
+{
+	return t == DType::PVRTC_RGB_4BPP || t == DType::PVRTC_RGB_2BPP ||
+		   t == DType::PVRTC_RGBA_4BPP || t == DType::PVRTC_RGBA_2BPP;
+}
+
+/**
+ * @brief block_width returns the width of the blocks of t in pixels, 1 for
+ * the uncompressed types.
+ */
+inline constexpr uint32_t block_width(const DType t)
+{
+	return t == DType::ASTC_6x6 ? 6 : t == DType::ASTC_8x8 ? 8 :
+		   t == DType::PVRTC_RGB_2BPP || t == DType::PVRTC_RGBA_2BPP ? 8 :
+		   is_compressed(t) ? 4 : 1;
+}
+
+/**
+ * @brief block_height returns the height of the blocks of t in pixels, 1 for
+ * the uncompressed types.
+ */
+inline constexpr uint32_t block_height(const DType t)
+{
+	return t == DType::ASTC_6x6 ? 6 : t == DType::ASTC_8x8 ? 8 : is_compressed(t) ? 4 : 1;
+}
+
+/**
+ * @brief block_bytes returns the number of bytes per block of a compressed
+ * type.
+ */
+inline constexpr uint32_t block_bytes(const DType t)
+{
+	return t == DType::ETC2_RGBA8_EAC || t == DType::EAC_RG11 || t == DType::ASTC_4x4 ||
+		   t == DType::ASTC_6x6 || t == DType::ASTC_8x8 || t == DType::BC3_RGBA ||
+		   t == DType::BC5_RG ? 16 : is_compressed(t) ? 8 : 0;
+}
+
 /**
  * @brief size_per_pixel gives the number of bytes per pixel for a given
- * format/type combination.
+ * format/type combination (of the uncompressed types).
  * @param f - the format.
  * @param t - the type.
  * @return
  */
-inline uint32_t size_per_pixel(const Format f, const DType t)
+inline constexpr uint32_t size_per_pixel(const Format f, const DType t)
 {
+	return t != DType::UNSIGNED_BYTE ? 2 :
+		   f == Format::LUMINANCE_ALPHA ? 2 :
+		   f == Format::RGB ? 3 :
+		   f == Format::RGBA ? 4 :
+		   1;
+}
+
 
-	if(t != DType::UNSIGNED_BYTE)
+/**
+ * @brief pvrtc_extent returns the width (or height) of the data of a PVRTC
+ * layer of n pixels with blocks of b pixels: the next power of two, but at
+ * least two blocks. The image is the top left part of the data.
+ */
+inline uint32_t pvrtc_extent(uint32_t n, uint32_t b)
+{
+	uint32_t e = 2*b;
+	while(e < n)
+		e *= 2;
+	return e;
+}
+
+/**
+ * @brief layer_size gives the number of bytes of a w x h layer for a given
+ * format/type combination, computed in 64 bits. Compressed layers consist of
+ * whole blocks, partial blocks at the right and bottom edges are padded. PVRTC
+ * layers are padded to pvrtc_extent.
+ * @param w
+ * @param h
+ * @param f - the format.
+ * @param t - the type.
+ * @return
+ */
+inline uint64_t layer_size(int w, int h, const Format f, const DType t)
+{
+	if(is_pvrtc(t))
 	{
-		return 2;
+		const uint64_t bx = pvrtc_extent(w,block_width(t))/block_width(t);
+		const uint64_t by = pvrtc_extent(h,block_height(t))/block_height(t);
+		return bx*by*block_bytes(t);
 	}
-	else
+	if(is_compressed(t))
+	{
+		const uint64_t bx = (uint64_t(w)+block_width(t)-1)/block_width(t);
+		const uint64_t by = (uint64_t(h)+block_height(t)-1)/block_height(t);
+		return bx*by*block_bytes(t);
+	}
+	return uint64_t(w)*uint64_t(h)*size_per_pixel(f,t);
+}
+
+
+/**
+ * @brief pixel_fields describes the bit fields of a pixel for a given
+ * format/type combination, the fields of the 16 bit types are listed from the
+ * most significant bits.
+ * @param f - the format.
+ * @param t - the type.
+ * @return
+ */
+inline PixelFields pixel_fields(const Format f, const DType t)
+{
+	switch(t)
+	{
+	case DType::UNSIGNED_SHORT_5_6_5: return {2,3,{11,5,0},{5,6,5}};
+	case DType::UNSIGNED_SHORT_4_4_4_4: return {2,4,{12,8,4,0},{4,4,4,4}};
+	case DType::UNSIGNED_SHORT_5_5_5_1: return {2,4,{11,6,1,0},{5,5,5,1}};
+	default:
+	{
+		const uint32_t n = size_per_pixel(f,t);
+		return {n,n,{0,8,16,24},{8,8,8,8}};
+	}
+	}
+}
+
+
+/**
+ * @brief crc32 computes the CRC-32 (as used by zlib and PNG) of n bytes,
+ * continuing crc. It processes 8 bytes per step using 8 lookup tables.
+ * @param data
+ * @param n
+ * @param crc - the crc of the preceding bytes.
+ * @return
+ */
+inline uint32_t crc32(const void* data, uint64_t n, uint32_t crc = 0)
+{
+	struct tables
+	{
+		uint32_t t[8][256];
+		tables()
+		{
+			for(uint32_t i = 0 ; i < 256;i++)
+			{
+				uint32_t c = i;
+				for(int k = 0 ; k < 8;k++)
+					c = c&1 ? 0xEDB88320u^(c>>1) : c>>1;
+				t[0][i] = c;
+			}
+			for(uint32_t i = 0 ; i < 256;i++)
+				for(int k = 1 ; k < 8;k++)
+					t[k][i] = t[0][t[k-1][i]&0xFF]^(t[k-1][i]>>8);
+		}
+	};
+	static const tables tbl;
+	const uint32_t (*t)[256] = tbl.t;
+
+	const uint8_t* p = static_cast<const uint8_t*>(data);
+	crc = ~crc;
+	for(; n >= 8; n-=8, p+=8)
+	{
+		uint32_t a, b;
+		memcpy(&a,p,4);
+		memcpy(&b,p+4,4);
+		a ^= crc;
+		crc = t[7][a&0xFF]^t[6][(a>>8)&0xFF]^t[5][(a>>16)&0xFF]^t[4][a>>24]^
+			  t[3][b&0xFF]^t[2][(b>>8)&0xFF]^t[1][(b>>16)&0xFF]^t[0][b>>24];
+	}
+	for(; n > 0; n--, p++)
+		crc = t[0][(crc^*p)&0xFF]^(crc>>8);
+	return ~crc;
+}
+
+/*
+ * The .td v3 layout (little endian):
+ *   FileHeader | LayerEntry * n_layers | payloads
+ * Each payload starts at a multiple of the alignment (e.g. 16 for SIMD or
+ * 4096 for direct I/O), the gaps are filled with zeros. The table allows to
+ * access any layer without parsing the others. Payloads are stored raw or
+ * compressed (see Codec).
+ * v2 files have the same layout, but their LayerEntrys end before the codec
+ * (all payloads are raw).
+ * v1 files start with the number of layers, followed by a header of 5 32 bit
+ * values (see TextureLayer::write) and the payload of each layer.
+ */
+static const uint32_t TD_MAGIC = 0x54414454; // "TDAT"
+static const uint32_t TD_VERSION = 3;
+
+/**
+ * @brief TD_MAX_LAYER_SIZE bounds the raw size of a layer read from a file,
+ * so a corrupted header cannot request an absurd allocation.
+ */
+static const uint64_t TD_MAX_LAYER_SIZE = uint64_t(1)<<34;
+
+struct FileHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_layers;
+	uint32_t alignment; // a power of two
+};
+
+struct LayerEntry
+{
+	int32_t lvl;
+	int32_t w;
+	int32_t h;
+	Format frmt;
+	DType type;
+	uint32_t checksum; // crc32 of the payload
+	uint64_t offset;   // from the start of the file
+	uint64_t size;     // of the stored payload
+	Codec codec;
+	uint32_t chunk_size; // raw bytes per compressed chunk
+};
+
+static_assert(sizeof(FileHeader) == 16 && sizeof(LayerEntry) == 48,
+			  "the .td header structs must not be padded");
+
+/**
+ * @brief entry_size returns the size of a LayerEntry in a file of the given
+ * version (2 or 3).
+ */
+inline uint32_t entry_size(uint32_t version)
+{
+	return version == 2 ? offsetof(LayerEntry,codec) : sizeof(LayerEntry);
+}
+
+/**
+ * @brief compress_layer compresses the w x h pixels of src with codec.
+ * @param payload - the result.
+ * @param chunk_size - the raw bytes per chunk of the result.
+ * @param src
+ * @param w
+ * @param h
+ * @param f - the format.
+ * @param t - the type.
+ * @param codec - LZ or PREDICTIVE.
+ * @return false if the payload is not smaller, the layer should be stored
+ * raw then. PREDICTIVE does not apply to compressed types, so they are always
+ * stored raw.
+ */
+inline bool compress_layer(std::vector<uint8_t>& payload, uint32_t& chunk_size, const void* src,
+						   int w, int h, Format f, DType t, Codec codec)
+{
+	if(codec == Codec::PREDICTIVE)
+	{
+		if(is_compressed(t))
+			return false;
+		chunk_size = field_chunk_size(w,pixel_fields(f,t));
+		return compress_fields(payload,src,w,h,pixel_fields(f,t),chunk_size);
+	}
+	chunk_size = TD_CHUNK_SIZE;
+	return codec == Codec::LZ && compress_payload(payload,src,layer_size(w,h,f,t),chunk_size);
+}
+
+/**
+ * @brief decompress_layer is the inverse of compress_layer.
+ * @param dst - layer_size(w,h,f,t) bytes.
+ * @return false if the payload is corrupted.
+ */
+inline bool decompress_layer(void* dst, int w, int h, Format f, DType t, Codec codec,
+							 const void* payload, uint64_t size, uint32_t chunk_size)
+{
+	switch(codec)
+	{
+	case Codec::NONE:
+		if(size != layer_size(w,h,f,t))
+			return false;
+		memcpy(dst,payload,size);
+		return true;
+	case Codec::LZ:
+		return decompress_payload(dst,layer_size(w,h,f,t),payload,size,chunk_size);
+	case Codec::PREDICTIVE:
+		if(is_compressed(t))
+			return false;
+		return decompress_fields(dst,w,h,pixel_fields(f,t),payload,size,chunk_size);
+	}
+	return false;
+}
+
+/**
+ * @brief payload_offset returns the offset of the first payload of a v2 file
+ * with n layers.
+ */
+inline uint64_t payload_offset(uint32_t n, uint32_t alignment)
+{
+	const uint64_t o = sizeof(FileHeader)+uint64_t(n)*sizeof(LayerEntry);
+	return (o+alignment-1)/alignment*alignment;
+}
+
+/**
+ * @brief write_padding writes zeros up to the next multiple of alignment.
+ * @param f
+ * @param pos - the current position in f.
+ * @param alignment
+ * @return the new position.
+ */
+inline uint64_t write_padding(std::ostream& f, uint64_t pos, uint32_t alignment)
+{
+	static const char zeros[256] = {};
+	uint64_t n = (alignment-pos%alignment)%alignment;
+	for(pos += n; n > 0; n -= std::min<uint64_t>(n,sizeof(zeros)))
+		f.write(zeros,std::min<uint64_t>(n,sizeof(zeros)));
+	return pos;
+}
+
+/**
+ * @brief stream_remaining returns the number of bytes from the current
+ * position to the end of f.
+ * @return UINT64_MAX if f cannot seek.
+ */
+inline uint64_t stream_remaining(std::istream& f)
+{
+	const std::streampos pos = f.tellg();
+	if(pos < 0)
+		return UINT64_MAX;
+	f.seekg(0,std::ios::end);
+	const std::streampos end = f.tellg();
+	f.seekg(pos);
+	if(!f || end < pos)
 	{
-		if(f==Format::LUMINANCE_ALPHA)
-			return 2;
-		else if(f==Format::RGB)
-			return 3;
-		else if(f==Format::RGBA)
-			return 4;
-		else
-			return 1;
+		f.clear();
+		return UINT64_MAX;
 	}
+	return uint64_t(end-pos);
+}
+
+/**
+ * @brief valid_format returns whether f is one of the formats of Format.
+ */
+inline bool valid_format(Format f)
+{
+	return f == Format::ALPHA || f == Format::LUMINANCE || f == Format::LUMINANCE_ALPHA ||
+		   f == Format::RGB || f == Format::RGBA;
+}
+
+/**
+ * @brief valid_type returns whether t is one of the types of DType.
+ */
+inline bool valid_type(DType t)
+{
+	return t == DType::UNSIGNED_BYTE || t == DType::UNSIGNED_SHORT_5_6_5 ||
+		   t == DType::UNSIGNED_SHORT_4_4_4_4 || t == DType::UNSIGNED_SHORT_5_5_5_1 ||
+		   is_compressed(t);
 }
 
+/*
+ * KTX 1.1 files (little endian):
+ *   KtxHeader | key/value data | per level: imageSize (uint32), pixels
+ * td reads and writes 2D textures with a single face and no array elements.
+ * glType and glFormat are the DType and Format of uncompressed levels (and
+ * glInternalFormat the unsized format, as in OpenGL ES 2.0), compressed types
+ * are stored as glInternalFormat with glType and glFormat 0. The rows of
+ * uncompressed levels are padded to 4 bytes, the default GL_UNPACK_ALIGNMENT,
+ * so each level can be uploaded as it is. glBaseInternalFormat does not tell
+ * e.g. ALPHA from LUMINANCE for EAC_R11, so the td Format of compressed types
+ * is stored in the key/value data (see ktx_key_values).
+ */
+static const uint8_t KTX_IDENTIFIER[12] = {0xAB,0x4B,0x54,0x58,0x20,0x31,0x31,0xBB,
+										   0x0D,0x0A,0x1A,0x0A}; // "<<KTX 11>>\r\n\x1A\n"
+static const uint32_t KTX_MAGIC = 0x58544BAB; // the first 4 bytes of the identifier
+static const uint32_t KTX_ENDIANNESS = 0x04030201;
+static const uint32_t KTX_RED = 0x1903; // GL_RED
+static const uint32_t KTX_RG = 0x8227;  // GL_RG
+static const char KTX_TD_FORMAT[] = "td.format";
+
+struct KtxHeader
+{
+	uint8_t identifier[12];
+	uint32_t endianness;
+	uint32_t gl_type;
+	uint32_t gl_type_size;
+	uint32_t gl_format;
+	uint32_t gl_internal_format;
+	uint32_t gl_base_internal_format;
+	uint32_t pixel_width;
+	uint32_t pixel_height;
+	uint32_t pixel_depth;
+	uint32_t n_array_elements;
+	uint32_t n_faces;
+	uint32_t n_mip_levels;
+	uint32_t key_value_bytes;
+};
+
+static_assert(sizeof(KtxHeader) == 64,"the KTX header must not be padded");
+
+/**
+ * @brief ktx_base_format returns the glBaseInternalFormat of layers of format f
+ * and type t: f for the uncompressed types, the channels stored by the
+ * compressed ones (GL_RED and GL_RG for EAC and RGTC).
+ */
+inline uint32_t ktx_base_format(Format f, DType t)
+{
+	switch(t)
+	{
+	case DType::EAC_R11:
+	case DType::BC4_R:
+		return KTX_RED;
+	case DType::EAC_RG11:
+	case DType::BC5_RG:
+		return KTX_RG;
+	case DType::ETC1_RGB8:
+	case DType::ETC2_RGB8:
+	case DType::BC1_RGB:
+	case DType::PVRTC_RGB_4BPP:
+	case DType::PVRTC_RGB_2BPP:
+		return uint32_t(Format::RGB);
+	default:
+		return is_compressed(t) ? uint32_t(Format::RGBA) : uint32_t(f);
+	}
+}
+
+/**
+ * @brief ktx_row_pitch returns the bytes per row of an uncompressed KTX level,
+ * padded to 4.
+ */
+inline uint64_t ktx_row_pitch(int w, Format f, DType t)
+{
+	return (uint64_t(w)*size_per_pixel(f,t)+3)/4*4;
+}
+
+/**
+ * @brief ktx_image_size returns the imageSize of a w x h KTX level.
+ */
+inline uint64_t ktx_image_size(int w, int h, Format f, DType t)
+{
+	return is_compressed(t) ? layer_size(w,h,f,t) : ktx_row_pitch(w,f,t)*h;
+}
+
+/**
+ * @brief ktx_key_values returns the key/value data of a KTX file of format f
+ * and type t. Compressed types store f under the key "td.format", as a 32 bit
+ * value.
+ */
+inline std::vector<uint8_t> ktx_key_values(Format f, DType t)
+{
+	std::vector<uint8_t> kv;
+	if(!is_compressed(t))
+		return kv;
+	const uint32_t size = sizeof(KTX_TD_FORMAT)+sizeof(uint32_t);
+	const uint32_t value = uint32_t(f);
+	kv.resize(sizeof(size)+(size+3)/4*4);
+	memcpy(kv.data(),&size,sizeof(size));
+	memcpy(kv.data()+sizeof(size),KTX_TD_FORMAT,sizeof(KTX_TD_FORMAT));
+	memcpy(kv.data()+sizeof(size)+sizeof(KTX_TD_FORMAT),&value,sizeof(value));
+	return kv;
+}
+
+/**
+ * @brief ktx_key_format looks up the format stored by ktx_key_values in the
+ * n bytes of key/value data kv.
+ * @return false if there is no valid "td.format".
+ */
+inline bool ktx_key_format(const uint8_t* kv, uint64_t n, Format& f)
+{
+	uint64_t pos = 0;
+	while(n-pos >= sizeof(uint32_t))
+	{
+		uint32_t size;
+		memcpy(&size,kv+pos,sizeof(size));
+		pos += sizeof(size);
+		if(size > n-pos)
+			return false;
+		if(size == sizeof(KTX_TD_FORMAT)+sizeof(uint32_t) &&
+		   memcmp(kv+pos,KTX_TD_FORMAT,sizeof(KTX_TD_FORMAT)) == 0)
+		{
+			uint32_t value;
+			memcpy(&value,kv+pos+sizeof(KTX_TD_FORMAT),sizeof(value));
+			f = Format(value);
+			return valid_format(f);
+		}
+		// the values are padded to 4 bytes, except maybe the last one
+		pos = std::min<uint64_t>(n,pos+(uint64_t(size)+3)/4*4);
+	}
+	return false;
+}
+
+/**
+ * @brief ktx_layout checks that h describes a 2D texture of a supported format
+ * and type and returns them. Compressed types take the format LUMINANCE or
+ * LUMINANCE_ALPHA for GL_RED and GL_RG, the format in the key/value data
+ * (see ktx_key_format) takes precedence.
+ * @param h
+ * @param f - the format.
+ * @param t - the type.
+ * @param levels - the number of levels stored (at least 1).
+ * @return
+ */
+inline bool ktx_layout(const KtxHeader& h, Format& f, DType& t, uint32_t& levels)
+{
+	if(memcmp(h.identifier,KTX_IDENTIFIER,sizeof(KTX_IDENTIFIER)) != 0 ||
+	   h.endianness != KTX_ENDIANNESS || h.pixel_width == 0 || h.pixel_height == 0 ||
+	   h.pixel_width > uint32_t(INT32_MAX) || h.pixel_height > uint32_t(INT32_MAX) || h.pixel_depth != 0 ||
+	   h.n_array_elements != 0 || h.n_faces != 1)
+		return false;
+	if(h.gl_type == 0)
+	{
+		t = DType(h.gl_internal_format);
+		f = h.gl_base_internal_format == KTX_RED ? Format::LUMINANCE :
+			h.gl_base_internal_format == KTX_RG ? Format::LUMINANCE_ALPHA :
+			Format(h.gl_base_internal_format);
+		if(!is_compressed(t) || h.gl_format != 0)
+			return false;
+	}
+	else
+	{
+		t = DType(h.gl_type);
+		f = Format(h.gl_format);
+		if(is_compressed(t) || h.gl_type_size != (t == DType::UNSIGNED_BYTE ? 1u : 2u))
+			return false;
+	}
+	// a level below 1x1 is invalid
+	levels = std::max(1u,h.n_mip_levels);
+	return valid_format(f) && valid_type(t) && levels <= 32 &&
+		   (std::max(h.pixel_width,h.pixel_height)>>(levels-1)) > 0;
+}
 
 /**
  * @brief The TextureLayer class a texture layer is an actual 2D-bitmap storing
@@ -86,8 +612,8 @@ public:
 	TextureLayer(const TextureLayer& o)
 		:lvl(o.lvl),w(o.w),h(o.h),frmt(o.frmt),type(o.type),data(nullptr)
 	{
-		data=malloc(w*h*size_per_pixel(frmt,type));
-		memcpy(data,o.data,w*h*size_per_pixel(frmt,type));
+		data=malloc(size());
+		memcpy(data,o.data,size());
 	}
 	~TextureLayer()
 	{
@@ -95,6 +621,17 @@ public:
 		free(data);
 	}
 
+	/**
+	 * @brief size returns the number of bytes of data.
+	 */
+	uint64_t size() const
+	{
+		return layer_size(w,h,frmt,type);
+	}
+
+	/**
+	 * @brief write writes the layer as a record of a v1 .td file.
+	 */
 	void write(std::ostream& f) const
 	{
 		f.write(reinterpret_cast<const char*>(&lvl),sizeof(lvl));
@@ -102,17 +639,32 @@ public:
 		f.write(reinterpret_cast<const char*>(&h),sizeof(h));
 		f.write(reinterpret_cast<const char*>(&frmt),sizeof(frmt));
 		f.write(reinterpret_cast<const char*>(&type),sizeof(type));
-		f.write(reinterpret_cast<const char*>(data),w*h*size_per_pixel(frmt,type));
+		f.write(reinterpret_cast<const char*>(data),size());
 	}
-	void read(std::istream& f)
+
+	/**
+	 * @brief read reads a record of a v1 .td file.
+	 * @param f
+	 * @param remaining - the bytes left in f (see stream_remaining).
+	 * @return false if the record is invalid, does not fit into remaining or
+	 * could not be read.
+	 */
+	bool read(std::istream& f, uint64_t remaining = UINT64_MAX)
 	{
 		f.read(reinterpret_cast<char*>(&lvl),sizeof(lvl));
 		f.read(reinterpret_cast<char*>(&w),sizeof(w));
 		f.read(reinterpret_cast<char*>(&h),sizeof(h));
 		f.read(reinterpret_cast<char*>(&frmt),sizeof(frmt));
 		f.read(reinterpret_cast<char*>(&type),sizeof(type));
-		data = realloc(data,w*h*size_per_pixel(frmt,type));
-		f.read(reinterpret_cast<char*>(data),w*h*size_per_pixel(frmt,type));
+		if(!f || w < 0 || h < 0 || !valid_format(frmt) || !valid_type(type) ||
+		   size() > TD_MAX_LAYER_SIZE || size() > remaining-std::min<uint64_t>(remaining,20))
+			return false;
+		void* d = realloc(data,size());
+		if(!d && size())
+			return false;
+		data = d;
+		f.read(reinterpret_cast<char*>(data),size());
+		return bool(f);
 	}
 };
 
@@ -125,43 +677,311 @@ class TextureData
 public:
 	std::vector<TextureLayer> layers;
 
-	void write(std::ostream& f) const
+	/**
+	 * @brief write writes a v3 .td file.
+	 * @param f
+	 * @param alignment - of the payloads, a power of two.
+	 * @param codec - used for each layer that gets smaller by it (see
+	 * compress_layer).
+	 */
+	void write(std::ostream& f, uint32_t alignment = 16, Codec codec = Codec::NONE) const
 	{
-		uint32_t n_layers = layers.size();
-		f.write(reinterpret_cast<const char*>(&n_layers),sizeof(n_layers));
-		for(const auto& l : layers)
-			l.write(f);
+		const FileHeader fh = {TD_MAGIC,TD_VERSION,uint32_t(layers.size()),alignment};
+		std::vector<LayerEntry> table(layers.size());
+		std::vector<std::vector<uint8_t>> payloads(layers.size());
+		uint64_t pos = payload_offset(fh.n_layers,alignment);
+		for(size_t i = 0 ; i < layers.size();i++)
+		{
+			const TextureLayer& l = layers[i];
+			LayerEntry& e = table[i];
+			e = {l.lvl,l.w,l.h,l.frmt,l.type,0,pos,l.size(),Codec::NONE,0};
+			if(codec != Codec::NONE &&
+			   compress_layer(payloads[i],e.chunk_size,l.data,l.w,l.h,l.frmt,l.type,codec))
+			{
+				e.size = payloads[i].size();
+				e.codec = codec;
+				e.checksum = crc32(payloads[i].data(),e.size);
+			}
+			else
+			{
+				payloads[i].clear();
+				e.chunk_size = 0;
+				e.checksum = crc32(l.data,e.size);
+			}
+			pos = (pos+e.size+alignment-1)/alignment*alignment;
+		}
+
+		f.write(reinterpret_cast<const char*>(&fh),sizeof(fh));
+		f.write(reinterpret_cast<const char*>(table.data()),table.size()*sizeof(LayerEntry));
+		pos = write_padding(f,sizeof(fh)+table.size()*sizeof(LayerEntry),alignment);
+		for(size_t i = 0 ; i < layers.size();i++)
+		{
+			const void* p = table[i].codec == Codec::NONE ? layers[i].data : payloads[i].data();
+			f.write(reinterpret_cast<const char*>(p),table[i].size);
+			pos = write_padding(f,pos+table[i].size,alignment);
+		}
+	}
+
+	/**
+	 * @brief write_ktx writes a KTX 1.1 file (see KtxHeader). The layers have
+	 * to form a single mip-map chain: layer i is level i of one format and
+	 * type, max(1,w>>i) x max(1,h>>i) pixels. That excludes e.g. the separate
+	 * ALPHA layers of ETC1.
+	 * @param f
+	 * @return false if the layers are no mip-map chain or could not be
+	 * written.
+	 */
+	bool write_ktx(std::ostream& f) const
+	{
+		if(layers.empty() || layers.size() > 32 || layers[0].w <= 0 || layers[0].h <= 0)
+			return false;
+		const TextureLayer& l0 = layers[0];
+		for(size_t i = 0 ; i < layers.size();i++)
+		{
+			const TextureLayer& l = layers[i];
+			if(l.lvl != int32_t(i) || l.frmt != l0.frmt || l.type != l0.type ||
+			   l.w != std::max(1,l0.w>>i) || l.h != std::max(1,l0.h>>i) ||
+			   ktx_image_size(l.w,l.h,l.frmt,l.type) > UINT32_MAX)
+				return false;
+		}
+
+		const bool c = is_compressed(l0.type);
+		KtxHeader h;
+		memcpy(h.identifier,KTX_IDENTIFIER,sizeof(KTX_IDENTIFIER));
+		h.endianness = KTX_ENDIANNESS;
+		h.gl_type = c ? 0 : uint32_t(l0.type);
+		h.gl_type_size = c || l0.type == DType::UNSIGNED_BYTE ? 1 : 2;
+		h.gl_format = c ? 0 : uint32_t(l0.frmt);
+		h.gl_internal_format = c ? uint32_t(l0.type) : uint32_t(l0.frmt);
+		h.gl_base_internal_format = ktx_base_format(l0.frmt,l0.type);
+		h.pixel_width = l0.w;
+		h.pixel_height = l0.h;
+		h.pixel_depth = 0;
+		h.n_array_elements = 0;
+		h.n_faces = 1;
+		h.n_mip_levels = uint32_t(layers.size());
+		const std::vector<uint8_t> kv = ktx_key_values(l0.frmt,l0.type);
+		h.key_value_bytes = uint32_t(kv.size());
+		f.write(reinterpret_cast<const char*>(&h),sizeof(h));
+		f.write(reinterpret_cast<const char*>(kv.data()),kv.size());
+
+		// padded rows and blocks are multiples of 4 bytes, so the levels
+		// need no padding
+		static const char zeros[4] = {};
+		for(const TextureLayer& l : layers)
+		{
+			const uint32_t size = uint32_t(ktx_image_size(l.w,l.h,l.frmt,l.type));
+			f.write(reinterpret_cast<const char*>(&size),sizeof(size));
+			const uint64_t row = uint64_t(l.w)*size_per_pixel(l.frmt,l.type);
+			const uint64_t pitch = ktx_row_pitch(l.w,l.frmt,l.type);
+			if(c || row == pitch)
+			{
+				f.write(reinterpret_cast<const char*>(l.data),size);
+				continue;
+			}
+			for(int y = 0 ; y < l.h;y++)
+			{
+				f.write(reinterpret_cast<const char*>(l.data)+y*row,row);
+				f.write(zeros,pitch-row);
+			}
+		}
+		return bool(f);
 	}
 
+	/**
+	 * @brief read_ktx reads the levels of a KTX 1.1 file following its header
+	 * h (see ktx_layout). Of the key/value data only the format of compressed
+	 * types is used (see ktx_key_format).
+	 * @param f
+	 * @param h
+	 * @return false if the file is invalid, unsupported or could not be read.
+	 */
+	bool read_ktx(std::istream& f, const KtxHeader& h)
+	{
+		Format frmt;
+		DType type;
+		uint32_t levels;
+		if(!ktx_layout(h,frmt,type,levels))
+			return false;
+		uint64_t remaining = stream_remaining(f);
+		if(h.key_value_bytes > remaining)
+			return false;
+		std::vector<uint8_t> kv(h.key_value_bytes);
+		f.read(reinterpret_cast<char*>(kv.data()),kv.size());
+		if(!f)
+			return false;
+		remaining -= h.key_value_bytes;
+		Format kf;
+		if(is_compressed(type) && ktx_key_format(kv.data(),kv.size(),kf))
+			frmt = kf;
+		layers.clear();
+		layers.resize(levels);
+		for(uint32_t i = 0 ; i < levels;i++)
+		{
+			TextureLayer& l = layers[i];
+			l.lvl = i;
+			l.w = std::max(1u,h.pixel_width>>i);
+			l.h = std::max(1u,h.pixel_height>>i);
+			l.frmt = frmt;
+			l.type = type;
+			uint32_t size = 0;
+			f.read(reinterpret_cast<char*>(&size),sizeof(size));
+			if(!f || size != ktx_image_size(l.w,l.h,frmt,type) ||
+			   remaining < sizeof(size) || remaining-sizeof(size) < size ||
+			   l.size() > TD_MAX_LAYER_SIZE)
+				return false;
+			void* d = realloc(l.data,l.size());
+			if(!d && l.size())
+				return false;
+			l.data = d;
+			const uint64_t row = uint64_t(l.w)*size_per_pixel(frmt,type);
+			const uint64_t pitch = ktx_row_pitch(l.w,frmt,type);
+			if(is_compressed(type) || row == pitch)
+				f.read(reinterpret_cast<char*>(l.data),size);
+			else
+			{
+				for(int y = 0 ; y < l.h;y++)
+				{
+					f.read(reinterpret_cast<char*>(l.data)+y*row,row);
+					f.ignore(pitch-row);
+				}
+			}
+			const uint32_t pad = (4-size%4)%4;
+			f.ignore(pad);
+			if(!f)
+				return false;
+			remaining -= std::min<uint64_t>(remaining,sizeof(size)+size+pad);
+		}
+		return true;
+	}
 
-	void read(std::istream& f)
+	/**
+	 * @brief read reads a v3, v2 or v1 .td file or a KTX file (see read_ktx).
+	 * The checksums are verified and compressed layers are decompressed.
+	 * @param f
+	 * @return false if the file is invalid or could not be read.
+	 */
+	bool read(std::istream& f)
 	{
-		uint32_t n_layers = 0;
-		f.read(reinterpret_cast<char*>(&n_layers),sizeof(n_layers));
-		layers.resize(n_layers);
-		for(auto& l : layers)
-			l.read(f);
+		// the offsets in the layer table are relative to the start of f
+		const uint64_t length = stream_remaining(f);
+		uint32_t first = 0;
+		f.read(reinterpret_cast<char*>(&first),sizeof(first));
+		if(!f)
+			return false;
+
+		if(first == KTX_MAGIC)
+		{
+			KtxHeader h;
+			memcpy(&h,&first,sizeof(first));
+			f.read(reinterpret_cast<char*>(&h)+sizeof(first),sizeof(h)-sizeof(first));
+			return f && read_ktx(f,h);
+		}
+		if(first != TD_MAGIC)
+		{
+			// v1, first is the number of layers, each needs at least its header
+			uint64_t pos = sizeof(first);
+			if(first > (length-std::min<uint64_t>(length,pos))/20)
+				return false;
+			layers.clear();
+			layers.resize(first);
+			for(auto& l : layers)
+			{
+				if(!l.read(f,length-std::min(length,pos)))
+					return false;
+				pos += 20+l.size();
+			}
+			return true;
+		}
+
+		FileHeader fh = {first,0,0,0};
+		f.read(reinterpret_cast<char*>(&fh)+sizeof(first),sizeof(fh)-sizeof(first));
+		if(!f || fh.version < 2 || fh.version > TD_VERSION)
+			return false;
+		const uint32_t es = entry_size(fh.version);
+		if(fh.n_layers > (length-std::min<uint64_t>(length,sizeof(fh)))/es)
+			return false;
+		std::vector<LayerEntry> table(fh.n_layers);
+		for(auto& e : table)
+		{
+			e.codec = Codec::NONE;
+			e.chunk_size = 0;
+			f.read(reinterpret_cast<char*>(&e),es);
+		}
+		if(!f)
+			return false;
+
+		uint64_t pos = sizeof(fh)+uint64_t(table.size())*es;
+		std::vector<uint8_t> payload;
+		layers.clear();
+		layers.resize(fh.n_layers);
+		for(size_t i = 0 ; i < table.size();i++)
+		{
+			const LayerEntry& e = table[i];
+			TextureLayer& l = layers[i];
+			l.lvl = e.lvl;
+			l.w = e.w;
+			l.h = e.h;
+			l.frmt = e.frmt;
+			l.type = e.type;
+			// the payloads are stored in order, compressed ones are only stored
+			// if they are smaller
+			if(e.w < 0 || e.h < 0 || !valid_format(e.frmt) || !valid_type(e.type) ||
+			   l.size() > TD_MAX_LAYER_SIZE)
+				return false;
+			if(e.codec != Codec::NONE && e.codec != Codec::LZ && e.codec != Codec::PREDICTIVE)
+				return false;
+			if((e.codec == Codec::NONE && e.size != l.size()) || e.size > l.size())
+				return false;
+			// every chunk of a compressed payload has an entry in its table
+			if(e.codec != Codec::NONE &&
+			   (e.chunk_size == 0 || chunk_count(l.size(),e.chunk_size) > e.size/sizeof(uint32_t)))
+				return false;
+			if(e.offset < pos || e.offset > length || length-e.offset < e.size)
+				return false;
+			f.ignore(e.offset-pos);
+			void* d = realloc(l.data,l.size());
+			if(!d && l.size())
+				return false;
+			l.data = d;
+			void* dst = l.data;
+			if(e.codec != Codec::NONE)
+			{
+				payload.resize(e.size);
+				dst = payload.data();
+			}
+			f.read(reinterpret_cast<char*>(dst),e.size);
+			if(!f || crc32(dst,e.size) != e.checksum)
+				return false;
+			if(e.codec != Codec::NONE &&
+			   !decompress_layer(l.data,l.w,l.h,l.frmt,l.type,e.codec,dst,e.size,e.chunk_size))
+				return false;
+			pos = e.offset+e.size;
+		}
+		return true;
 	}
 
-	void write(const std::string& path)
+	void write(const std::string& path, uint32_t alignment = 16, Codec codec = Codec::NONE)
 	{
 		std::ofstream f(path,std::ios::binary);
 		if(f.is_open())
 		{
-			write(f);
+			write(f,alignment,codec);
 			f.close();
 		}
 	}
 
 
-	void read(const std::string& path)
+	bool write_ktx(const std::string& path) const
+	{
+		std::ofstream f(path,std::ios::binary);
+		return f.is_open() && write_ktx(f);
+	}
+
+	bool read(const std::string& path)
 	{
 		std::ifstream f(path,std::ios::binary);
-		if(f.is_open())
-		{
-			read(f);
-			f.close();
-		}
+		return f.is_open() && read(f);
 	}
 
 	auto begin() -> decltype(layers.begin()){return layers.begin();}
@@ -6,10 +6,27 @@ CONFIG   -= app_bundle
 INCLUDEPATH +=
 SOURCES += \
 	td.cpp \
-    	td_image.cpp
-
-
-CONFIG += c++11
+    	td_image.cpp \
+	td_thread.cpp \
+	td_color.cpp \
+	td_pack.cpp \
+	td_cpu.cpp \
+	td_precision.cpp \
+	td_view.cpp \
+	td_codec.cpp \
+	td_rans.cpp \
+	td_block.cpp \
+	td_etc.cpp \
+	td_astc.cpp \
+	td_bc.cpp \
+	td_pvrtc.cpp \
+	td_cache.cpp
+
+
+CONFIG += c++11 thread
+unix:LIBS += -pthread
+# the kernels of all instruction sets have to round the same way (no FMA)
+*-g++*|*-clang*:QMAKE_CXXFLAGS += -ffp-contract=off
 
 
 DESTDIR = bin
@@ -18,5 +35,19 @@ OBJECTS_DIR = obj
 
 HEADERS += \
 	td_image.h \
+	td_thread.h \
+	td_color.h \
+	td_pack.h \
+	td_cpu.h \
+	td_precision.h \
+	td_view.h \
+	td_codec.h \
+	td_rans.h \
+	td_block.h \
+	td_etc.h \
+	td_astc.h \
+	td_bc.h \
+	td_pvrtc.h \
+	td_cache.h \
 	td.h
 
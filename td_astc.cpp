@@ -0,0 +1,1121 @@
+#include "td_astc.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+namespace td
+{
+
+/*
+ * An ASTC block is a little endian 128 bit integer. The blocks of the encoder
+ * have a single partition:
+ *   bits 0..10  the block mode: size of the weight grid, range of the weights
+ *               and whether there is a second plane of weights
+ *   bits 11..12 the number of partitions - 1
+ *   bits 13..16 the color endpoint mode (CEM), 8 for RGB and 12 for RGBA
+ *   bits 17..   the endpoints, integer sequence encoded (ISE) in the largest
+ *               range which fits into the block
+ * The weights are ISE encoded from bit 127 downwards, with two planes the
+ * weights of a grid point are interleaved and the two bits selecting the
+ * channel of the second plane precede them. Block mode 0x1FC marks void
+ * extent blocks, which store a single color in 16 bits per channel.
+ */
+
+// the ranges of the integer sequence encoding, the weights use the first 12
+static const int RANGE_LEVELS[21] = {2,3,4,5,6,8,10,12,16,20,24,32,40,48,64,80,96,128,160,192,256};
+
+/**
+ * @brief The Range struct describes the ISE of a range: each value is a trit
+ * or quint (if any) and the given number of low bits.
+ */
+struct Range
+{
+	int trits, quints, bits;
+};
+
+static Range range_of(int r)
+{
+	const int l = RANGE_LEVELS[r];
+	Range res = {l%3 == 0, l%5 == 0, 0};
+	for(int m = res.trits ? l/3 : res.quints ? l/5 : l; m > 1; m >>= 1)
+		res.bits++;
+	return res;
+}
+
+// the number of bits of n values of range r, 5 trits take 8 bits, 3 quints 7
+static int ise_bits(int r, int n)
+{
+	const Range s = range_of(r);
+	return n*s.bits+(s.trits ? (8*n+4)/5 : s.quints ? (7*n+2)/3 : 0);
+}
+
+/**
+ * @brief The BitWriter struct sets bits of a zeroed block, bits beyond end are
+ * dropped.
+ */
+struct BitWriter
+{
+	uint8_t* data;
+	int pos, end;
+	void put(uint32_t v, int n)
+	{
+		for(int i = 0 ; i < n;i++, pos++)
+			if(pos < end && (v>>i)&1)
+				data[pos>>3] |= uint8_t(1<<(pos&7));
+	}
+};
+
+/**
+ * @brief The BitReader struct reads bits of a block, bits beyond end are 0.
+ */
+struct BitReader
+{
+	const uint8_t* data;
+	int pos, end;
+	uint32_t get(int n)
+	{
+		uint32_t v = 0;
+		for(int i = 0 ; i < n;i++, pos++)
+			if(pos < end)
+				v |= uint32_t((data[pos>>3]>>(pos&7))&1)<<i;
+		return v;
+	}
+};
+
+static inline int field(int v, int hi, int lo)
+{
+	return (v>>lo)&((1<<(hi-lo+1))-1);
+}
+
+// the 5 trits packed into T
+static void unpack_trits(int T, int* t)
+{
+	int c;
+	if(field(T,4,2) == 7)
+	{
+		c = field(T,7,5)<<2|field(T,1,0);
+		t[4] = t[3] = 2;
+	}
+	else
+	{
+		c = field(T,4,0);
+		if(field(T,6,5) == 3)
+		{
+			t[4] = 2;
+			t[3] = field(T,7,7);
+		}
+		else
+		{
+			t[4] = field(T,7,7);
+			t[3] = field(T,6,5);
+		}
+	}
+	if(field(c,1,0) == 3)
+	{
+		t[2] = 2;
+		t[1] = field(c,4,4);
+		t[0] = field(c,3,3)<<1|(field(c,2,2)&~field(c,3,3)&1);
+	}
+	else if(field(c,3,2) == 3)
+	{
+		t[2] = t[1] = 2;
+		t[0] = field(c,1,0);
+	}
+	else
+	{
+		t[2] = field(c,4,4);
+		t[1] = field(c,3,2);
+		t[0] = field(c,1,1)<<1|(field(c,0,0)&~field(c,1,1)&1);
+	}
+}
+
+// the 3 quints packed into Q
+static void unpack_quints(int Q, int* q)
+{
+	if(field(Q,2,1) == 3 && field(Q,6,5) == 0)
+	{
+		q[2] = field(Q,0,0)<<2|(field(Q,4,4)&~field(Q,0,0)&1)<<1|(field(Q,3,3)&~field(Q,0,0)&1);
+		q[1] = q[0] = 4;
+		return;
+	}
+	int c;
+	if(field(Q,2,1) == 3)
+	{
+		q[2] = 4;
+		c = field(Q,4,3)<<3|(~field(Q,6,5)&3)<<1|field(Q,0,0);
+	}
+	else
+	{
+		q[2] = field(Q,6,5);
+		c = field(Q,4,0);
+	}
+	if(field(c,2,0) == 5)
+	{
+		q[1] = 4;
+		q[0] = field(c,4,3);
+	}
+	else
+	{
+		q[1] = field(c,4,3);
+		q[0] = field(c,2,0);
+	}
+}
+
+/**
+ * @brief The IseTables struct holds the packing of trits and quints: the
+ * smallest code of each combination, so the bits of trailing zeros are 0 and
+ * incomplete groups can be cut off.
+ */
+struct IseTables
+{
+	uint8_t trit_code[243];
+	uint8_t quint_code[125];
+	IseTables()
+	{
+		memset(trit_code,0xFF,sizeof(trit_code));
+		memset(quint_code,0xFF,sizeof(quint_code));
+		for(int T = 0 ; T < 256;T++)
+		{
+			int t[5];
+			unpack_trits(T,t);
+			uint8_t& c = trit_code[t[0]+3*t[1]+9*t[2]+27*t[3]+81*t[4]];
+			c = std::min(c,uint8_t(T));
+		}
+		for(int Q = 0 ; Q < 128;Q++)
+		{
+			int q[3];
+			unpack_quints(Q,q);
+			uint8_t& c = quint_code[q[0]+5*q[1]+25*q[2]];
+			c = std::min(c,uint8_t(Q));
+		}
+	}
+};
+static const IseTables ise_tables;
+
+static void ise_encode(uint8_t* data, int pos, int r, const uint8_t* v, int n)
+{
+	const Range s = range_of(r);
+	BitWriter w = {data,pos,pos+ise_bits(r,n)};
+	const int mask = (1<<s.bits)-1;
+	if(s.trits)
+	{
+		for(int i = 0 ; i < n;i+=5)
+		{
+			int t[5] = {}, m[5] = {};
+			for(int j = 0 ; j < 5 && i+j < n;j++)
+			{
+				t[j] = v[i+j]>>s.bits;
+				m[j] = v[i+j]&mask;
+			}
+			const int T = ise_tables.trit_code[t[0]+3*t[1]+9*t[2]+27*t[3]+81*t[4]];
+			w.put(m[0],s.bits); w.put(T,2);
+			w.put(m[1],s.bits); w.put(T>>2,2);
+			w.put(m[2],s.bits); w.put(T>>4,1);
+			w.put(m[3],s.bits); w.put(T>>5,2);
+			w.put(m[4],s.bits); w.put(T>>7,1);
+		}
+	}
+	else if(s.quints)
+	{
+		for(int i = 0 ; i < n;i+=3)
+		{
+			int q[3] = {}, m[3] = {};
+			for(int j = 0 ; j < 3 && i+j < n;j++)
+			{
+				q[j] = v[i+j]>>s.bits;
+				m[j] = v[i+j]&mask;
+			}
+			const int Q = ise_tables.quint_code[q[0]+5*q[1]+25*q[2]];
+			w.put(m[0],s.bits); w.put(Q,3);
+			w.put(m[1],s.bits); w.put(Q>>3,2);
+			w.put(m[2],s.bits); w.put(Q>>5,2);
+		}
+	}
+	else
+	{
+		for(int i = 0 ; i < n;i++)
+			w.put(v[i],s.bits);
+	}
+}
+
+static void ise_decode(const uint8_t* data, int pos, int r, uint8_t* v, int n)
+{
+	const Range s = range_of(r);
+	BitReader rd = {data,pos,pos+ise_bits(r,n)};
+	if(s.trits)
+	{
+		for(int i = 0 ; i < n;i+=5)
+		{
+			int m[5], t[5];
+			int T = 0;
+			m[0] = rd.get(s.bits); T |= rd.get(2);
+			m[1] = rd.get(s.bits); T |= rd.get(2)<<2;
+			m[2] = rd.get(s.bits); T |= rd.get(1)<<4;
+			m[3] = rd.get(s.bits); T |= rd.get(2)<<5;
+			m[4] = rd.get(s.bits); T |= rd.get(1)<<7;
+			unpack_trits(T,t);
+			for(int j = 0 ; j < 5 && i+j < n;j++)
+				v[i+j] = uint8_t(t[j]<<s.bits|m[j]);
+		}
+	}
+	else if(s.quints)
+	{
+		for(int i = 0 ; i < n;i+=3)
+		{
+			int m[3], q[3];
+			int Q = 0;
+			m[0] = rd.get(s.bits); Q |= rd.get(3);
+			m[1] = rd.get(s.bits); Q |= rd.get(2)<<3;
+			m[2] = rd.get(s.bits); Q |= rd.get(2)<<5;
+			unpack_quints(Q,q);
+			for(int j = 0 ; j < 3 && i+j < n;j++)
+				v[i+j] = uint8_t(q[j]<<s.bits|m[j]);
+		}
+	}
+	else
+	{
+		for(int i = 0 ; i < n;i++)
+			v[i] = uint8_t(rd.get(s.bits));
+	}
+}
+
+// repeats the n bits of v to fill the given number of bits
+static int replicate(int v, int n, int bits)
+{
+	int res = 0;
+	for(int s = bits-n; s > -n; s -= n)
+		res |= s >= 0 ? v<<s : v>>-s;
+	return res&((1<<bits)-1);
+}
+
+/*
+ * The values of trits and quints are unquantized by scrambling the low bits
+ * (a..f, from the lsb) into B and scaling the trit or quint by C.
+ */
+static int unquantize_color(int r, int v)
+{
+	const Range s = range_of(r);
+	if(!s.trits && !s.quints)
+		return replicate(v,s.bits,8);
+	const int D = v>>s.bits;
+	const int m = v&((1<<s.bits)-1);
+	const int a = m&1 ? 0x1FF : 0;
+	const int b = m>>1&1, c = m>>2&1, d = m>>3&1, e = m>>4&1, f = m>>5&1;
+	int B = 0, C = 0;
+	if(s.trits)
+	{
+		switch(s.bits)
+		{
+		case 1: C = 204; break;
+		case 2: C = 93; B = b*0x116; break;
+		case 3: C = 44; B = c*0x10A+b*0x085; break;
+		case 4: C = 22; B = d*0x104+c*0x082+b*0x041; break;
+		case 5: C = 11; B = e*0x102+d*0x081+c*0x040+b*0x020; break;
+		case 6: C = 5; B = f*0x101+e*0x080+d*0x040+c*0x020+b*0x010; break;
+		}
+	}
+	else
+	{
+		switch(s.bits)
+		{
+		case 1: C = 113; break;
+		case 2: C = 54; B = b*0x10C; break;
+		case 3: C = 26; B = c*0x105+b*0x082; break;
+		case 4: C = 13; B = d*0x102+c*0x081+b*0x040; break;
+		case 5: C = 6; B = e*0x101+d*0x080+c*0x040+b*0x020; break;
+		}
+	}
+	const int t = (D*C+B)^a;
+	return (a&0x80)|(t>>2);
+}
+
+// weights are unquantized to [0,64]
+static int unquantize_weight(int r, int v)
+{
+	const Range s = range_of(r);
+	int res;
+	if(!s.trits && !s.quints)
+	{
+		res = replicate(v,s.bits,6);
+	}
+	else if(!s.bits)
+	{
+		static const int T[3] = {0,32,63};
+		static const int Q[5] = {0,16,32,47,63};
+		res = s.trits ? T[v] : Q[v];
+	}
+	else
+	{
+		const int D = v>>s.bits;
+		const int m = v&((1<<s.bits)-1);
+		const int a = m&1 ? 0x7F : 0;
+		const int b = m>>1&1, c = m>>2&1;
+		int B = 0, C = 0;
+		if(s.trits)
+		{
+			switch(s.bits)
+			{
+			case 1: C = 50; break;
+			case 2: C = 23; B = b*0x45; break;
+			case 3: C = 11; B = c*0x42+b*0x21; break;
+			}
+		}
+		else
+		{
+			switch(s.bits)
+			{
+			case 1: C = 28; break;
+			case 2: C = 13; B = b*0x42; break;
+			}
+		}
+		const int t = (D*C+B)^a;
+		res = (a&0x20)|(t>>2);
+	}
+	return res > 32 ? res+1 : res;
+}
+
+/**
+ * @brief The QuantTables struct holds the unquantized values of each ISE value
+ * and the closest ISE value of each color (weight) value.
+ */
+struct QuantTables
+{
+	uint8_t color[21][256];
+	uint8_t color_code[21][256];
+	uint8_t weight[12][32];
+	uint8_t weight_code[12][65];
+	QuantTables()
+	{
+		for(int r = 0 ; r < 21;r++)
+		{
+			for(int v = 0 ; v < RANGE_LEVELS[r];v++)
+				color[r][v] = uint8_t(unquantize_color(r,v));
+			for(int c = 0 ; c < 256;c++)
+			{
+				int best = 0;
+				for(int v = 1 ; v < RANGE_LEVELS[r];v++)
+					if(std::abs(color[r][v]-c) < std::abs(color[r][best]-c))
+						best = v;
+				color_code[r][c] = uint8_t(best);
+			}
+		}
+		for(int r = 0 ; r < 12;r++)
+		{
+			for(int v = 0 ; v < RANGE_LEVELS[r];v++)
+				weight[r][v] = uint8_t(unquantize_weight(r,v));
+			for(int c = 0 ; c <= 64;c++)
+			{
+				int best = 0;
+				for(int v = 1 ; v < RANGE_LEVELS[r];v++)
+					if(std::abs(weight[r][v]-c) < std::abs(weight[r][best]-c))
+						best = v;
+				weight_code[r][c] = uint8_t(best);
+			}
+		}
+	}
+};
+static const QuantTables quant;
+
+/**
+ * @brief The BlockMode struct is a decoded block mode.
+ */
+struct BlockMode
+{
+	int gw, gh;
+	int range;
+	bool dual;
+};
+
+static bool decode_block_mode(int mode, BlockMode& m)
+{
+	int r = field(mode,4,4);
+	bool h = field(mode,9,9);
+	m.dual = field(mode,10,10);
+	const int a = field(mode,6,5);
+	if(field(mode,1,0))
+	{
+		r |= field(mode,1,0)<<1;
+		const int b = field(mode,8,7);
+		switch(field(mode,3,2))
+		{
+		case 0: m.gw = b+4; m.gh = a+2; break;
+		case 1: m.gw = b+8; m.gh = a+2; break;
+		case 2: m.gw = a+2; m.gh = b+8; break;
+		default:
+			if(field(mode,8,8))
+			{
+				m.gw = (b&1)+2;
+				m.gh = a+2;
+			}
+			else
+			{
+				m.gw = a+2;
+				m.gh = (b&1)+6;
+			}
+		}
+	}
+	else
+	{
+		r |= field(mode,3,2)<<1;
+		if(!field(mode,3,2))
+			return false;
+		const int b = field(mode,10,9);
+		switch(field(mode,8,7))
+		{
+		case 0: m.gw = 12; m.gh = a+2; break;
+		case 1: m.gw = a+2; m.gh = 12; break;
+		case 2:
+			m.gw = a+6;
+			m.gh = b+6;
+			m.dual = h = false;
+			break;
+		default:
+			if(a > 1)
+				return false;
+			m.gw = a ? 10 : 6;
+			m.gh = a ? 6 : 10;
+		}
+	}
+	m.range = r-2+6*h;
+	const int count = m.gw*m.gh*(m.dual ? 2 : 1);
+	const int bits = ise_bits(m.range,count);
+	return count <= 64 && bits >= 24 && bits <= 96;
+}
+
+/**
+ * @brief The Infill struct describes how the weights of the texels are
+ * interpolated from a weight grid: the 4 grid points of each texel and their
+ * factors (summing up to 16), and, for the encoder, the texels (and factors)
+ * of each grid point, those of point j at [start[j],start[j+1]).
+ */
+struct Infill
+{
+	std::vector<uint8_t> idx;
+	std::vector<uint8_t> f;
+	std::vector<int> start;
+	std::vector<uint8_t> texel;
+	std::vector<uint8_t> tf;
+
+	void init_points(int n, int count)
+	{
+		start.assign(count+1,0);
+		for(int i = 0 ; i < n*4;i++)
+			if(f[i])
+				start[idx[i]+1]++;
+		for(int j = 0 ; j < count;j++)
+			start[j+1] += start[j];
+		texel.resize(start[count]);
+		tf.resize(start[count]);
+		std::vector<int> pos(start.begin(),start.end()-1);
+		for(int i = 0 ; i < n*4;i++)
+		{
+			if(f[i])
+			{
+				texel[pos[idx[i]]] = uint8_t(i/4);
+				tf[pos[idx[i]]++] = f[i];
+			}
+		}
+	}
+
+	void init(int w, int h, int gw, int gh)
+	{
+		idx.resize(w*h*4);
+		f.resize(w*h*4);
+		const int ds = (1024+w/2)/(w-1);
+		const int dt = (1024+h/2)/(h-1);
+		for(int t = 0 ; t < h;t++)
+		{
+			for(int s = 0 ; s < w;s++)
+			{
+				const int gs = (ds*s*(gw-1)+32)>>6;
+				const int gt = (dt*t*(gh-1)+32)>>6;
+				const int fs = gs&15;
+				const int ft = gt&15;
+				const int v0 = (gs>>4)+(gt>>4)*gw;
+				const int w11 = (fs*ft+8)>>4;
+				const int i = (t*w+s)*4;
+				const int v[4] = {v0,v0+1,v0+gw,v0+gw+1};
+				const int fv[4] = {16-fs-ft+w11,fs-w11,ft-w11,w11};
+				for(int k = 0 ; k < 4;k++)
+				{
+					// points beyond the grid have a factor of 0
+					idx[i+k] = uint8_t(std::min(v[k],gw*gh-1));
+					f[i+k] = uint8_t(fv[k]);
+				}
+			}
+		}
+	}
+
+	inline int weight(const int* g, int t) const
+	{
+		const int i = t*4;
+		return (g[idx[i]]*f[i]+g[idx[i+1]]*f[i+1]+g[idx[i+2]]*f[i+2]+g[idx[i+3]]*f[i+3]+8)>>4;
+	}
+};
+
+/**
+ * @brief The Config struct is an encoding the encoder tries: the block mode
+ * and the range of the endpoints, which is the largest one fitting.
+ */
+struct Config
+{
+	int mode;
+	BlockMode m;
+	int crange;
+	int wbits;
+};
+
+/**
+ * @brief The Footprint struct holds the configs of a block size, for RGB
+ * (config[0]), RGBA (1) and RGBA with the alpha in the second plane (2), and
+ * the infill of their weight grids.
+ */
+struct Footprint
+{
+	int w, h;
+	std::vector<Config> configs[3];
+	Infill infill[13][13];
+
+	Footprint(int w, int h) : w(w), h(h)
+	{
+		for(int mode = 0 ; mode < 2048;mode++)
+		{
+			BlockMode m;
+			if((mode&0x1FF) == 0x1FC || !decode_block_mode(mode,m))
+				continue;
+			// roughly square grids of at least half the resolution, the
+			// others hardly ever win
+			if(m.gw > w || m.gh > h || 2*m.gw < w || 2*m.gh < h ||
+			   std::abs((m.gw-m.gh)-(w-h)) > 1 || m.range < 1)
+				continue;
+			const int count = m.gw*m.gh*(m.dual ? 2 : 1);
+			const int wbits = ise_bits(m.range,count);
+			for(int k = 0 ; k < 3;k++)
+			{
+				if(m.dual != (k == 2))
+					continue;
+				const int values = k ? 8 : 6;
+				const int avail = 128-17-wbits-(m.dual ? 2 : 0);
+				int crange = -1;
+				for(int r = 0 ; r < 21;r++)
+					if(ise_bits(r,values) <= avail)
+						crange = r;
+				// at least 24 levels per endpoint value
+				if(crange < 10)
+					continue;
+				bool dup = false;
+				for(const Config& c : configs[k])
+					dup = dup || (c.m.gw == m.gw && c.m.gh == m.gh && c.m.range == m.range);
+				if(dup)
+					continue;
+				configs[k].push_back({mode,m,crange,wbits});
+				if(infill[m.gw][m.gh].idx.empty())
+				{
+					infill[m.gw][m.gh].init(w,h,m.gw,m.gh);
+					infill[m.gw][m.gh].init_points(w*h,m.gw*m.gh);
+				}
+			}
+		}
+	}
+};
+
+// the footprints are square
+static const Footprint& footprint(int w)
+{
+	static const Footprint f4(4,4);
+	static const Footprint f6(6,6);
+	static const Footprint f8(8,8);
+	return w == 4 ? f4 : w == 6 ? f6 : f8;
+}
+
+/**
+ * @brief The Fit struct is an encoded block: the ISE values of the endpoints
+ * and the weights.
+ */
+struct Fit
+{
+	uint32_t err;
+	const Config* config;
+	uint8_t colors[8];
+	uint8_t weights[64];
+};
+
+/**
+ * @brief The Texels struct holds the pixels of a block and the initial
+ * endpoints of the encoder.
+ */
+struct Texels
+{
+	int n;
+	int channels;
+	float p[64][4];
+	uint8_t px[64][4];
+	float e[2][4];
+};
+
+// the principal axis of the channels [c0,c1) through their mean
+static void principal_axis(const Texels& t, int c0, int c1, float* e0, float* e1)
+{
+	float mean[4] = {0,0,0,0};
+	for(int i = 0 ; i < t.n;i++)
+		for(int c = c0 ; c < c1;c++)
+			mean[c] += t.p[i][c];
+	for(int c = c0 ; c < c1;c++)
+		mean[c] /= t.n;
+	float cov[4][4] = {};
+	for(int i = 0 ; i < t.n;i++)
+		for(int a = c0 ; a < c1;a++)
+			for(int b = c0 ; b < c1;b++)
+				cov[a][b] += (t.p[i][a]-mean[a])*(t.p[i][b]-mean[b]);
+	float axis[4] = {1,1,1,1};
+	for(int it = 0 ; it < 8;it++)
+	{
+		float next[4] = {0,0,0,0};
+		float len = 0;
+		for(int a = c0 ; a < c1;a++)
+		{
+			for(int b = c0 ; b < c1;b++)
+				next[a] += cov[a][b]*axis[b];
+			len = std::max(len,std::fabs(next[a]));
+		}
+		if(len <= 0)
+			break;
+		for(int a = c0 ; a < c1;a++)
+			axis[a] = next[a]/len;
+	}
+	float lo = 0, hi = 0;
+	for(int i = 0 ; i < t.n;i++)
+	{
+		float d = 0;
+		for(int c = c0 ; c < c1;c++)
+			d += (t.p[i][c]-mean[c])*axis[c];
+		lo = std::min(lo,d);
+		hi = std::max(hi,d);
+	}
+	float len2 = 0;
+	for(int c = c0 ; c < c1;c++)
+		len2 += axis[c]*axis[c];
+	for(int c = c0 ; c < c1;c++)
+	{
+		const float a = len2 > 0 ? axis[c]/len2 : 0;
+		e0[c] = mean[c]+a*lo;
+		e1[c] = mean[c]+a*hi;
+	}
+}
+
+/**
+ * @brief decimate fits the weights of the grid to the ideal weights of the
+ * texels u: the average of the texels each point contributes to, improved by
+ * a pass of coordinate descent on the squared error.
+ */
+static void decimate(const Infill& inf, int n, int count, const float* u, float* g)
+{
+	float f2[64];
+	for(int j = 0 ; j < count;j++)
+	{
+		float sum = 0, fsum = 0;
+		f2[j] = 0;
+		for(int k = inf.start[j] ; k < inf.start[j+1];k++)
+		{
+			const float f = inf.tf[k];
+			sum += f*u[inf.texel[k]];
+			fsum += f;
+			f2[j] += f*f;
+		}
+		g[j] = fsum > 0 ? sum/fsum : 0;
+	}
+
+	float r[64];
+	for(int t = 0 ; t < n;t++)
+	{
+		float v = 0;
+		for(int k = 0 ; k < 4;k++)
+			v += inf.f[t*4+k]*g[inf.idx[t*4+k]];
+		r[t] = u[t]-v/16;
+	}
+	for(int j = 0 ; j < count;j++)
+	{
+		if(f2[j] <= 0)
+			continue;
+		float num = 0;
+		for(int k = inf.start[j] ; k < inf.start[j+1];k++)
+			num += inf.tf[k]*r[inf.texel[k]];
+		const float d = std::min(64.0f,std::max(0.0f,g[j]+16*num/f2[j]))-g[j];
+		g[j] += d;
+		for(int k = inf.start[j] ; k < inf.start[j+1];k++)
+			r[inf.texel[k]] -= inf.tf[k]*d/16;
+	}
+}
+
+static inline int interpolate(int e0, int e1, int w)
+{
+	// the endpoints are expanded to 16 bits, the top 8 bits are the result
+	return ((e0*257*(64-w)+e1*257*w+32)>>6)>>8;
+}
+
+/**
+ * @brief fit_config encodes the texels with config c, starting with the
+ * initial endpoints and refining them iterations-1 times by least squares.
+ */
+static void fit_config(const Footprint& fp, const Config& c, const Texels& t, int iterations, Fit& out)
+{
+	const BlockMode& m = c.m;
+	const Infill& inf = fp.infill[m.gw][m.gh];
+	const int count = m.gw*m.gh;
+	const int planes = m.dual ? 2 : 1;
+	const int plane_of[4] = {0,0,0,m.dual ? 1 : 0};
+
+	float e[2][4];
+	memcpy(e,t.e,sizeof(e));
+	int q[2][4] = {{0,0,0,255},{0,0,0,255}};
+	int tw[2][64];
+	uint8_t codes[2][4];
+	uint8_t wcodes[2][64];
+	for(int it = 0 ; it < iterations;it++)
+	{
+		if(it)
+		{
+			// least squares endpoints for the weights of the texels
+			for(int ch = 0 ; ch < t.channels;ch++)
+			{
+				const int* w = tw[plane_of[ch]];
+				float a = 0, b = 0, cc = 0, d0 = 0, d1 = 0;
+				for(int i = 0 ; i < t.n;i++)
+				{
+					const float u = w[i]/64.0f;
+					a += (1-u)*(1-u);
+					b += u*(1-u);
+					cc += u*u;
+					d0 += (1-u)*t.p[i][ch];
+					d1 += u*t.p[i][ch];
+				}
+				const float det = a*cc-b*b;
+				if(std::fabs(det) > 1e-3f)
+				{
+					e[0][ch] = (cc*d0-b*d1)/det;
+					e[1][ch] = (a*d1-b*d0)/det;
+				}
+			}
+		}
+
+		for(int s = 0 ; s < 2;s++)
+		{
+			for(int ch = 0 ; ch < t.channels;ch++)
+			{
+				const int v = std::min(255,std::max(0,int(e[s][ch]+0.5f)));
+				codes[s][ch] = quant.color_code[c.crange][v];
+				q[s][ch] = quant.color[c.crange][codes[s][ch]];
+			}
+		}
+		// the decoder swaps the endpoints (and contracts them to blue) if the
+		// second is darker
+		if(t.channels >= 3 && q[1][0]+q[1][1]+q[1][2] < q[0][0]+q[0][1]+q[0][2])
+		{
+			std::swap(q[0],q[1]);
+			std::swap(codes[0],codes[1]);
+		}
+
+		for(int p = 0 ; p < planes;p++)
+		{
+			float d[4] = {0,0,0,0};
+			float len2 = 0;
+			for(int ch = 0 ; ch < t.channels;ch++)
+			{
+				if(plane_of[ch] != p)
+					continue;
+				d[ch] = float(q[1][ch]-q[0][ch]);
+				len2 += d[ch]*d[ch];
+			}
+			float u[64];
+			for(int i = 0 ; i < t.n;i++)
+			{
+				float v = 0;
+				for(int ch = 0 ; ch < t.channels;ch++)
+					v += (t.p[i][ch]-q[0][ch])*d[ch];
+				u[i] = len2 > 0 ? std::min(64.0f,std::max(0.0f,64*v/len2)) : 0;
+			}
+			float g[64];
+			if(count == t.n)
+				memcpy(g,u,sizeof(float)*count);
+			else
+				decimate(inf,t.n,count,u,g);
+			int gv[64];
+			for(int j = 0 ; j < count;j++)
+			{
+				wcodes[p][j] = quant.weight_code[m.range][int(g[j]+0.5f)];
+				gv[j] = quant.weight[m.range][wcodes[p][j]];
+			}
+			for(int i = 0 ; i < t.n;i++)
+				tw[p][i] = count == t.n ? gv[i] : inf.weight(gv,i);
+		}
+	}
+
+	uint32_t err = 0;
+	for(int i = 0 ; i < t.n;i++)
+	{
+		for(int ch = 0 ; ch < 4;ch++)
+		{
+			const int v = ch < t.channels ? interpolate(q[0][ch],q[1][ch],tw[plane_of[ch]][i]) : 255;
+			const int d = v-t.px[i][ch];
+			err += uint32_t(d*d);
+		}
+	}
+	out.err = err;
+	out.config = &c;
+	for(int ch = 0 ; ch < t.channels;ch++)
+	{
+		out.colors[2*ch] = codes[0][ch];
+		out.colors[2*ch+1] = codes[1][ch];
+	}
+	for(int j = 0 ; j < count;j++)
+		for(int p = 0 ; p < planes;p++)
+			out.weights[j*planes+p] = wcodes[p][j];
+}
+
+static void write_fit(uint8_t* dst, const Fit& f, int channels)
+{
+	const Config& c = *f.config;
+	const int count = c.m.gw*c.m.gh*(c.m.dual ? 2 : 1);
+	uint8_t block[16] = {};
+	BitWriter w = {block,0,128};
+	w.put(uint32_t(c.mode),11);
+	w.put(0,2);
+	w.put(channels == 4 ? 12 : 8,4);
+	ise_encode(block,17,c.crange,f.colors,channels*2);
+
+	// the weights are written from the top bit down
+	uint8_t weights[16] = {};
+	ise_encode(weights,0,c.m.range,f.weights,count);
+	for(int i = 0 ; i < c.wbits;i++)
+		if((weights[i>>3]>>(i&7))&1)
+			block[(127-i)>>3] |= uint8_t(1<<((127-i)&7));
+	if(c.m.dual)
+	{
+		// the second plane is the alpha
+		BitWriter ccs = {block,128-c.wbits-2,128-c.wbits};
+		ccs.put(3,2);
+	}
+	memcpy(dst,block,16);
+}
+
+void astc_encode_block(uint8_t *dst, const uint8_t *rgba, int w, int h, BlockQuality q)
+{
+	const Footprint& fp = footprint(w);
+	Texels t;
+	t.n = w*h;
+	bool constant = true;
+	int amin = 255, amax = 0;
+	for(int i = 0 ; i < t.n;i++)
+	{
+		for(int ch = 0 ; ch < 4;ch++)
+		{
+			t.px[i][ch] = rgba[i*4+ch];
+			t.p[i][ch] = rgba[i*4+ch];
+		}
+		constant = constant && !memcmp(rgba,rgba+i*4,4);
+		amin = std::min(amin,int(rgba[i*4+3]));
+		amax = std::max(amax,int(rgba[i*4+3]));
+	}
+
+	if(constant)
+	{
+		// a void extent block without extent, the color in 16 bits
+		uint8_t block[16] = {0xFC,0xFD,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF};
+		for(int ch = 0 ; ch < 4;ch++)
+			block[8+2*ch] = block[9+2*ch] = rgba[ch];
+		memcpy(dst,block,16);
+		return;
+	}
+
+	t.channels = amin < 255 ? 4 : 3;
+	// the configs to try and their initial endpoints
+	struct Set
+	{
+		const std::vector<Config>* configs;
+		float e[2][4];
+	} sets[2];
+	int nsets = 1;
+	sets[0].configs = &fp.configs[t.channels == 4];
+	principal_axis(t,0,t.channels,sets[0].e[0],sets[0].e[1]);
+	if(amin != amax && t.channels == 4 && q != BlockQuality::FAST)
+	{
+		Set& s = sets[nsets++];
+		s.configs = &fp.configs[2];
+		principal_axis(t,0,3,s.e[0],s.e[1]);
+		s.e[0][3] = float(amin);
+		s.e[1][3] = float(amax);
+	}
+
+	const int iterations = q == BlockQuality::BEST ? 4 : 1;
+	const int refined = q == BlockQuality::NORMAL ? 4 : 0;
+	std::vector<Fit> fits;
+	for(int k = 0 ; k < nsets;k++)
+	{
+		memcpy(t.e,sets[k].e,sizeof(t.e));
+		for(const Config& c : *sets[k].configs)
+		{
+			Fit f;
+			fit_config(fp,c,t,iterations,f);
+			fits.push_back(f);
+		}
+	}
+	std::sort(fits.begin(),fits.end(),[](const Fit& a, const Fit& b)
+	{
+		return a.err < b.err;
+	});
+
+	// NORMAL refines the endpoints of the best few configs
+	Fit best = fits[0];
+	for(int i = 0 ; i < std::min(refined,int(fits.size()));i++)
+	{
+		const Config& c = *fits[i].config;
+		memcpy(t.e,sets[c.m.dual ? nsets-1 : 0].e,sizeof(t.e));
+		Fit f;
+		fit_config(fp,c,t,3,f);
+		if(f.err < best.err)
+			best = f;
+	}
+	write_fit(dst,best,t.channels);
+}
+
+void astc_decode_block(uint8_t *rgba, const uint8_t *src, int w, int h)
+{
+	const int n = w*h;
+	auto error = [&]()
+	{
+		for(int i = 0 ; i < n;i++)
+		{
+			rgba[i*4] = rgba[i*4+2] = rgba[i*4+3] = 255;
+			rgba[i*4+1] = 0;
+		}
+	};
+
+	BitReader rd = {src,0,128};
+	const int mode = int(rd.get(11));
+	if((mode&0x1FF) == 0x1FC)
+	{
+		// LDR void extent, the 16 bit colors are rounded down
+		if(mode&0x200)
+			return error();
+		for(int i = 0 ; i < n;i++)
+			for(int ch = 0 ; ch < 4;ch++)
+				rgba[i*4+ch] = src[9+2*ch];
+		return;
+	}
+	BlockMode m;
+	if(!decode_block_mode(mode,m) || m.gw > w || m.gh > h || rd.get(2))
+		return error();
+	const int cem = int(rd.get(4));
+	if(cem != 0 && cem != 4 && cem != 8 && cem != 12)
+		return error();
+	const int values = cem/2+2;
+	const int count = m.gw*m.gh*(m.dual ? 2 : 1);
+	const int wbits = ise_bits(m.range,count);
+	const int avail = 128-17-wbits-(m.dual ? 2 : 0);
+	int crange = -1;
+	for(int r = 0 ; r < 21;r++)
+		if(ise_bits(r,values) <= avail)
+			crange = r;
+	if(crange < 4)
+		return error();
+
+	uint8_t v[8];
+	ise_decode(src,17,crange,v,values);
+	int c[8];
+	for(int i = 0 ; i < values;i++)
+		c[i] = quant.color[crange][v[i]];
+	int e[2][4];
+	if(cem < 8)
+	{
+		for(int s = 0 ; s < 2;s++)
+		{
+			e[s][0] = e[s][1] = e[s][2] = c[s];
+			e[s][3] = cem == 4 ? c[2+s] : 255;
+		}
+	}
+	else
+	{
+		const bool swap = c[1]+c[3]+c[5] < c[0]+c[2]+c[4];
+		for(int s = 0 ; s < 2;s++)
+		{
+			const int k = swap ? 1-s : s;
+			e[s][0] = c[k];
+			e[s][1] = c[2+k];
+			e[s][2] = c[4+k];
+			e[s][3] = cem == 12 ? c[6+k] : 255;
+			if(swap)
+			{
+				// blue contraction
+				e[s][0] = (e[s][0]+e[s][2])>>1;
+				e[s][1] = (e[s][1]+e[s][2])>>1;
+			}
+		}
+	}
+
+	uint8_t rev[16];
+	for(int i = 0 ; i < 16;i++)
+	{
+		uint8_t b = src[15-i];
+		b = uint8_t((b&0xF0)>>4|(b&0x0F)<<4);
+		b = uint8_t((b&0xCC)>>2|(b&0x33)<<2);
+		rev[i] = uint8_t((b&0xAA)>>1|(b&0x55)<<1);
+	}
+	uint8_t wv[64];
+	ise_decode(rev,0,m.range,wv,count);
+	int ccs = -1;
+	if(m.dual)
+	{
+		BitReader r = {src,128-wbits-2,128};
+		ccs = int(r.get(2));
+	}
+
+	Infill inf;
+	inf.init(w,h,m.gw,m.gh);
+	const int planes = m.dual ? 2 : 1;
+	for(int p = 0 ; p < planes;p++)
+	{
+		int g[64];
+		for(int j = 0 ; j < m.gw*m.gh;j++)
+			g[j] = quant.weight[m.range][wv[j*planes+p]];
+		for(int i = 0 ; i < n;i++)
+		{
+			const int wt = inf.weight(g,i);
+			for(int ch = 0 ; ch < 4;ch++)
+				if((ch == ccs) == (p == 1))
+					rgba[i*4+ch] = uint8_t(interpolate(e[0][ch],e[1][ch],wt));
+		}
+	}
+}
+
+void astc_encode_block_4x4(uint8_t *dst, const uint8_t *rgba, BlockQuality q)
+{
+	astc_encode_block(dst,rgba,4,4,q);
+}
+
+void astc_encode_block_6x6(uint8_t *dst, const uint8_t *rgba, BlockQuality q)
+{
+	astc_encode_block(dst,rgba,6,6,q);
+}
+
+void astc_encode_block_8x8(uint8_t *dst, const uint8_t *rgba, BlockQuality q)
+{
+	astc_encode_block(dst,rgba,8,8,q);
+}
+
+void astc_decode_block_4x4(uint8_t *rgba, const uint8_t *src)
+{
+	astc_decode_block(rgba,src,4,4);
+}
+
+void astc_decode_block_6x6(uint8_t *rgba, const uint8_t *src)
+{
+	astc_decode_block(rgba,src,6,6);
+}
+
+void astc_decode_block_8x8(uint8_t *rgba, const uint8_t *src)
+{
+	astc_decode_block(rgba,src,8,8);
+}
+
+}
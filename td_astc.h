@@ -0,0 +1,41 @@
+#pragma once
+#include <cstdint>
+#include "td_block.h"
+namespace td {
+
+/**
+ * @brief astc_encode_block encodes w x h pixels to an ASTC LDR block (16
+ * bytes). The block has a single partition, the endpoints are stored as RGB
+ * or, if any alpha is below 255, RGBA. Blocks with varying alpha may use a
+ * second plane of weights for the alpha, constant blocks are encoded as void
+ * extent blocks. The weight grids and ranges which fit into the block are
+ * searched for the lowest squared error: FAST fits each of them once, NORMAL
+ * and BEST refine the endpoints of the best few or all of them by least
+ * squares.
+ * @param dst - 16 bytes.
+ * @param rgba - h rows of w RGBA pixels.
+ * @param w - 4, 6 or 8.
+ * @param h - 4, 6 or 8.
+ * @param q
+ */
+void astc_encode_block(uint8_t* dst, const uint8_t* rgba, int w, int h, BlockQuality q);
+
+/**
+ * @brief astc_decode_block decodes an ASTC LDR block to w x h RGBA pixels.
+ * Blocks using the features the encoder does not (several partitions, the
+ * HDR and the offset or scaled endpoint modes) are decoded as magenta, the
+ * color of invalid blocks.
+ * @param rgba - h rows of w pixels.
+ * @param src - 16 bytes.
+ * @param w
+ * @param h
+ */
+void astc_decode_block(uint8_t* rgba, const uint8_t* src, int w, int h);
+
+void astc_encode_block_4x4(uint8_t* dst, const uint8_t* rgba, BlockQuality q);
+void astc_encode_block_6x6(uint8_t* dst, const uint8_t* rgba, BlockQuality q);
+void astc_encode_block_8x8(uint8_t* dst, const uint8_t* rgba, BlockQuality q);
+void astc_decode_block_4x4(uint8_t* rgba, const uint8_t* src);
+void astc_decode_block_6x6(uint8_t* rgba, const uint8_t* src);
+void astc_decode_block_8x8(uint8_t* rgba, const uint8_t* src);
+}
@@ -0,0 +1,494 @@
+#include "td_bc.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace td
+{
+
+/*
+ * A BC1 block holds two little endian 565 colors c0 and c1 followed by the 2
+ * bit index of each pixel, that of pixel i = y*4+x at bit 2i of the last 32
+ * bits. If c0 > c1 the indices select c0, c1, (2*c0+c1)/3 and (c0+2*c1)/3,
+ * otherwise c0, c1, (c0+c1)/2 and black, which is transparent for BC1_RGBA.
+ * The colors are expanded to 8 bits by replicating their high bits, the
+ * interpolated ones are rounded down (as by Mesa). BC3 blocks always select
+ * one of four colors.
+ * A BC4 block holds two values a0 and a1 followed by the 3 bit index of each
+ * pixel (48 bits, little endian). If a0 > a1 they select a0, a1 and 6 values
+ * between them, otherwise a0, a1, 4 values between them, 0 and 255.
+ */
+
+static inline int expand5(int c)
+{
+	return c<<3|c>>2;
+}
+
+static inline int expand6(int c)
+{
+	return c<<2|c>>4;
+}
+
+static inline int quantize(float v, int max)
+{
+	return std::min(max,std::max(0,int(v*max/255.0f+0.5f)));
+}
+
+static inline int pack565(const float* rgb)
+{
+	return quantize(rgb[0],31)<<11|quantize(rgb[1],63)<<5|quantize(rgb[2],31);
+}
+
+/**
+ * @brief The Bc1Block struct holds the pixels of a block and how they are
+ * encoded.
+ */
+struct Bc1Block
+{
+	BlockPixels p;
+	// pixels with an alpha below 128 (BC1_RGBA)
+	uint16_t transparent;
+	// the colors always contain four colors (BC3)
+	bool four;
+	// the black of the three color mode is opaque (BC1_RGB)
+	bool black;
+};
+
+/**
+ * @brief The Bc1Fit struct is an encoding of the colors of a block: the
+ * endpoints and whether it uses four colors.
+ */
+struct Bc1Fit
+{
+	uint32_t err;
+	int c0, c1;
+	bool four;
+};
+
+/**
+ * @brief bc1_palette orders the endpoints of f for its mode and returns the
+ * colors the indices can select. The transparent pixels, which take the last
+ * index, are given the first color, so they add no error.
+ */
+static int bc1_palette(Bc1Block& b, Bc1Fit& f, int (*pal)[3])
+{
+	if(f.four ? f.c0 < f.c1 : f.c0 > f.c1)
+		std::swap(f.c0,f.c1);
+	const int e0[3] = {expand5(f.c0>>11),expand6(f.c0>>5&63),expand5(f.c0&31)};
+	const int e1[3] = {expand5(f.c1>>11),expand6(f.c1>>5&63),expand5(f.c1&31)};
+	const bool four = b.four || f.c0 > f.c1;
+	for(int ch = 0 ; ch < 3;ch++)
+	{
+		pal[0][ch] = e0[ch];
+		pal[1][ch] = e1[ch];
+		pal[2][ch] = four ? (2*e0[ch]+e1[ch])/3 : (e0[ch]+e1[ch])/2;
+		pal[3][ch] = four ? (e0[ch]+2*e1[ch])/3 : 0;
+	}
+	for(int i = 0 ; i < 16;i++)
+	{
+		if(b.transparent>>i&1)
+		{
+			b.p.rg[2*i] = int16_t(pal[0][0]);
+			b.p.rg[2*i+1] = int16_t(pal[0][1]);
+			b.p.b[2*i] = int16_t(pal[0][2]);
+		}
+	}
+	return four || b.black ? 4 : 3;
+}
+
+static uint32_t bc1_error(Bc1Block& b, Bc1Fit& f)
+{
+	int pal[4][3];
+	const int n = bc1_palette(b,f,pal);
+	f.err = palette_error(b.p,pal,n);
+	return f.err;
+}
+
+// the endpoints of the principal axis of the opaque pixels
+static void bc1_axis(const Bc1Block& b, float* e0, float* e1)
+{
+	float mean[3] = {0,0,0};
+	int n = 0;
+	for(int i = 0 ; i < 16;i++)
+	{
+		if(b.transparent>>i&1)
+			continue;
+		mean[0] += b.p.rg[2*i];
+		mean[1] += b.p.rg[2*i+1];
+		mean[2] += b.p.b[2*i];
+		n++;
+	}
+	for(int ch = 0 ; ch < 3;ch++)
+		mean[ch] /= float(n);
+
+	float cov[6] = {0,0,0,0,0,0};
+	for(int i = 0 ; i < 16;i++)
+	{
+		if(b.transparent>>i&1)
+			continue;
+		const float d[3] = {b.p.rg[2*i]-mean[0],b.p.rg[2*i+1]-mean[1],b.p.b[2*i]-mean[2]};
+		cov[0] += d[0]*d[0]; cov[1] += d[0]*d[1]; cov[2] += d[0]*d[2];
+		cov[3] += d[1]*d[1]; cov[4] += d[1]*d[2]; cov[5] += d[2]*d[2];
+	}
+	float axis[3] = {1,1,1};
+	for(int it = 0 ; it < 8;it++)
+	{
+		const float v[3] = {cov[0]*axis[0]+cov[1]*axis[1]+cov[2]*axis[2],
+							cov[1]*axis[0]+cov[3]*axis[1]+cov[4]*axis[2],
+							cov[2]*axis[0]+cov[4]*axis[1]+cov[5]*axis[2]};
+		const float len = std::sqrt(v[0]*v[0]+v[1]*v[1]+v[2]*v[2]);
+		if(len < 1e-6f)
+			break;
+		for(int ch = 0 ; ch < 3;ch++)
+			axis[ch] = v[ch]/len;
+	}
+
+	float tmin = 0, tmax = 0;
+	for(int i = 0 ; i < 16;i++)
+	{
+		if(b.transparent>>i&1)
+			continue;
+		const float t = (b.p.rg[2*i]-mean[0])*axis[0]+(b.p.rg[2*i+1]-mean[1])*axis[1]+
+						(b.p.b[2*i]-mean[2])*axis[2];
+		tmin = std::min(tmin,t);
+		tmax = std::max(tmax,t);
+	}
+	for(int ch = 0 ; ch < 3;ch++)
+	{
+		e0[ch] = mean[ch]+tmin*axis[ch];
+		e1[ch] = mean[ch]+tmax*axis[ch];
+	}
+}
+
+/**
+ * @brief bc1_least_squares replaces the endpoints of f by those minimizing the
+ * squared error of the pixels with their current indices.
+ * @return false if the indices do not determine the endpoints.
+ */
+static bool bc1_least_squares(Bc1Block& b, Bc1Fit& f)
+{
+	static const float T[2][4] = {{0,1,0.5f,0},{0,1,1/3.0f,2/3.0f}};
+	int pal[4][3];
+	const int n = bc1_palette(b,f,pal);
+	const bool four = b.four || f.c0 > f.c1;
+	uint8_t idx[16];
+	palette_indices(idx,b.p,pal,n);
+
+	float aa = 0, ab = 0, bb = 0;
+	float xa[3] = {0,0,0}, xb[3] = {0,0,0};
+	for(int i = 0 ; i < 16;i++)
+	{
+		// black of the three color mode is not on the line
+		if(b.transparent>>i&1 || (!four && idx[i] == 3))
+			continue;
+		const float t = T[four][idx[i]];
+		const float x[3] = {float(b.p.rg[2*i]),float(b.p.rg[2*i+1]),float(b.p.b[2*i])};
+		aa += (1-t)*(1-t);
+		ab += (1-t)*t;
+		bb += t*t;
+		for(int ch = 0 ; ch < 3;ch++)
+		{
+			xa[ch] += (1-t)*x[ch];
+			xb[ch] += t*x[ch];
+		}
+	}
+	const float det = aa*bb-ab*ab;
+	if(std::abs(det) < 1e-3f)
+		return false;
+	float e0[3], e1[3];
+	for(int ch = 0 ; ch < 3;ch++)
+	{
+		e0[ch] = (bb*xa[ch]-ab*xb[ch])/det;
+		e1[ch] = (aa*xb[ch]-ab*xa[ch])/det;
+	}
+	f.c0 = pack565(e0);
+	f.c1 = pack565(e1);
+	return true;
+}
+
+// tries each endpoint channel one step up and down while the error decreases
+static void bc1_neighbours(Bc1Block& b, Bc1Fit& f)
+{
+	static const int SHIFT[3] = {11,5,0};
+	static const int MAX[3] = {31,63,31};
+	for(int pass = 0 ; pass < 8;pass++)
+	{
+		bool improved = false;
+		for(int e = 0 ; e < 2;e++)
+		{
+			for(int ch = 0 ; ch < 3;ch++)
+			{
+				for(int d = -1 ; d <= 1;d += 2)
+				{
+					Bc1Fit g = f;
+					int& c = e ? g.c1 : g.c0;
+					const int v = (c>>SHIFT[ch]&MAX[ch])+d;
+					if(v < 0 || v > MAX[ch])
+						continue;
+					c = (c&~(MAX[ch]<<SHIFT[ch]))|v<<SHIFT[ch];
+					if(bc1_error(b,g) < f.err)
+					{
+						f = g;
+						improved = true;
+					}
+				}
+			}
+		}
+		if(!improved)
+			break;
+	}
+}
+
+static Bc1Fit bc1_search(Bc1Block& b, BlockQuality q)
+{
+	float e[2][3];
+	bc1_axis(b,e[0],e[1]);
+	const int iterations = q == BlockQuality::FAST ? 0 : q == BlockQuality::NORMAL ? 2 : 4;
+	Bc1Fit best = {UINT32_MAX,0,0,true};
+	for(int m = 0 ; m < 2;m++)
+	{
+		// blocks with transparent pixels need the three color mode
+		const bool four = m == 0;
+		if(four ? b.transparent != 0 : b.four || (q == BlockQuality::FAST && !b.transparent))
+			continue;
+		Bc1Fit f = {0,pack565(e[0]),pack565(e[1]),four};
+		bc1_error(b,f);
+		for(int it = 0 ; it < iterations && f.err;it++)
+		{
+			Bc1Fit g = f;
+			if(!bc1_least_squares(b,g) || bc1_error(b,g) >= f.err)
+				break;
+			f = g;
+		}
+		if(q == BlockQuality::BEST)
+			bc1_neighbours(b,f);
+		if(f.err < best.err)
+			best = f;
+	}
+	return best;
+}
+
+static void bc1_write(uint8_t* dst, Bc1Block& b, Bc1Fit f)
+{
+	int pal[4][3];
+	const int n = bc1_palette(b,f,pal);
+	uint8_t idx[16];
+	palette_indices(idx,b.p,pal,n);
+	uint32_t bits = 0;
+	for(int i = 0 ; i < 16;i++)
+		bits |= uint32_t(b.transparent>>i&1 ? 3 : idx[i])<<(2*i);
+	dst[0] = uint8_t(f.c0);
+	dst[1] = uint8_t(f.c0>>8);
+	dst[2] = uint8_t(f.c1);
+	dst[3] = uint8_t(f.c1>>8);
+	for(int i = 0 ; i < 4;i++)
+		dst[4+i] = uint8_t(bits>>(8*i));
+}
+
+static void bc1_encode(uint8_t* dst, const uint8_t* rgba, bool alpha, bool four, BlockQuality q)
+{
+	Bc1Block b;
+	b.p.load(rgba);
+	b.transparent = 0;
+	b.four = four;
+	b.black = !alpha;
+	if(alpha)
+		for(int i = 0 ; i < 16;i++)
+			if(rgba[i*4+3] < 128)
+				b.transparent |= uint16_t(1<<i);
+	if(b.transparent == 0xFFFF)
+	{
+		// c0 = c1 selects three colors, all pixels transparent
+		const uint8_t block[8] = {0,0,0,0,0xFF,0xFF,0xFF,0xFF};
+		memcpy(dst,block,8);
+		return;
+	}
+	bc1_write(dst,b,bc1_search(b,q));
+}
+
+static void bc1_decode(uint8_t* rgba, const uint8_t* src, bool alpha, bool four)
+{
+	const int c0 = src[0]|src[1]<<8;
+	const int c1 = src[2]|src[3]<<8;
+	const uint32_t bits = uint32_t(src[4])|uint32_t(src[5])<<8|uint32_t(src[6])<<16|uint32_t(src[7])<<24;
+	Bc1Block b;
+	b.transparent = 0;
+	b.four = four;
+	b.black = !alpha;
+	// keeps the order of the endpoints
+	Bc1Fit f = {0,c0,c1,c0 > c1};
+	int pal[4][3];
+	bc1_palette(b,f,pal);
+	const bool transparent = alpha && !four && c0 <= c1;
+	for(int i = 0 ; i < 16;i++)
+	{
+		const int k = bits>>(2*i)&3;
+		for(int ch = 0 ; ch < 3;ch++)
+			rgba[i*4+ch] = uint8_t(pal[k][ch]);
+		rgba[i*4+3] = transparent && k == 3 ? 0 : 255;
+	}
+}
+
+static void bc4_values(int a0, int a1, int* v)
+{
+	v[0] = a0;
+	v[1] = a1;
+	if(a0 > a1)
+	{
+		for(int i = 1 ; i < 7;i++)
+			v[i+1] = (a0*(7-i)+a1*i)/7;
+	}
+	else
+	{
+		for(int i = 1 ; i < 5;i++)
+			v[i+1] = (a0*(5-i)+a1*i)/5;
+		v[6] = 0;
+		v[7] = 255;
+	}
+}
+
+/**
+ * @brief bc4_encode encodes channel ch of 4x4 RGBA pixels to a BC4 block. Both
+ * modes are tried, with the endpoints around the range of all values (8
+ * values) and of those other than 0 and 255 (6 values).
+ */
+static void bc4_encode(uint8_t* dst, const uint8_t* rgba, int ch, BlockQuality q)
+{
+	const int r = q == BlockQuality::FAST ? 0 : q == BlockQuality::NORMAL ? 1 : 3;
+	alignas(32) int16_t px[16];
+	int lo = 255, hi = 0, lo6 = 255, hi6 = 0;
+	for(int i = 0 ; i < 16;i++)
+	{
+		const int v = rgba[i*4+ch];
+		px[i] = int16_t(v);
+		lo = std::min(lo,v);
+		hi = std::max(hi,v);
+		if(v != 0 && v != 255)
+		{
+			lo6 = std::min(lo6,v);
+			hi6 = std::max(hi6,v);
+		}
+	}
+	if(lo6 > hi6)
+		lo6 = hi6 = 0;
+
+	uint32_t best = UINT32_MAX;
+	int a[2] = {0,0};
+	auto search = [&](int c0, int c1, bool eight)
+	{
+		for(int a0 = std::max(0,c0-r); a0 <= std::min(255,c0+r) && best;a0++)
+		{
+			for(int a1 = std::max(0,c1-r); a1 <= std::min(255,c1+r);a1++)
+			{
+				if((a0 > a1) != eight)
+					continue;
+				int v[8];
+				bc4_values(a0,a1,v);
+				const uint32_t e = value_error(px,v);
+				if(e < best)
+				{
+					best = e;
+					a[0] = a0;
+					a[1] = a1;
+				}
+			}
+		}
+	};
+	search(hi,lo,true);
+	search(lo6,hi6,false);
+
+	int v[8];
+	bc4_values(a[0],a[1],v);
+	uint64_t bits = 0;
+	for(int i = 0 ; i < 16;i++)
+	{
+		// the first closest value, as in value_error
+		int idx = 0;
+		for(int j = 1 ; j < 8;j++)
+			if(std::abs(px[i]-v[j]) < std::abs(px[i]-v[idx]))
+				idx = j;
+		bits |= uint64_t(idx)<<(3*i);
+	}
+	dst[0] = uint8_t(a[0]);
+	dst[1] = uint8_t(a[1]);
+	for(int i = 0 ; i < 6;i++)
+		dst[2+i] = uint8_t(bits>>(8*i));
+}
+
+static void bc4_decode(uint8_t* rgba, int ch, const uint8_t* src)
+{
+	int v[8];
+	bc4_values(src[0],src[1],v);
+	uint64_t bits = 0;
+	for(int i = 0 ; i < 6;i++)
+		bits |= uint64_t(src[2+i])<<(8*i);
+	for(int i = 0 ; i < 16;i++)
+		rgba[i*4+ch] = uint8_t(v[bits>>(3*i)&7]);
+}
+
+// the pixels of the RGTC blocks are (r,g,0,255)
+static void clear_rgba(uint8_t* rgba)
+{
+	for(int i = 0 ; i < 16;i++)
+	{
+		rgba[i*4] = rgba[i*4+1] = rgba[i*4+2] = 0;
+		rgba[i*4+3] = 255;
+	}
+}
+
+void bc1_encode_block(uint8_t *dst, const uint8_t *rgba, BlockQuality q)
+{
+	bc1_encode(dst,rgba,false,false,q);
+}
+
+void bc1_decode_block(uint8_t *rgba, const uint8_t *src)
+{
+	bc1_decode(rgba,src,false,false);
+}
+
+void bc1a_encode_block(uint8_t *dst, const uint8_t *rgba, BlockQuality q)
+{
+	bc1_encode(dst,rgba,true,false,q);
+}
+
+void bc1a_decode_block(uint8_t *rgba, const uint8_t *src)
+{
+	bc1_decode(rgba,src,true,false);
+}
+
+void bc3_encode_block(uint8_t *dst, const uint8_t *rgba, BlockQuality q)
+{
+	bc4_encode(dst,rgba,3,q);
+	bc1_encode(dst+8,rgba,false,true,q);
+}
+
+void bc3_decode_block(uint8_t *rgba, const uint8_t *src)
+{
+	bc1_decode(rgba,src+8,false,true);
+	bc4_decode(rgba,3,src);
+}
+
+void bc4_encode_block(uint8_t *dst, const uint8_t *rgba, BlockQuality q)
+{
+	bc4_encode(dst,rgba,0,q);
+}
+
+void bc4_decode_block(uint8_t *rgba, const uint8_t *src)
+{
+	clear_rgba(rgba);
+	bc4_decode(rgba,0,src);
+}
+
+void bc5_encode_block(uint8_t *dst, const uint8_t *rgba, BlockQuality q)
+{
+	bc4_encode(dst,rgba,0,q);
+	bc4_encode(dst+8,rgba,1,q);
+}
+
+void bc5_decode_block(uint8_t *rgba, const uint8_t *src)
+{
+	clear_rgba(rgba);
+	bc4_decode(rgba,0,src);
+	bc4_decode(rgba,1,src+8);
+}
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <cstdint>
+#include "td_block.h"
+namespace td {
+
+/**
+ * @brief bc1_encode_block encodes 4x4 pixels to a BC1 (DXT1) block: two 565
+ * endpoints and the index of each pixel, which selects one of four colors on
+ * the line between them, or one of three and black. The endpoints are fitted
+ * to the principal axis of the colors, NORMAL and BEST also try three colors
+ * and refine the endpoints by least squares, BEST searches their neighbours.
+ * @param dst - 8 bytes.
+ * @param rgba - 4 rows of 4 RGBA pixels, alpha is ignored.
+ * @param q
+ */
+void bc1_encode_block(uint8_t* dst, const uint8_t* rgba, BlockQuality q);
+
+/**
+ * @brief bc1_decode_block decodes a BC1 block to 4x4 RGBA pixels (alpha is
+ * 255).
+ * @param rgba - 4 rows of 4 pixels.
+ * @param src - 8 bytes.
+ */
+void bc1_decode_block(uint8_t* rgba, const uint8_t* src);
+
+/**
+ * @brief bc1a_encode_block encodes 4x4 pixels to a BC1 block with 1 bit alpha:
+ * pixels with an alpha below 128 take the transparent black of the three
+ * color mode, which is used by all blocks containing any.
+ */
+void bc1a_encode_block(uint8_t* dst, const uint8_t* rgba, BlockQuality q);
+void bc1a_decode_block(uint8_t* rgba, const uint8_t* src);
+
+/**
+ * @brief bc3_encode_block encodes 4x4 pixels to a BC3 (DXT5) block: a BC4
+ * block of the alpha followed by a BC1 block of the colors, which always
+ * selects one of four colors.
+ * @param dst - 16 bytes.
+ */
+void bc3_encode_block(uint8_t* dst, const uint8_t* rgba, BlockQuality q);
+void bc3_decode_block(uint8_t* rgba, const uint8_t* src);
+
+/**
+ * @brief bc4_encode_block encodes the red of 4x4 pixels to a BC4 (RGTC1)
+ * block (8 bytes), decoded to (r,0,0,255): two endpoints and the index of each
+ * pixel, which selects one of 8 values between them, or one of 6 values, 0 and
+ * 255. The endpoints around the range of the values are searched within 0, 1
+ * or 3 for FAST, NORMAL and BEST.
+ */
+void bc4_encode_block(uint8_t* dst, const uint8_t* rgba, BlockQuality q);
+void bc4_decode_block(uint8_t* rgba, const uint8_t* src);
+
+/**
+ * @brief bc5_encode_block encodes the red and green of 4x4 pixels to two BC4
+ * blocks (16 bytes), decoded to (r,g,0,255).
+ */
+void bc5_encode_block(uint8_t* dst, const uint8_t* rgba, BlockQuality q);
+void bc5_decode_block(uint8_t* rgba, const uint8_t* src);
+}
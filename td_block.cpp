@@ -0,0 +1,282 @@
+#include "td_block.h"
+#include "td_astc.h"
+#include "td_bc.h"
+#include "td_etc.h"
+#include "td_cpu.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+#if TD_SSE2
+#include <immintrin.h>
+#endif
+
+namespace td
+{
+
+void BlockPixels::load(const uint8_t *rgba)
+{
+	for(int i = 0 ; i < 16;i++)
+	{
+		rg[2*i] = rgba[i*4];
+		rg[2*i+1] = rgba[i*4+1];
+		b[2*i] = rgba[i*4+2];
+		b[2*i+1] = 0;
+	}
+}
+
+typedef uint32_t (*palette_error_fn)(const BlockPixels& p, const int (*colors)[3], int n);
+
+static uint32_t palette_error_scalar(const BlockPixels& p, const int (*colors)[3], int n)
+{
+	uint32_t e = 0;
+	for(int i = 0 ; i < 16;i++)
+	{
+		uint32_t best = UINT32_MAX;
+		for(int c = 0 ; c < n;c++)
+		{
+			const int dr = p.rg[2*i]-colors[c][0];
+			const int dg = p.rg[2*i+1]-colors[c][1];
+			const int db = p.b[2*i]-colors[c][2];
+			best = std::min(best,uint32_t(dr*dr+dg*dg+db*db));
+		}
+		e += best;
+	}
+	return e;
+}
+
+#if TD_SSE2
+static inline __m128i min_epi32_sse2(__m128i a, __m128i b)
+{
+	const __m128i lt = _mm_cmplt_epi32(a,b);
+	return _mm_or_si128(_mm_and_si128(lt,a),_mm_andnot_si128(lt,b));
+}
+
+// the differences are 16 bit, madd sums up the squares of red and green
+static uint32_t palette_error_sse2(const BlockPixels& p, const int (*colors)[3], int n)
+{
+	__m128i rg[4], b[4], best[4];
+	for(int i = 0 ; i < 4;i++)
+	{
+		rg[i] = _mm_load_si128((const __m128i*)(p.rg+8*i));
+		b[i] = _mm_load_si128((const __m128i*)(p.b+8*i));
+		best[i] = _mm_set1_epi32(INT_MAX);
+	}
+	for(int c = 0 ; c < n;c++)
+	{
+		const __m128i crg = _mm_set1_epi32(colors[c][0]|colors[c][1]<<16);
+		const __m128i cb = _mm_set1_epi32(colors[c][2]);
+		for(int i = 0 ; i < 4;i++)
+		{
+			const __m128i d = _mm_sub_epi16(rg[i],crg);
+			const __m128i e = _mm_sub_epi16(b[i],cb);
+			best[i] = min_epi32_sse2(best[i],_mm_add_epi32(_mm_madd_epi16(d,d),_mm_madd_epi16(e,e)));
+		}
+	}
+	__m128i sum = _mm_add_epi32(_mm_add_epi32(best[0],best[1]),_mm_add_epi32(best[2],best[3]));
+	sum = _mm_add_epi32(sum,_mm_shuffle_epi32(sum,0x4E));
+	sum = _mm_add_epi32(sum,_mm_shuffle_epi32(sum,0xB1));
+	return uint32_t(_mm_cvtsi128_si32(sum));
+}
+
+TD_TARGET("avx2")
+static uint32_t palette_error_avx2(const BlockPixels& p, const int (*colors)[3], int n)
+{
+	const __m256i rg0 = _mm256_load_si256((const __m256i*)p.rg);
+	const __m256i rg1 = _mm256_load_si256((const __m256i*)(p.rg+16));
+	const __m256i b0 = _mm256_load_si256((const __m256i*)p.b);
+	const __m256i b1 = _mm256_load_si256((const __m256i*)(p.b+16));
+	__m256i best0 = _mm256_set1_epi32(INT_MAX);
+	__m256i best1 = best0;
+	for(int c = 0 ; c < n;c++)
+	{
+		const __m256i crg = _mm256_set1_epi32(colors[c][0]|colors[c][1]<<16);
+		const __m256i cb = _mm256_set1_epi32(colors[c][2]);
+		const __m256i d0 = _mm256_sub_epi16(rg0,crg);
+		const __m256i d1 = _mm256_sub_epi16(rg1,crg);
+		const __m256i e0 = _mm256_sub_epi16(b0,cb);
+		const __m256i e1 = _mm256_sub_epi16(b1,cb);
+		best0 = _mm256_min_epi32(best0,_mm256_add_epi32(_mm256_madd_epi16(d0,d0),_mm256_madd_epi16(e0,e0)));
+		best1 = _mm256_min_epi32(best1,_mm256_add_epi32(_mm256_madd_epi16(d1,d1),_mm256_madd_epi16(e1,e1)));
+	}
+	const __m256i s = _mm256_add_epi32(best0,best1);
+	__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(s),_mm256_extracti128_si256(s,1));
+	sum = _mm_add_epi32(sum,_mm_shuffle_epi32(sum,0x4E));
+	sum = _mm_add_epi32(sum,_mm_shuffle_epi32(sum,0xB1));
+	return uint32_t(_mm_cvtsi128_si32(sum));
+}
+#endif
+
+static const KernelTable<palette_error_fn> palette_error_kernels = {{
+	palette_error_scalar,
+#if TD_SSE2
+	palette_error_sse2,nullptr,palette_error_avx2
+#endif
+}};
+
+uint32_t palette_error(const BlockPixels &p, const int (*colors)[3], int n)
+{
+	return palette_error_kernels.select()(p,colors,n);
+}
+
+void palette_indices(uint8_t *idx, const BlockPixels &p, const int (*colors)[3], int n)
+{
+	for(int i = 0 ; i < 16;i++)
+	{
+		uint32_t best = UINT32_MAX;
+		for(int c = 0 ; c < n;c++)
+		{
+			const int dr = p.rg[2*i]-colors[c][0];
+			const int dg = p.rg[2*i+1]-colors[c][1];
+			const int db = p.b[2*i]-colors[c][2];
+			const uint32_t e = uint32_t(dr*dr+dg*dg+db*db);
+			if(e < best)
+			{
+				best = e;
+				idx[i] = uint8_t(c);
+			}
+		}
+	}
+}
+
+// the smallest absolute difference fits into 16 bits
+typedef uint32_t (*value_error_fn)(const int16_t* px, const int* v);
+
+static uint32_t value_error_scalar(const int16_t* px, const int* v)
+{
+	uint32_t e = 0;
+	for(int i = 0 ; i < 16;i++)
+	{
+		int best = INT_MAX;
+		for(int j = 0 ; j < 8;j++)
+			best = std::min(best,std::abs(px[i]-v[j]));
+		e += uint32_t(best*best);
+	}
+	return e;
+}
+
+#if TD_SSE2
+static uint32_t value_error_sse2(const int16_t* px, const int* v)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i p0 = _mm_load_si128((const __m128i*)px);
+	const __m128i p1 = _mm_load_si128((const __m128i*)(px+8));
+	__m128i m0 = _mm_set1_epi16(SHRT_MAX);
+	__m128i m1 = m0;
+	for(int j = 0 ; j < 8;j++)
+	{
+		const __m128i c = _mm_set1_epi16(int16_t(v[j]));
+		const __m128i d0 = _mm_sub_epi16(p0,c);
+		const __m128i d1 = _mm_sub_epi16(p1,c);
+		m0 = _mm_min_epi16(m0,_mm_max_epi16(d0,_mm_sub_epi16(zero,d0)));
+		m1 = _mm_min_epi16(m1,_mm_max_epi16(d1,_mm_sub_epi16(zero,d1)));
+	}
+	__m128i sum = _mm_add_epi32(_mm_madd_epi16(m0,m0),_mm_madd_epi16(m1,m1));
+	sum = _mm_add_epi32(sum,_mm_shuffle_epi32(sum,0x4E));
+	sum = _mm_add_epi32(sum,_mm_shuffle_epi32(sum,0xB1));
+	return uint32_t(_mm_cvtsi128_si32(sum));
+}
+
+TD_TARGET("avx2")
+static uint32_t value_error_avx2(const int16_t* px, const int* v)
+{
+	const __m256i p = _mm256_load_si256((const __m256i*)px);
+	__m256i m = _mm256_set1_epi16(SHRT_MAX);
+	for(int j = 0 ; j < 8;j++)
+		m = _mm256_min_epi16(m,_mm256_abs_epi16(_mm256_sub_epi16(p,_mm256_set1_epi16(int16_t(v[j])))));
+	const __m256i s = _mm256_madd_epi16(m,m);
+	__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(s),_mm256_extracti128_si256(s,1));
+	sum = _mm_add_epi32(sum,_mm_shuffle_epi32(sum,0x4E));
+	sum = _mm_add_epi32(sum,_mm_shuffle_epi32(sum,0xB1));
+	return uint32_t(_mm_cvtsi128_si32(sum));
+}
+#endif
+
+static const KernelTable<value_error_fn> value_error_kernels = {{
+	value_error_scalar,
+#if TD_SSE2
+	value_error_sse2,nullptr,value_error_avx2
+#endif
+}};
+
+uint32_t value_error(const int16_t *px, const int *v)
+{
+	return value_error_kernels.select()(px,v);
+}
+
+typedef void (*encode_block_fn)(uint8_t* dst, const uint8_t* rgba, BlockQuality q);
+typedef void (*decode_block_fn)(uint8_t* rgba, const uint8_t* src);
+
+static encode_block_fn block_encoder(DType t)
+{
+	switch(t)
+	{
+	case DType::ETC1_RGB8: return etc1_encode_block;
+	case DType::ETC2_RGB8: return etc2_encode_block;
+	case DType::ETC2_RGBA8_EAC: return etc2_eac_encode_block;
+	case DType::EAC_R11: return eac_r11_encode_block;
+	case DType::EAC_RG11: return eac_rg11_encode_block;
+	case DType::ASTC_4x4: return astc_encode_block_4x4;
+	case DType::ASTC_6x6: return astc_encode_block_6x6;
+	case DType::ASTC_8x8: return astc_encode_block_8x8;
+	case DType::BC1_RGB: return bc1_encode_block;
+	case DType::BC1_RGBA: return bc1a_encode_block;
+	case DType::BC3_RGBA: return bc3_encode_block;
+	case DType::BC4_R: return bc4_encode_block;
+	case DType::BC5_RG: return bc5_encode_block;
+	default: return nullptr;
+	}
+}
+
+static decode_block_fn block_decoder(DType t)
+{
+	switch(t)
+	{
+	case DType::ETC1_RGB8: return etc1_decode_block;
+	case DType::ETC2_RGB8: return etc2_decode_block;
+	case DType::ETC2_RGBA8_EAC: return etc2_eac_decode_block;
+	case DType::EAC_R11: return eac_r11_decode_block;
+	case DType::EAC_RG11: return eac_rg11_decode_block;
+	case DType::ASTC_4x4: return astc_decode_block_4x4;
+	case DType::ASTC_6x6: return astc_decode_block_6x6;
+	case DType::ASTC_8x8: return astc_decode_block_8x8;
+	case DType::BC1_RGB: return bc1_decode_block;
+	case DType::BC1_RGBA: return bc1a_decode_block;
+	case DType::BC3_RGBA: return bc3_decode_block;
+	case DType::BC4_R: return bc4_decode_block;
+	case DType::BC5_RG: return bc5_decode_block;
+	default: return nullptr;
+	}
+}
+
+void encode_block_row(uint8_t *dst, const uint8_t *rgba, int w, DType t, BlockQuality q)
+{
+	const encode_block_fn encode = block_encoder(t);
+	const int bw = block_width(t);
+	const int bh = block_height(t);
+	std::vector<uint8_t> block(bw*bh*4);
+	for(int x0 = 0 ; x0 < w; x0+=bw, dst+=block_bytes(t))
+	{
+		for(int y = 0 ; y < bh;y++)
+			for(int x = 0 ; x < bw;x++)
+				memcpy(&block[(y*bw+x)*4],rgba+(size_t(y)*w+std::min(x0+x,w-1))*4,4);
+		encode(dst,block.data(),q);
+	}
+}
+
+void decode_block_row(uint8_t *rgba, const uint8_t *src, int w, DType t)
+{
+	const decode_block_fn decode = block_decoder(t);
+	const int bw = block_width(t);
+	const int bh = block_height(t);
+	std::vector<uint8_t> block(bw*bh*4);
+	for(int x0 = 0 ; x0 < w; x0+=bw, src+=block_bytes(t))
+	{
+		decode(block.data(),src);
+		const int n = std::min(bw,w-x0);
+		for(int y = 0 ; y < bh;y++)
+			memcpy(rgba+(size_t(y)*w+x0)*4,&block[y*bw*4],n*4);
+	}
+}
+
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include "td.h"
+namespace td {
+
+/**
+ * @brief The BlockQuality enum selects how thoroughly the encoders of the
+ * block compressed types search for the best encoding of a block.
+ * FAST   - only the candidates derived from the average colors.
+ * NORMAL - also the neighbours of these candidates.
+ * BEST   - a wider neighbourhood, several times slower than NORMAL.
+ */
+enum class BlockQuality
+{
+	FAST,
+	NORMAL,
+	BEST,
+};
+
+/**
+ * @brief The BlockPixels struct holds the RGB of the 16 pixels of a 4x4 block,
+ * laid out for palette_error: red and green of pixel i at rg[2i] and rg[2i+1],
+ * blue at b[2i] (b[2i+1] is 0). Pixel i is at x = i%4, y = i/4.
+ */
+struct BlockPixels
+{
+	alignas(32) int16_t rg[32];
+	alignas(32) int16_t b[32];
+
+	/**
+	 * @brief load reads 4 rows of 4 RGBA pixels, alpha is ignored.
+	 */
+	void load(const uint8_t* rgba);
+};
+
+/**
+ * @brief palette_error returns the squared error of the pixels of p, if each
+ * of them takes the closest of the n colors. It is vectorised for
+ * active_isa(), encoders call it for each candidate palette.
+ * @param p
+ * @param colors - n RGB colors in [0,255].
+ * @param n
+ * @return
+ */
+uint32_t palette_error(const BlockPixels& p, const int (*colors)[3], int n);
+
+/**
+ * @brief palette_indices returns the index of the closest color of each pixel
+ * (the first one on ties, as assumed by palette_error).
+ * @param idx - 16 indices.
+ * @param p
+ * @param colors
+ * @param n
+ */
+void palette_indices(uint8_t* idx, const BlockPixels& p, const int (*colors)[3], int n);
+
+/**
+ * @brief value_error returns the squared error of the 16 values of a single
+ * channel, if each of them takes the closest of the 8 values v. It is
+ * vectorised like palette_error.
+ * @param px - 16 values (up to 11 bits), 32 byte aligned.
+ * @param v - 8 values.
+ * @return
+ */
+uint32_t value_error(const int16_t* px, const int* v);
+
+/**
+ * @brief encode_block_row encodes a row of blocks of the compressed type t.
+ * @param dst - (w+block_width(t)-1)/block_width(t) blocks.
+ * @param rgba - block_height(t) rows of w RGBA pixels using unsigned bytes.
+ * Blocks crossing the right edge are padded by repeating the last column.
+ * @param w
+ * @param t
+ * @param q
+ */
+void encode_block_row(uint8_t* dst, const uint8_t* rgba, int w, DType t, BlockQuality q);
+
+/**
+ * @brief decode_block_row is the inverse of encode_block_row.
+ * @param rgba - block_height(t) rows of w RGBA pixels, the pixels of the
+ * padding are dropped.
+ * @param src
+ * @param w
+ * @param t
+ */
+void decode_block_row(uint8_t* rgba, const uint8_t* src, int w, DType t);
+}
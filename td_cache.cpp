@@ -0,0 +1,347 @@
+#include "td_cache.h"
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#include <io.h>
+#include <process.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+namespace td
+{
+
+static const uint64_t P1 = 11400714785074694791ull;
+static const uint64_t P2 = 14029467366897019727ull;
+static const uint64_t P3 = 1609587929392839161ull;
+static const uint64_t P4 = 9650029242287828579ull;
+static const uint64_t P5 = 2870177450012600261ull;
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+	return x<<r | x>>(64-r);
+}
+
+static inline uint64_t load64(const uint8_t* p)
+{
+	uint64_t v;
+	memcpy(&v,p,8);
+	return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t v)
+{
+	return rotl(acc+v*P2,31)*P1;
+}
+
+static inline uint64_t merge64(uint64_t h, uint64_t v)
+{
+	return (h^round64(0,v))*P1+P4;
+}
+
+uint64_t hash64(const void* data, uint64_t n, uint64_t seed)
+{
+	const uint8_t* p = static_cast<const uint8_t*>(data);
+	const uint8_t* end = p+n;
+	uint64_t h;
+	if(n >= 32)
+	{
+		uint64_t v[4] = {seed+P1+P2,seed+P2,seed,seed-P1};
+		for(; end-p >= 32; p += 32)
+			for(int i = 0 ; i < 4;i++)
+				v[i] = round64(v[i],load64(p+8*i));
+		h = rotl(v[0],1)+rotl(v[1],7)+rotl(v[2],12)+rotl(v[3],18);
+		for(int i = 0 ; i < 4;i++)
+			h = merge64(h,v[i]);
+	}
+	else
+		h = seed+P5;
+	h += n;
+
+	for(; end-p >= 8; p += 8)
+		h = rotl(h^round64(0,load64(p)),27)*P1+P4;
+	if(end-p >= 4)
+	{
+		uint32_t v;
+		memcpy(&v,p,4);
+		h = rotl(h^(v*P1),23)*P2+P3;
+		p += 4;
+	}
+	for(; p < end; p++)
+		h = rotl(h^(*p*P5),11)*P1;
+
+	h ^= h>>33;
+	h *= P2;
+	h ^= h>>29;
+	h *= P3;
+	return h^(h>>32);
+}
+
+bool hash_file(const std::string& path, uint64_t seed, uint64_t& h)
+{
+	std::ifstream f(path,std::ios::binary);
+	if(!f.is_open())
+		return false;
+	std::vector<char> buf(1<<20);
+	h = seed;
+	do
+	{
+		f.read(buf.data(),buf.size());
+		h = hash64(buf.data(),f.gcount(),h);
+	}
+	while(f);
+	return f.eof();
+}
+
+std::string temp_name(const std::string& path)
+{
+#ifdef _WIN32
+	const int pid = _getpid();
+#else
+	const int pid = getpid();
+#endif
+	const std::string tag = ".tmp"+std::to_string(pid)+"_"+
+			std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+	const auto dot = path.find_last_of('.');
+	const auto slash = path.find_last_of("/\\");
+	if(dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return path+tag;
+	return path.substr(0,dot)+tag+path.substr(dot);
+}
+
+bool replace_file(const std::string& src, const std::string& dst)
+{
+#ifdef _WIN32
+	return MoveFileExA(src.c_str(),dst.c_str(),MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(src.c_str(),dst.c_str()) == 0;
+#endif
+}
+
+std::vector<std::string> list_directory(const std::string& path)
+{
+	std::vector<std::string> names;
+#ifdef _WIN32
+	_finddata_t e;
+	const intptr_t h = _findfirst((path+"/*").c_str(),&e);
+	if(h == -1)
+		return names;
+	do
+		names.push_back(e.name);
+	while(_findnext(h,&e) == 0);
+	_findclose(h);
+#else
+	DIR* d = opendir(path.c_str());
+	if(!d)
+		return names;
+	while(dirent* e = readdir(d))
+		names.push_back(e->d_name);
+	closedir(d);
+#endif
+	names.erase(std::remove_if(names.begin(),names.end(),[](const std::string& n)
+	{
+		return n == "." || n == "..";
+	}),names.end());
+	std::sort(names.begin(),names.end());
+	return names;
+}
+
+static void make_dir(const std::string& path)
+{
+#ifdef _WIN32
+	_mkdir(path.c_str());
+#else
+	mkdir(path.c_str(),0755);
+#endif
+}
+
+static bool hard_link(const std::string& existing, const std::string& path)
+{
+#ifdef _WIN32
+	return CreateHardLinkA(path.c_str(),existing.c_str(),nullptr) != 0;
+#else
+	return link(existing.c_str(),path.c_str()) == 0;
+#endif
+}
+
+/**
+ * @brief copy_file copies src to dst through a temporary file, which
+ * replaces dst, so dst never exists partially.
+ */
+static bool copy_file(const std::string& src, const std::string& dst)
+{
+	const std::string t = temp_name(dst);
+	{
+		std::ifstream in(src,std::ios::binary);
+		std::ofstream out(t,std::ios::binary);
+		if(!in.is_open() || !out.is_open() || !(out << in.rdbuf()))
+		{
+			out.close();
+			remove(t.c_str());
+			return false;
+		}
+	}
+	if(!replace_file(t,dst))
+	{
+		remove(t.c_str());
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief The Sum struct is stored next to each entry (as <entry>.sum), so
+ * fetch can detect entries which were modified or truncated.
+ */
+struct Sum
+{
+	uint64_t size;
+	uint64_t hash;
+};
+
+ConversionCache::ConversionCache(const std::string &dir, uint64_t max_bytes, int64_t max_age)
+	:dir(dir),max_bytes(max_bytes),max_age(max_age),
+	  hits_(0),misses_(0),evicted_(0),bytes_(0),entries_(0)
+{
+	make_dir(dir);
+}
+
+std::string ConversionCache::entry(uint64_t key) const
+{
+	char name[24];
+	snprintf(name,sizeof(name),"%02x/%016" PRIx64,unsigned(key>>56),key);
+	return dir+"/"+name;
+}
+
+bool ConversionCache::fetch(uint64_t key, const std::string &path)
+{
+	const std::string e = entry(key);
+	struct stat st;
+	Sum sum;
+	uint64_t h;
+	std::ifstream f(e+".sum",std::ios::binary);
+	if(!f.read(reinterpret_cast<char*>(&sum),sizeof(sum)) || stat(e.c_str(),&st) != 0 ||
+	   uint64_t(st.st_size) != sum.size || !hash_file(e,0,h) || h != sum.hash)
+	{
+		// a damaged entry is replaced by store
+		misses_++;
+		return false;
+	}
+
+	// path is replaced, it is left alone if that fails. If path already is a
+	// link to the entry, rename does nothing and leaves t.
+	const std::string t = temp_name(path);
+	const bool linked = hard_link(e,t) && replace_file(t,path);
+	remove(t.c_str());
+	if(!linked && !copy_file(e,path))
+	{
+		misses_++;
+		return false;
+	}
+	// the access time tracks the last use for evict, the modification time of
+	// the entry (and the outputs linked to it) is kept
+#ifdef _WIN32
+	_utimbuf times = {time(nullptr),st.st_mtime};
+	_utime(e.c_str(),&times);
+#else
+	utimbuf times = {time(nullptr),st.st_mtime};
+	utime(e.c_str(),&times);
+#endif
+	hits_++;
+	return true;
+}
+
+bool ConversionCache::store(uint64_t key, const std::string &path)
+{
+	const std::string e = entry(key);
+	make_dir(e.substr(0,e.find_last_of('/')));
+	// the entry is a copy, linking it would share it with path and any tool
+	// modifying path
+	Sum sum;
+	struct stat st;
+	if(!copy_file(path,e) || stat(e.c_str(),&st) != 0 || !hash_file(e,0,sum.hash))
+		return false;
+	sum.size = uint64_t(st.st_size);
+	const std::string t = temp_name(e+".sum");
+	{
+		std::ofstream out(t,std::ios::binary);
+		if(!out.write(reinterpret_cast<const char*>(&sum),sizeof(sum)))
+		{
+			out.close();
+			remove(t.c_str());
+			return false;
+		}
+	}
+	if(!replace_file(t,e+".sum"))
+	{
+		remove(t.c_str());
+		return false;
+	}
+	return true;
+}
+
+void ConversionCache::evict()
+{
+	struct Entry
+	{
+		std::string path;
+		uint64_t size;
+		time_t used;
+	};
+	std::vector<Entry> all;
+	for(const auto& s : list_directory(dir))
+	{
+		if(s.size() != 2)
+			continue;
+		const std::string sub = dir+"/"+s;
+		for(const auto& n : list_directory(sub))
+		{
+			struct stat st;
+			const std::string p = sub+"/"+n;
+			if(n.size() == 16 && stat(p.c_str(),&st) == 0 && (st.st_mode&S_IFMT) == S_IFREG)
+				all.push_back({p,uint64_t(st.st_size),st.st_atime});
+		}
+	}
+
+	std::sort(all.begin(),all.end(),[](const Entry& a, const Entry& b)
+	{
+		return a.used > b.used;
+	});
+	const time_t now = time(nullptr);
+	bytes_ = entries_ = 0;
+	// the most recently used entries are kept, all older than the first one
+	// exceeding max_bytes are evicted
+	bool full = false;
+	for(const Entry& e : all)
+	{
+		full = full || (max_bytes && bytes_+e.size > max_bytes);
+		if(full || (max_age && now-e.used > max_age))
+		{
+			if(remove(e.path.c_str()) == 0)
+			{
+				remove((e.path+".sum").c_str());
+				evicted_++;
+				continue;
+			}
+		}
+		bytes_ += e.size;
+		entries_++;
+	}
+}
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+namespace td {
+
+/**
+ * @brief hash64 computes the 64 bit xxHash (XXH64) of n bytes, which
+ * processes 32 bytes per step.
+ * @param data
+ * @param n
+ * @param seed
+ * @return
+ */
+uint64_t hash64(const void* data, uint64_t n, uint64_t seed = 0);
+
+/**
+ * @brief hash_file hashes the bytes of the file at path in chunks of 1 MiB,
+ * each chunk is hashed with the hash of the previous ones as seed.
+ * @param path
+ * @param seed - e.g. the hash of the options the file is converted with.
+ * @param h - the result.
+ * @return false if the file could not be read.
+ */
+bool hash_file(const std::string& path, uint64_t seed, uint64_t& h);
+
+/**
+ * @brief temp_name returns a name for a temporary file next to path with the
+ * same ending, unique per process and thread.
+ */
+std::string temp_name(const std::string& path);
+
+/**
+ * @brief replace_file renames src to dst, replacing dst if it exists.
+ * @return false if src could not be renamed.
+ */
+bool replace_file(const std::string& src, const std::string& dst);
+
+/**
+ * @brief list_directory returns the sorted names of the entries of the
+ * directory path, without "." and "..".
+ */
+std::vector<std::string> list_directory(const std::string& path);
+
+/**
+ * @brief The ConversionCache class is a directory of converted files, each
+ * named after the hash of everything its conversion depends on (the input,
+ * the options and the tool version), so a conversion which was run before is
+ * replaced by fetching its result. The entries are stored in 256
+ * subdirectories as <dir>/<first 2 hex digits>/<16 hex digits>, next to
+ * the size and hash of their contents (<entry>.sum). Entries are copies of
+ * the outputs they were stored from, fetched entries are hard linked to the
+ * output where possible (copied otherwise), so td replaces outputs instead of
+ * modifying them. Entries which were modified anyway are detected by fetch.
+ * Several processes can share a cache, entries are created atomically.
+ */
+class ConversionCache
+{
+	std::string dir;
+	uint64_t max_bytes;
+	int64_t max_age;
+
+	std::atomic<uint64_t> hits_, misses_, evicted_;
+	uint64_t bytes_, entries_;
+
+	std::string entry(uint64_t key) const;
+
+public:
+
+	/**
+	 * @param dir - the directory, it is created if needed.
+	 * @param max_bytes - the size evict reduces the cache to (0 for no
+	 * limit).
+	 * @param max_age - entries not used for this many seconds are evicted (0
+	 * for no limit).
+	 */
+	ConversionCache(const std::string& dir, uint64_t max_bytes = 0, int64_t max_age = 0);
+
+	/**
+	 * @brief fetch links or copies the entry key to path (replacing it
+	 * atomically) and marks it as used (by its access time). Counts a hit or
+	 * a miss.
+	 * @return false if there is no such entry or its contents do not match
+	 * its hash, path is unchanged then.
+	 */
+	bool fetch(uint64_t key, const std::string& path);
+
+	/**
+	 * @brief store adds a copy of the file at path as entry key, replacing
+	 * an existing one.
+	 * @return false if it could not be added.
+	 */
+	bool store(uint64_t key, const std::string& path);
+
+	/**
+	 * @brief evict removes the entries not used for max_age and then the
+	 * least recently used ones until the cache holds at most max_bytes. It also
+	 * counts the remaining entries and their bytes.
+	 */
+	void evict();
+
+	uint64_t hits() const {return hits_;}
+	uint64_t misses() const {return misses_;}
+	uint64_t evicted() const {return evicted_;}
+	// as of the last evict
+	uint64_t bytes() const {return bytes_;}
+	uint64_t entries() const {return entries_;}
+};
+}
@@ -0,0 +1,338 @@
+#include "td_codec.h"
+#include "td_thread.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace td
+{
+
+/*
+ * The LZ4 block format: a block is a sequence of
+ *   token | [literal length bytes] | literals | offset | [match length bytes]
+ * The high nibble of the token is the number of literals, the low nibble the
+ * match length - 4. A nibble of 15 is continued by bytes which are added
+ * until one is not 255. The offset is a 16 bit little endian distance back
+ * into the output. The last sequence only has literals, the last match starts
+ * at least 12 bytes before the end and ends at least 5 before it.
+ */
+static const int MIN_MATCH = 4;
+static const size_t LAST_LITERALS = 5;
+static const size_t MF_LIMIT = 12;
+static const size_t MAX_OFFSET = 65535;
+static const int HASH_BITS = 14;
+
+static inline uint32_t load32(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v,p,sizeof(v));
+	return v;
+}
+
+static inline uint64_t load64(const uint8_t* p)
+{
+	uint64_t v;
+	memcpy(&v,p,sizeof(v));
+	return v;
+}
+
+// hashes 5 bytes, which finds less of the short matches that hardly pay off
+static inline uint32_t hash5(const uint8_t* p)
+{
+	return uint32_t(((load64(p)<<24)*889523592379ull)>>(64-HASH_BITS));
+}
+
+static inline unsigned trailing_zeros(uint64_t v)
+{
+#if defined(_MSC_VER)
+	unsigned long i;
+	_BitScanForward64(&i,v);
+	return i;
+#else
+	return __builtin_ctzll(v);
+#endif
+}
+
+// number of equal bytes at a and b, reading up to end (a < b)
+static inline size_t match_length(const uint8_t* a, const uint8_t* b, const uint8_t* end)
+{
+	const uint8_t* start = b;
+	while(b+8 <= end)
+	{
+		const uint64_t d = load64(a)^load64(b);
+		if(d)
+			return b-start+trailing_zeros(d)/8;
+		a+=8;
+		b+=8;
+	}
+	while(b < end && *a == *b)
+	{
+		a++;
+		b++;
+	}
+	return b-start;
+}
+
+static inline uint8_t* write_length(uint8_t* op, size_t l)
+{
+	for(; l >= 255; l-=255)
+		*op++ = 255;
+	*op++ = uint8_t(l);
+	return op;
+}
+
+static inline uint8_t* write_literals(uint8_t* op, const uint8_t* src, size_t n)
+{
+	uint8_t* token = op++;
+	*token = uint8_t(std::min<size_t>(n,15)<<4);
+	if(n >= 15)
+		op = write_length(op,n-15);
+	if(n)
+		memcpy(op,src,n);
+	return op+n;
+}
+
+size_t lz_bound(size_t n)
+{
+	return n+n/255+16;
+}
+
+size_t lz_compress(void *dst, const void *src, size_t n)
+{
+	const uint8_t* const base = static_cast<const uint8_t*>(src);
+	const uint8_t* const end = base+n;
+	const uint8_t* anchor = base;
+	uint8_t* op = static_cast<uint8_t*>(dst);
+
+	if(n > MF_LIMIT)
+	{
+		const uint8_t* const mf_limit = end-MF_LIMIT;
+		const uint8_t* const match_limit = end-LAST_LITERALS;
+		std::vector<uint32_t> table(1u<<HASH_BITS,0);
+		const uint8_t* ip = base+1;
+		while(ip < mf_limit)
+		{
+			const uint32_t seq = load32(ip);
+			uint32_t& slot = table[hash5(ip)];
+			const uint8_t* m = base+slot;
+			slot = uint32_t(ip-base);
+			if(size_t(ip-m) > MAX_OFFSET || load32(m) != seq)
+			{
+				// skip faster through data which does not compress
+				ip += 1+((ip-anchor)>>6);
+				continue;
+			}
+			while(ip > anchor && m > base && ip[-1] == m[-1])
+			{
+				ip--;
+				m--;
+			}
+			const size_t ml = MIN_MATCH+match_length(m+MIN_MATCH,ip+MIN_MATCH,match_limit);
+
+			uint8_t* token = op;
+			op = write_literals(op,anchor,ip-anchor);
+			const size_t off = ip-m;
+			*op++ = uint8_t(off);
+			*op++ = uint8_t(off>>8);
+			*token |= uint8_t(std::min<size_t>(ml-MIN_MATCH,15));
+			if(ml-MIN_MATCH >= 15)
+				op = write_length(op,ml-MIN_MATCH-15);
+
+			ip += ml;
+			anchor = ip;
+			if(ip < mf_limit)
+				table[hash5(ip-2)] = uint32_t(ip-2-base);
+		}
+	}
+	op = write_literals(op,anchor,end-anchor);
+	return op-static_cast<uint8_t*>(dst);
+}
+
+bool lz_decompress(void *dst, size_t n, const void *src, size_t size)
+{
+	const uint8_t* ip = static_cast<const uint8_t*>(src);
+	const uint8_t* const iend = ip+size;
+	uint8_t* const base = static_cast<uint8_t*>(dst);
+	uint8_t* op = base;
+	uint8_t* const oend = base+n;
+
+	auto read_length = [&](size_t& l)
+	{
+		uint8_t b;
+		do
+		{
+			if(ip >= iend)
+				return false;
+			b = *ip++;
+			l += b;
+		}while(b == 255);
+		return true;
+	};
+
+	while(ip < iend)
+	{
+		const uint8_t token = *ip++;
+		size_t lit = token>>4;
+		if(lit < 15 && size_t(iend-ip) >= 18 && size_t(oend-op) >= 32)
+		{
+			// short literals far from the ends are copied with a fixed size
+			memcpy(op,ip,16);
+		}
+		else
+		{
+			if(lit == 15 && !read_length(lit))
+				return false;
+			if(lit > size_t(iend-ip) || lit > size_t(oend-op))
+				return false;
+			if(size_t(iend-ip) >= lit+16 && size_t(oend-op) >= lit+16)
+			{
+				// may copy up to 15 bytes too many, which are overwritten later
+				for(size_t i = 0 ; i < lit; i+=16)
+					memcpy(op+i,ip+i,16);
+			}
+			else if(lit)
+				memcpy(op,ip,lit);
+			if(ip+lit == iend)
+			{
+				op += lit;
+				break;
+			}
+			if(size_t(iend-ip)-lit < 2)
+				return false;
+		}
+		ip += lit;
+		op += lit;
+
+		const size_t off = ip[0]|(size_t(ip[1])<<8);
+		ip += 2;
+		size_t ml = token&15;
+		const uint8_t* m = op-off;
+		if(ml < 15 && off >= 8 && off <= size_t(op-base) && size_t(oend-op) >= 18)
+		{
+			// as well as short matches
+			memcpy(op,m,8);
+			memcpy(op+8,m+8,8);
+			memcpy(op+16,m+16,2);
+			op += ml+MIN_MATCH;
+			continue;
+		}
+
+		if(ml == 15 && !read_length(ml))
+			return false;
+		ml += MIN_MATCH;
+		if(off == 0 || off > size_t(op-base) || ml > size_t(oend-op))
+			return false;
+
+		uint8_t* const mend = op+ml;
+		if(ml <= 32 && size_t(oend-mend) >= 8)
+		{
+			if(off < 8)
+			{
+				// repeat the pattern up to a distance of at least 8
+				for(int i = 0 ; i < 8;i++)
+					op[i] = m[i];
+				op += 8;
+				m = op-off*((8+off-1)/off);
+			}
+			// may copy up to 7 bytes too many
+			for(; op < mend; op+=8, m+=8)
+				memcpy(op,m,8);
+			op = mend;
+		}
+		else
+		{
+			// the match repeats the pattern between m and op, which doubles
+			// with every copy
+			while(op < mend)
+			{
+				const size_t k = std::min<size_t>(op-m,mend-op);
+				memcpy(op,m,k);
+				op += k;
+			}
+		}
+	}
+	return op == oend;
+}
+
+void compress_chunks(const void *src, uint64_t n, uint32_t chunk_size,
+					 std::vector<uint32_t> &sizes, std::vector<uint8_t> &data)
+{
+	const uint8_t* s = static_cast<const uint8_t*>(src);
+	const int count = int(chunk_count(n,chunk_size));
+	std::vector<std::vector<uint8_t>> chunks(count);
+	parallel_for(0,count,[&](int i)
+	{
+		const uint64_t begin = uint64_t(i)*chunk_size;
+		const size_t len = size_t(std::min<uint64_t>(chunk_size,n-begin));
+		std::vector<uint8_t>& c = chunks[i];
+		c.resize(lz_bound(len));
+		const size_t cl = lz_compress(c.data(),s+begin,len);
+		if(cl < len)
+			c.resize(cl);
+		else
+			c.assign(s+begin,s+begin+len);
+	});
+	for(const auto& c : chunks)
+	{
+		sizes.push_back(uint32_t(c.size()));
+		data.insert(data.end(),c.begin(),c.end());
+	}
+}
+
+bool compress_payload(std::vector<uint8_t> &payload, const void *src, uint64_t n,
+					  uint32_t chunk_size)
+{
+	std::vector<uint32_t> sizes;
+	payload.clear();
+	compress_chunks(src,n,chunk_size,sizes,payload);
+	const size_t pos = payload.size();
+	payload.resize(pos+sizes.size()*sizeof(uint32_t));
+	if(!sizes.empty())
+		memcpy(payload.data()+pos,sizes.data(),sizes.size()*sizeof(uint32_t));
+	return payload.size() < n;
+}
+
+bool decompress_payload(void *dst, uint64_t n, const void *payload, uint64_t size,
+						uint32_t chunk_size)
+{
+	if(chunk_size == 0)
+		return false;
+	const uint8_t* p = static_cast<const uint8_t*>(payload);
+	const uint64_t count = chunk_count(n,chunk_size);
+	if(count > size/sizeof(uint32_t) || count > uint64_t(INT32_MAX))
+		return false;
+
+	// the offsets of the chunks, from the table at the end
+	const uint8_t* table = p+size-count*sizeof(uint32_t);
+	std::vector<uint64_t> offsets(count+1);
+	offsets[0] = 0;
+	for(uint64_t i = 0 ; i < count;i++)
+	{
+		uint32_t s;
+		memcpy(&s,table+i*sizeof(s),sizeof(s));
+		offsets[i+1] = offsets[i]+s;
+	}
+	if(offsets[count] != size-count*sizeof(uint32_t))
+		return false;
+
+	uint8_t* d = static_cast<uint8_t*>(dst);
+	std::atomic<bool> ok(true);
+	parallel_for(0,int(count),[&](int i)
+	{
+		const uint64_t begin = uint64_t(i)*chunk_size;
+		const size_t len = size_t(std::min<uint64_t>(chunk_size,n-begin));
+		const size_t stored = size_t(offsets[i+1]-offsets[i]);
+		// chunks which did not get smaller are stored raw
+		if(stored == len)
+			memcpy(d+begin,p+offsets[i],len);
+		else if(stored > len || !lz_decompress(d+begin,len,p+offsets[i],stored))
+			ok = false;
+	});
+	return ok.load();
+}
+
+}
@@ -0,0 +1,106 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+namespace td {
+
+/**
+ * @brief The Codec enum lists the ways a layer payload can be stored in a .td
+ * file.
+ * NONE       - the raw pixels.
+ * LZ         - chunks compressed independently with the LZ4 block format
+ *              (see compress_payload).
+ * PREDICTIVE - chunks of rows, the bit fields of the pixels are predicted
+ *              from their neighbours and the residuals are rANS coded (see
+ *              compress_fields). Best suited for the 16 bit types.
+ */
+enum class Codec : uint32_t
+{
+	NONE = 0,
+	LZ = 1,
+	PREDICTIVE = 2,
+};
+
+/**
+ * @brief TD_CHUNK_SIZE is the default number of raw bytes per chunk. Chunks
+ * are compressed and decompressed in parallel.
+ */
+static const uint32_t TD_CHUNK_SIZE = 1u<<18;
+
+/**
+ * @brief lz_bound returns the maximum size of n bytes compressed by
+ * lz_compress.
+ */
+size_t lz_bound(size_t n);
+
+/**
+ * @brief lz_compress compresses n bytes of src to an LZ4 block (greedy
+ * matching of at least 4 bytes within 64 KiB).
+ * @param dst - at least lz_bound(n) bytes.
+ * @param src
+ * @param n
+ * @return the number of bytes written to dst.
+ */
+size_t lz_compress(void* dst, const void* src, size_t n);
+
+/**
+ * @brief lz_decompress decompresses the LZ4 block src of size bytes, which has
+ * to expand to exactly n bytes. Corrupted input is detected, it never reads or
+ * writes out of bounds.
+ * @param dst - n bytes.
+ * @param n
+ * @param src
+ * @param size
+ * @return false if src is no valid block of n bytes.
+ */
+bool lz_decompress(void* dst, size_t n, const void* src, size_t size);
+
+/**
+ * @brief chunk_count returns the number of chunks n bytes are split into.
+ */
+inline uint64_t chunk_count(uint64_t n, uint32_t chunk_size)
+{
+	return (n+chunk_size-1)/chunk_size;
+}
+
+/**
+ * @brief compress_chunks compresses the n bytes of src in chunks of chunk_size
+ * bytes (the last one may be shorter) in parallel, appending the results to
+ * data and their sizes to sizes. Chunks which do not get smaller are stored
+ * as they are.
+ * @param src
+ * @param n
+ * @param chunk_size
+ * @param sizes
+ * @param data
+ */
+void compress_chunks(const void* src, uint64_t n, uint32_t chunk_size,
+					 std::vector<uint32_t>& sizes, std::vector<uint8_t>& data);
+
+/**
+ * @brief compress_payload compresses n bytes to an LZ payload, which are the
+ * chunks followed by a table of their 32 bit sizes. The table is at the end, so
+ * a payload can be written while the chunks are compressed.
+ * @param payload - the result.
+ * @param src
+ * @param n
+ * @param chunk_size
+ * @return false if the payload is not smaller than n, the data should be
+ * stored raw then.
+ */
+bool compress_payload(std::vector<uint8_t>& payload, const void* src, uint64_t n,
+					  uint32_t chunk_size = TD_CHUNK_SIZE);
+
+/**
+ * @brief decompress_payload is the inverse of compress_payload, the chunks are
+ * decompressed in parallel.
+ * @param dst - n bytes.
+ * @param n
+ * @param payload
+ * @param size - of the payload.
+ * @param chunk_size
+ * @return false if the payload is corrupted.
+ */
+bool decompress_payload(void* dst, uint64_t n, const void* payload, uint64_t size,
+						uint32_t chunk_size);
+}
@@ -0,0 +1,499 @@
+#include "td_color.h"
+#include "td_cpu.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if TD_SSE2
+#include <immintrin.h>
+#endif
+
+namespace td
+{
+
+static float ref_to_linear(float v, Transfer t)
+{
+	if(t == Transfer::GAMMA_22)
+		return powf(v,2.2f);
+	if(t == Transfer::SRGB)
+		return v <= 0.04045f ? v/12.92f : powf((v+0.055f)/1.055f,2.4f);
+	return v;
+}
+
+static float ref_from_linear(float v, Transfer t)
+{
+	if(t == Transfer::GAMMA_22)
+		return powf(v,1.0f/2.2f);
+	if(t == Transfer::SRGB)
+		return v <= 0.0031308f ? v*12.92f : 1.055f*powf(v,1.0f/2.4f)-0.055f;
+	return v;
+}
+
+static inline uint32_t float_bits(float f)
+{
+	uint32_t u;
+	memcpy(&u,&f,sizeof(u));
+	return u;
+}
+
+static inline float bits_float(uint32_t u)
+{
+	float f;
+	memcpy(&f,&u,sizeof(f));
+	return f;
+}
+
+/**
+ * The decode table samples [0,1] uniformly, as the slope of the decoding
+ * curves is bounded. The encoding curves are very steep close to 0, so the
+ * encode table is indexed by the exponent and the upper 7 mantissa bits of
+ * the value, covering [2^-32,1] with a constant relative step size.
+ */
+static const int LUT_SIZE = 4096;
+static const uint32_t ENC_BASE = (127-32)<<23;
+
+struct color_tables
+{
+	float dec[LUT_SIZE+1];
+	float enc[LUT_SIZE+1];
+	float dec8[256];
+
+	color_tables(Transfer t)
+	{
+		for(int i = 0 ; i <= LUT_SIZE;i++)
+		{
+			dec[i] = ref_to_linear((float)i/LUT_SIZE,t);
+			enc[i] = ref_from_linear(bits_float(ENC_BASE+(i<<16)),t);
+		}
+		for(int i = 0 ; i < 256;i++)
+			dec8[i] = ref_to_linear(i*(1.0f/255.0f),t);
+	}
+
+	float to_linear(float v) const
+	{
+		v = std::min(std::max(v,0.0f),1.0f)*LUT_SIZE;
+		const int i = std::min((int)v,LUT_SIZE-1);
+		const float f = v-i;
+		return dec[i]+f*(dec[i+1]-dec[i]);
+	}
+
+	float from_linear(float v) const
+	{
+		if(!(v > bits_float(ENC_BASE)))
+			return 0.0f;
+		if(v >= 1.0f)
+			return enc[LUT_SIZE];
+		const uint32_t b = float_bits(v)-ENC_BASE;
+		const uint32_t i = b>>16;
+		const float f = (b&0xFFFF)*(1.0f/65536.0f);
+		return enc[i]+f*(enc[i+1]-enc[i]);
+	}
+};
+
+static const color_tables& tables(Transfer t)
+{
+	static const color_tables gamma_22(Transfer::GAMMA_22);
+	static const color_tables srgb(Transfer::SRGB);
+	static const color_tables linear(Transfer::LINEAR);
+	if(t == Transfer::GAMMA_22)
+		return gamma_22;
+	if(t == Transfer::SRGB)
+		return srgb;
+	return linear;
+}
+
+const float* decode_table_8(Transfer t)
+{
+	return tables(t).dec8;
+}
+
+uint8_t encode_8(float v, Transfer t)
+{
+	return (uint8_t)(tables(t).from_linear(v)*255.0f+0.5f);
+}
+
+static void build_linear8(Linear8& l, Transfer t)
+{
+	l.thr[0] = 0;
+	for(int k = 0 ; k < 256;k++)
+	{
+		l.dec[k] = (uint32_t)(ref_to_linear(k/255.0f,t)*LINEAR8_ONE+0.5f);
+		if(k > 0)
+			l.thr[k] = (uint32_t)ceil(ref_to_linear((k-0.5f)/255.0f,t)*LINEAR8_ONE);
+	}
+	int k = 0;
+	for(uint32_t i = 0 ; i < 65536;i++)
+	{
+		while(k < 255 && (i<<8) >= l.thr[k+1])
+			k++;
+		l.enc[i] = (uint8_t)k;
+	}
+}
+
+const Linear8& linear8_table(Transfer t)
+{
+	struct table
+	{
+		Linear8 l;
+		table(Transfer t) {build_linear8(l,t);}
+	};
+	if(t == Transfer::GAMMA_22)
+	{
+		static const table gamma_22(Transfer::GAMMA_22);
+		return gamma_22.l;
+	}
+	if(t == Transfer::SRGB)
+	{
+		static const table srgb(Transfer::SRGB);
+		return srgb.l;
+	}
+	static const table linear(Transfer::LINEAR);
+	return linear.l;
+}
+
+template<bool TO_LINEAR>
+static void convert_lut(float* data, size_t n, Transfer t)
+{
+	const color_tables& tbl = tables(t);
+	for(size_t p = 0 ; p < n;p++,data+=4)
+		for(int c = 0 ; c < 3;c++)
+			data[c] = TO_LINEAR ? tbl.to_linear(data[c]) : tbl.from_linear(data[c]);
+}
+
+/*
+ * The vectorised kernels below evaluate the same approximation with the same
+ * operations, so they produce the same results on every instruction set.
+ */
+
+#if TD_SSE2
+
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask,a),_mm_andnot_ps(mask,b));
+}
+
+/**
+ * @brief log2_ps approximates log2(x) for x > 0 using
+ * log2(m) = 2/ln(2)*atanh((m-1)/(m+1)) with m in [sqrt(1/2),sqrt(2)).
+ */
+static inline __m128 log2_ps(__m128 x)
+{
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128i bits = _mm_castps_si128(x);
+	const __m128i e = _mm_sub_epi32(_mm_srli_epi32(bits,23),_mm_set1_epi32(127));
+	__m128 m = _mm_castsi128_ps(_mm_or_si128(
+								   _mm_and_si128(bits,_mm_set1_epi32(0x007FFFFF)),
+								   _mm_set1_epi32(0x3F800000)));
+	const __m128 big = _mm_cmpgt_ps(m,_mm_set1_ps(1.41421356f));
+	m = select_ps(big,_mm_mul_ps(m,_mm_set1_ps(0.5f)),m);
+	const __m128 ef = _mm_add_ps(_mm_cvtepi32_ps(e),_mm_and_ps(big,one));
+
+	const __m128 t = _mm_div_ps(_mm_sub_ps(m,one),_mm_add_ps(m,one));
+	const __m128 t2 = _mm_mul_ps(t,t);
+	__m128 p = _mm_set1_ps(1.0f/7.0f);
+	p = _mm_add_ps(_mm_mul_ps(p,t2),_mm_set1_ps(1.0f/5.0f));
+	p = _mm_add_ps(_mm_mul_ps(p,t2),_mm_set1_ps(1.0f/3.0f));
+	p = _mm_add_ps(_mm_mul_ps(p,t2),one);
+	p = _mm_mul_ps(_mm_mul_ps(p,t),_mm_set1_ps(2.88539008f)); // 2/ln(2)
+	return _mm_add_ps(ef,p);
+}
+
+/**
+ * @brief exp2_ps approximates 2^y splitting y into round(y) and a fraction
+ * in [-0.5,0.5], which is handled by a Taylor polynomial.
+ */
+static inline __m128 exp2_ps(__m128 y)
+{
+	y = _mm_min_ps(_mm_max_ps(y,_mm_set1_ps(-126.0f)),_mm_set1_ps(126.0f));
+	const __m128i i = _mm_cvtps_epi32(y);
+	const __m128 z = _mm_mul_ps(_mm_sub_ps(y,_mm_cvtepi32_ps(i)),
+								_mm_set1_ps(0.69314718f));
+	__m128 p = _mm_set1_ps(1.0f/720.0f);
+	p = _mm_add_ps(_mm_mul_ps(p,z),_mm_set1_ps(1.0f/120.0f));
+	p = _mm_add_ps(_mm_mul_ps(p,z),_mm_set1_ps(1.0f/24.0f));
+	p = _mm_add_ps(_mm_mul_ps(p,z),_mm_set1_ps(1.0f/6.0f));
+	p = _mm_add_ps(_mm_mul_ps(p,z),_mm_set1_ps(0.5f));
+	p = _mm_add_ps(_mm_mul_ps(p,z),_mm_set1_ps(1.0f));
+	p = _mm_add_ps(_mm_mul_ps(p,z),_mm_set1_ps(1.0f));
+	const __m128 s = _mm_castsi128_ps(_mm_slli_epi32(
+										  _mm_add_epi32(i,_mm_set1_epi32(127)),23));
+	return _mm_mul_ps(p,s);
+}
+
+/**
+ * @brief pow_ps approximates x^g for x > 0, returns 0 for x <= 0.
+ */
+static inline __m128 pow_ps(__m128 x, float g)
+{
+	const __m128 pos = _mm_cmpgt_ps(x,_mm_setzero_ps());
+	return _mm_and_ps(pos,exp2_ps(_mm_mul_ps(log2_ps(x),_mm_set1_ps(g))));
+}
+
+static inline __m128 to_linear_ps(__m128 v, Transfer t)
+{
+	if(t == Transfer::GAMMA_22)
+		return pow_ps(v,2.2f);
+
+	const __m128 lo = _mm_mul_ps(v,_mm_set1_ps(1.0f/12.92f));
+	const __m128 hi = pow_ps(_mm_mul_ps(_mm_add_ps(v,_mm_set1_ps(0.055f)),
+										_mm_set1_ps(1.0f/1.055f)),2.4f);
+	return select_ps(_mm_cmple_ps(v,_mm_set1_ps(0.04045f)),lo,hi);
+}
+
+static inline __m128 from_linear_ps(__m128 v, Transfer t)
+{
+	if(t == Transfer::GAMMA_22)
+		return pow_ps(v,1.0f/2.2f);
+
+	const __m128 lo = _mm_mul_ps(v,_mm_set1_ps(12.92f));
+	const __m128 hi = _mm_sub_ps(_mm_mul_ps(pow_ps(v,1.0f/2.4f),_mm_set1_ps(1.055f)),
+								 _mm_set1_ps(0.055f));
+	return select_ps(_mm_cmple_ps(v,_mm_set1_ps(0.0031308f)),lo,hi);
+}
+
+template<bool TO_LINEAR>
+static void convert_sse2(float* data, size_t n, Transfer t)
+{
+	const __m128 alpha = _mm_castsi128_ps(_mm_set_epi32(-1,0,0,0));
+	for(size_t p = 0 ; p < n;p++,data+=4)
+	{
+		const __m128 v = _mm_loadu_ps(data);
+		const __m128 r = TO_LINEAR ? to_linear_ps(v,t) : from_linear_ps(v,t);
+		_mm_storeu_ps(data,select_ps(alpha,v,r));
+	}
+}
+
+TD_TARGET("avx2")
+static inline __m256 log2_ps8(__m256 x)
+{
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256i bits = _mm256_castps_si256(x);
+	const __m256i e = _mm256_sub_epi32(_mm256_srli_epi32(bits,23),_mm256_set1_epi32(127));
+	__m256 m = _mm256_castsi256_ps(_mm256_or_si256(
+									   _mm256_and_si256(bits,_mm256_set1_epi32(0x007FFFFF)),
+									   _mm256_set1_epi32(0x3F800000)));
+	const __m256 big = _mm256_cmp_ps(m,_mm256_set1_ps(1.41421356f),_CMP_GT_OQ);
+	m = _mm256_blendv_ps(m,_mm256_mul_ps(m,_mm256_set1_ps(0.5f)),big);
+	const __m256 ef = _mm256_add_ps(_mm256_cvtepi32_ps(e),_mm256_and_ps(big,one));
+
+	const __m256 t = _mm256_div_ps(_mm256_sub_ps(m,one),_mm256_add_ps(m,one));
+	const __m256 t2 = _mm256_mul_ps(t,t);
+	__m256 p = _mm256_set1_ps(1.0f/7.0f);
+	p = _mm256_add_ps(_mm256_mul_ps(p,t2),_mm256_set1_ps(1.0f/5.0f));
+	p = _mm256_add_ps(_mm256_mul_ps(p,t2),_mm256_set1_ps(1.0f/3.0f));
+	p = _mm256_add_ps(_mm256_mul_ps(p,t2),one);
+	p = _mm256_mul_ps(_mm256_mul_ps(p,t),_mm256_set1_ps(2.88539008f));
+	return _mm256_add_ps(ef,p);
+}
+
+TD_TARGET("avx2")
+static inline __m256 exp2_ps8(__m256 y)
+{
+	y = _mm256_min_ps(_mm256_max_ps(y,_mm256_set1_ps(-126.0f)),_mm256_set1_ps(126.0f));
+	const __m256i i = _mm256_cvtps_epi32(y);
+	const __m256 z = _mm256_mul_ps(_mm256_sub_ps(y,_mm256_cvtepi32_ps(i)),
+								   _mm256_set1_ps(0.69314718f));
+	__m256 p = _mm256_set1_ps(1.0f/720.0f);
+	p = _mm256_add_ps(_mm256_mul_ps(p,z),_mm256_set1_ps(1.0f/120.0f));
+	p = _mm256_add_ps(_mm256_mul_ps(p,z),_mm256_set1_ps(1.0f/24.0f));
+	p = _mm256_add_ps(_mm256_mul_ps(p,z),_mm256_set1_ps(1.0f/6.0f));
+	p = _mm256_add_ps(_mm256_mul_ps(p,z),_mm256_set1_ps(0.5f));
+	p = _mm256_add_ps(_mm256_mul_ps(p,z),_mm256_set1_ps(1.0f));
+	p = _mm256_add_ps(_mm256_mul_ps(p,z),_mm256_set1_ps(1.0f));
+	const __m256 s = _mm256_castsi256_ps(_mm256_slli_epi32(
+											 _mm256_add_epi32(i,_mm256_set1_epi32(127)),23));
+	return _mm256_mul_ps(p,s);
+}
+
+TD_TARGET("avx2")
+static inline __m256 pow_ps8(__m256 x, float g)
+{
+	const __m256 pos = _mm256_cmp_ps(x,_mm256_setzero_ps(),_CMP_GT_OQ);
+	return _mm256_and_ps(pos,exp2_ps8(_mm256_mul_ps(log2_ps8(x),_mm256_set1_ps(g))));
+}
+
+TD_TARGET("avx2")
+static inline __m256 to_linear_ps8(__m256 v, Transfer t)
+{
+	if(t == Transfer::GAMMA_22)
+		return pow_ps8(v,2.2f);
+
+	const __m256 lo = _mm256_mul_ps(v,_mm256_set1_ps(1.0f/12.92f));
+	const __m256 hi = pow_ps8(_mm256_mul_ps(_mm256_add_ps(v,_mm256_set1_ps(0.055f)),
+											_mm256_set1_ps(1.0f/1.055f)),2.4f);
+	return _mm256_blendv_ps(hi,lo,_mm256_cmp_ps(v,_mm256_set1_ps(0.04045f),_CMP_LE_OQ));
+}
+
+TD_TARGET("avx2")
+static inline __m256 from_linear_ps8(__m256 v, Transfer t)
+{
+	if(t == Transfer::GAMMA_22)
+		return pow_ps8(v,1.0f/2.2f);
+
+	const __m256 lo = _mm256_mul_ps(v,_mm256_set1_ps(12.92f));
+	const __m256 hi = _mm256_sub_ps(_mm256_mul_ps(pow_ps8(v,1.0f/2.4f),_mm256_set1_ps(1.055f)),
+									_mm256_set1_ps(0.055f));
+	return _mm256_blendv_ps(hi,lo,_mm256_cmp_ps(v,_mm256_set1_ps(0.0031308f),_CMP_LE_OQ));
+}
+
+// converts 2 pixels per iteration
+template<bool TO_LINEAR>
+TD_TARGET("avx2")
+static void convert_avx2(float* data, size_t n, Transfer t)
+{
+	size_t p = 0;
+	for(; p+2 <= n; p+=2,data+=8)
+	{
+		const __m256 v = _mm256_loadu_ps(data);
+		const __m256 r = TO_LINEAR ? to_linear_ps8(v,t) : from_linear_ps8(v,t);
+		_mm256_storeu_ps(data,_mm256_blend_ps(r,v,0x88));
+	}
+	convert_sse2<TO_LINEAR>(data,n-p,t);
+}
+
+// some GCC versions warn about the undefined registers in the avx512 headers
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+TD_TARGET("avx512f")
+static inline __m512 log2_ps16(__m512 x)
+{
+	const __m512 one = _mm512_set1_ps(1.0f);
+	const __m512i bits = _mm512_castps_si512(x);
+	const __m512i e = _mm512_sub_epi32(_mm512_srli_epi32(bits,23),_mm512_set1_epi32(127));
+	__m512 m = _mm512_castsi512_ps(_mm512_or_si512(
+									   _mm512_and_si512(bits,_mm512_set1_epi32(0x007FFFFF)),
+									   _mm512_set1_epi32(0x3F800000)));
+	const __mmask16 big = _mm512_cmp_ps_mask(m,_mm512_set1_ps(1.41421356f),_CMP_GT_OQ);
+	m = _mm512_mask_mul_ps(m,big,m,_mm512_set1_ps(0.5f));
+	const __m512 ef = _mm512_add_ps(_mm512_cvtepi32_ps(e),_mm512_maskz_mov_ps(big,one));
+
+	const __m512 t = _mm512_div_ps(_mm512_sub_ps(m,one),_mm512_add_ps(m,one));
+	const __m512 t2 = _mm512_mul_ps(t,t);
+	__m512 p = _mm512_set1_ps(1.0f/7.0f);
+	p = _mm512_add_ps(_mm512_mul_ps(p,t2),_mm512_set1_ps(1.0f/5.0f));
+	p = _mm512_add_ps(_mm512_mul_ps(p,t2),_mm512_set1_ps(1.0f/3.0f));
+	p = _mm512_add_ps(_mm512_mul_ps(p,t2),one);
+	p = _mm512_mul_ps(_mm512_mul_ps(p,t),_mm512_set1_ps(2.88539008f));
+	return _mm512_add_ps(ef,p);
+}
+
+TD_TARGET("avx512f")
+static inline __m512 exp2_ps16(__m512 y)
+{
+	y = _mm512_min_ps(_mm512_max_ps(y,_mm512_set1_ps(-126.0f)),_mm512_set1_ps(126.0f));
+	const __m512i i = _mm512_cvtps_epi32(y);
+	const __m512 z = _mm512_mul_ps(_mm512_sub_ps(y,_mm512_cvtepi32_ps(i)),
+								   _mm512_set1_ps(0.69314718f));
+	__m512 p = _mm512_set1_ps(1.0f/720.0f);
+	p = _mm512_add_ps(_mm512_mul_ps(p,z),_mm512_set1_ps(1.0f/120.0f));
+	p = _mm512_add_ps(_mm512_mul_ps(p,z),_mm512_set1_ps(1.0f/24.0f));
+	p = _mm512_add_ps(_mm512_mul_ps(p,z),_mm512_set1_ps(1.0f/6.0f));
+	p = _mm512_add_ps(_mm512_mul_ps(p,z),_mm512_set1_ps(0.5f));
+	p = _mm512_add_ps(_mm512_mul_ps(p,z),_mm512_set1_ps(1.0f));
+	p = _mm512_add_ps(_mm512_mul_ps(p,z),_mm512_set1_ps(1.0f));
+	const __m512 s = _mm512_castsi512_ps(_mm512_slli_epi32(
+											 _mm512_add_epi32(i,_mm512_set1_epi32(127)),23));
+	return _mm512_mul_ps(p,s);
+}
+
+TD_TARGET("avx512f")
+static inline __m512 pow_ps16(__m512 x, float g)
+{
+	const __mmask16 pos = _mm512_cmp_ps_mask(x,_mm512_setzero_ps(),_CMP_GT_OQ);
+	return _mm512_maskz_mov_ps(pos,exp2_ps16(_mm512_mul_ps(log2_ps16(x),_mm512_set1_ps(g))));
+}
+
+TD_TARGET("avx512f")
+static inline __m512 to_linear_ps16(__m512 v, Transfer t)
+{
+	if(t == Transfer::GAMMA_22)
+		return pow_ps16(v,2.2f);
+
+	const __m512 lo = _mm512_mul_ps(v,_mm512_set1_ps(1.0f/12.92f));
+	const __m512 hi = pow_ps16(_mm512_mul_ps(_mm512_add_ps(v,_mm512_set1_ps(0.055f)),
+											 _mm512_set1_ps(1.0f/1.055f)),2.4f);
+	return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(v,_mm512_set1_ps(0.04045f),_CMP_LE_OQ),hi,lo);
+}
+
+TD_TARGET("avx512f")
+static inline __m512 from_linear_ps16(__m512 v, Transfer t)
+{
+	if(t == Transfer::GAMMA_22)
+		return pow_ps16(v,1.0f/2.2f);
+
+	const __m512 lo = _mm512_mul_ps(v,_mm512_set1_ps(12.92f));
+	const __m512 hi = _mm512_sub_ps(_mm512_mul_ps(pow_ps16(v,1.0f/2.4f),_mm512_set1_ps(1.055f)),
+									_mm512_set1_ps(0.055f));
+	return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(v,_mm512_set1_ps(0.0031308f),_CMP_LE_OQ),hi,lo);
+}
+
+// converts 4 pixels per iteration, the masked loads/stores handle the rest
+// and keep alpha
+template<bool TO_LINEAR>
+TD_TARGET("avx512f")
+static void convert_avx512(float* data, size_t n, Transfer t)
+{
+	const __mmask16 rgb = 0x7777;
+	for(size_t p = 0 ; p < n; p+=4,data+=16)
+	{
+		const __mmask16 m = n-p >= 4 ? 0xFFFF : (__mmask16)((1u<<(4*(n-p)))-1);
+		const __m512 v = _mm512_maskz_loadu_ps(m,data);
+		const __m512 r = TO_LINEAR ? to_linear_ps16(v,t) : from_linear_ps16(v,t);
+		_mm512_mask_storeu_ps(data,m&rgb,r);
+	}
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+typedef void (*convert_fn)(float* data, size_t n, Transfer t);
+
+static const KernelTable<convert_fn> to_linear_kernels = {{
+	convert_lut<true>,
+#if TD_SSE2
+	convert_sse2<true>,nullptr,convert_avx2<true>,convert_avx512<true>
+#endif
+}};
+
+static const KernelTable<convert_fn> from_linear_kernels = {{
+	convert_lut<false>,
+#if TD_SSE2
+	convert_sse2<false>,nullptr,convert_avx2<false>,convert_avx512<false>
+#endif
+}};
+
+
+void to_linear(float *data, size_t n, Transfer t, ColorMethod m)
+{
+	if(t == Transfer::LINEAR)
+		return;
+	if(m == ColorMethod::SIMD)
+		to_linear_kernels.select()(data,n,t);
+	else if(m == ColorMethod::LUT)
+		convert_lut<true>(data,n,t);
+	else
+		for(size_t p = 0 ; p < n;p++,data+=4)
+			for(int c = 0 ; c < 3;c++)
+				data[c] = ref_to_linear(data[c],t);
+}
+
+void from_linear(float *data, size_t n, Transfer t, ColorMethod m)
+{
+	if(t == Transfer::LINEAR)
+		return;
+	if(m == ColorMethod::SIMD)
+		from_linear_kernels.select()(data,n,t);
+	else if(m == ColorMethod::LUT)
+		convert_lut<false>(data,n,t);
+	else
+		for(size_t p = 0 ; p < n;p++,data+=4)
+			for(int c = 0 ; c < 3;c++)
+				data[c] = ref_from_linear(data[c],t);
+}
+
+}
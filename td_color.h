@@ -0,0 +1,105 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+namespace td {
+
+/**
+ * @brief The Transfer enum represents the transfer function (the "gamma") of
+ * the color channels of an image.
+ * LINEAR   - the values are linear intensities.
+ * GAMMA_22 - the values are linear intensities ^ (1/2.2).
+ * SRGB     - the values are encoded with the exact sRGB curve.
+ */
+enum class Transfer
+{
+	LINEAR,
+	GAMMA_22,
+	SRGB,
+};
+
+/**
+ * @brief The ColorMethod enum selects how colors are converted between a
+ * transfer function and linear space.
+ * REFERENCE - powf per value.
+ * LUT       - 4096-entry lookup tables with linear interpolation.
+ * SIMD      - vectorised polynomial approximation, using the best instruction
+ *             set the CPU supports (falls back to LUT without SSE2).
+ */
+enum class ColorMethod
+{
+	REFERENCE,
+	LUT,
+	SIMD,
+};
+
+/**
+ * @brief to_linear converts n RGBA pixels (4 floats each) in place from the
+ * transfer function t into linear space. Alpha is not touched.
+ * @param data
+ * @param n - number of pixels.
+ * @param t
+ * @param m
+ */
+void to_linear(float* data, size_t n, Transfer t, ColorMethod m = ColorMethod::SIMD);
+
+/**
+ * @brief from_linear converts n RGBA pixels (4 floats each) in place from
+ * linear space to the transfer function t. Alpha is not touched.
+ * @param data
+ * @param n - number of pixels.
+ * @param t
+ * @param m
+ */
+void from_linear(float* data, size_t n, Transfer t, ColorMethod m = ColorMethod::SIMD);
+
+/**
+ * @brief decode_table_8 returns a table of 256 linear values for the 8 bit
+ * values encoded with transfer function t.
+ * @param t
+ * @return
+ */
+const float* decode_table_8(Transfer t);
+
+/**
+ * @brief encode_8 converts a linear value to an 8 bit value encoded with the
+ * transfer function t, using the lookup tables.
+ * @param v
+ * @param t
+ * @return
+ */
+uint8_t encode_8(float v, Transfer t);
+
+// 1.0 in the 24 bit fixed point linear values of Linear8
+static const uint32_t LINEAR8_ONE = 0xFFFFFF;
+
+/**
+ * @brief The Linear8 struct converts 8 bit values encoded with a transfer
+ * function to linear values in 24 bit fixed point (0 - LINEAR8_ONE) and back,
+ * without floats. encode rounds to the nearest 8 bit value.
+ * dec - the linear value of each 8 bit value.
+ * thr - thr[k] is the smallest linear value encoded as k (k > 0).
+ * enc - the 8 bit value of the linear value i<<8, a lower bound for encode.
+ */
+struct Linear8
+{
+	uint32_t dec[256];
+	uint32_t thr[256];
+	uint8_t enc[65536];
+
+	uint8_t encode(uint32_t l) const
+	{
+		int k = enc[l>>8];
+		while(k < 255 && l >= thr[k+1])
+			k++;
+		return (uint8_t)k;
+	}
+};
+
+/**
+ * @brief linear8_table returns the Linear8 tables of t, which are built on the
+ * first call.
+ * @param t
+ * @return
+ */
+const Linear8& linear8_table(Transfer t);
+}
@@ -0,0 +1,119 @@
+#include "td_cpu.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+
+#if TD_SSE2 && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace td
+{
+
+static ISA detect()
+{
+#if TD_SSE2 && defined(__GNUC__)
+	__builtin_cpu_init();
+	const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c");
+	if(avx2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+		return ISA::AVX512;
+	if(avx2)
+		return ISA::AVX2;
+	if(__builtin_cpu_supports("ssse3"))
+		return ISA::SSSE3;
+	return ISA::SSE2;
+#elif TD_SSE2 && defined(_MSC_VER)
+	int r[4];
+	__cpuid(r,0);
+	const int n = r[0];
+	__cpuid(r,1);
+	const bool ssse3 = (r[2]>>9)&1;
+	const bool f16c = (r[2]>>29)&1;
+	const bool osxsave = (r[2]>>27)&1;
+	const unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	const bool avx_os = (xcr0&0x6) == 0x6;
+	const bool avx512_os = (xcr0&0xE6) == 0xE6;
+	if(n >= 7)
+	{
+		__cpuidex(r,7,0);
+		const bool avx2 = avx_os && f16c && ((r[1]>>5)&1);
+		if(avx2 && avx512_os && ((r[1]>>16)&1) && ((r[1]>>30)&1))
+			return ISA::AVX512;
+		if(avx2)
+			return ISA::AVX2;
+	}
+	return ssse3 ? ISA::SSSE3 : ISA::SSE2;
+#else
+	return ISA::SCALAR;
+#endif
+}
+
+ISA detected_isa()
+{
+	static const ISA isa = detect();
+	return isa;
+}
+
+static int initial_isa()
+{
+	ISA isa = detected_isa();
+	const char* env = getenv("TD_ISA");
+	ISA forced;
+	if(env && *env)
+	{
+		if(parse_isa(env,forced))
+			isa = std::min(isa,forced);
+		else
+			fprintf(stderr,"Ignoring unknown TD_ISA '%s'\n",env);
+	}
+	return (int)isa;
+}
+
+static std::atomic<int>& isa_limit()
+{
+	static std::atomic<int> isa(initial_isa());
+	return isa;
+}
+
+ISA active_isa()
+{
+	return (ISA)isa_limit().load(std::memory_order_relaxed);
+}
+
+void set_isa(ISA isa)
+{
+	isa_limit() = (int)std::min(isa,detected_isa());
+}
+
+const char* isa_name(ISA isa)
+{
+	switch(isa)
+	{
+	case ISA::SCALAR: return "SCALAR";
+	case ISA::SSE2: return "SSE2";
+	case ISA::SSSE3: return "SSSE3";
+	case ISA::AVX2: return "AVX2";
+	case ISA::AVX512: return "AVX512";
+	default: return "?";
+	}
+}
+
+bool parse_isa(const std::string& s, ISA& isa)
+{
+	std::string u(s);
+	for(auto& c : u)
+		c = toupper((unsigned char)c);
+	for(int i = 0 ; i < (int)ISA::COUNT;i++)
+	{
+		if(u == isa_name((ISA)i))
+		{
+			isa = (ISA)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+}
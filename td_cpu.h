@@ -0,0 +1,90 @@
+#pragma once
+#include <string>
+namespace td {
+
+/**
+ * TD_SSE2 is set if the target always supports SSE2, which is the baseline of
+ * the vectorised kernels. Kernels for the higher instruction sets are compiled
+ * using TD_TARGET and are only called if the CPU supports them.
+ */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TD_SSE2 1
+#else
+#define TD_SSE2 0
+#endif
+
+#if defined(__GNUC__)
+#define TD_TARGET(isa) __attribute__((target(isa)))
+#else
+#define TD_TARGET(isa)
+#endif
+
+/**
+ * @brief The ISA enum lists the instruction set levels td has kernels for,
+ * ordered by capability. AVX2 includes F16C, AVX512 means AVX512F and
+ * AVX512BW.
+ */
+enum class ISA : int
+{
+	SCALAR,
+	SSE2,
+	SSSE3,
+	AVX2,
+	AVX512,
+	COUNT
+};
+
+/**
+ * @brief detected_isa returns the best instruction set level supported by
+ * the CPU (and the OS) td is running on.
+ */
+ISA detected_isa();
+
+/**
+ * @brief active_isa returns the instruction set level the kernels are selected
+ * for. This is detected_isa(), unless it is limited by set_isa or the
+ * environment variable TD_ISA.
+ */
+ISA active_isa();
+
+/**
+ * @brief set_isa limits the kernels to the instruction set level isa (e.g. to
+ * benchmark or to reproduce a bug). Levels above detected_isa() are clamped.
+ * @param isa
+ */
+void set_isa(ISA isa);
+
+/**
+ * @brief isa_name returns the name of isa as used by parse_isa.
+ */
+const char* isa_name(ISA isa);
+
+/**
+ * @brief parse_isa parses one of SCALAR, SSE2, SSSE3, AVX2, AVX512 (case
+ * insensitive).
+ * @return true on success.
+ */
+bool parse_isa(const std::string& s, ISA& isa);
+
+/**
+ * @brief The KernelTable struct holds the implementations of one kernel for
+ * each instruction set level (nullptr if there is none). The SCALAR entry has
+ * to be present.
+ */
+template<typename F>
+struct KernelTable
+{
+	F impl[(int)ISA::COUNT];
+
+	/**
+	 * @brief select returns the best implementation usable on active_isa().
+	 */
+	F select() const
+	{
+		for(int i = (int)active_isa(); i > 0; i--)
+			if(impl[i])
+				return impl[i];
+		return impl[0];
+	}
+};
+}
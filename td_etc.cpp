@@ -0,0 +1,1151 @@
+#include "td_etc.h"
+#include "td_cpu.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <vector>
+
+#if TD_SSE2
+#include <immintrin.h>
+#endif
+
+namespace td
+{
+
+/*
+ * An ETC1 block is a big endian 64 bit integer. The high 32 bits are
+ *   individual mode (diff = 0): R1 R2 G1 G2 B1 B2 (4 bits each)
+ *   differential mode (diff = 1): R1 dR G1 dG B1 dB (5 and 3 bits, the second
+ *     color is the first plus the signed delta)
+ * followed by the table of each half (3 bits), diff and flip. The low 32 bits
+ * hold the 2 bit index of each pixel, the msb at bit 16+k and the lsb at bit
+ * k, where k = x*4+y. flip = 0 splits the block into the left and right 2x4
+ * halves, flip = 1 into the top and bottom 4x2 halves.
+ */
+static const int ETC_TABLES[8][2] = {{2,8},{5,17},{9,29},{13,42},
+									 {18,60},{24,80},{33,106},{47,183}};
+
+// the offset of index i: +a, +b, -a, -b
+static inline int etc_modifier(int table, int i)
+{
+	const int m = ETC_TABLES[table][i&1];
+	return i&2 ? -m : m;
+}
+
+static inline int clamp255(int v)
+{
+	return std::min(255,std::max(0,v));
+}
+
+static inline int expand4(int c)
+{
+	return c*17;
+}
+
+static inline int expand5(int c)
+{
+	return (c<<3)|(c>>2);
+}
+
+static inline uint32_t load_be32(const uint8_t* p)
+{
+	return uint32_t(p[0])<<24|uint32_t(p[1])<<16|uint32_t(p[2])<<8|p[3];
+}
+
+static inline void store_be32(uint8_t* p, uint32_t v)
+{
+	p[0] = uint8_t(v>>24);
+	p[1] = uint8_t(v>>16);
+	p[2] = uint8_t(v>>8);
+	p[3] = uint8_t(v);
+}
+
+/**
+ * @brief The Half struct holds the 8 pixels of a half block, laid out for the
+ * kernels: red and green of pixel i at rg[2i] and rg[2i+1], blue at b[2i]
+ * (b[2i+1] is 0).
+ */
+struct Half
+{
+	alignas(32) int16_t rg[16];
+	alignas(32) int16_t b[16];
+	uint8_t k[8]; // the index bit of each pixel
+	int sum[3];
+};
+
+/*
+ * table_errors kernels compute the squared error of a half for each of the 8
+ * tables, with every pixel using its best index, for the base color c.
+ */
+typedef void (*table_errors_fn)(const Half& h, const int* c, uint32_t* err);
+
+static void table_errors_scalar(const Half& h, const int* c, uint32_t* err)
+{
+	for(int t = 0 ; t < 8;t++)
+	{
+		int cand[4][3];
+		for(int i = 0 ; i < 4;i++)
+			for(int ch = 0 ; ch < 3;ch++)
+				cand[i][ch] = clamp255(c[ch]+etc_modifier(t,i));
+		uint32_t e = 0;
+		for(int p = 0 ; p < 8;p++)
+		{
+			uint32_t best = UINT32_MAX;
+			for(int i = 0 ; i < 4;i++)
+			{
+				const int dr = h.rg[2*p]-cand[i][0];
+				const int dg = h.rg[2*p+1]-cand[i][1];
+				const int db = h.b[2*p]-cand[i][2];
+				best = std::min(best,uint32_t(dr*dr+dg*dg+db*db));
+			}
+			e += best;
+		}
+		err[t] = e;
+	}
+}
+
+#if TD_SSE2
+/**
+ * @brief The ModifierVectors struct holds the modifiers of each table for the
+ * candidate colors of the kernels: rg[t] the 4 modifiers of table t for red
+ * and green, b[t] for blue (and 0).
+ */
+struct ModifierVectors
+{
+	alignas(16) int16_t rg[8][8];
+	alignas(16) int16_t b[8][8];
+	ModifierVectors()
+	{
+		for(int t = 0 ; t < 8;t++)
+		{
+			for(int i = 0 ; i < 4;i++)
+			{
+				rg[t][2*i] = rg[t][2*i+1] = b[t][2*i] = int16_t(etc_modifier(t,i));
+				b[t][2*i+1] = 0;
+			}
+		}
+	}
+};
+static const ModifierVectors modifier_vectors;
+
+/**
+ * @brief candidates_sse2 returns the 4 candidate colors of table t for the
+ * base color c, as pairs of 16 bit red and green (rg) and blue and 0 (b).
+ */
+static inline void candidates_sse2(__m128i crg, __m128i cb, int t, __m128i& rg, __m128i& b)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i max = _mm_set1_epi16(255);
+	rg = _mm_add_epi16(crg,_mm_load_si128((const __m128i*)modifier_vectors.rg[t]));
+	b = _mm_add_epi16(cb,_mm_load_si128((const __m128i*)modifier_vectors.b[t]));
+	rg = _mm_min_epi16(_mm_max_epi16(rg,zero),max);
+	b = _mm_min_epi16(_mm_max_epi16(b,zero),max);
+}
+
+// the differences are 16 bit, madd sums up the squares of red and green
+static inline __m128i half_error_sse2(__m128i rg, __m128i b, __m128i crg, __m128i cb)
+{
+	const __m128i d = _mm_sub_epi16(rg,crg);
+	const __m128i e = _mm_sub_epi16(b,cb);
+	return _mm_add_epi32(_mm_madd_epi16(d,d),_mm_madd_epi16(e,e));
+}
+
+static inline __m128i min_epi32_sse2(__m128i a, __m128i b)
+{
+	const __m128i lt = _mm_cmplt_epi32(a,b);
+	return _mm_or_si128(_mm_and_si128(lt,a),_mm_andnot_si128(lt,b));
+}
+
+template<int I>
+static inline __m128i broadcast_sse2(__m128i v)
+{
+	return _mm_shuffle_epi32(v,I*0x55);
+}
+
+template<int I>
+static inline void min_candidate_sse2(const __m128i* rg, const __m128i* b, __m128i crg,
+									  __m128i cb, __m128i* best)
+{
+	const __m128i r = broadcast_sse2<I>(crg);
+	const __m128i s = broadcast_sse2<I>(cb);
+	best[0] = min_epi32_sse2(best[0],half_error_sse2(rg[0],b[0],r,s));
+	best[1] = min_epi32_sse2(best[1],half_error_sse2(rg[1],b[1],r,s));
+}
+
+static void table_errors_sse2(const Half& h, const int* c, uint32_t* err)
+{
+	const __m128i rg[2] = {_mm_load_si128((const __m128i*)h.rg),
+						   _mm_load_si128((const __m128i*)(h.rg+8))};
+	const __m128i b[2] = {_mm_load_si128((const __m128i*)h.b),
+						  _mm_load_si128((const __m128i*)(h.b+8))};
+	const __m128i crg = _mm_set1_epi32(c[0]|c[1]<<16);
+	const __m128i cb = _mm_set1_epi32(c[2]);
+	for(int t = 0 ; t < 8;t++)
+	{
+		__m128i r, s;
+		candidates_sse2(crg,cb,t,r,s);
+		__m128i best[2] = {_mm_set1_epi32(INT_MAX),_mm_set1_epi32(INT_MAX)};
+		min_candidate_sse2<0>(rg,b,r,s,best);
+		min_candidate_sse2<1>(rg,b,r,s,best);
+		min_candidate_sse2<2>(rg,b,r,s,best);
+		min_candidate_sse2<3>(rg,b,r,s,best);
+		__m128i sum = _mm_add_epi32(best[0],best[1]);
+		sum = _mm_add_epi32(sum,_mm_shuffle_epi32(sum,0x4E));
+		sum = _mm_add_epi32(sum,_mm_shuffle_epi32(sum,0xB1));
+		err[t] = uint32_t(_mm_cvtsi128_si32(sum));
+	}
+}
+
+template<int I>
+TD_TARGET("avx2")
+static inline __m256i candidate_error_avx2(__m256i rg, __m256i b, __m256i crg, __m256i cb)
+{
+	const __m256i d = _mm256_sub_epi16(rg,_mm256_shuffle_epi32(crg,I*0x55));
+	const __m256i e = _mm256_sub_epi16(b,_mm256_shuffle_epi32(cb,I*0x55));
+	return _mm256_add_epi32(_mm256_madd_epi16(d,d),_mm256_madd_epi16(e,e));
+}
+
+// the 8 pixels fill a vector, the sums of the 8 tables are transposed with
+// horizontal adds
+TD_TARGET("avx2")
+static void table_errors_avx2(const Half& h, const int* c, uint32_t* err)
+{
+	const __m256i rg = _mm256_load_si256((const __m256i*)h.rg);
+	const __m256i b = _mm256_load_si256((const __m256i*)h.b);
+	const __m128i crg = _mm_set1_epi32(c[0]|c[1]<<16);
+	const __m128i cb = _mm_set1_epi32(c[2]);
+	__m256i best[8];
+	for(int t = 0 ; t < 8;t++)
+	{
+		__m128i r, s;
+		candidates_sse2(crg,cb,t,r,s);
+		const __m256i r2 = _mm256_broadcastsi128_si256(r);
+		const __m256i s2 = _mm256_broadcastsi128_si256(s);
+		best[t] = _mm256_min_epi32(_mm256_min_epi32(candidate_error_avx2<0>(rg,b,r2,s2),
+													candidate_error_avx2<1>(rg,b,r2,s2)),
+								   _mm256_min_epi32(candidate_error_avx2<2>(rg,b,r2,s2),
+													candidate_error_avx2<3>(rg,b,r2,s2)));
+	}
+	const __m256i h0 = _mm256_hadd_epi32(_mm256_hadd_epi32(best[0],best[1]),
+										 _mm256_hadd_epi32(best[2],best[3]));
+	const __m256i h1 = _mm256_hadd_epi32(_mm256_hadd_epi32(best[4],best[5]),
+										 _mm256_hadd_epi32(best[6],best[7]));
+	const __m256i s = _mm256_add_epi32(_mm256_permute2x128_si256(h0,h1,0x20),
+									   _mm256_permute2x128_si256(h0,h1,0x31));
+	_mm256_storeu_si256((__m256i*)err,s);
+}
+#endif
+
+static const KernelTable<table_errors_fn> table_errors_kernels = {{
+	table_errors_scalar,
+#if TD_SSE2
+	table_errors_sse2,nullptr,table_errors_avx2
+#endif
+}};
+
+/**
+ * @brief The HalfFit struct is a base color of a half (in 4 or 5 bits per
+ * channel) with its best table.
+ */
+struct HalfFit
+{
+	int c[3];
+	int table;
+	uint32_t err;
+};
+
+static HalfFit fit_half(const Half& h, const int* c, bool diff, table_errors_fn errors)
+{
+	HalfFit f = {{c[0],c[1],c[2]},0,0};
+	int c8[3];
+	for(int ch = 0 ; ch < 3;ch++)
+		c8[ch] = diff ? expand5(c[ch]) : expand4(c[ch]);
+	uint32_t err[8];
+	errors(h,c8,err);
+	f.err = err[0];
+	for(int t = 1 ; t < 8;t++)
+	{
+		if(err[t] < f.err)
+		{
+			f.err = err[t];
+			f.table = t;
+		}
+	}
+	return f;
+}
+
+/**
+ * @brief candidates fits the base colors within r steps around the average
+ * of h, quantized to 4 (diff = false) or 5 bits per channel.
+ */
+static void candidates(const Half& h, bool diff, int r, table_errors_fn errors,
+					   std::vector<HalfFit>& res)
+{
+	const int max = diff ? 31 : 15;
+	int q[3];
+	for(int ch = 0 ; ch < 3;ch++)
+		q[ch] = (h.sum[ch]*max+8*255/2)/(8*255);
+	res.clear();
+	int c[3];
+	for(c[0] = std::max(0,q[0]-r); c[0] <= std::min(max,q[0]+r); c[0]++)
+		for(c[1] = std::max(0,q[1]-r); c[1] <= std::min(max,q[1]+r); c[1]++)
+			for(c[2] = std::max(0,q[2]-r); c[2] <= std::min(max,q[2]+r); c[2]++)
+				res.push_back(fit_half(h,c,diff,errors));
+}
+
+static inline bool fits_delta(const HalfFit& a, const HalfFit& b)
+{
+	for(int ch = 0 ; ch < 3;ch++)
+	{
+		const int d = b.c[ch]-a.c[ch];
+		if(d < -4 || d > 3)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * @brief The Encoding struct is a candidate encoding of a whole block.
+ */
+struct Encoding
+{
+	uint32_t err;
+	bool diff;
+	int flip;
+	HalfFit half[2];
+};
+
+static void write_block(uint8_t* dst, const Encoding& e, const Half* halves)
+{
+	const HalfFit& a = e.half[0];
+	const HalfFit& b = e.half[1];
+	uint32_t hi = uint32_t(a.table)<<5|uint32_t(b.table)<<2|uint32_t(e.diff)<<1|uint32_t(e.flip);
+	for(int ch = 0 ; ch < 3;ch++)
+	{
+		if(e.diff)
+			hi |= uint32_t(a.c[ch])<<(27-8*ch)|uint32_t((b.c[ch]-a.c[ch])&7)<<(24-8*ch);
+		else
+			hi |= uint32_t(a.c[ch])<<(28-8*ch)|uint32_t(b.c[ch])<<(24-8*ch);
+	}
+
+	uint32_t lo = 0;
+	for(int s = 0 ; s < 2;s++)
+	{
+		const Half& h = halves[s];
+		const HalfFit& f = e.half[s];
+		int c8[3];
+		for(int ch = 0 ; ch < 3;ch++)
+			c8[ch] = e.diff ? expand5(f.c[ch]) : expand4(f.c[ch]);
+		for(int p = 0 ; p < 8;p++)
+		{
+			// the first best index, as in table_errors
+			uint32_t best = UINT32_MAX;
+			uint32_t idx = 0;
+			for(int i = 0 ; i < 4;i++)
+			{
+				const int m = etc_modifier(f.table,i);
+				const int dr = h.rg[2*p]-clamp255(c8[0]+m);
+				const int dg = h.rg[2*p+1]-clamp255(c8[1]+m);
+				const int db = h.b[2*p]-clamp255(c8[2]+m);
+				const uint32_t err = uint32_t(dr*dr+dg*dg+db*db);
+				if(err < best)
+				{
+					best = err;
+					idx = i;
+				}
+			}
+			lo |= (idx>>1)<<(16+h.k[p])|(idx&1)<<h.k[p];
+		}
+	}
+	store_be32(dst,hi);
+	store_be32(dst+4,lo);
+}
+
+/**
+ * @brief etc1_search finds the best individual or differential encoding of a
+ * block, the halves of both splits are returned for write_block.
+ */
+static Encoding etc1_search(const uint8_t* rgba, BlockQuality q, Half (&halves)[2][2])
+{
+	const table_errors_fn errors = table_errors_kernels.select();
+	const int r = q == BlockQuality::FAST ? 0 : q == BlockQuality::NORMAL ? 1 : 2;
+
+	// the halves of both splits
+	for(int flip = 0 ; flip < 2;flip++)
+	{
+		int n[2] = {0,0};
+		for(auto& h : halves[flip])
+		{
+			memset(&h,0,sizeof(h));
+		}
+		for(int y = 0 ; y < 4;y++)
+		{
+			for(int x = 0 ; x < 4;x++)
+			{
+				Half& h = halves[flip][(flip ? y : x)/2];
+				const int i = n[(flip ? y : x)/2]++;
+				const uint8_t* p = rgba+(y*4+x)*4;
+				h.rg[2*i] = p[0];
+				h.rg[2*i+1] = p[1];
+				h.b[2*i] = p[2];
+				h.k[i] = uint8_t(x*4+y);
+				for(int ch = 0 ; ch < 3;ch++)
+					h.sum[ch] += p[ch];
+			}
+		}
+	}
+
+	Encoding best;
+	best.err = UINT32_MAX;
+	std::vector<HalfFit> c0, c1;
+	for(int flip = 0 ; flip < 2;flip++)
+	{
+		const Half* h = halves[flip];
+
+		// individual mode, the halves are independent
+		Encoding e = {0,false,flip,{}};
+		for(int s = 0 ; s < 2;s++)
+		{
+			candidates(h[s],false,r,errors,c0);
+			e.half[s] = *std::min_element(c0.begin(),c0.end(),[](const HalfFit& a, const HalfFit& b)
+			{
+				return a.err < b.err;
+			});
+			e.err += e.half[s].err;
+		}
+		if(e.err < best.err)
+			best = e;
+
+		// differential mode, the best pair within the range of the delta
+		candidates(h[0],true,r,errors,c0);
+		candidates(h[1],true,r,errors,c1);
+		for(const HalfFit& a : c0)
+		{
+			if(a.err >= best.err)
+				continue;
+			for(const HalfFit& b : c1)
+			{
+				if(a.err+b.err < best.err && fits_delta(a,b))
+				{
+					best.err = a.err+b.err;
+					best.diff = true;
+					best.flip = flip;
+					best.half[0] = a;
+					best.half[1] = b;
+				}
+			}
+		}
+	}
+	return best;
+}
+
+void etc1_encode_block(uint8_t *dst, const uint8_t *rgba, BlockQuality q)
+{
+	Half halves[2][2];
+	const Encoding e = etc1_search(rgba,q,halves);
+	write_block(dst,e,halves[e.flip]);
+}
+
+void etc1_decode_block(uint8_t *rgba, const uint8_t *src)
+{
+	const uint32_t hi = load_be32(src);
+	const uint32_t lo = load_be32(src+4);
+	const bool diff = (hi>>1)&1;
+	const bool flip = hi&1;
+	int c[2][3];
+	for(int ch = 0 ; ch < 3;ch++)
+	{
+		if(diff)
+		{
+			const int a = (hi>>(27-8*ch))&31;
+			const int d = int(((hi>>(24-8*ch))&7)^4)-4;
+			c[0][ch] = expand5(a);
+			c[1][ch] = expand5((a+d)&31);
+		}
+		else
+		{
+			c[0][ch] = expand4((hi>>(28-8*ch))&15);
+			c[1][ch] = expand4((hi>>(24-8*ch))&15);
+		}
+	}
+	const int table[2] = {int(hi>>5)&7,int(hi>>2)&7};
+
+	for(int y = 0 ; y < 4;y++)
+	{
+		for(int x = 0 ; x < 4;x++)
+		{
+			const int k = x*4+y;
+			const int s = (flip ? y : x)/2;
+			const int m = etc_modifier(table[s],int((lo>>(16+k))&1)<<1|int((lo>>k)&1));
+			uint8_t* p = rgba+(y*4+x)*4;
+			for(int ch = 0 ; ch < 3;ch++)
+				p[ch] = uint8_t(clamp255(c[s][ch]+m));
+			p[3] = 255;
+		}
+	}
+}
+
+/*
+ * ETC2 adds three modes to the differential mode of ETC1, which are signalled
+ * by a second base color overflowing in red (T), green (H) or blue (planar).
+ * The bits of the first color and delta, which these modes do not use, are
+ * set to cause the overflow (see set_mode_bits). The high 32 bits are
+ *   T: R1 (60..59, 57..56) G1 B1 R2 G2 B2 (4 bits each, 55..36), the
+ *      distance (35..34, 32)
+ *   H: R1 (62..59) G1 (58..56, 52) B1 (51, 49..47) R2 G2 B2 (4 bits each,
+ *      46..35), the distance (34, 32 and color 1 >= color 2 as lsb)
+ * with the indices of ETC1 selecting one of 4 paint colors. The planar mode
+ * interpolates the colors O, H and V at (0,0), (4,0) and (0,4), stored in 6,
+ * 7 and 6 bits per channel (see write_planar).
+ */
+enum class Etc2Mode
+{
+	INDIVIDUAL,
+	DIFFERENTIAL,
+	T,
+	H,
+	PLANAR,
+};
+
+static const int ETC2_DISTANCES[8] = {3,6,11,16,23,32,41,64};
+
+static inline int signed3(uint32_t v)
+{
+	return int((v&7)^4)-4;
+}
+
+static Etc2Mode etc2_mode(uint32_t hi)
+{
+	if(!((hi>>1)&1))
+		return Etc2Mode::INDIVIDUAL;
+	const int r = int((hi>>27)&31)+signed3(hi>>24);
+	if(r < 0 || r > 31)
+		return Etc2Mode::T;
+	const int g = int((hi>>19)&31)+signed3(hi>>16);
+	if(g < 0 || g > 31)
+		return Etc2Mode::H;
+	const int b = int((hi>>11)&31)+signed3(hi>>8);
+	if(b < 0 || b > 31)
+		return Etc2Mode::PLANAR;
+	return Etc2Mode::DIFFERENTIAL;
+}
+
+/**
+ * @brief set_mode_bits sets the bits of mask, which carry no data in mode m,
+ * such that hi decodes in mode m. Returns false if there is no such setting.
+ */
+static bool set_mode_bits(uint32_t& hi, uint32_t mask, Etc2Mode m)
+{
+	for(uint32_t s = mask;; s = (s-1)&mask)
+	{
+		const uint32_t h = (hi&~mask)|s;
+		if(etc2_mode(h) == m)
+		{
+			hi = h;
+			return true;
+		}
+		if(!s)
+			return false;
+	}
+}
+
+static inline int rgb444(const int* c)
+{
+	return c[0]<<8|c[1]<<4|c[2];
+}
+
+/**
+ * @brief The ThFit struct is a candidate encoding in the T or H mode: two
+ * colors in 4 bits per channel and the index of the distance.
+ */
+struct ThFit
+{
+	uint32_t err;
+	Etc2Mode mode;
+	int c[2][3];
+	int dist;
+};
+
+static void th_paint(const ThFit& f, int (*paint)[3])
+{
+	const int d = ETC2_DISTANCES[f.dist];
+	for(int ch = 0 ; ch < 3;ch++)
+	{
+		const int a = expand4(f.c[0][ch]);
+		const int b = expand4(f.c[1][ch]);
+		if(f.mode == Etc2Mode::T)
+		{
+			paint[0][ch] = a;
+			paint[1][ch] = clamp255(b+d);
+			paint[2][ch] = b;
+			paint[3][ch] = clamp255(b-d);
+		}
+		else
+		{
+			paint[0][ch] = clamp255(a+d);
+			paint[1][ch] = clamp255(a-d);
+			paint[2][ch] = clamp255(b+d);
+			paint[3][ch] = clamp255(b-d);
+		}
+	}
+}
+
+/**
+ * @brief split_colors splits the pixels into two clusters (2-means, starting
+ * from two pixels far apart), returns false if all pixels are equal.
+ * @param avg - the average color of each cluster.
+ */
+static bool split_colors(const BlockPixels& p, int (*avg)[3])
+{
+	auto dist = [&p](int i, const int* c)
+	{
+		const int dr = p.rg[2*i]-c[0];
+		const int dg = p.rg[2*i+1]-c[1];
+		const int db = p.b[2*i]-c[2];
+		return dr*dr+dg*dg+db*db;
+	};
+	int mean[3] = {0,0,0};
+	for(int i = 0 ; i < 16;i++)
+	{
+		mean[0] += p.rg[2*i];
+		mean[1] += p.rg[2*i+1];
+		mean[2] += p.b[2*i];
+	}
+	for(int ch = 0 ; ch < 3;ch++)
+		mean[ch] = (mean[ch]+8)/16;
+	for(int s = 0 ; s < 2;s++)
+	{
+		// the pixel furthest from the mean, then the one furthest from that
+		const int* from = s ? avg[0] : mean;
+		int far = 0;
+		for(int i = 1 ; i < 16;i++)
+			if(dist(i,from) > dist(far,from))
+				far = i;
+		avg[s][0] = p.rg[2*far];
+		avg[s][1] = p.rg[2*far+1];
+		avg[s][2] = p.b[2*far];
+	}
+	if(!dist(0,avg[0]) && !dist(0,avg[1]) && !dist(0,mean))
+		return false;
+
+	for(int it = 0 ; it < 3;it++)
+	{
+		int sum[2][4] = {};
+		for(int i = 0 ; i < 16;i++)
+		{
+			int* s = sum[dist(i,avg[1]) < dist(i,avg[0])];
+			s[0] += p.rg[2*i];
+			s[1] += p.rg[2*i+1];
+			s[2] += p.b[2*i];
+			s[3]++;
+		}
+		for(int s = 0 ; s < 2;s++)
+			if(sum[s][3])
+				for(int ch = 0 ; ch < 3;ch++)
+					avg[s][ch] = (sum[s][ch]+sum[s][3]/2)/sum[s][3];
+	}
+	return true;
+}
+
+static uint32_t th_error(const BlockPixels& p, const ThFit& f)
+{
+	// the lsb of the distance of the H mode is the order of the colors, which
+	// can be swapped, except if they are equal
+	if(f.mode == Etc2Mode::H && !(f.dist&1) && rgb444(f.c[0]) == rgb444(f.c[1]))
+		return UINT32_MAX;
+	int paint[4][3];
+	th_paint(f,paint);
+	return palette_error(p,paint,4);
+}
+
+/**
+ * @brief fit_th fits the T or H mode to the clusters avg (for T avg[0] is the
+ * single color) and keeps the result in best if it is better. FAST tries all
+ * distances for the averages, NORMAL then the neighbours of each color with
+ * the best distance, BEST with all distances.
+ */
+static void fit_th(const BlockPixels& p, Etc2Mode mode, const int (*avg)[3], BlockQuality q, ThFit& best)
+{
+	ThFit f;
+	f.mode = mode;
+	for(int s = 0 ; s < 2;s++)
+		for(int ch = 0 ; ch < 3;ch++)
+			f.c[s][ch] = (avg[s][ch]*15+127)/255;
+	ThFit cur = f;
+	cur.err = UINT32_MAX;
+	for(f.dist = 0 ; f.dist < 8;f.dist++)
+	{
+		f.err = th_error(p,f);
+		if(f.err < cur.err)
+			cur = f;
+	}
+
+	if(q != BlockQuality::FAST)
+	{
+		const ThFit start = cur;
+		for(int s = 0 ; s < 2;s++)
+		{
+			const ThFit base = cur;
+			for(int n = 0 ; n < 27;n++)
+			{
+				f = base;
+				const int d[3] = {n%3-1,n/3%3-1,n/9-1};
+				bool valid = n != 13;
+				for(int ch = 0 ; ch < 3;ch++)
+				{
+					f.c[s][ch] += d[ch];
+					valid = valid && f.c[s][ch] >= 0 && f.c[s][ch] <= 15;
+				}
+				if(!valid)
+					continue;
+				const int d0 = q == BlockQuality::BEST ? 0 : start.dist;
+				const int d1 = q == BlockQuality::BEST ? 7 : start.dist;
+				for(f.dist = d0 ; f.dist <= d1;f.dist++)
+				{
+					f.err = th_error(p,f);
+					if(f.err < cur.err)
+						cur = f;
+				}
+			}
+		}
+	}
+	if(cur.err < best.err)
+		best = cur;
+}
+
+static bool write_th(uint8_t* dst, ThFit f, const BlockPixels& p)
+{
+	uint32_t hi = 2;
+	if(f.mode == Etc2Mode::T)
+	{
+		const int* a = f.c[0];
+		const int* b = f.c[1];
+		hi |= uint32_t(a[0]>>2)<<27|uint32_t(a[0]&3)<<24|uint32_t(a[1])<<20|uint32_t(a[2])<<16|
+			  uint32_t(b[0])<<12|uint32_t(b[1])<<8|uint32_t(b[2])<<4|uint32_t(f.dist>>1)<<2|uint32_t(f.dist&1);
+		if(!set_mode_bits(hi,0xE4000000,Etc2Mode::T))
+			return false;
+	}
+	else
+	{
+		if((rgb444(f.c[0]) >= rgb444(f.c[1])) != bool(f.dist&1))
+			std::swap(f.c[0],f.c[1]);
+		const int* a = f.c[0];
+		const int* b = f.c[1];
+		hi |= uint32_t(a[0])<<27|uint32_t(a[1]>>1)<<24|uint32_t(a[1]&1)<<20|uint32_t(a[2]>>3)<<19|
+			  uint32_t(a[2]&7)<<15|uint32_t(b[0])<<11|uint32_t(b[1])<<7|uint32_t(b[2])<<3|
+			  uint32_t(f.dist>>2)<<2|uint32_t((f.dist>>1)&1);
+		if(!set_mode_bits(hi,0x80E40000,Etc2Mode::H))
+			return false;
+	}
+
+	int paint[4][3];
+	th_paint(f,paint);
+	uint8_t idx[16];
+	palette_indices(idx,p,paint,4);
+	uint32_t lo = 0;
+	for(int i = 0 ; i < 16;i++)
+	{
+		const int k = (i%4)*4+i/4;
+		lo |= uint32_t(idx[i]>>1)<<(16+k)|uint32_t(idx[i]&1)<<k;
+	}
+	store_be32(dst,hi);
+	store_be32(dst+4,lo);
+	return true;
+}
+
+/**
+ * @brief The PlanarFit struct is a candidate encoding in the planar mode: the
+ * colors O, H and V in 6, 7 and 6 bits for red, green and blue.
+ */
+struct PlanarFit
+{
+	uint32_t err;
+	int o[3], h[3], v[3];
+};
+
+static inline int planar_expand(int c, int ch)
+{
+	return ch == 1 ? (c<<1)|(c>>6) : (c<<2)|(c>>4);
+}
+
+static inline int planar_value(int o, int h, int v, int x, int y)
+{
+	return clamp255((x*(h-o)+y*(v-o)+4*o+2)>>2);
+}
+
+static inline int pixel_channel(const BlockPixels& p, int i, int ch)
+{
+	return ch == 2 ? p.b[2*i] : p.rg[2*i+ch];
+}
+
+static uint32_t planar_error(const BlockPixels& p, int ch, int o, int h, int v)
+{
+	o = planar_expand(o,ch);
+	h = planar_expand(h,ch);
+	v = planar_expand(v,ch);
+	uint32_t e = 0;
+	for(int i = 0 ; i < 16;i++)
+	{
+		const int d = pixel_channel(p,i,ch)-planar_value(o,h,v,i%4,i/4);
+		e += uint32_t(d*d);
+	}
+	return e;
+}
+
+/**
+ * @brief The PlanarSolver struct holds the least squares solution of the plane
+ * through the 16 pixels, c(x,y) = O*(1-x/4-y/4) + H*x/4 + V*y/4: the weights
+ * of each pixel for O, H and V.
+ */
+struct PlanarSolver
+{
+	float w[3][16];
+	PlanarSolver()
+	{
+		// the normal equations, inverted by the cofactors
+		double a[3][3] = {};
+		for(int i = 0 ; i < 16;i++)
+		{
+			const double u[3] = {1-(i%4)/4.0-(i/4)/4.0,(i%4)/4.0,(i/4)/4.0};
+			for(int r = 0 ; r < 3;r++)
+				for(int c = 0 ; c < 3;c++)
+					a[r][c] += u[r]*u[c];
+		}
+		double inv[3][3];
+		for(int r = 0 ; r < 3;r++)
+			for(int c = 0 ; c < 3;c++)
+				inv[c][r] = a[(r+1)%3][(c+1)%3]*a[(r+2)%3][(c+2)%3]-a[(r+1)%3][(c+2)%3]*a[(r+2)%3][(c+1)%3];
+		const double det = a[0][0]*inv[0][0]+a[0][1]*inv[1][0]+a[0][2]*inv[2][0];
+		for(int i = 0 ; i < 16;i++)
+		{
+			const double u[3] = {1-(i%4)/4.0-(i/4)/4.0,(i%4)/4.0,(i/4)/4.0};
+			for(int r = 0 ; r < 3;r++)
+				w[r][i] = float((inv[r][0]*u[0]+inv[r][1]*u[1]+inv[r][2]*u[2])/det);
+		}
+	}
+};
+static const PlanarSolver planar_solver;
+
+/**
+ * @brief fit_planar fits the planar mode, each channel on its own: the least
+ * squares plane, quantized, and for NORMAL and BEST the neighbours of the
+ * quantized colors.
+ */
+static PlanarFit fit_planar(const BlockPixels& p, BlockQuality q)
+{
+	PlanarFit f;
+	f.err = 0;
+	for(int ch = 0 ; ch < 3;ch++)
+	{
+		const int max = ch == 1 ? 127 : 63;
+		int c[3];
+		for(int j = 0 ; j < 3;j++)
+		{
+			float s = 0;
+			for(int i = 0 ; i < 16;i++)
+				s += planar_solver.w[j][i]*pixel_channel(p,i,ch);
+			c[j] = std::min(max,std::max(0,int(s*max/255+0.5f)));
+		}
+		int best[3] = {c[0],c[1],c[2]};
+		uint32_t err = planar_error(p,ch,c[0],c[1],c[2]);
+		if(q != BlockQuality::FAST)
+		{
+			for(int n = 0 ; n < 27;n++)
+			{
+				const int o = c[0]+n%3-1;
+				const int h = c[1]+n/3%3-1;
+				const int v = c[2]+n/9-1;
+				if(std::min(o,std::min(h,v)) < 0 || std::max(o,std::max(h,v)) > max)
+					continue;
+				const uint32_t e = planar_error(p,ch,o,h,v);
+				if(e < err)
+				{
+					err = e;
+					best[0] = o;
+					best[1] = h;
+					best[2] = v;
+				}
+			}
+		}
+		f.o[ch] = best[0];
+		f.h[ch] = best[1];
+		f.v[ch] = best[2];
+		f.err += err;
+	}
+	return f;
+}
+
+static void write_planar(uint8_t* dst, const PlanarFit& f)
+{
+	uint32_t hi = uint32_t(f.o[0])<<25|uint32_t(f.o[1]>>6)<<24|uint32_t(f.o[1]&63)<<17|
+				  uint32_t(f.o[2]>>5)<<16|uint32_t((f.o[2]>>3)&3)<<11|uint32_t(f.o[2]&7)<<7|
+				  uint32_t(f.h[0]>>1)<<2|2|uint32_t(f.h[0]&1);
+	const uint32_t lo = uint32_t(f.h[1])<<25|uint32_t(f.h[2])<<19|uint32_t(f.v[0])<<13|
+						uint32_t(f.v[1])<<6|uint32_t(f.v[2]);
+	// there is always a setting, the free bits reach every overflow
+	set_mode_bits(hi,0x8080E400,Etc2Mode::PLANAR);
+	store_be32(dst,hi);
+	store_be32(dst+4,lo);
+}
+
+void etc2_encode_block(uint8_t *dst, const uint8_t *rgba, BlockQuality q)
+{
+	Half halves[2][2];
+	const Encoding e = etc1_search(rgba,q,halves);
+	if(!e.err)
+	{
+		write_block(dst,e,halves[e.flip]);
+		return;
+	}
+
+	BlockPixels p;
+	p.load(rgba);
+	const PlanarFit planar = fit_planar(p,q);
+	ThFit th;
+	th.err = UINT32_MAX;
+	int avg[2][3];
+	if(split_colors(p,avg))
+	{
+		fit_th(p,Etc2Mode::H,avg,q,th);
+		fit_th(p,Etc2Mode::T,avg,q,th);
+		std::swap(avg[0],avg[1]);
+		fit_th(p,Etc2Mode::T,avg,q,th);
+	}
+
+	if(th.err < e.err && th.err < planar.err && write_th(dst,th,p))
+		return;
+	if(planar.err < e.err)
+		write_planar(dst,planar);
+	else
+		write_block(dst,e,halves[e.flip]);
+}
+
+void etc2_decode_block(uint8_t *rgba, const uint8_t *src)
+{
+	const uint32_t hi = load_be32(src);
+	const uint32_t lo = load_be32(src+4);
+	const Etc2Mode mode = etc2_mode(hi);
+	if(mode == Etc2Mode::INDIVIDUAL || mode == Etc2Mode::DIFFERENTIAL)
+	{
+		etc1_decode_block(rgba,src);
+		return;
+	}
+	if(mode == Etc2Mode::PLANAR)
+	{
+		const int o[3] = {int(hi>>25)&63,int(hi>>24&1)<<6|int(hi>>17&63),
+						  int(hi>>16&1)<<5|int(hi>>11&3)<<3|int(hi>>7&7)};
+		const int h[3] = {int(hi>>2&31)<<1|int(hi&1),int(lo>>25)&127,int(lo>>19)&63};
+		const int v[3] = {int(lo>>13)&63,int(lo>>6)&127,int(lo)&63};
+		for(int y = 0 ; y < 4;y++)
+		{
+			for(int x = 0 ; x < 4;x++)
+			{
+				uint8_t* px = rgba+(y*4+x)*4;
+				for(int ch = 0 ; ch < 3;ch++)
+					px[ch] = uint8_t(planar_value(planar_expand(o[ch],ch),planar_expand(h[ch],ch),
+												  planar_expand(v[ch],ch),x,y));
+				px[3] = 255;
+			}
+		}
+		return;
+	}
+
+	ThFit f;
+	f.mode = mode;
+	if(mode == Etc2Mode::T)
+	{
+		const int c[2][3] = {{int(hi>>27&3)<<2|int(hi>>24&3),int(hi>>20)&15,int(hi>>16)&15},
+							 {int(hi>>12)&15,int(hi>>8)&15,int(hi>>4)&15}};
+		memcpy(f.c,c,sizeof(c));
+		f.dist = int(hi>>2&3)<<1|int(hi&1);
+	}
+	else
+	{
+		const int c[2][3] = {{int(hi>>27)&15,int(hi>>24&7)<<1|int(hi>>20&1),int(hi>>19&1)<<3|int(hi>>15&7)},
+							 {int(hi>>11)&15,int(hi>>7)&15,int(hi>>3)&15}};
+		memcpy(f.c,c,sizeof(c));
+		f.dist = int(hi>>2&1)<<2|int(hi&1)<<1|int(rgb444(c[0]) >= rgb444(c[1]));
+	}
+	int paint[4][3];
+	th_paint(f,paint);
+	for(int y = 0 ; y < 4;y++)
+	{
+		for(int x = 0 ; x < 4;x++)
+		{
+			const int k = x*4+y;
+			const int i = int((lo>>(16+k))&1)<<1|int((lo>>k)&1);
+			uint8_t* px = rgba+(y*4+x)*4;
+			for(int ch = 0 ; ch < 3;ch++)
+				px[ch] = uint8_t(paint[i][ch]);
+			px[3] = 255;
+		}
+	}
+}
+
+/*
+ * An EAC block is a big endian 64 bit integer: the base codeword (8 bits), the
+ * multiplier (4 bits), the table (4 bits) and the 3 bit index of each pixel,
+ * pixel k = x*4+y at bits 47-3k..45-3k. The value of index i is
+ *   8 bit (alpha): base + table[i]*multiplier
+ *   11 bit (R11):  base*8 + 4 + table[i]*multiplier*8
+ * clamped to the range of the channel.
+ */
+static const int EAC_TABLES[16][8] = {
+	{-3,-6,-9,-15,2,5,8,14},	{-3,-7,-10,-13,2,6,9,12},	{-2,-5,-8,-13,1,4,7,12},
+	{-2,-4,-6,-13,1,3,5,12},	{-3,-6,-8,-12,2,5,7,11},	{-3,-7,-9,-11,2,6,8,10},
+	{-4,-7,-8,-11,3,6,7,10},	{-3,-5,-8,-11,2,4,7,10},	{-2,-6,-8,-10,1,5,7,9},
+	{-2,-5,-8,-10,1,4,7,9},		{-2,-4,-8,-10,1,3,7,9},		{-2,-5,-7,-10,1,4,6,9},
+	{-3,-4,-7,-10,2,3,6,9},		{-1,-2,-3,-10,0,1,2,9},		{-4,-6,-8,-9,3,5,7,8},
+	{-3,-5,-7,-9,2,4,6,8}};
+
+/**
+ * @brief The EacFit struct is the encoding of an EAC block.
+ */
+struct EacFit
+{
+	uint32_t err;
+	int base, mult, table;
+};
+
+static void eac_values(const EacFit& f, bool r11, int* v)
+{
+	for(int i = 0 ; i < 8;i++)
+	{
+		const int m = EAC_TABLES[f.table][i];
+		if(r11)
+			v[i] = std::min(2047,std::max(0,f.base*8+4+(f.mult ? m*f.mult*8 : m)));
+		else
+			v[i] = clamp255(f.base+m*f.mult);
+	}
+}
+
+/**
+ * @brief eac_search searches each table with the multipliers and base
+ * codewords around the ones spanning the range of the values, within 0, 1 or
+ * 2 multipliers and 0, 1 or 3 codewords for FAST, NORMAL and BEST.
+ */
+static EacFit eac_search(const int16_t* px, bool r11, BlockQuality q)
+{
+	const int rm = q == BlockQuality::FAST ? 0 : q == BlockQuality::NORMAL ? 1 : 2;
+	const int rb = q == BlockQuality::FAST ? 0 : q == BlockQuality::NORMAL ? 1 : 3;
+	const int scale = r11 ? 8 : 1;
+	const int lo = *std::min_element(px,px+16);
+	const int hi = *std::max_element(px,px+16);
+
+	EacFit best = {UINT32_MAX,0,0,0};
+	for(int t = 0 ; t < 16;t++)
+	{
+		const int tmin = EAC_TABLES[t][3];
+		const int tmax = EAC_TABLES[t][7];
+		const int span = (tmax-tmin)*scale;
+		const int m0 = std::min(15,std::max(1,(hi-lo+span/2)/span));
+		for(int m = std::max(1,m0-rm); m <= std::min(15,m0+rm); m++)
+		{
+			// the codeword centering the table on the range
+			const int center = lo+hi-(tmin+tmax)*m*scale;
+			const int b0 = std::min(255,std::max(0,r11 ? center/16 : (center+1)/2));
+			for(int b = std::max(0,b0-rb); b <= std::min(255,b0+rb); b++)
+			{
+				EacFit f = {0,b,m,t};
+				int v[8];
+				eac_values(f,r11,v);
+				f.err = value_error(px,v);
+				if(f.err < best.err)
+				{
+					best = f;
+					if(!f.err)
+						return best;
+				}
+			}
+		}
+	}
+	return best;
+}
+
+/**
+ * @brief eac_encode encodes channel ch of 4x4 RGBA pixels to an EAC block, in 8
+ * or 11 bits.
+ */
+static void eac_encode(uint8_t* dst, const uint8_t* rgba, int ch, bool r11, BlockQuality q)
+{
+	alignas(32) int16_t px[16];
+	for(int i = 0 ; i < 16;i++)
+		px[i] = int16_t(r11 ? (rgba[i*4+ch]*2047+127)/255 : rgba[i*4+ch]);
+	const EacFit f = eac_search(px,r11,q);
+	int v[8];
+	eac_values(f,r11,v);
+	uint64_t bits = uint64_t(f.base)<<56|uint64_t(f.mult)<<52|uint64_t(f.table)<<48;
+	for(int i = 0 ; i < 16;i++)
+	{
+		// the first closest value, as in value_error
+		int idx = 0;
+		for(int j = 1 ; j < 8;j++)
+			if(std::abs(px[i]-v[j]) < std::abs(px[i]-v[idx]))
+				idx = j;
+		bits |= uint64_t(idx)<<(45-3*((i%4)*4+i/4));
+	}
+	store_be32(dst,uint32_t(bits>>32));
+	store_be32(dst+4,uint32_t(bits));
+}
+
+static void eac_decode(uint8_t* rgba, int ch, const uint8_t* src, bool r11)
+{
+	const uint64_t bits = uint64_t(load_be32(src))<<32|load_be32(src+4);
+	const EacFit f = {0,int(bits>>56),int(bits>>52)&15,int(bits>>48)&15};
+	int v[8];
+	eac_values(f,r11,v);
+	for(int y = 0 ; y < 4;y++)
+	{
+		for(int x = 0 ; x < 4;x++)
+		{
+			const int c = v[(bits>>(45-3*(x*4+y)))&7];
+			rgba[(y*4+x)*4+ch] = uint8_t(r11 ? (c*255+1023)/2047 : c);
+		}
+	}
+}
+
+void etc2_eac_encode_block(uint8_t *dst, const uint8_t *rgba, BlockQuality q)
+{
+	eac_encode(dst,rgba,3,false,q);
+	etc2_encode_block(dst+8,rgba,q);
+}
+
+void etc2_eac_decode_block(uint8_t *rgba, const uint8_t *src)
+{
+	etc2_decode_block(rgba,src+8);
+	eac_decode(rgba,3,src,false);
+}
+
+void eac_r11_encode_block(uint8_t *dst, const uint8_t *rgba, BlockQuality q)
+{
+	eac_encode(dst,rgba,0,true,q);
+}
+
+void eac_r11_decode_block(uint8_t *rgba, const uint8_t *src)
+{
+	for(int i = 0 ; i < 16;i++)
+	{
+		rgba[i*4+1] = rgba[i*4+2] = 0;
+		rgba[i*4+3] = 255;
+	}
+	eac_decode(rgba,0,src,true);
+}
+
+void eac_rg11_encode_block(uint8_t *dst, const uint8_t *rgba, BlockQuality q)
+{
+	eac_encode(dst,rgba,0,true,q);
+	eac_encode(dst+8,rgba,1,true,q);
+}
+
+void eac_rg11_decode_block(uint8_t *rgba, const uint8_t *src)
+{
+	for(int i = 0 ; i < 16;i++)
+	{
+		rgba[i*4+2] = 0;
+		rgba[i*4+3] = 255;
+	}
+	eac_decode(rgba,0,src,true);
+	eac_decode(rgba,1,src+8,true);
+}
+
+}
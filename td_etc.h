@@ -0,0 +1,64 @@
+#pragma once
+#include <cstdint>
+#include "td_block.h"
+namespace td {
+
+/**
+ * @brief etc1_encode_block encodes 4x4 pixels to an ETC1 block. The block is
+ * split into two halves (side by side or on top of each other), each of which
+ * has a base color and a table of luminance offsets. All splits, both ways to
+ * store the base colors and all tables are searched for the lowest squared
+ * error, the base colors around the average of each half as selected by q.
+ * @param dst - 8 bytes.
+ * @param rgba - 4 rows of 4 RGBA pixels, alpha is ignored.
+ * @param q
+ */
+void etc1_encode_block(uint8_t* dst, const uint8_t* rgba, BlockQuality q);
+
+/**
+ * @brief etc1_decode_block decodes an ETC1 block to 4x4 RGBA pixels (alpha is
+ * 255).
+ * @param rgba - 4 rows of 4 pixels.
+ * @param src - 8 bytes.
+ */
+void etc1_decode_block(uint8_t* rgba, const uint8_t* src);
+
+/**
+ * @brief etc2_encode_block encodes 4x4 pixels to an ETC2 RGB8 block. Besides
+ * the ETC1 encodings (see etc1_encode_block) it fits the planar mode (a
+ * gradient) and the T and H modes (two clusters of colors), which are searched
+ * more thoroughly for NORMAL and BEST.
+ * @param dst - 8 bytes.
+ * @param rgba - 4 rows of 4 RGBA pixels, alpha is ignored.
+ * @param q
+ */
+void etc2_encode_block(uint8_t* dst, const uint8_t* rgba, BlockQuality q);
+
+/**
+ * @brief etc2_decode_block decodes an ETC2 RGB8 (or ETC1) block to 4x4 RGBA
+ * pixels (alpha is 255).
+ */
+void etc2_decode_block(uint8_t* rgba, const uint8_t* src);
+
+/**
+ * @brief etc2_eac_encode_block encodes 4x4 pixels to an ETC2 RGBA8 block: an
+ * EAC block of the alpha followed by an ETC2 RGB8 block.
+ * @param dst - 16 bytes.
+ */
+void etc2_eac_encode_block(uint8_t* dst, const uint8_t* rgba, BlockQuality q);
+void etc2_eac_decode_block(uint8_t* rgba, const uint8_t* src);
+
+/**
+ * @brief eac_r11_encode_block encodes the red of 4x4 pixels to an 11 bit EAC
+ * block (8 bytes), decoded to (r,0,0,255).
+ */
+void eac_r11_encode_block(uint8_t* dst, const uint8_t* rgba, BlockQuality q);
+void eac_r11_decode_block(uint8_t* rgba, const uint8_t* src);
+
+/**
+ * @brief eac_rg11_encode_block encodes the red and green of 4x4 pixels to two
+ * 11 bit EAC blocks (16 bytes), decoded to (r,g,0,255).
+ */
+void eac_rg11_encode_block(uint8_t* dst, const uint8_t* rgba, BlockQuality q);
+void eac_rg11_decode_block(uint8_t* rgba, const uint8_t* src);
+}
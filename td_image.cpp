@@ -5,6 +5,19 @@
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
 #include "stb_image_resize.h"
 #include "td_image.h"
+#include "td_cpu.h"
+#include "td_pack.h"
+#include "td_pvrtc.h"
+#include "td_thread.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <memory>
+
+#if TD_SSE2
+#include <immintrin.h>
+#endif
 
 namespace td
 {
@@ -43,9 +56,151 @@ void Image::write_tga(const std::string &path)
 
 }
 
-Image::Image(const std::string &path)
+Image::Image(const std::string &path):data(nullptr),w(0),h(0),d(0)
 {
 	data = stbi_load(path.c_str(),&w,&h,&d,0);
+	if(data)
+		return;
+
+	// formats stb_image does not know, like PAM
+	ImageReader r;
+	if(!r.open_pnm(path))
+		return;
+	data = (unsigned char*)malloc(size_t(r.w)*r.h*r.d);
+	w = r.w;
+	h = r.h;
+	d = r.d;
+	if(!r.read_rows(data,h))
+	{
+		free(data);
+		data = nullptr;
+	}
+}
+
+/**
+ * @brief pnm_token reads the next whitespace separated token of a PNM header,
+ * skipping comments.
+ */
+static std::string pnm_token(std::istream& f)
+{
+	std::string t;
+	int c;
+	while((c = f.get()) != EOF)
+	{
+		if(c == '#')
+		{
+			while((c = f.get()) != EOF && c != '\n');
+			continue;
+		}
+		if(isspace(c))
+		{
+			if(!t.empty())
+				break;
+			continue;
+		}
+		t += (char)c;
+	}
+	return t;
+}
+
+bool ImageReader::open_pnm(const std::string& path)
+{
+	y = 0;
+	file.open(path,std::ios::binary);
+	if(!file.is_open())
+		return false;
+
+	const std::string magic = pnm_token(file);
+	int maxval = 0;
+	if(magic == "P5" || magic == "P6")
+	{
+		d = magic == "P5" ? 1 : 3;
+		w = atoi(pnm_token(file).c_str());
+		h = atoi(pnm_token(file).c_str());
+		// the single whitespace after maxval is consumed by pnm_token
+		maxval = atoi(pnm_token(file).c_str());
+	}
+	else if(magic == "P7")
+	{
+		for(std::string t = pnm_token(file); !t.empty() && t != "ENDHDR"; t = pnm_token(file))
+		{
+			if(t == "WIDTH") w = atoi(pnm_token(file).c_str());
+			else if(t == "HEIGHT") h = atoi(pnm_token(file).c_str());
+			else if(t == "DEPTH") d = atoi(pnm_token(file).c_str());
+			else if(t == "MAXVAL") maxval = atoi(pnm_token(file).c_str());
+		}
+	}
+
+	if(maxval != 255 || w <= 0 || h <= 0 || d < 1 || d > 4 || !file)
+	{
+		file.close();
+		return false;
+	}
+	return true;
+}
+
+bool ImageReader::open(const std::string &path)
+{
+	if(open_pnm(path))
+		return true;
+
+	Image i(path);
+	if(!i.data)
+		return false;
+	std::swap(image.data,i.data);
+	w = image.w = i.w;
+	h = image.h = i.h;
+	d = image.d = i.d;
+	return true;
+}
+
+bool ImageReader::read_rows(unsigned char *dst, int n)
+{
+	if(n > h-y)
+		return false;
+	const size_t bytes = size_t(n)*w*d;
+	if(file.is_open())
+		file.read((char*)dst,bytes);
+	else
+		memcpy(dst,image.data+size_t(y)*w*d,bytes);
+	y += n;
+	return !file.is_open() || bool(file);
+}
+
+void Image::to_texture_layer(TextureLayer &td, Format f) const
+{
+	td.w = w;
+	td.h = h;
+	td.frmt = f;
+	td.type = DType::UNSIGNED_BYTE;
+	const size_t size = size_per_pixel(f,DType::UNSIGNED_BYTE);
+	td.data = realloc(td.data,layer_size(w,h,f,DType::UNSIGNED_BYTE));
+	uint8_t* out = (uint8_t*)td.data;
+	if((d == 4 && f == Format::RGBA) || (d == 3 && f == Format::RGB))
+	{
+		memcpy(out,data,size_t(w)*h*d);
+		return;
+	}
+
+	// bands of rows are converted concurrently, other layouts than RGBA are
+	// expanded row by row
+	const int rows = std::max(1,(1<<16)/std::max(1,w));
+	parallel_for(0,(h+rows-1)/rows,[&](int band)
+	{
+		const int y0 = band*rows;
+		const int y1 = std::min(h,y0+rows);
+		if(d == 4)
+		{
+			pack_rgba8(out+size_t(y0)*w*size,data+size_t(y0)*w*4,size_t(y1-y0)*w,f);
+			return;
+		}
+		std::vector<uint8_t> line(size_t(w)*4);
+		for(int y = y0; y < y1;y++)
+		{
+			expand_rgba8(line.data(),data+size_t(y)*w*d,w,d);
+			pack_rgba8(out+size_t(y)*w*size,line.data(),w,f);
+		}
+	});
 }
 
 FloatImage::FloatImage():data(nullptr),w(0),h(0){}
@@ -56,38 +211,49 @@ FloatImage::~FloatImage()
 		free(data);
 }
 
-void FloatImage::from_image(const Image &img)
+/**
+ * @brief image_row converts w pixels of d channels stored in src to RGBA
+ * floats in [0,1], decoding the color channels with lut.
+ */
+static void image_row(float* f, const unsigned char* src, int w, int d, const float* lut)
+{
+	const float s = 1.0f/255.0f;
+	for(int x = 0 ; x<w;x++,f+=4,src+=d)
+	{
+		if(d == 1)
+		{
+			f[0] = f[1] = f[2] = lut[src[0]];
+			f[3] = 1.0f;
+		}
+		else if(d == 2)
+		{
+			f[0] = f[1] = f[2] = lut[src[0]];
+			f[3] = s*src[1];
+		}
+		else
+		{
+			f[3] = 1.0f;
+			for(int c= 0 ; c< 3;c++)
+				f[c] = lut[src[c]];
+			if(d == 4)
+				f[3] = s*src[3];
+		}
+	}
+}
+
+void FloatImage::from_image(const Image &img, Transfer decode)
 {
 	w=img.w;
 	h=img.h;
 
-	data=(float*)realloc(data,w*h*4*sizeof(float));
-	float s = 1.0f/255.0f;
+	data=(float*)realloc(data,elems()*sizeof(float));
+	const float* lut = decode_table_8(decode);
 	for(int y = 0 ; y < h;y++)
-		for(int x = 0 ; x<w;x++)
-		{
-			float* f = at(x,y);
-			if(img.d == 1)
-			{
-				f[0] = f[1] = f[2] = s*img(x,y,0);
-				f[3] = 1.0f;
-			}
-			else if(img.d == 2)
-			{
-				f[0] = f[1] = f[2] = s*img(x,y,0);
-				f[3] = img(x,y,1);
-			}
-			else
-			{
-				f[3] = 1.0f;
-				for(int c= 0 ; c< img.d;c++)
-					f[c] =s*img(x,y,c);
-			}
-		}
+		image_row(at(0,y),img.data+size_t(y)*w*img.d,w,img.d,lut);
 }
 
 
-void FloatImage::to_image(Image &i)
+void FloatImage::to_image(Image &i, Transfer encode)
 {
 	const auto e = elems();
 	i.data=(unsigned char*)realloc(i.data,e);
@@ -95,253 +261,697 @@ void FloatImage::to_image(Image &i)
 	i.h=h;
 	i.d=4;
 
-	for(int j = 0 ; j<e;j++)
+	if(encode == Transfer::LINEAR)
 	{
-		i.data[j] = data[j]*255.0f + 0.5f;
+		pack_pixels(i.data,data,size_t(w)*h,Format::RGBA,DType::UNSIGNED_BYTE);
+		return;
 	}
+
+	for(size_t j = 0 ; j<e;j+=4)
+	{
+		for(int c = 0 ; c < 3;c++)
+			i.data[j+c] = encode_8(data[j+c],encode);
+		i.data[j+3] = data[j+3]*255.0f + 0.5f;
+	}
+}
+
+void FloatImage::from_texture_layer(const TextureLayer &tl)
+{
+	const TextureLayerView v = {tl.lvl,tl.w,tl.h,tl.frmt,tl.type,tl.data,
+								Codec::NONE,tl.data,tl.size(),0};
+	from_texture_layer(v);
 }
 
-void pack_ub(void *dst,const float *src, Format f)
+void FloatImage::from_texture_layer(const TextureLayerView &tl)
 {
-	unsigned char* c = (unsigned char*) dst;
-	if(f == Format::ALPHA)
+	w = tl.w;
+	h = tl.h;
+	data = (float*) realloc(data,elems()*sizeof(float));
+
+	if(is_pvrtc(tl.type))
 	{
-		c[0] = src[3] * 255.0f+0.5f;
+		// the layer is decoded at once, the rows are unpacked concurrently
+		const PixelKernels& k = pixel_kernels(tl.frmt,DType::UNSIGNED_BYTE);
+		std::vector<uint8_t> rgba(size_t(w)*h*4);
+		pvrtc_decode(rgba.data(),(const uint8_t*)tl.data,w,h,
+					 tl.type == DType::PVRTC_RGB_2BPP || tl.type == DType::PVRTC_RGBA_2BPP);
+		parallel_for(0,h,[&](int y)
+		{
+			std::vector<uint8_t> packed(size_t(w)*k.size);
+			pack_rgba8(packed.data(),rgba.data()+size_t(y)*w*4,w,tl.frmt);
+			k.unpack(at(0,y),packed.data(),w);
+		});
+		return;
 	}
-	else if(f == Format::LUMINANCE)
+	if(is_compressed(tl.type))
 	{
-		c[0] = (0.2126f*src[0] + 0.7152f*src[1] + 0.0722f*src[2])*255.0f + 0.5f;
+		// rows of blocks are decoded concurrently
+		const int bh = block_height(tl.type);
+		const uint64_t block_row = layer_size(w,bh,tl.frmt,tl.type);
+		const PixelKernels& k = pixel_kernels(tl.frmt,DType::UNSIGNED_BYTE);
+		const bool rg = tl.type == DType::EAC_RG11 || tl.type == DType::BC5_RG;
+		const bool red = rg || tl.type == DType::EAC_R11 || tl.type == DType::BC4_R;
+		parallel_for(0,(h+bh-1)/bh,[&](int by)
+		{
+			std::vector<uint8_t> rgba(size_t(w)*bh*4);
+			std::vector<uint8_t> packed(size_t(w)*k.size);
+			decode_block_row(rgba.data(),(const uint8_t*)tl.data+by*block_row,w,tl.type);
+			for(int y = by*bh; y < std::min(h,(by+1)*bh);y++)
+			{
+				uint8_t* p = rgba.data()+size_t(y-by*bh)*w*4;
+				// ALPHA layers are encoded as gray, luminance (and alpha) of
+				// EAC and RGTC layers as red (and green)
+				if(tl.frmt == Format::ALPHA)
+					for(int x = 0 ; x < w;x++)
+						p[x*4+3] = p[x*4];
+				if(red && (tl.frmt == Format::LUMINANCE || tl.frmt == Format::LUMINANCE_ALPHA))
+				{
+					for(int x = 0 ; x < w;x++)
+					{
+						p[x*4+3] = tl.frmt == Format::LUMINANCE_ALPHA && rg ? p[x*4+1] : 255;
+						p[x*4+1] = p[x*4+2] = p[x*4];
+					}
+				}
+				pack_rgba8(packed.data(),p,w,tl.frmt);
+				k.unpack(at(0,y),packed.data(),w);
+			}
+		});
+		return;
 	}
-	else if(f == Format::LUMINANCE_ALPHA)
+
+	// bands of rows are unpacked concurrently
+	const PixelKernels& k = pixel_kernels(tl.frmt,tl.type);
+	const int rows = std::max(1,(1<<16)/std::max(1,w));
+	parallel_for(0,(h+rows-1)/rows,[&](int band)
 	{
-		c[0] = (0.2126f*src[0] + 0.7152f*src[1] + 0.0722f*src[2])*255.0f + 0.5f;
-		c[1] = src[3]*255.0f+0.5f;
-	}
-	else if(f == Format::RGB)
+		const int y0 = band*rows;
+		const int y1 = std::min(h,y0+rows);
+		k.unpack(at(0,y0),(const uint8_t*)tl.data+size_t(y0)*w*k.size,size_t(y1-y0)*w);
+	});
+}
+
+
+/**
+ * @brief encode_blocks encodes a w x h image, whose rows are provided by
+ * load(y,dst) as RGBA floats, to the compressed type t. The pixels are
+ * quantized to f using unsigned bytes and expanded to RGBA again, so 1 and 2
+ * channel formats are encoded as gray (and alpha), except that EAC_RG11 and
+ * BC5_RG take the alpha as green. The rows of blocks are encoded concurrently,
+ * PVRTC layers at once by pvrtc_encode.
+ */
+static void encode_blocks(int w, int h, const std::function<void(int,float*)>& load,
+						  TextureLayer &td, Format f, DType t, BlockQuality q)
+{
+	td.w = w;
+	td.h = h;
+	td.frmt =f;
+	td.type = t;
+	td.data = realloc(td.data,layer_size(w,h,f,t));
+	const PixelKernels& k = pixel_kernels(f,DType::UNSIGNED_BYTE);
+	if(is_pvrtc(t))
 	{
-		for(int i = 0 ; i<3;i++)
+		// PVRTC interpolates between the blocks, so the layer is encoded at
+		// once after its rows were quantized concurrently
+		std::vector<uint8_t> rgba(size_t(w)*h*4);
+		parallel_for(0,h,[&](int y)
 		{
-			c[i] = src[i]*255.0f+0.5f;
-		}
+			std::vector<float> line(size_t(w)*4);
+			std::vector<uint8_t> packed(size_t(w)*k.size);
+			load(y,line.data());
+			k.pack(packed.data(),line.data(),w);
+			expand_rgba8(rgba.data()+size_t(y)*w*4,packed.data(),w,k.size);
+		});
+		pvrtc_encode((uint8_t*)td.data,rgba.data(),w,h,
+					 t == DType::PVRTC_RGB_2BPP || t == DType::PVRTC_RGBA_2BPP,q);
+		return;
 	}
-	else if(f == Format::RGBA)
+	const int bh = block_height(t);
+	const uint64_t block_row = layer_size(w,bh,f,t);
+	parallel_for(0,(h+bh-1)/bh,[&](int by)
 	{
-		for(int i = 0 ; i<4;i++)
+		std::vector<float> line(size_t(w)*4);
+		std::vector<uint8_t> packed(size_t(w)*k.size);
+		std::vector<uint8_t> rgba(size_t(w)*bh*4);
+		for(int y = 0 ; y < bh;y++)
 		{
-			c[i] = src[i]*255.0f+0.5f;
+			// the padding below the image repeats the last row
+			load(std::min(by*bh+y,h-1),line.data());
+			k.pack(packed.data(),line.data(),w);
+			uint8_t* p = rgba.data()+size_t(y)*w*4;
+			expand_rgba8(p,packed.data(),w,k.size);
+			// EAC_RG11 and BC5_RG store luminance and alpha as red and green
+			if((t == DType::EAC_RG11 || t == DType::BC5_RG) && f == Format::LUMINANCE_ALPHA)
+				for(int x = 0 ; x < w;x++)
+					p[x*4+1] = p[x*4+3];
 		}
-	}
+		encode_block_row((uint8_t*)td.data+by*block_row,rgba.data(),w,t,q);
+	});
 }
 
-
-void unpack_ub(float *dst,const void *src, Format f)
+void FloatImage::to_texture_layer(TextureLayer &td, Format f, DType t, BlockQuality q)
 {
-	unsigned char* c = (unsigned char*) src;
-	float s = 1.0f/255.0f;
-	if(f == Format::ALPHA)
+	if(is_compressed(t))
 	{
-		dst[0]=dst[1]=dst[2] = 0.0f;
-		dst[3] = s*c[0];
-	}
-	else if(f == Format::LUMINANCE)
-	{
-		dst[0]=dst[1]=dst[2] = s*c[0];
-		dst[3] = 1.0f;
-	}
-	else if(f == Format::LUMINANCE_ALPHA)
-	{
-		dst[0]=dst[1]=dst[2] = s*c[0];
-		dst[3] = s*c[1];
-	}
-	else if(f == Format::RGB)
-	{
-		for(int i = 0 ; i<3;i++)
+		const size_t row_bytes = size_t(w)*4*sizeof(float);
+		encode_blocks(w,h,[&](int y, float* dst)
 		{
-			dst[i] = s*c[i];
-		}
-		dst[3] = 1.0f;
+			memcpy(dst,at(0,y),row_bytes);
+		},td,f,t,q);
+		return;
 	}
-	else if(f == Format::RGBA)
+
+	td.w = w;
+	td.h = h;
+	td.frmt =f;
+	td.type = t;
+	const PixelKernels& k = pixel_kernels(f,t);
+	td.data = realloc(td.data,layer_size(w,h,f,t));
+
+	// bands of rows are packed concurrently
+	const int rows = std::max(1,(1<<16)/std::max(1,w));
+	parallel_for(0,(h+rows-1)/rows,[&](int band)
+	{
+		const int y0 = band*rows;
+		const int y1 = std::min(h,y0+rows);
+		k.pack((uint8_t*)td.data+size_t(y0)*w*k.size,at(0,y0),size_t(y1-y0)*w);
+	});
+}
+
+
+/*
+ * Row kernels of dither_floyd_steinberg and reduce_box for each instruction
+ * set. The vectorised kernels process the 4 channels of a pixel at once using
+ * the same operations as the scalar ones, so all produce the same results.
+ */
+
+/**
+ * @brief fs_row_fn diffuses the quantization errors of the pixels [x0,x1) of
+ * row (w pixels wide) to the following pixels of row and to next (nullptr for
+ * the last row). q[0-3] hold steps-1, q[4-7] the step sizes.
+ */
+typedef void (*fs_row_fn)(float* row, float* next, int w, int x0, int x1, const float* q);
+
+static void fs_row_scalar(float* row, float* next, int w, int x0, int x1, const float* q)
+{
+	for(int x = x0; x<x1;x++)
 	{
-		for(int i = 0 ; i<4;i++)
+		float* p = row+4*x;
+		for(int c= 0 ; c<4;c++)
 		{
-			dst[i] = s*c[i];
+			const auto& v = p[c];
+			uint32_t interval = (int)(v*q[c])+0.5f;
+			float qe = v-interval*q[4+c];
+			if(x<w-1)
+				p[4+c] += qe * 7.0f / 16.0f;
+			if(x<w-1 && next)
+				next[4*x+4+c] += qe * 1.0f / 16.0f;
+			if(x>0 && next)
+				next[4*x-4+c] += qe * 3.0f / 16.0f;
+			if(next)
+				next[4*x+c] += qe * 5.0f / 16.0f;
 		}
 	}
 }
 
+/**
+ * @brief ordered_row_fn adds t[x&mask]*s[c] to the channels c of the w pixels
+ * of row. t is the row of the threshold map, s holds the step sizes.
+ */
+typedef void (*ordered_row_fn)(float* row, int w, const float* t, int mask, const float* s);
 
-void unpack_us_5_6_5(float *dst, const void *src)
+static void ordered_row_scalar(float* row, int w, const float* t, int mask, const float* s)
 {
-	const uint16_t& c = *static_cast<const uint16_t*>(src);
-
-	dst[0] = 1.0f/31.0f*((c>>11)&((1<<5)-1));
-	dst[1] = 1.0f/63.0f*((c>>5 )&((1<<6)-1));
-	dst[2] = 1.0f/31.0f*((c>>0 )&((1<<5)-1));
-	dst[3] = 1.0f;
+	for(int x = 0; x<w;x++,row+=4)
+		for(int c = 0 ; c < 4;c++)
+			row[c] += t[x&mask]*s[c];
 }
 
+typedef void (*box_row_fn)(float* o, const float* r0, const float* r1, int w);
 
-void unpack_us_4_4_4_4(float *dst, const void *src)
+/**
+ * @brief box_row_scalar averages 2x2 texels of the rows r0 and r1 into the w
+ * texels of o.
+ */
+static void box_row_scalar(float* o, const float* r0, const float* r1, int w)
 {
-	const uint16_t& c = *static_cast<const uint16_t*>(src);
-
-	dst[0] = 1.0f/15.0f*((c>>12)&((1<<4)-1));
-	dst[1] = 1.0f/15.0f*((c>>8 )&((1<<4)-1));
-	dst[2] = 1.0f/15.0f*((c>>4 )&((1<<4)-1));
-	dst[3] = 1.0f/15.0f*((c>>0 )&((1<<4)-1));
+	for(int x = 0 ; x < w;x++,o+=4,r0+=8,r1+=8)
+		for(int c = 0 ; c < 4;c++)
+			o[c] = 0.25f*((r0[c]+r0[c+4])+(r1[c]+r1[c+4]));
 }
 
-
-void unpack_us_5_5_5_1(float *dst, const void *src)
+#if TD_SSE2
+static void fs_row_sse2(float* row, float* next, int w, int x0, int x1, const float* q)
 {
-	const uint16_t& c = *static_cast<const uint16_t*>(src);
-	dst[0] = 1.0f/31.0f*(float)((c>>11)&((1<<5)-1));
-	dst[1] = 1.0f/31.0f*(float)((c>>6 )&((1<<5)-1));
-	dst[2] = 1.0f/31.0f*(float)((c>>1 )&((1<<5)-1));
-	dst[3] = 1.0f/ 1.0f*(float)((c>>0 )&((1<<2)-1));
+	const __m128 m = _mm_loadu_ps(q);
+	const __m128 s = _mm_loadu_ps(q+4);
+	const __m128 d = _mm_set1_ps(1.0f/16.0f);
+	for(int x = x0; x<x1;x++)
+	{
+		float* p = row+4*x;
+		const __m128 v = _mm_loadu_ps(p);
+		// the scalar conversion to uint32_t maps the interval -1 to 0
+		const __m128 interval = _mm_max_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(v,m))),
+										   _mm_setzero_ps());
+		const __m128 qe = _mm_sub_ps(v,_mm_mul_ps(interval,s));
+		if(x<w-1)
+			_mm_storeu_ps(p+4,_mm_add_ps(_mm_loadu_ps(p+4),
+										 _mm_mul_ps(_mm_mul_ps(qe,_mm_set1_ps(7.0f)),d)));
+		if(!next)
+			continue;
+		float* n = next+4*x;
+		if(x<w-1)
+			_mm_storeu_ps(n+4,_mm_add_ps(_mm_loadu_ps(n+4),_mm_mul_ps(qe,d)));
+		if(x>0)
+			_mm_storeu_ps(n-4,_mm_add_ps(_mm_loadu_ps(n-4),
+										 _mm_mul_ps(_mm_mul_ps(qe,_mm_set1_ps(3.0f)),d)));
+		_mm_storeu_ps(n,_mm_add_ps(_mm_loadu_ps(n),
+								   _mm_mul_ps(_mm_mul_ps(qe,_mm_set1_ps(5.0f)),d)));
+	}
 }
 
+static void ordered_row_sse2(float* row, int w, const float* t, int mask, const float* s)
+{
+	const __m128 sv = _mm_loadu_ps(s);
+	for(int x = 0; x<w;x++,row+=4)
+		_mm_storeu_ps(row,_mm_add_ps(_mm_loadu_ps(row),_mm_mul_ps(_mm_set1_ps(t[x&mask]),sv)));
+}
 
-
-void FloatImage::from_texture_layer(const TextureLayer &tl)
+TD_TARGET("avx2")
+static void ordered_row_avx2(float* row, int w, const float* t, int mask, const float* s)
 {
-	w = tl.w;
-	h = tl.h;
-	data = (float*) realloc(data,w*h*4*sizeof(float));
+	const __m256 sv = _mm256_broadcast_ps((const __m128*)s);
+	int x = 0;
+	for(; x+2 <= w;x+=2,row+=8)
+	{
+		const __m256 tv = _mm256_insertf128_ps(_mm256_set1_ps(t[x&mask]),
+											   _mm_set1_ps(t[(x+1)&mask]),1);
+		_mm256_storeu_ps(row,_mm256_add_ps(_mm256_loadu_ps(row),_mm256_mul_ps(tv,sv)));
+	}
+	for(; x<w;x++,row+=4)
+		_mm_storeu_ps(row,_mm_add_ps(_mm_loadu_ps(row),
+									 _mm_mul_ps(_mm_set1_ps(t[x&mask]),_mm256_castps256_ps128(sv))));
+}
 
+static void box_row_sse2(float* o, const float* r0, const float* r1, int w)
+{
+	const __m128 q = _mm_set1_ps(0.25f);
+	for(int x = 0 ; x < w;x++,o+=4,r0+=8,r1+=8)
+	{
+		const __m128 a = _mm_add_ps(_mm_loadu_ps(r0),_mm_loadu_ps(r0+4));
+		const __m128 b = _mm_add_ps(_mm_loadu_ps(r1),_mm_loadu_ps(r1+4));
+		_mm_storeu_ps(o,_mm_mul_ps(q,_mm_add_ps(a,b)));
+	}
+}
 
-	uint32_t spp = size_per_pixel(tl.frmt,tl.type);
-	float* op = data;
-	const uint8_t* ip = (const uint8_t*)tl.data;
-	for(int p = 0 ; p <w*h;p++)
+// reduces 2 texels per iteration, the 128 bit lane permutes pair the texels
+TD_TARGET("avx2")
+static void box_row_avx2(float* o, const float* r0, const float* r1, int w)
+{
+	const __m256 q = _mm256_set1_ps(0.25f);
+	int x = 0;
+	for(; x+2 <= w;x+=2,o+=8,r0+=16,r1+=16)
 	{
-		if(tl.type == DType::UNSIGNED_SHORT_4_4_4_4)
-			unpack_us_4_4_4_4(op,ip);
-		else if (tl.type == DType::UNSIGNED_SHORT_5_5_5_1)
-			unpack_us_5_5_5_1(op,ip);
-		else if (tl.type == DType::UNSIGNED_SHORT_5_6_5)
-			unpack_us_5_6_5(op,ip);
-		else
-			unpack_ub(op,ip,tl.frmt);
-		op += 4;
-		ip += spp;
+		const __m256 a0 = _mm256_loadu_ps(r0);
+		const __m256 a1 = _mm256_loadu_ps(r0+8);
+		const __m256 b0 = _mm256_loadu_ps(r1);
+		const __m256 b1 = _mm256_loadu_ps(r1+8);
+		const __m256 a = _mm256_add_ps(_mm256_permute2f128_ps(a0,a1,0x20),
+									   _mm256_permute2f128_ps(a0,a1,0x31));
+		const __m256 b = _mm256_add_ps(_mm256_permute2f128_ps(b0,b1,0x20),
+									   _mm256_permute2f128_ps(b0,b1,0x31));
+		_mm256_storeu_ps(o,_mm256_mul_ps(q,_mm256_add_ps(a,b)));
+	}
+	box_row_sse2(o,r0,r1,w-x);
+}
+#endif
+
+// there is no AVX2 Floyd-Steinberg kernel, the pixels depend on each other
+static const KernelTable<fs_row_fn> fs_row_kernels = {{
+	fs_row_scalar,
+#if TD_SSE2
+	fs_row_sse2
+#endif
+}};
+
+static const KernelTable<ordered_row_fn> ordered_row_kernels = {{
+	ordered_row_scalar,
+#if TD_SSE2
+	ordered_row_sse2,nullptr,ordered_row_avx2
+#endif
+}};
+
+static const KernelTable<box_row_fn> box_row_kernels = {{
+	box_row_scalar,
+#if TD_SSE2
+	box_row_sse2,nullptr,box_row_avx2
+#endif
+}};
+
+static void fs_params(const int* steps, float* q)
+{
+	for(int i = 0 ; i<4;i++)
+	{
+		q[i] = steps[i]-1;
+		q[4+i] = 1.0f/(steps[i]-1);
 	}
 }
 
+static const int FS_CHUNK = 128;
 
-void pack_us_5_6_5(void *dst, const float *src)
+/**
+ * @brief fs_threads returns the number of threads dithering a w x h image.
+ */
+static unsigned fs_threads(int w, int h)
 {
-	uint16_t& d = *static_cast<uint16_t*>(dst);
-	d = 0;
+	if(w < 2*FS_CHUNK)
+		return 1;
+	return std::max(1u,std::min<unsigned>(thread_count(),h));
+}
 
-	uint16_t steps[3]={32,64,32};
-	uint16_t bits[3]={5,6,5};
+/**
+ * @brief fs_wavefront calls f(y,x0,x1) for the chunks of columns [x0,x1) of
+ * all rows y. The rows are processed concurrently by n_threads, but chunk
+ * [x0,x1) of row y is started after row y-1 finished pixel x1+1. So every pixel
+ * receives its Floyd-Steinberg error terms in the same order as in a serial
+ * loop and the results are bit-identical. Each row is processed by one thread
+ * from left to right, and the rows finish in order. parallel_for hands out the
+ * rows in order, so the row waited for is always being processed.
+ */
+static void fs_wavefront(int w, int h, unsigned n_threads,
+						 const std::function<void(int,int,int)>& f)
+{
+	std::unique_ptr<std::atomic<int>[]> done(new std::atomic<int>[h]);
+	for(int y = 0; y<h;y++)
+		done[y].store(0,std::memory_order_relaxed);
 
-	uint16_t shift = 16;
-	for(int c= 0 ; c<3;c++)
+	parallel_for(0,h,[&](int y)
 	{
-		shift-=bits[c];
-		auto& v = src[c];
-		uint16_t interval = (int)(v*(steps[c]-1))+0.5f;
-		interval = interval<<shift;
-		d |= interval;
-	}
+		for(int x0 = 0; x0<w;x0+=FS_CHUNK)
+		{
+			const int x1 = std::min(w,x0+FS_CHUNK);
+			if(y > 0)
+			{
+				const int need = std::min(w,x1+2);
+				while(done[y-1].load(std::memory_order_acquire) < need)
+					std::this_thread::yield();
+			}
+			f(y,x0,x1);
+			done[y].store(x1,std::memory_order_release);
+		}
+	},n_threads);
 }
 
-void pack_us_4_4_4_4(void *dst, const float *src)
+void FloatImage::dither_floyd_steinberg(int *steps)
 {
-	uint16_t& d = *static_cast<uint16_t*>(dst);
-	d = 0;
-
-	uint16_t steps[]={16,16,16,16};
-	uint16_t bits[]={4,4,4,4};
+	float q[8];
+	fs_params(steps,q);
+	const fs_row_fn row = fs_row_kernels.select();
+	const unsigned n_threads = fs_threads(w,h);
+	if(n_threads <= 1)
+	{
+		for(int y = 0; y<h;y++)
+			row(at(0,y),y<h-1 ? at(0,y+1) : nullptr,w,0,w,q);
+		return;
+	}
 
-	uint16_t shift = 16;
-	for(int c= 0 ; c<4;c++)
+	fs_wavefront(w,h,n_threads,[&](int y, int x0, int x1)
 	{
-		shift-=bits[c];
-		auto& v = src[c];
-		uint16_t interval = (int)(v*(steps[c]-1))+0.5f;
-		interval = interval<<shift;
-		d |= interval;
+		row(at(0,y),y<h-1 ? at(0,y+1) : nullptr,w,x0,x1,q);
+	});
+}
 
-	}
+/**
+ * @brief bayer_thresholds returns the 8x8 Bayer matrix as thresholds in (0,1).
+ */
+static const float* bayer_thresholds()
+{
+	struct table
+	{
+		float t[64];
+		table()
+		{
+			for(int y = 0 ; y < 8;y++)
+				for(int x = 0 ; x < 8;x++)
+				{
+					// interleave the bits of x^y and y, most significant first
+					int r = 0;
+					for(int b = 0 ; b < 3;b++)
+						r |= (((x^y)>>b)&1)<<(5-2*b) | ((y>>b)&1)<<(4-2*b);
+					t[y*8+x] = (r+0.5f)/64.0f;
+				}
+		}
+	};
+	static const table bayer;
+	return bayer.t;
 }
 
-void pack_us_5_5_5_1(void *dst, const float *src)
+/**
+ * @brief void_and_cluster ranks the texels of a tileable size x size map
+ * using the void-and-cluster method (Ulichney 1993): starting with a uniformly
+ * distributed set of points, points are ranked by removing them from the
+ * tightest clusters and by inserting new points into the largest voids.
+ * Clusters and voids are found using a toroidal gaussian energy, so the map
+ * tiles seamlessly.
+ */
+static std::vector<int> void_and_cluster(int size)
 {
-	uint16_t& d = *static_cast<uint16_t*>(dst);
-	d = 0;
+	const int n = size*size;
+	const float sigma = 1.5f;
+	std::vector<float> g(n);
+	for(int y = 0 ; y < size;y++)
+		for(int x = 0 ; x < size;x++)
+		{
+			const int dx = std::min(x,size-x);
+			const int dy = std::min(y,size-y);
+			g[y*size+x] = expf(-(dx*dx+dy*dy)/(2.0f*sigma*sigma));
+		}
 
-	uint16_t steps[]={32,32,32,2};
-	uint16_t bits[]={5,5,5,1};
+	std::vector<float> e(n,0.0f);
+	std::vector<uint8_t> on(n,0);
+	auto set = [&](int p, bool v)
+	{
+		on[p] = v;
+		const float sgn = v ? 1.0f : -1.0f;
+		const int px = p%size, py = p/size;
+		for(int y = 0 ; y < size;y++)
+		{
+			const float* gr = g.data()+((y-py+size)%size)*size;
+			float* er = e.data()+y*size;
+			for(int x = 0 ; x < size;x++)
+				er[x] += sgn*gr[(x-px+size)%size];
+		}
+	};
+	auto tightest_cluster = [&]()
+	{
+		int best = -1;
+		for(int p = 0 ; p < n;p++)
+			if(on[p] && (best < 0 || e[p] > e[best]))
+				best = p;
+		return best;
+	};
+	auto largest_void = [&]()
+	{
+		int best = -1;
+		for(int p = 0 ; p < n;p++)
+			if(!on[p] && (best < 0 || e[p] < e[best]))
+				best = p;
+		return best;
+	};
+
+	// initial pattern: 10% random points, spread until stable
+	uint32_t r = 0x2545F491;
+	int ones = 0;
+	while(ones < n/10)
+	{
+		r ^= r<<13; r ^= r>>17; r ^= r<<5;
+		const int p = r%n;
+		if(!on[p])
+		{
+			set(p,true);
+			ones++;
+		}
+	}
+	for(int i = 0 ; i < n;i++)
+	{
+		const int c = tightest_cluster();
+		set(c,false);
+		const int v = largest_void();
+		set(v,true);
+		if(v == c)
+			break;
+	}
 
-	uint16_t shift = 16;
-	for(int c= 0 ; c<4;c++)
+	std::vector<int> rank(n);
+	const std::vector<uint8_t> proto_on = on;
+	const std::vector<float> proto_e = e;
+	for(int i = ones-1; i >= 0;i--)
+	{
+		const int c = tightest_cluster();
+		set(c,false);
+		rank[c] = i;
+	}
+	on = proto_on;
+	e = proto_e;
+	for(int i = ones; i < n;i++)
 	{
-		shift-=bits[c];
-		auto& v = src[c];
-		uint16_t interval = (int)(v*(steps[c]-1))+0.5f;
-		interval = interval<<shift;
-		d |= interval;
+		const int v = largest_void();
+		set(v,true);
+		rank[v] = i;
 	}
+	return rank;
 }
 
-void FloatImage::to_texture_layer(TextureLayer &td, Format f, DType t)
+/**
+ * @brief blue_noise_thresholds returns the 64x64 blue noise map as thresholds
+ * in (0,1). It is generated once, on first use.
+ */
+static const float* blue_noise_thresholds()
 {
-		td.w = w;
-		td.h = h;
-		td.frmt =f;
-		td.type = t;
-		const uint32_t spp = size_per_pixel(td.frmt,td.type);
-		td.data = realloc(td.data,w*h*spp);
-
-		const float* ip = data;
-		uint8_t* op = (uint8_t*)td.data;
-		for(int p = 0 ; p <w*h;p++)
+	struct table
+	{
+		std::vector<float> t;
+		table()
 		{
-			if(td.type == DType::UNSIGNED_SHORT_4_4_4_4)
-				pack_us_4_4_4_4(op,ip);
-			else if (td.type == DType::UNSIGNED_SHORT_5_5_5_1)
-				pack_us_5_5_5_1(op,ip);
-			else if (td.type == DType::UNSIGNED_SHORT_5_6_5)
-				pack_us_5_6_5(op,ip);
-			else
-				pack_ub(op,ip,td.frmt);
-			op += spp;
-			ip += 4;
+			const std::vector<int> rank = void_and_cluster(64);
+			t.resize(rank.size());
+			for(size_t i = 0 ; i < rank.size();i++)
+				t[i] = (rank[i]+0.5f)/rank.size();
 		}
+	};
+	static const table blue_noise;
+	return blue_noise.t.data();
+}
+
+/**
+ * @brief ordered_params returns the size x size threshold map of d and the
+ * step sizes s of steps.
+ */
+static const float* ordered_params(Dither d, const int* steps, int& size, float* s)
+{
+	for(int i = 0 ; i<4;i++)
+		s[i] = steps[i] > 1 ? 1.0f/(steps[i]-1) : 0.0f;
+	if(d == Dither::BLUE_NOISE)
+	{
+		size = 64;
+		return blue_noise_thresholds();
 	}
+	size = 8;
+	return bayer_thresholds();
+}
 
+void FloatImage::dither_ordered(int *steps, Dither d)
+{
+	int size;
+	float s[4];
+	const float* t = ordered_params(d,steps,size,s);
 
-void FloatImage::dither_floyd_steinberg(int *steps)
+	const ordered_row_fn row = ordered_row_kernels.select();
+	const int rows = std::max(1,65536/std::max(1,w));
+	parallel_for(0,(h+rows-1)/rows,[&](int band)
+	{
+		const int y1 = std::min(h,(band+1)*rows);
+		for(int y = band*rows; y < y1;y++)
+			row(at(0,y),w,t+(y%size)*size,size-1,s);
+	});
+}
+
+void FloatImage::dither(int *steps, Dither d)
 {
-	float step_size[4];
-	for(int i = 0 ; i<4;i++)
+	if(d == Dither::FLOYD_STEINBERG)
+		dither_floyd_steinberg(steps);
+	else if(d == Dither::BAYER || d == Dither::BLUE_NOISE)
+		dither_ordered(steps,d);
+}
+
+/**
+ * @brief pack_dithered dithers (d), quantizes and packs a w x h image into td.
+ * Row y is fetched by load(y,dst) as w*4 floats into one of a few row buffers
+ * and packed as soon as it is final, so the image can be kept in any
+ * representation. Compressed types are encoded without dithering.
+ */
+static void pack_dithered(int w, int h, const std::function<void(int,float*)>& load,
+						  TextureLayer &td, Format f, DType t, Dither d, const int *steps,
+						  BlockQuality q)
+{
+	if(is_compressed(t))
 	{
-		step_size[i] = 1.0f/(steps[i]-1);
+		encode_blocks(w,h,load,td,f,t,q);
+		return;
 	}
 
-	for(int y = 0; y<h;y++)
-		for(int x = 0; x<w;x++)
+	td.w = w;
+	td.h = h;
+	td.frmt =f;
+	td.type = t;
+	const PixelKernels& k = pixel_kernels(f,t);
+	td.data = realloc(td.data,layer_size(w,h,f,t));
+	uint8_t* out = (uint8_t*)td.data;
+	const size_t row_floats = size_t(w)*4;
+
+	if(d == Dither::FLOYD_STEINBERG)
+	{
+		float q[8];
+		fs_params(steps,q);
+		const fs_row_fn row = fs_row_kernels.select();
+		const unsigned n_threads = fs_threads(w,h);
+
+		// rows being dithered: at most n_threads, plus the next row of the
+		// last one. Each row is copied into its buffer by the previous row.
+		const int slots = n_threads+1;
+		std::vector<float> buf(slots*row_floats);
+		auto line = [&](int y) {return buf.data()+(y%slots)*row_floats;};
+
+		fs_wavefront(w,h,n_threads,[&](int y, int x0, int x1)
 		{
-			for(int c= 0 ; c<4;c++)
+			if(x0 == 0)
 			{
-				const auto& v = at(x,y,c);
-				uint32_t interval = (int)(v*(steps[c]-1))+0.5f;
-				float qe = v-interval*step_size[c];
-				if(x<w-1)
-					at(x+1,y  ,c) += qe * 7.0f / 16.0f;
-				if(x<w-1 && y<h-1 )
-					at(x+1,y+1,c) += qe * 1.0f / 16.0f;
-				if(x>0 && y<h-1 )
-					at(x-1,y+1,c) += qe * 3.0f / 16.0f;
-				if(y<h-1 )
-					at(x  ,y+1,c) += qe * 5.0f / 16.0f;
+				if(y == 0)
+					load(0,line(0));
+				if(y < h-1)
+					load(y+1,line(y+1));
 			}
+			row(line(y),y<h-1 ? line(y+1) : nullptr,w,x0,x1,q);
+			// the pixels of the chunk receive no further errors
+			k.pack(out+(size_t(y)*w+x0)*k.size,line(y)+4*x0,x1-x0);
+		});
+		return;
+	}
+
+	const bool ordered = d == Dither::BAYER || d == Dither::BLUE_NOISE;
+	int size = 1;
+	float s[4];
+	const float* thr = ordered ? ordered_params(d,steps,size,s) : nullptr;
+	const ordered_row_fn row = ordered_row_kernels.select();
+	const int rows = std::max(1,65536/std::max(1,w));
+	parallel_for(0,(h+rows-1)/rows,[&](int band)
+	{
+		std::vector<float> line(row_floats);
+		const int y1 = std::min(h,(band+1)*rows);
+		for(int y = band*rows; y < y1;y++)
+		{
+			load(y,line.data());
+			if(ordered)
+				row(line.data(),w,thr+(y%size)*size,size-1,s);
+			k.pack(out+size_t(y)*w*k.size,line.data(),w);
 		}
+	});
+}
+
+void FloatImage::to_texture_layer(TextureLayer &td, Format f, DType t, Dither d, int *steps,
+								  BlockQuality q)
+{
+	if(is_compressed(t) ||
+	   (d != Dither::FLOYD_STEINBERG && d != Dither::BAYER && d != Dither::BLUE_NOISE))
+	{
+		to_texture_layer(td,f,t,q);
+		return;
+	}
 
+	const size_t row_bytes = size_t(w)*4*sizeof(float);
+	pack_dithered(w,h,[&](int y, float* dst)
+	{
+		memcpy(dst,at(0,y),row_bytes);
+	},td,f,t,d,steps,q);
 }
 
 void FloatImage::quantize(int *steps)
@@ -368,75 +978,650 @@ void FloatImage::quantize(int *steps)
 
 float *FloatImage::operator()(int x, int y)
 {
-	return data+ (y*w+x)*4;
+	return data+ (size_t(y)*w+x)*4;
 }
 
 float &FloatImage::operator()(int x, int y, int c)
 {
-	return data[(y*w+x)*4+c];
+	return data[(size_t(y)*w+x)*4+c];
 }
 
 float *FloatImage::at(int x, int y)
 {
-	return data+ (y*w+x)*4;
+	return data+ (size_t(y)*w+x)*4;
 }
 
 float &FloatImage::at(int x, int y, int c)
 {
-	return data[(y*w+x)*4+c];
+	return data[(size_t(y)*w+x)*4+c];
+}
+
+size_t FloatImage::elems() const {return size_t(w)*h*4;}
+
+CompactImage::CompactImage(Precision p):data(nullptr),w(0),h(0),precision(p){}
+
+CompactImage::~CompactImage()
+{
+	if(data)
+		free(data);
+}
+
+CompactImage::CompactImage(const CompactImage &o):data(nullptr),w(o.w),h(o.h),precision(o.precision)
+{
+	data = (uint16_t*)realloc(data,elems()*sizeof(uint16_t));
+	memcpy(data,o.data,elems()*sizeof(uint16_t));
+}
+
+void CompactImage::from_image(const Image &img, Transfer decode)
+{
+	w=img.w;
+	h=img.h;
+
+	data=(uint16_t*)realloc(data,elems()*sizeof(uint16_t));
+	const float* lut = decode_table_8(decode);
+	std::vector<float> row(size_t(w)*4);
+	for(int y = 0 ; y < h;y++)
+	{
+		image_row(row.data(),img.data+size_t(y)*w*img.d,w,img.d,lut);
+		store_row(y,row.data());
+	}
+}
+
+void CompactImage::load_row(int y, float *dst) const
+{
+	decode_pixels(dst,data+size_t(y)*w*4,w,precision);
+}
+
+void CompactImage::store_row(int y, const float *src)
+{
+	encode_pixels(data+size_t(y)*w*4,src,w,precision);
+}
+
+void CompactImage::to_texture_layer(TextureLayer &td, Format f, DType t, Dither d, int *steps,
+									BlockQuality q)
+{
+	pack_dithered(w,h,[&](int y, float* dst)
+	{
+		load_row(y,dst);
+	},td,f,t,d,steps,q);
+}
+
+size_t CompactImage::elems() const {return size_t(w)*h*4;}
+
+int mip_map_levels(int w, int h)
+{
+	int n = 1;
+	while (w > 1 || h > 1)
+	{
+		w = std::max(1,w/2);
+		h = std::max(1,h/2);
+		n++;
+	}
+	return n;
+}
+
+/**
+ * @brief The box_taps struct holds the (up to three) source texels and their
+ * weights contributing to one texel of the next mip-map-level along one axis.
+ */
+struct box_taps
+{
+	int i[3];
+	float w[3];
+	int n;
+};
+
+/**
+ * @brief make_box_taps computes the taps reducing src texels to max(1,src/2).
+ * Even sizes average pairs of texels, odd sizes use the 3 texel polyphase box
+ * filter, so every source texel contributes with the same total weight.
+ */
+static std::vector<box_taps> make_box_taps(int src)
+{
+	const int dst = std::max(1,src/2);
+	std::vector<box_taps> res(dst);
+	for(int x = 0 ; x < dst;x++)
+	{
+		box_taps& t = res[x];
+		if(src == 1)
+		{
+			t.n = 1;
+			t.i[0] = 0;
+			t.w[0] = 1.0f;
+		}
+		else if(src%2 == 0)
+		{
+			t.n = 2;
+			t.i[0] = 2*x;
+			t.i[1] = 2*x+1;
+			t.w[0] = t.w[1] = 0.5f;
+		}
+		else
+		{
+			t.n = 3;
+			t.i[0] = 2*x;
+			t.i[1] = 2*x+1;
+			t.i[2] = 2*x+2;
+			t.w[0] = (float)(dst-x)/src;
+			t.w[1] = (float)dst/src;
+			t.w[2] = (float)(x+1)/src;
+		}
+	}
+	return res;
+}
+
+/**
+ * @brief box_reduce_row computes row o (dw texels) of the next mip-map-level
+ * from the source rows rows[j] = row v.i[j]. If even, v.n == 2 and each texel
+ * averages a 2x2 block.
+ */
+static void box_reduce_row(float* o, const float* const* rows, const box_taps& v,
+						   const box_taps* ht, int dw, bool even, box_row_fn box_row)
+{
+	if(even)
+	{
+		box_row(o,rows[0],rows[1],dw);
+		return;
+	}
+
+	for(int x = 0 ; x < dw;x++,o+=4)
+	{
+		const box_taps& h = ht[x];
+		float sum[4] = {0.0f,0.0f,0.0f,0.0f};
+		for(int j = 0 ; j < v.n;j++)
+			for(int i = 0 ; i < h.n;i++)
+			{
+				const float wgt = v.w[j]*h.w[i];
+				const float* p = rows[j]+h.i[i]*4;
+				for(int c = 0 ; c < 4;c++)
+					sum[c] += wgt*p[c];
+			}
+		for(int c = 0 ; c < 4;c++)
+			o[c] = sum[c];
+	}
+}
+
+/**
+ * @brief reduce_box computes the next mip-map-level of src using a box filter.
+ */
+static void reduce_box(const FloatImage& src, FloatImage& dst)
+{
+	dst.w = std::max(1,src.w/2);
+	dst.h = std::max(1,src.h/2);
+	dst.data = (float*)realloc(dst.data,dst.elems()*sizeof(float));
+
+	const bool even = src.w%2 == 0 && src.h%2 == 0;
+	const auto ht = make_box_taps(src.w);
+	const auto vt = make_box_taps(src.h);
+	const box_row_fn box_row = box_row_kernels.select();
+
+	parallel_for(0,dst.h,[&](int y)
+	{
+		const box_taps& v = vt[y];
+		const float* rows[3];
+		for(int j = 0 ; j < v.n;j++)
+			rows[j] = src.data+size_t(v.i[j])*src.w*4;
+		box_reduce_row(dst.data+size_t(y)*dst.w*4,rows,v,ht.data(),dst.w,even,box_row);
+	});
+}
+
+/**
+ * @brief reduce_box reduces a CompactImage, the source rows of each output
+ * row are decoded into row buffers.
+ */
+static void reduce_box(const CompactImage& src, CompactImage& dst)
+{
+	dst.w = std::max(1,src.w/2);
+	dst.h = std::max(1,src.h/2);
+	dst.precision = src.precision;
+	dst.data = (uint16_t*)realloc(dst.data,dst.elems()*sizeof(uint16_t));
+
+	const bool even = src.w%2 == 0 && src.h%2 == 0;
+	const auto ht = make_box_taps(src.w);
+	const auto vt = make_box_taps(src.h);
+	const box_row_fn box_row = box_row_kernels.select();
+
+	const int rows = std::max(1,16384/std::max(1,dst.w));
+	parallel_for(0,(dst.h+rows-1)/rows,[&](int band)
+	{
+		std::vector<float> buf(size_t(src.w)*4*3+size_t(dst.w)*4);
+		float* o = buf.data()+size_t(src.w)*4*3;
+		const int y1 = std::min(dst.h,(band+1)*rows);
+		for(int y = band*rows; y < y1;y++)
+		{
+			const box_taps& v = vt[y];
+			const float* in[3];
+			for(int j = 0 ; j < v.n;j++)
+			{
+				float* r = buf.data()+size_t(j)*src.w*4;
+				src.load_row(v.i[j],r);
+				in[j] = r;
+			}
+			box_reduce_row(o,in,v,ht.data(),dst.w,even,box_row);
+			dst.store_row(y,o);
+		}
+	});
+}
+
+/**
+ * @brief reduce_reference computes the next mip-map-level of src using the
+ * triangle filter of stb_image_resize.
+ */
+static void reduce_reference(const FloatImage& src, FloatImage& dst)
+{
+	dst.w = std::max(1,src.w/2);
+	dst.h = std::max(1,src.h/2);
+	dst.data = (float*)realloc(dst.data,dst.elems()*sizeof(float));
+
+	stbir_resize(src.data,src.w,src.h,0,dst.data,dst.w,dst.h,0,
+				 STBIR_TYPE_FLOAT,4,3,
+				 STBIR_FLAG_ALPHA_USES_COLORSPACE,//flags
+				 STBIR_EDGE_CLAMP,//edgemoce hor
+				 STBIR_EDGE_CLAMP,//edfemode vert
+				 STBIR_FILTER_TRIANGLE ,//fileter hor
+				 STBIR_FILTER_TRIANGLE ,//filter vert
+				 STBIR_COLORSPACE_LINEAR,//colorspace
+				 nullptr//alloc context
+				 );
 }
 
-int FloatImage::elems() const {return w*h*4;}
+/**
+ * @brief reduce_reference reduces a CompactImage. UNORM16 data is filtered
+ * directly, HALF data is decoded to floats for stb_image_resize.
+ */
+static void reduce_reference(const CompactImage& src, CompactImage& dst)
+{
+	dst.w = std::max(1,src.w/2);
+	dst.h = std::max(1,src.h/2);
+	dst.precision = src.precision;
+	dst.data = (uint16_t*)realloc(dst.data,dst.elems()*sizeof(uint16_t));
+
+	if(src.precision == Precision::UNORM16)
+	{
+		stbir_resize(src.data,src.w,src.h,0,dst.data,dst.w,dst.h,0,
+					 STBIR_TYPE_UINT16,4,3,
+					 STBIR_FLAG_ALPHA_USES_COLORSPACE,
+					 STBIR_EDGE_CLAMP,STBIR_EDGE_CLAMP,
+					 STBIR_FILTER_TRIANGLE,STBIR_FILTER_TRIANGLE,
+					 STBIR_COLORSPACE_LINEAR,nullptr);
+		return;
+	}
 
-std::vector<FloatImage> generate_mip_maps(const FloatImage& img)
+	FloatImage fs, fd;
+	fs.w = src.w;
+	fs.h = src.h;
+	fs.data = (float*)malloc(fs.elems()*sizeof(float));
+	decode_pixels(fs.data,src.data,size_t(src.w)*src.h,src.precision);
+	reduce_reference(fs,fd);
+	encode_pixels(dst.data,fd.data,size_t(dst.w)*dst.h,dst.precision);
+}
+
+void resize(Image &img, int w, int h, const MipSettings& s)
 {
-	std::vector<FloatImage> res;
+	FloatImage src, dst;
+	src.from_image(img,s.transfer);
+	dst.w = w;
+	dst.h = h;
+	dst.data = (float*)malloc(dst.elems()*sizeof(float));
+	stbir_resize(src.data,src.w,src.h,0,dst.data,dst.w,dst.h,0,
+				 STBIR_TYPE_FLOAT,4,3,
+				 STBIR_FLAG_ALPHA_USES_COLORSPACE,
+				 STBIR_EDGE_CLAMP,STBIR_EDGE_CLAMP,
+				 STBIR_FILTER_DEFAULT,STBIR_FILTER_DEFAULT,
+				 STBIR_COLORSPACE_LINEAR,nullptr);
+	dst.to_image(img,s.transfer);
+}
 
+void generate_mip_maps(const FloatImage &img,
+					   const std::function<void(int, FloatImage&)>& process,
+					   const MipSettings& s)
+{
 	// generate a linear version of the image
-	float* lin_img = (float*)malloc(img.w*img.h*4*sizeof(float));
-	for(int i = 0; i< img.elems();i++)
+	FloatImage lin(img);
+	parallel_for(0,img.h,[&](int y)
 	{
-		lin_img[i] = powf((float)img.data[i],2.2f);
+		to_linear(lin.at(0,y),lin.w,s.transfer,s.color);
+	});
+
+	// Each level is reduced from the previous (linear) one, while the
+	// processing of the finished levels runs concurrently on the pool.
+	std::unique_ptr<ThreadPool> pool;
+	if(thread_count() > 1)
+		pool.reset(new ThreadPool());
+
+	auto emit = [&](int lvl, const std::shared_ptr<FloatImage>& level)
+	{
+		if(pool)
+			pool->enqueue([&process,lvl,level](){process(lvl,*level);});
+		else
+			process(lvl,*level);
+	};
+
+	emit(0,std::make_shared<FloatImage>(img));
+
+	FloatImage next;
+	for(int lvl = 1; lin.w > 1 || lin.h > 1; lvl++)
+	{
+		if(s.filter == MipFilter::FAST)
+			reduce_box(lin,next);
+		else
+			reduce_reference(lin,next);
+		std::swap(lin.data,next.data);
+		std::swap(lin.w,next.w);
+		std::swap(lin.h,next.h);
+
+		auto level = std::make_shared<FloatImage>();
+		level->w = lin.w;
+		level->h = lin.h;
+		level->data = (float*) malloc(lin.elems()*sizeof(float));
+		memcpy(level->data,lin.data,lin.elems()*sizeof(float));
+		parallel_for(0,level->h,[&](int y)
+		{
+			from_linear(level->at(0,y),level->w,s.transfer,s.color);
+		});
+		emit(lvl,level);
 	}
 
-	int curr_w = img.w*2;
-	int curr_h = img.h*2;
+	if(pool)
+		pool->wait();
+}
 
-	float* working_image=(float*)malloc((curr_w/2)*(curr_h/2)*4*sizeof(float));
+void generate_mip_maps(const CompactImage &img,
+					   const std::function<void(int, CompactImage&)>& process,
+					   const MipSettings& s)
+{
+	// converts the rows of i from/to linear space
+	auto convert = [&](CompactImage& i, bool linear)
+	{
+		parallel_for(0,i.h,[&](int y)
+		{
+			std::vector<float> row(size_t(i.w)*4);
+			i.load_row(y,row.data());
+			if(linear)
+				to_linear(row.data(),i.w,s.transfer,s.color);
+			else
+				from_linear(row.data(),i.w,s.transfer,s.color);
+			i.store_row(y,row.data());
+		});
+	};
+
+	CompactImage lin(img);
+	convert(lin,true);
+
+	std::unique_ptr<ThreadPool> pool;
+	if(thread_count() > 1)
+		pool.reset(new ThreadPool());
+
+	auto emit = [&](int lvl, const std::shared_ptr<CompactImage>& level)
+	{
+		if(pool)
+			pool->enqueue([&process,lvl,level](){process(lvl,*level);});
+		else
+			process(lvl,*level);
+	};
+
+	emit(0,std::make_shared<CompactImage>(img));
 
-	do
+	CompactImage next(img.precision);
+	for(int lvl = 1; lin.w > 1 || lin.h > 1; lvl++)
 	{
+		if(s.filter == MipFilter::FAST)
+			reduce_box(lin,next);
+		else
+			reduce_reference(lin,next);
+		std::swap(lin.data,next.data);
+		std::swap(lin.w,next.w);
+		std::swap(lin.h,next.h);
+
+		auto level = std::make_shared<CompactImage>(lin);
+		convert(*level,false);
+		emit(lvl,level);
+	}
 
-		curr_w = curr_w/2;
-		curr_h = curr_h/2;
+	if(pool)
+		pool->wait();
+}
 
-		stbir_resize(lin_img,img.w,img.h,0,working_image,curr_w,curr_h,0,
-					 STBIR_TYPE_FLOAT,4,3,
-					 STBIR_FLAG_ALPHA_USES_COLORSPACE,//flags
-					 STBIR_EDGE_CLAMP,//edgemoce hor
-					 STBIR_EDGE_CLAMP,//edfemode vert
-					 STBIR_FILTER_TRIANGLE ,//fileter hor
-					 STBIR_FILTER_TRIANGLE ,//filter vert
-					 STBIR_COLORSPACE_LINEAR,//colorspace
-					 nullptr//alloc context
-					 );
+/**
+ * @brief reduce_box8 reduces an RGBA8 image with a box filter, the colors are
+ * averaged in linear space using l.
+ */
+static void reduce_box8(const Image& src, Image& dst, const Linear8& l)
+{
+	dst.w = std::max(1,src.w/2);
+	dst.h = std::max(1,src.h/2);
+	dst.d = 4;
+	dst.data = (unsigned char*)realloc(dst.data,dst.elems());
 
+	const bool even = src.w%2 == 0 && src.h%2 == 0;
+	const auto ht = make_box_taps(src.w);
+	const auto vt = make_box_taps(src.h);
 
-		FloatImage mms;
-		res.push_back(mms);
-		res.back().w = curr_w;
-		res.back().h = curr_h;
-		res.back().data = (float*) malloc(curr_w*curr_h*sizeof(float)*4);
-		for(int i = 0; i< curr_w*curr_h*4;i++)
+	parallel_for(0,dst.h,[&](int y)
+	{
+		uint8_t* o = dst.data+size_t(y)*dst.w*4;
+		const box_taps& v = vt[y];
+		if(even)
 		{
-			res.back().data[i] =powf(working_image[i],1.0f/2.2f);
+			const uint8_t* r0 = src.data+size_t(2*y)*src.w*4;
+			const uint8_t* r1 = r0+src.w*4;
+			for(int x = 0 ; x < dst.w;x++,o+=4,r0+=8,r1+=8)
+			{
+				for(int c = 0 ; c < 3;c++)
+					o[c] = l.encode((l.dec[r0[c]]+l.dec[r0[c+4]]+l.dec[r1[c]]+l.dec[r1[c+4]]+2)>>2);
+				o[3] = (r0[3]+r0[7]+r1[3]+r1[7]+2)>>2;
+			}
+			return;
 		}
 
+		for(int x = 0 ; x < dst.w;x++,o+=4)
+		{
+			const box_taps& h = ht[x];
+			float sum[4] = {0.0f,0.0f,0.0f,0.0f};
+			for(int j = 0 ; j < v.n;j++)
+				for(int i = 0 ; i < h.n;i++)
+				{
+					const float wgt = v.w[j]*h.w[i];
+					const uint8_t* p = src.data+(size_t(v.i[j])*src.w+h.i[i])*4;
+					for(int c = 0 ; c < 3;c++)
+						sum[c] += wgt*l.dec[p[c]];
+					sum[3] += wgt*p[3];
+				}
+			for(int c = 0 ; c < 3;c++)
+				o[c] = l.encode(std::min<uint32_t>(sum[c]+0.5f,LINEAR8_ONE));
+			o[3] = std::min(sum[3]+0.5f,255.0f);
+		}
+	});
+}
+
+void generate_mip_maps(const Image &img,
+					   const std::function<void(int, const Image&)>& process,
+					   const MipSettings& s)
+{
+	const Linear8& l = linear8_table(s.transfer);
+	process(0,img);
+
+	Image lvl_img, next;
+	const Image* src = &img;
+	if(img.d != 4)
+	{
+		lvl_img.w = img.w;
+		lvl_img.h = img.h;
+		lvl_img.d = 4;
+		lvl_img.data = (unsigned char*)malloc(size_t(img.w)*img.h*4);
+		expand_rgba8(lvl_img.data,img.data,size_t(img.w)*img.h,img.d);
+		src = &lvl_img;
+	}
+
+	for(int lvl = 1; src->w > 1 || src->h > 1; lvl++)
+	{
+		reduce_box8(*src,next,l);
+		std::swap(lvl_img.data,next.data);
+		std::swap(lvl_img.w,next.w);
+		std::swap(lvl_img.h,next.h);
+		lvl_img.d = 4;
+		src = &lvl_img;
+		process(lvl,lvl_img);
 	}
-	while (curr_w != 1 || curr_h !=1);
+}
 
-	free(working_image);
+std::vector<FloatImage> generate_mip_maps(const FloatImage& img, const MipSettings& s)
+{
+	std::vector<FloatImage> res(mip_map_levels(img.w,img.h));
+	generate_mip_maps(img,[&](int lvl, FloatImage& level)
+	{
+		std::swap(res[lvl].data,level.data);
+		res[lvl].w = level.w;
+		res[lvl].h = level.h;
+	},s);
 	return res;
 }
 
+/**
+ * @brief stream_rows converts the image of in band by band. convert(y0,n,dst)
+ * fills dst with the n packed rows starting at y0, which are then written to
+ * out as the single layer of a .td file, compressed by codec.
+ */
+static bool stream_rows(ImageReader &in, std::ostream &out, Format f, DType t,
+						uint32_t alignment, Codec codec, int band,
+						const std::function<bool(int,int,uint8_t*)>& convert)
+{
+	const std::streampos start = out.tellp();
+	const FileHeader fh = {TD_MAGIC,TD_VERSION,1,alignment};
+	const PixelFields fields = pixel_fields(f,t);
+	LayerEntry e = {0,in.w,in.h,f,t,0,payload_offset(1,alignment),0,codec,
+					codec == Codec::LZ ? TD_CHUNK_SIZE :
+					codec == Codec::PREDICTIVE ? field_chunk_size(in.w,fields) : 0};
+	out.write(reinterpret_cast<const char*>(&fh),sizeof(fh));
+	out.write(reinterpret_cast<const char*>(&e),sizeof(e));
+	write_padding(out,sizeof(fh)+sizeof(e),alignment);
+
+	auto emit = [&](const void* p, size_t n)
+	{
+		e.checksum = crc32(p,n,e.checksum);
+		e.size += n;
+		return bool(out.write((const char*)p,n));
+	};
+
+	const size_t row_bytes = size_t(in.w)*size_per_pixel(f,t);
+	std::vector<uint8_t> dst(band*row_bytes);
+	// rows which do not fill a chunk yet
+	std::vector<uint8_t> pending;
+	std::vector<uint8_t> chunks;
+	std::vector<uint32_t> sizes;
+	for(int y0 = 0; y0 < in.h; y0+=band)
+	{
+		const int n = std::min(band,in.h-y0);
+		if(!convert(y0,n,dst.data()))
+			return false;
+		if(codec == Codec::NONE)
+		{
+			if(!emit(dst.data(),n*row_bytes))
+				return false;
+			continue;
+		}
+		pending.insert(pending.end(),dst.begin(),dst.begin()+n*row_bytes);
+		const size_t full = y0+n == in.h ? pending.size() :
+											pending.size()/e.chunk_size*e.chunk_size;
+		chunks.clear();
+		if(codec == Codec::LZ)
+			compress_chunks(pending.data(),full,e.chunk_size,sizes,chunks);
+		else
+			compress_field_chunks(pending.data(),in.w,int(full/row_bytes),fields,
+								  e.chunk_size,sizes,chunks);
+		pending.erase(pending.begin(),pending.begin()+full);
+		if(!emit(chunks.data(),chunks.size()))
+			return false;
+	}
+	if(codec != Codec::NONE && !emit(sizes.data(),sizes.size()*sizeof(uint32_t)))
+		return false;
+	write_padding(out,e.offset+e.size,alignment);
+
+	// the size and checksum are known now
+	const std::streampos end = out.tellp();
+	out.seekp(start+std::streamoff(sizeof(fh)));
+	out.write(reinterpret_cast<const char*>(&e),sizeof(e));
+	out.seekp(end);
+	return bool(out);
+}
+
+bool stream_texture_layer(ImageReader &in, std::ostream &out,
+						  Format f, DType t, Dither d, int *steps, uint32_t alignment,
+						  Codec codec)
+{
+	if(is_compressed(t))
+		return false;
+	const int w = in.w;
+	const int h = in.h;
+	const PixelKernels& k = pixel_kernels(f,t);
+	const int band = std::max(16u,4*thread_count());
+	const size_t row_floats = size_t(w)*4;
+	const size_t row_bytes = size_t(w)*k.size;
+	std::vector<unsigned char> src(size_t(band)*w*in.d);
+
+	// UNSIGNED_BYTE outputs without dithering are converted without floats
+	if(t == DType::UNSIGNED_BYTE && d != Dither::BAYER && d != Dither::BLUE_NOISE)
+	{
+		return stream_rows(in,out,f,t,alignment,codec,band,[&](int, int n, uint8_t* dst)
+		{
+			if(!in.read_rows(src.data(),n))
+				return false;
+			parallel_for(0,n,[&](int y)
+			{
+				std::vector<uint8_t> line(size_t(w)*4);
+				expand_rgba8(line.data(),src.data()+size_t(y)*w*in.d,w,in.d);
+				pack_rgba8(dst+y*row_bytes,line.data(),w,f);
+			});
+			return true;
+		});
+	}
+
+	// rows[0] holds the first row of a band, which already received the
+	// errors of the previous band, rows[n] the first row of the next band.
+	const float* lut = decode_table_8(Transfer::LINEAR);
+	std::vector<float> rows((band+1)*row_floats);
+	auto row = [&](int i){return rows.data()+i*row_floats;};
+	if(!in.read_rows(src.data(),1))
+		return false;
+	image_row(row(0),src.data(),w,in.d,lut);
+
+	float q[8];
+	fs_params(steps,q);
+	const fs_row_fn fs_row = fs_row_kernels.select();
+	int size = 1;
+	float s[4];
+	const bool ordered = d == Dither::BAYER || d == Dither::BLUE_NOISE;
+	const float* thr = ordered ? ordered_params(d,steps,size,s) : nullptr;
+	const ordered_row_fn ordered_row = ordered_row_kernels.select();
+
+	return stream_rows(in,out,f,t,alignment,codec,band,[&](int y0, int n, uint8_t* dst)
+	{
+		const int next = std::min(n,h-1-y0);
+		if(!in.read_rows(src.data(),next))
+			return false;
+		parallel_for(0,next,[&](int y)
+		{
+			image_row(row(y+1),src.data()+size_t(y)*w*in.d,w,in.d,lut);
+		});
+
+		if(d == Dither::FLOYD_STEINBERG)
+		{
+			fs_wavefront(w,n,fs_threads(w,n),[&](int y, int x0, int x1)
+			{
+				fs_row(row(y),y0+y < h-1 ? row(y+1) : nullptr,w,x0,x1,q);
+			});
+		}
+
+		parallel_for(0,n,[&](int y)
+		{
+			if(ordered)
+				ordered_row(row(y),w,thr+((y0+y)%size)*size,size-1,s);
+			k.pack(dst+y*row_bytes,row(y),w);
+		});
+		if(next == n)
+			memcpy(row(0),row(n),row_floats*sizeof(float));
+		return true;
+	});
+}
+
 }
@@ -1,8 +1,14 @@
 #pragma once
+#include <functional>
+#include <fstream>
 #include <string>
 #include <vector>
 #include <cstring>
 #include "td.h"
+#include "td_block.h"
+#include "td_color.h"
+#include "td_precision.h"
+#include "td_view.h"
 namespace td {
 
 /**
@@ -34,23 +40,23 @@ public:
 
 	Image(const Image& o):data(nullptr),w(o.w),h(o.h),d(o.d)
 	{
-		data = (unsigned char*)realloc(data,w*h*d);
-		memcpy(data,o.data,w*h*d);
+		data = (unsigned char*)realloc(data,elems());
+		memcpy(data,o.data,elems());
 	}
 
 	unsigned char* operator()(int x, int y)
 	{
-		return data+ (y*w+x)*d;
+		return data+ (size_t(y)*w+x)*d;
 	}
 
 	unsigned char& operator()(int x, int y,int c)
 	{
-		return data[(y*w+x)*d+c];
+		return data[(size_t(y)*w+x)*d+c];
 	}
 
 	unsigned char operator()(int x, int y,int c) const
 	{
-		return data[(y*w+x)*d+c];
+		return data[(size_t(y)*w+x)*d+c];
 	}
 
 	void write(const std::string& path);
@@ -59,8 +65,83 @@ public:
 	void write_tga(const std::string& path);
 
 	Image(const std::string& path);
-	int elems() const {return w*h*d;}
+	size_t elems() const {return size_t(w)*h*d;}
 
+	/**
+	 * @brief to_texture_layer converts the Image to a TextureLayer of format f
+	 * using UNSIGNED_BYTE, without converting it to floats, see pack_rgba8.
+	 * Matching layouts (RGBA to RGBA, RGB to RGB) are copied.
+	 * @param td - target Texture layser
+	 * @param f  - target Format
+	 */
+	void to_texture_layer(TextureLayer& td, Format f) const;
+
+};
+
+/**
+ * @brief The ImageReader class reads an image row by row from top to bottom.
+ * Binary PNM files (P5, P6 and P7 using 8 bit channels) are streamed from the
+ * file, so only the rows being read are in memory. Other formats are loaded
+ * as a whole using stb_image.
+ */
+class ImageReader
+{
+	std::ifstream file;
+	Image image;
+	int y;
+
+public:
+
+	int w;
+	int h;
+	int d;
+
+	ImageReader():y(0),w(0),h(0),d(0){}
+
+	/**
+	 * @brief open opens the image at path.
+	 * @param path
+	 * @return false if the image could not be read.
+	 */
+	bool open(const std::string& path);
+
+	/**
+	 * @brief open_pnm opens the binary PNM file at path for streaming.
+	 * @param path
+	 * @return false if it is no PNM file with 8 bit channels.
+	 */
+	bool open_pnm(const std::string& path);
+
+	/**
+	 * @brief read_rows reads the next n rows.
+	 * @param dst - n*w*d bytes.
+	 * @param n
+	 * @return false on read errors or if there are less than n rows left.
+	 */
+	bool read_rows(unsigned char* dst, int n);
+
+	/**
+	 * @brief streaming returns true if the rows are read from the file.
+	 */
+	bool streaming() const {return file.is_open();}
+};
+
+/**
+ * @brief The Dither enum selects how quantization errors are hidden.
+ * NONE            - no dithering.
+ * FLOYD_STEINBERG - error diffusion, best quality.
+ * BAYER           - ordered dithering using an 8x8 Bayer matrix.
+ * BLUE_NOISE      - ordered dithering using a tileable 64x64 blue noise
+ *                   threshold map.
+ * The ordered modes quantize every pixel independently, which is faster and
+ * scales to any number of threads.
+ */
+enum class Dither
+{
+	NONE,
+	FLOYD_STEINBERG,
+	BAYER,
+	BLUE_NOISE,
 };
 
 /**
@@ -85,49 +166,93 @@ public:
 
 	FloatImage(const FloatImage& o):data(nullptr),w(o.w),h(o.h)
 	{
-		data = (float*)realloc(data,w*h*4*sizeof(float));
-		memcpy(data,o.data,w*h*4*sizeof(float));
+		data = (float*)realloc(data,elems()*sizeof(float));
+		memcpy(data,o.data,elems()*sizeof(float));
 	}
 
 	/**
 	 * @brief from_image reads data from an Image normalizing the color data
 	 * from [0,255] to [0,1].
 	 * @param img
+	 * @param decode - the transfer function of img. Unless it is LINEAR, the
+	 * color channels are converted to linear space (using a 256-entry LUT).
 	 */
-	void from_image(const Image& img);
+	void from_image(const Image& img, Transfer decode = Transfer::LINEAR);
 
 	/**
 	 * @brief from_texture_layer reads data from a TextureLayer normalizing
-	 * the color data to [0,1].
+	 * the color data to [0,1]. Compressed layers are decoded.
 	 * @param img
 	 */
 	void from_texture_layer(const TextureLayer& tl);
+	void from_texture_layer(const TextureLayerView& tl);
 
 	/**
 	 * @brief to_image converts the Image to a normal Image converting the data.
 	 * from [0,1] to [0,255]
 	 * @param i
+	 * @param encode - unless it is LINEAR, the color channels are converted
+	 * from linear space to this transfer function (using a 4096-entry LUT).
 	 */
-	void to_image(Image& i);
+	void to_image(Image& i, Transfer encode = Transfer::LINEAR);
 
 	/**
 	 * @brief to_texture_layer converts the Image to a TextureLayer - quantizing
 	 * and packing the data according to the given type and format.
+	 * Compressed types are encoded block by block (see encode_block_row), the
+	 * pixels of 1 and 2 channel formats are encoded as gray (and alpha).
 	 * @param td - target Texture layser
 	 * @param f  - target Format
 	 * @param t  - target Type
+	 * @param q  - the quality of compressed types.
 	 */
-	void to_texture_layer(TextureLayer& td, Format f, DType t);
+	void to_texture_layer(TextureLayer& td, Format f, DType t,
+						  BlockQuality q = BlockQuality::NORMAL);
+
+	/**
+	 * @brief to_texture_layer dithers, quantizes and packs the image in a
+	 * single pass. The dithered rows are kept in small row buffers and packed
+	 * as soon as they are final, the image itself is not modified. The result
+	 * is the same as dither(steps,d) followed by to_texture_layer(td,f,t).
+	 * Compressed types are not dithered.
+	 * @param td - target Texture layser
+	 * @param f  - target Format
+	 * @param t  - target Type
+	 * @param d  - the dithering
+	 * @param steps - an array of 4 integers refering to the steps per channel.
+	 * @param q  - the quality of compressed types.
+	 */
+	void to_texture_layer(TextureLayer& td, Format f, DType t, Dither d, int* steps,
+						  BlockQuality q = BlockQuality::NORMAL);
 
 	/**
 	 * @brief dither_floyd_steinberg applies the Floyd-Steinberg-Dithering for
 	 * a hyperthetical quantization of setps[0-3] steps.
 	 * Note: There is no quantization, only a dithering for the given
 	 * quantiuation is applied.
+	 * Rows are processed as a wavefront on thread_count() threads, the result
+	 * does not depend on the number of threads.
 	 * @param steps - an array of 4 integers refering to the steps per channel.
 	 */
 	void dither_floyd_steinberg(int* steps);
 
+	/**
+	 * @brief dither_ordered applies an ordered dithering (BAYER or BLUE_NOISE)
+	 * for a hyperthetical quantization of steps[0-3] steps. Like
+	 * dither_floyd_steinberg it only adds the dither, each value is offset
+	 * by a threshold in [0,1) of one step.
+	 * @param steps - an array of 4 integers refering to the steps per channel.
+	 * @param d
+	 */
+	void dither_ordered(int* steps, Dither d);
+
+	/**
+	 * @brief dither applies the dithering d, see Dither.
+	 * @param steps - an array of 4 integers refering to the steps per channel.
+	 * @param d
+	 */
+	void dither(int* steps, Dither d);
+
 	/**
 	 * @brief quantize Applies a quantization in [0,1] for steps[0-3] steps.
 	 * @param steps - an array of 4 integers refering to the steps per channel.
@@ -159,14 +284,194 @@ public:
 	 * stored in thins image.
 	 * @return w*h*4
 	 */
-	int elems() const;
+	size_t elems() const;
 };
 
+/**
+ * @brief The CompactImage class is a FloatImage storing each channel in 16
+ * bits (HALF or UNORM16, see Precision), which halves the memory needed for
+ * the working copies of large images. Rows are decoded to floats on demand
+ * into small row buffers, so dithering, mip-map reduction and packing run the
+ * same kernels as for a FloatImage.
+ */
+class CompactImage
+{
+
+public:
+
+	uint16_t* data;
+	int w;
+	int h;
+	Precision precision;
+
+	CompactImage(Precision p = Precision::HALF);
+	/**
+	 * @brief Note: ~CompactImage() will free data if data!=nullptr !
+	 */
+	~CompactImage();
+
+	CompactImage(const CompactImage& o);
+
+	/**
+	 * @brief from_image reads data from an Image, see FloatImage::from_image.
+	 * @param img
+	 * @param decode
+	 */
+	void from_image(const Image& img, Transfer decode = Transfer::LINEAR);
+
+	/**
+	 * @brief load_row decodes row y into dst (w*4 floats).
+	 */
+	void load_row(int y, float* dst) const;
+
+	/**
+	 * @brief store_row encodes w*4 floats of src into row y.
+	 */
+	void store_row(int y, const float* src);
+
+	/**
+	 * @brief to_texture_layer dithers, quantizes and packs the image in a
+	 * single pass, see FloatImage::to_texture_layer.
+	 * @param td - target Texture layser
+	 * @param f  - target Format
+	 * @param t  - target Type
+	 * @param d  - the dithering
+	 * @param steps - an array of 4 integers refering to the steps per channel.
+	 * @param q  - the quality of compressed types.
+	 */
+	void to_texture_layer(TextureLayer& td, Format f, DType t, Dither d, int* steps,
+						  BlockQuality q = BlockQuality::NORMAL);
+
+	/**
+	 * @brief elems returns the number of elements (width*height*channels)
+	 * stored in thins image.
+	 * @return w*h*4
+	 */
+	size_t elems() const;
+};
+
+/**
+ * @brief The MipFilter enum selects how generate_mip_maps reduces a mip-map-
+ * level into the next one.
+ * REFERENCE - the triangle filter of stb_image_resize.
+ * FAST      - a box filter (2x2, or 3 texels along odd sized axes).
+ */
+enum class MipFilter
+{
+	REFERENCE,
+	FAST,
+};
+
+/**
+ * @brief The MipSettings struct collects the options of generate_mip_maps.
+ * filter    - the filter reducing one level into the next.
+ * transfer  - the transfer function of the image. Levels are reduced in
+ *             linear space.
+ * color     - how values are converted from/to linear space.
+ */
+struct MipSettings
+{
+	MipSettings()
+		:filter(MipFilter::REFERENCE),
+		  transfer(Transfer::GAMMA_22),
+		  color(ColorMethod::SIMD)
+	{}
+	MipFilter filter;
+	Transfer transfer;
+	ColorMethod color;
+};
+
+/**
+ * @brief mip_map_levels returns the number of mip-map-levels (including lvl 0)
+ * of an image of size w x h. Each level has half the size (rounded down, but at
+ * least 1) of the previous one, the last level is 1 x 1.
+ * @param w
+ * @param h
+ * @return
+ */
+int mip_map_levels(int w, int h);
+
 /**
  * @brief generate_mip_maps generate all mip-map-levels for img (including lvl 0!)
- * using stb_image_resize.
+ * Each level is computed in linear space from the previous level.
  * @param img
+ * @param s
  * @return
  */
-std::vector<FloatImage> generate_mip_maps(const FloatImage &img);
+std::vector<FloatImage> generate_mip_maps(const FloatImage &img,
+										  const MipSettings& s = MipSettings());
+
+/**
+ * @brief generate_mip_maps generates all mip-map-levels for img (including
+ * lvl 0!) and hands each of them to process(lvl, level). While the next level
+ * is reduced, the finished ones are processed concurrently, so process is
+ * called from different threads and has to be thread safe.
+ * @param img
+ * @param process
+ * @param s
+ */
+void generate_mip_maps(const FloatImage &img,
+					   const std::function<void(int, FloatImage&)>& process,
+					   const MipSettings& s = MipSettings());
+
+/**
+ * @brief generate_mip_maps generates all mip-map-levels of a CompactImage, see
+ * above. The levels are reduced in linear space using the precision of img.
+ * @param img
+ * @param process
+ * @param s
+ */
+void generate_mip_maps(const CompactImage &img,
+					   const std::function<void(int, CompactImage&)>& process,
+					   const MipSettings& s = MipSettings());
+
+/**
+ * @brief generate_mip_maps generates all mip-map-levels of an 8 bit image
+ * (lvl 0 is img itself) without converting them to floats. Each level is
+ * reduced from the previous one with a box filter (see MipFilter::FAST) in 24
+ * bit fixed point linear space, the levels are RGBA. s.filter and s.color are
+ * ignored. process(lvl, level) is called in order from the calling thread.
+ * @param img
+ * @param process
+ * @param s
+ */
+void generate_mip_maps(const Image &img,
+					   const std::function<void(int, const Image&)>& process,
+					   const MipSettings& s = MipSettings());
+
+/**
+ * @brief resize scales img to w x h in linear space (see s.transfer) with the
+ * default filters of stb_image_resize (Catmull-Rom when enlarging, Mitchell
+ * when reducing), e.g. to the power of two sizes PVRTC needs. The result is
+ * RGBA.
+ * @param img
+ * @param w
+ * @param h
+ * @param s
+ */
+void resize(Image &img, int w, int h, const MipSettings& s = MipSettings());
+
+/**
+ * @brief stream_texture_layer converts the image read by in to a TextureLayer
+ * of format f and type t and writes it to out as a .td file. The
+ * image is read, dithered, packed and written in bands of rows, so the memory
+ * needed is proportional to the width of the image. The result is the same as
+ * converting the whole image with FloatImage::to_texture_layer, or with
+ * Image::to_texture_layer for UNSIGNED_BYTE outputs which need no dithering.
+ * @param in
+ * @param out
+ * @param f  - target Format
+ * @param t  - target Type
+ * @param d  - the dithering
+ * @param steps - an array of 4 integers refering to the steps per channel.
+ * @param alignment - of the payload, see TextureData::write. out has to be
+ * seekable, the checksum is written at the end.
+ * @param codec - compresses the rows chunk by chunk. Unlike TextureData::write
+ * the layer is not stored raw if it does not get smaller.
+ * @return false on read or write errors, or if t is compressed (which is not
+ * supported).
+ */
+bool stream_texture_layer(ImageReader& in, std::ostream& out,
+						  Format f, DType t, Dither d, int* steps,
+						  uint32_t alignment = 16, Codec codec = Codec::NONE);
 }
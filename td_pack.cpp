@@ -0,0 +1,1235 @@
+#include "td_pack.h"
+#include "td_cpu.h"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#if TD_SSE2
+#include <immintrin.h>
+#endif
+
+namespace td
+{
+
+void pack_us_5_6_5(void *dst, const float *src)
+{
+	uint16_t& d = *static_cast<uint16_t*>(dst);
+	d = 0;
+
+	uint16_t steps[3]={32,64,32};
+	uint16_t bits[3]={5,6,5};
+
+	uint16_t shift = 16;
+	for(int c= 0 ; c<3;c++)
+	{
+		shift-=bits[c];
+		auto& v = src[c];
+		uint16_t interval = (int)(v*(steps[c]-1))+0.5f;
+		interval = interval<<shift;
+		d |= interval;
+	}
+}
+
+void pack_us_4_4_4_4(void *dst, const float *src)
+{
+	uint16_t& d = *static_cast<uint16_t*>(dst);
+	d = 0;
+
+	uint16_t steps[]={16,16,16,16};
+	uint16_t bits[]={4,4,4,4};
+
+	uint16_t shift = 16;
+	for(int c= 0 ; c<4;c++)
+	{
+		shift-=bits[c];
+		auto& v = src[c];
+		uint16_t interval = (int)(v*(steps[c]-1))+0.5f;
+		interval = interval<<shift;
+		d |= interval;
+
+	}
+}
+
+void pack_us_5_5_5_1(void *dst, const float *src)
+{
+	uint16_t& d = *static_cast<uint16_t*>(dst);
+	d = 0;
+
+	uint16_t steps[]={32,32,32,2};
+	uint16_t bits[]={5,5,5,1};
+
+	uint16_t shift = 16;
+	for(int c= 0 ; c<4;c++)
+	{
+		shift-=bits[c];
+		auto& v = src[c];
+		uint16_t interval = (int)(v*(steps[c]-1))+0.5f;
+		interval = interval<<shift;
+		d |= interval;
+	}
+}
+
+void unpack_us_5_6_5(float *dst, const void *src)
+{
+	const uint16_t& c = *static_cast<const uint16_t*>(src);
+
+	dst[0] = 1.0f/31.0f*((c>>11)&((1<<5)-1));
+	dst[1] = 1.0f/63.0f*((c>>5 )&((1<<6)-1));
+	dst[2] = 1.0f/31.0f*((c>>0 )&((1<<5)-1));
+	dst[3] = 1.0f;
+}
+
+
+void unpack_us_4_4_4_4(float *dst, const void *src)
+{
+	const uint16_t& c = *static_cast<const uint16_t*>(src);
+
+	dst[0] = 1.0f/15.0f*((c>>12)&((1<<4)-1));
+	dst[1] = 1.0f/15.0f*((c>>8 )&((1<<4)-1));
+	dst[2] = 1.0f/15.0f*((c>>4 )&((1<<4)-1));
+	dst[3] = 1.0f/15.0f*((c>>0 )&((1<<4)-1));
+}
+
+
+void unpack_us_5_5_5_1(float *dst, const void *src)
+{
+	const uint16_t& c = *static_cast<const uint16_t*>(src);
+	dst[0] = 1.0f/31.0f*(float)((c>>11)&((1<<5)-1));
+	dst[1] = 1.0f/31.0f*(float)((c>>6 )&((1<<5)-1));
+	dst[2] = 1.0f/31.0f*(float)((c>>1 )&((1<<5)-1));
+	dst[3] = 1.0f/ 1.0f*(float)((c>>0 )&((1<<1)-1));
+}
+
+/*
+ * The vectorised kernels below return the number of pixels they packed, the
+ * rest is left to pack_scalar. The packed shorts quantize with floor(v*max)
+ * like the scalar functions, the bytes with trunc(v*255+0.5). Values are
+ * clamped/saturated to the target range.
+ */
+
+#if TD_SSE2
+
+static inline void load_soa(const float* s, __m128& r, __m128& g, __m128& b, __m128& a)
+{
+	r = _mm_loadu_ps(s);
+	g = _mm_loadu_ps(s+4);
+	b = _mm_loadu_ps(s+8);
+	a = _mm_loadu_ps(s+12);
+	_MM_TRANSPOSE4_PS(r,g,b,a);
+}
+
+static inline __m128i quantize_ps(__m128 v, float max)
+{
+	const __m128 m = _mm_set1_ps(max);
+	return _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(v,m),_mm_setzero_ps()),m));
+}
+
+static inline __m128i to_ub_ps(__m128 v)
+{
+	return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v,_mm_set1_ps(255.0f)),_mm_set1_ps(0.5f)));
+}
+
+static inline __m128i to_ub_clamped_ps(__m128 v)
+{
+	const __m128 x = _mm_add_ps(_mm_mul_ps(v,_mm_set1_ps(255.0f)),_mm_set1_ps(0.5f));
+	return _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(x,_mm_setzero_ps()),_mm_set1_ps(255.0f)));
+}
+
+static inline __m128 luminance_ps(__m128 r, __m128 g, __m128 b)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.2126f),r),
+								 _mm_mul_ps(_mm_set1_ps(0.7152f),g)),
+					  _mm_mul_ps(_mm_set1_ps(0.0722f),b));
+}
+
+// packs the lower 16 bits of the 32 bit lanes without saturation
+static inline __m128i pack_lo16(__m128i lo, __m128i hi)
+{
+	lo = _mm_srai_epi32(_mm_slli_epi32(lo,16),16);
+	hi = _mm_srai_epi32(_mm_slli_epi32(hi,16),16);
+	return _mm_packs_epi32(lo,hi);
+}
+
+static inline __m128i pack_ub_epi32(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+	return _mm_packus_epi16(_mm_packs_epi32(a,b),_mm_packs_epi32(c,d));
+}
+
+template<int R, int G, int B, int A>
+static inline __m128i pack_us4_sse2(const float* s)
+{
+	__m128 r,g,b,a;
+	load_soa(s,r,g,b,a);
+	const int sr = 16-R, sg = sr-G, sb = sg-B, sa = sb-A;
+	__m128i v = _mm_slli_epi32(quantize_ps(r,(1<<R)-1),sr);
+	v = _mm_or_si128(v,_mm_slli_epi32(quantize_ps(g,(1<<G)-1),sg));
+	v = _mm_or_si128(v,_mm_slli_epi32(quantize_ps(b,(1<<B)-1),sb));
+	if(A)
+		v = _mm_or_si128(v,_mm_slli_epi32(quantize_ps(a,(1<<A)-1),sa));
+	return v;
+}
+
+template<int R, int G, int B, int A>
+static size_t pack_us_sse2(uint8_t* dst, const float* src, size_t n)
+{
+	size_t i = 0;
+	for(; i+8 <= n; i+=8)
+	{
+		const __m128i lo = pack_us4_sse2<R,G,B,A>(src+4*i);
+		const __m128i hi = pack_us4_sse2<R,G,B,A>(src+4*i+16);
+		_mm_storeu_si128((__m128i*)(dst+2*i),pack_lo16(lo,hi));
+	}
+	return i;
+}
+
+static inline __m128i pack_rgba4_sse2(const float* s)
+{
+	return pack_ub_epi32(to_ub_ps(_mm_loadu_ps(s)),to_ub_ps(_mm_loadu_ps(s+4)),
+						 to_ub_ps(_mm_loadu_ps(s+8)),to_ub_ps(_mm_loadu_ps(s+12)));
+}
+
+static size_t pack_rgba_sse2(uint8_t* dst, const float* src, size_t n)
+{
+	size_t i = 0;
+	for(; i+4 <= n; i+=4)
+		_mm_storeu_si128((__m128i*)(dst+4*i),pack_rgba4_sse2(src+4*i));
+	return i;
+}
+
+static size_t pack_rgb_sse2(uint8_t* dst, const float* src, size_t n)
+{
+	size_t i = 0;
+	uint8_t tmp[16];
+	for(; i+4 <= n; i+=4)
+	{
+		_mm_storeu_si128((__m128i*)tmp,pack_rgba4_sse2(src+4*i));
+		for(int p = 0 ; p < 4;p++)
+			memcpy(dst+3*(i+p),tmp+4*p,3);
+	}
+	return i;
+}
+
+TD_TARGET("ssse3")
+static size_t pack_rgb_ssse3(uint8_t* dst, const float* src, size_t n)
+{
+	const __m128i drop_a = _mm_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+	size_t i = 0;
+	// the 16 byte store writes 4 bytes beyond the 4 pixels
+	for(; i+6 <= n; i+=4)
+		_mm_storeu_si128((__m128i*)(dst+3*i),
+						 _mm_shuffle_epi8(pack_rgba4_sse2(src+4*i),drop_a));
+	return i;
+}
+
+template<bool LUMINANCE>
+static inline __m128i pack_l4_sse2(const float* s)
+{
+	__m128 r,g,b,a;
+	load_soa(s,r,g,b,a);
+	return to_ub_ps(LUMINANCE ? luminance_ps(r,g,b) : a);
+}
+
+template<bool LUMINANCE>
+static size_t pack_l_sse2(uint8_t* dst, const float* src, size_t n)
+{
+	size_t i = 0;
+	for(; i+16 <= n; i+=16)
+	{
+		const float* s = src+4*i;
+		_mm_storeu_si128((__m128i*)(dst+i),
+						 pack_ub_epi32(pack_l4_sse2<LUMINANCE>(s),
+									   pack_l4_sse2<LUMINANCE>(s+16),
+									   pack_l4_sse2<LUMINANCE>(s+32),
+									   pack_l4_sse2<LUMINANCE>(s+48)));
+	}
+	return i;
+}
+
+static inline __m128i pack_la4_sse2(const float* s)
+{
+	__m128 r,g,b,a;
+	load_soa(s,r,g,b,a);
+	return _mm_or_si128(to_ub_clamped_ps(luminance_ps(r,g,b)),
+						_mm_slli_epi32(to_ub_clamped_ps(a),8));
+}
+
+static size_t pack_la_sse2(uint8_t* dst, const float* src, size_t n)
+{
+	size_t i = 0;
+	for(; i+8 <= n; i+=8)
+		_mm_storeu_si128((__m128i*)(dst+2*i),
+						 pack_lo16(pack_la4_sse2(src+4*i),pack_la4_sse2(src+4*i+16)));
+	return i;
+}
+
+static size_t pack_sse2(uint8_t* dst, const float* src, size_t n, Format f, DType t)
+{
+	if(t == DType::UNSIGNED_SHORT_4_4_4_4)
+		return pack_us_sse2<4,4,4,4>(dst,src,n);
+	if(t == DType::UNSIGNED_SHORT_5_5_5_1)
+		return pack_us_sse2<5,5,5,1>(dst,src,n);
+	if(t == DType::UNSIGNED_SHORT_5_6_5)
+		return pack_us_sse2<5,6,5,0>(dst,src,n);
+	if(f == Format::RGBA)
+		return pack_rgba_sse2(dst,src,n);
+	if(f == Format::RGB)
+		return pack_rgb_sse2(dst,src,n);
+	if(f == Format::LUMINANCE)
+		return pack_l_sse2<true>(dst,src,n);
+	if(f == Format::ALPHA)
+		return pack_l_sse2<false>(dst,src,n);
+	if(f == Format::LUMINANCE_ALPHA)
+		return pack_la_sse2(dst,src,n);
+	return 0;
+}
+
+static size_t pack_ssse3(uint8_t* dst, const float* src, size_t n, Format f, DType t)
+{
+	if(f == Format::RGB && t == DType::UNSIGNED_BYTE)
+		return pack_rgb_ssse3(dst,src,n);
+	return pack_sse2(dst,src,n,f,t);
+}
+#endif
+
+#if TD_SSE2
+
+// loads 8 pixels, pixel i and i+4 share a 128 bit lane, so the lane wise
+// transpose yields the channels in pixel order.
+TD_TARGET("avx2")
+static inline void load_soa8(const float* s, __m256& r, __m256& g, __m256& b, __m256& a)
+{
+	const __m256 p0 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(s)),_mm_loadu_ps(s+16),1);
+	const __m256 p1 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(s+4)),_mm_loadu_ps(s+20),1);
+	const __m256 p2 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(s+8)),_mm_loadu_ps(s+24),1);
+	const __m256 p3 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(s+12)),_mm_loadu_ps(s+28),1);
+	const __m256 t0 = _mm256_unpacklo_ps(p0,p1);
+	const __m256 t1 = _mm256_unpacklo_ps(p2,p3);
+	const __m256 t2 = _mm256_unpackhi_ps(p0,p1);
+	const __m256 t3 = _mm256_unpackhi_ps(p2,p3);
+	r = _mm256_shuffle_ps(t0,t1,_MM_SHUFFLE(1,0,1,0));
+	g = _mm256_shuffle_ps(t0,t1,_MM_SHUFFLE(3,2,3,2));
+	b = _mm256_shuffle_ps(t2,t3,_MM_SHUFFLE(1,0,1,0));
+	a = _mm256_shuffle_ps(t2,t3,_MM_SHUFFLE(3,2,3,2));
+}
+
+TD_TARGET("avx2")
+static inline __m256i quantize_ps8(__m256 v, float max)
+{
+	const __m256 m = _mm256_set1_ps(max);
+	return _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(v,m),_mm256_setzero_ps()),m));
+}
+
+TD_TARGET("avx2")
+static inline __m256i to_ub_ps8(__m256 v)
+{
+	return _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(v,_mm256_set1_ps(255.0f)),_mm256_set1_ps(0.5f)));
+}
+
+TD_TARGET("avx2")
+static inline __m256i to_ub_clamped_ps8(__m256 v)
+{
+	const __m256 x = _mm256_add_ps(_mm256_mul_ps(v,_mm256_set1_ps(255.0f)),_mm256_set1_ps(0.5f));
+	return _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(x,_mm256_setzero_ps()),_mm256_set1_ps(255.0f)));
+}
+
+TD_TARGET("avx2")
+static inline __m256 luminance_ps8(__m256 r, __m256 g, __m256 b)
+{
+	return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.2126f),r),
+									   _mm256_mul_ps(_mm256_set1_ps(0.7152f),g)),
+						 _mm256_mul_ps(_mm256_set1_ps(0.0722f),b));
+}
+
+// the packs work per 128 bit lane, the permutes restore the order
+TD_TARGET("avx2")
+static inline __m256i pack_lo16_8(__m256i lo, __m256i hi)
+{
+	lo = _mm256_srai_epi32(_mm256_slli_epi32(lo,16),16);
+	hi = _mm256_srai_epi32(_mm256_slli_epi32(hi,16),16);
+	return _mm256_permute4x64_epi64(_mm256_packs_epi32(lo,hi),_MM_SHUFFLE(3,1,2,0));
+}
+
+TD_TARGET("avx2")
+static inline __m256i pack_ub_epi32_8(__m256i a, __m256i b, __m256i c, __m256i d)
+{
+	const __m256i v = _mm256_packus_epi16(_mm256_packs_epi32(a,b),_mm256_packs_epi32(c,d));
+	return _mm256_permutevar8x32_epi32(v,_mm256_setr_epi32(0,4,1,5,2,6,3,7));
+}
+
+template<int R, int G, int B, int A>
+TD_TARGET("avx2")
+static inline __m256i pack_us8_avx2(const float* s)
+{
+	__m256 r,g,b,a;
+	load_soa8(s,r,g,b,a);
+	const int sr = 16-R, sg = sr-G, sb = sg-B, sa = sb-A;
+	__m256i v = _mm256_slli_epi32(quantize_ps8(r,(1<<R)-1),sr);
+	v = _mm256_or_si256(v,_mm256_slli_epi32(quantize_ps8(g,(1<<G)-1),sg));
+	v = _mm256_or_si256(v,_mm256_slli_epi32(quantize_ps8(b,(1<<B)-1),sb));
+	if(A)
+		v = _mm256_or_si256(v,_mm256_slli_epi32(quantize_ps8(a,(1<<A)-1),sa));
+	return v;
+}
+
+template<int R, int G, int B, int A>
+TD_TARGET("avx2")
+static size_t pack_us_avx2(uint8_t* dst, const float* src, size_t n)
+{
+	size_t i = 0;
+	for(; i+16 <= n; i+=16)
+	{
+		const __m256i lo = pack_us8_avx2<R,G,B,A>(src+4*i);
+		const __m256i hi = pack_us8_avx2<R,G,B,A>(src+4*i+32);
+		_mm256_storeu_si256((__m256i*)(dst+2*i),pack_lo16_8(lo,hi));
+	}
+	return i;
+}
+
+TD_TARGET("avx2")
+static inline __m256i pack_rgba8_avx2(const float* s)
+{
+	return pack_ub_epi32_8(to_ub_ps8(_mm256_loadu_ps(s)),to_ub_ps8(_mm256_loadu_ps(s+8)),
+						   to_ub_ps8(_mm256_loadu_ps(s+16)),to_ub_ps8(_mm256_loadu_ps(s+24)));
+}
+
+TD_TARGET("avx2")
+static size_t pack_rgba_avx2(uint8_t* dst, const float* src, size_t n)
+{
+	size_t i = 0;
+	for(; i+8 <= n; i+=8)
+		_mm256_storeu_si256((__m256i*)(dst+4*i),pack_rgba8_avx2(src+4*i));
+	return i;
+}
+
+TD_TARGET("avx2")
+static size_t pack_rgb_avx2(uint8_t* dst, const float* src, size_t n)
+{
+	const __m256i drop_a = _mm256_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+											0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+	size_t i = 0;
+	// the second 16 byte store writes 4 bytes beyond the 8 pixels
+	for(; i+10 <= n; i+=8)
+	{
+		const __m256i v = _mm256_shuffle_epi8(pack_rgba8_avx2(src+4*i),drop_a);
+		_mm_storeu_si128((__m128i*)(dst+3*i),_mm256_castsi256_si128(v));
+		_mm_storeu_si128((__m128i*)(dst+3*i+12),_mm256_extracti128_si256(v,1));
+	}
+	return i;
+}
+
+template<bool LUMINANCE>
+TD_TARGET("avx2")
+static inline __m256i pack_l8_avx2(const float* s)
+{
+	__m256 r,g,b,a;
+	load_soa8(s,r,g,b,a);
+	return to_ub_ps8(LUMINANCE ? luminance_ps8(r,g,b) : a);
+}
+
+template<bool LUMINANCE>
+TD_TARGET("avx2")
+static size_t pack_l_avx2(uint8_t* dst, const float* src, size_t n)
+{
+	size_t i = 0;
+	for(; i+32 <= n; i+=32)
+	{
+		const float* s = src+4*i;
+		_mm256_storeu_si256((__m256i*)(dst+i),
+							pack_ub_epi32_8(pack_l8_avx2<LUMINANCE>(s),
+											pack_l8_avx2<LUMINANCE>(s+32),
+											pack_l8_avx2<LUMINANCE>(s+64),
+											pack_l8_avx2<LUMINANCE>(s+96)));
+	}
+	return i;
+}
+
+TD_TARGET("avx2")
+static inline __m256i pack_la8_avx2(const float* s)
+{
+	__m256 r,g,b,a;
+	load_soa8(s,r,g,b,a);
+	return _mm256_or_si256(to_ub_clamped_ps8(luminance_ps8(r,g,b)),
+						   _mm256_slli_epi32(to_ub_clamped_ps8(a),8));
+}
+
+TD_TARGET("avx2")
+static size_t pack_la_avx2(uint8_t* dst, const float* src, size_t n)
+{
+	size_t i = 0;
+	for(; i+16 <= n; i+=16)
+		_mm256_storeu_si256((__m256i*)(dst+2*i),
+							pack_lo16_8(pack_la8_avx2(src+4*i),pack_la8_avx2(src+4*i+32)));
+	return i;
+}
+
+TD_TARGET("avx2")
+static size_t pack_avx2(uint8_t* dst, const float* src, size_t n, Format f, DType t)
+{
+	if(t == DType::UNSIGNED_SHORT_4_4_4_4)
+		return pack_us_avx2<4,4,4,4>(dst,src,n);
+	if(t == DType::UNSIGNED_SHORT_5_5_5_1)
+		return pack_us_avx2<5,5,5,1>(dst,src,n);
+	if(t == DType::UNSIGNED_SHORT_5_6_5)
+		return pack_us_avx2<5,6,5,0>(dst,src,n);
+	if(f == Format::RGBA)
+		return pack_rgba_avx2(dst,src,n);
+	if(f == Format::RGB)
+		return pack_rgb_avx2(dst,src,n);
+	if(f == Format::LUMINANCE)
+		return pack_l_avx2<true>(dst,src,n);
+	if(f == Format::ALPHA)
+		return pack_l_avx2<false>(dst,src,n);
+	if(f == Format::LUMINANCE_ALPHA)
+		return pack_la_avx2(dst,src,n);
+	return 0;
+}
+#endif
+
+/**
+ * @brief unpack_table returns a table of the 65536 unpacked RGBA pixels of
+ * a 16 bit type.
+ */
+static const float* unpack_table(DType t)
+{
+	struct table
+	{
+		std::vector<float> v;
+		table(void (*unpack)(float*, const void*)):v(65536*4)
+		{
+			for(uint32_t c = 0 ; c < 65536;c++)
+			{
+				const uint16_t p = c;
+				unpack(&v[c*4],&p);
+			}
+		}
+	};
+	static const table t_565(unpack_us_5_6_5);
+	static const table t_4444(unpack_us_4_4_4_4);
+	static const table t_5551(unpack_us_5_5_5_1);
+	if(t == DType::UNSIGNED_SHORT_5_6_5)
+		return t_565.v.data();
+	if(t == DType::UNSIGNED_SHORT_4_4_4_4)
+		return t_4444.v.data();
+	return t_5551.v.data();
+}
+
+/**
+ * @brief unpack_lut unpacks the 16 bit types using unpack_table.
+ */
+static size_t unpack_lut(float* dst, const uint8_t* src, size_t n, DType t)
+{
+	if(t == DType::UNSIGNED_BYTE)
+		return 0;
+	const float* tbl = unpack_table(t);
+	for(size_t i = 0 ; i < n;i++)
+	{
+		uint16_t c;
+		memcpy(&c,src+2*i,2);
+		memcpy(dst+4*i,tbl+4*c,4*sizeof(float));
+	}
+	return n;
+}
+
+#if TD_SSE2
+
+static inline void store_aos(float* d, __m128 r, __m128 g, __m128 b, __m128 a)
+{
+	_MM_TRANSPOSE4_PS(r,g,b,a);
+	_mm_storeu_ps(d,r);
+	_mm_storeu_ps(d+4,g);
+	_mm_storeu_ps(d+8,b);
+	_mm_storeu_ps(d+12,a);
+}
+
+static inline __m128 field_ps(__m128i v, int shift, int bits)
+{
+	const __m128i f = _mm_and_si128(_mm_srli_epi32(v,shift),_mm_set1_epi32((1<<bits)-1));
+	return _mm_mul_ps(_mm_cvtepi32_ps(f),_mm_set1_ps(1.0f/((1<<bits)-1)));
+}
+
+template<int R, int G, int B, int A>
+static inline void unpack_us4_sse2(float* d, __m128i v)
+{
+	const int sr = 16-R, sg = sr-G, sb = sg-B;
+	store_aos(d,field_ps(v,sr,R),field_ps(v,sg,G),field_ps(v,sb,B),
+			  A ? field_ps(v,0,A) : _mm_set1_ps(1.0f));
+}
+
+template<int R, int G, int B, int A>
+static size_t unpack_us_sse2(float* dst, const uint8_t* src, size_t n)
+{
+	size_t i = 0;
+	for(; i+8 <= n; i+=8)
+	{
+		const __m128i v = _mm_loadu_si128((const __m128i*)(src+2*i));
+		unpack_us4_sse2<R,G,B,A>(dst+4*i,_mm_unpacklo_epi16(v,_mm_setzero_si128()));
+		unpack_us4_sse2<R,G,B,A>(dst+4*i+16,_mm_unpackhi_epi16(v,_mm_setzero_si128()));
+	}
+	return i;
+}
+
+static inline __m128 from_ub_ps(__m128i v)
+{
+	return _mm_mul_ps(_mm_set1_ps(1.0f/255.0f),_mm_cvtepi32_ps(v));
+}
+
+// converts 16 bytes to 16 floats
+static inline void ub16_ps(__m128i v, __m128& f0, __m128& f1, __m128& f2, __m128& f3)
+{
+	const __m128i z = _mm_setzero_si128();
+	const __m128i lo = _mm_unpacklo_epi8(v,z);
+	const __m128i hi = _mm_unpackhi_epi8(v,z);
+	f0 = from_ub_ps(_mm_unpacklo_epi16(lo,z));
+	f1 = from_ub_ps(_mm_unpackhi_epi16(lo,z));
+	f2 = from_ub_ps(_mm_unpacklo_epi16(hi,z));
+	f3 = from_ub_ps(_mm_unpackhi_epi16(hi,z));
+}
+
+static size_t unpack_rgba_sse2(float* dst, const uint8_t* src, size_t n)
+{
+	size_t i = 0;
+	for(; i+4 <= n; i+=4)
+	{
+		__m128 p0,p1,p2,p3;
+		ub16_ps(_mm_loadu_si128((const __m128i*)(src+4*i)),p0,p1,p2,p3);
+		_mm_storeu_ps(dst+4*i,p0);
+		_mm_storeu_ps(dst+4*i+4,p1);
+		_mm_storeu_ps(dst+4*i+8,p2);
+		_mm_storeu_ps(dst+4*i+12,p3);
+	}
+	return i;
+}
+
+static size_t unpack_rgb_sse2(float* dst, const uint8_t* src, size_t n)
+{
+	const __m128 alpha = _mm_castsi128_ps(_mm_set_epi32(-1,0,0,0));
+	const __m128 one = _mm_and_ps(alpha,_mm_set1_ps(1.0f));
+	size_t i = 0;
+	// the 16 byte load reads 4 bytes beyond the 4 pixels
+	for(; i+6 <= n; i+=4)
+	{
+		const __m128i v = _mm_loadu_si128((const __m128i*)(src+3*i));
+		const __m128i m = _mm_setr_epi32(0xFFFFFF,0,0,0);
+		__m128i rgbx = _mm_and_si128(v,m);
+		rgbx = _mm_or_si128(rgbx,_mm_slli_si128(_mm_and_si128(_mm_srli_si128(v,3),m),4));
+		rgbx = _mm_or_si128(rgbx,_mm_slli_si128(_mm_and_si128(_mm_srli_si128(v,6),m),8));
+		rgbx = _mm_or_si128(rgbx,_mm_slli_si128(_mm_and_si128(_mm_srli_si128(v,9),m),12));
+		__m128 p[4];
+		ub16_ps(rgbx,p[0],p[1],p[2],p[3]);
+		for(int k = 0 ; k < 4;k++)
+			_mm_storeu_ps(dst+4*(i+k),_mm_or_ps(_mm_andnot_ps(alpha,p[k]),one));
+	}
+	return i;
+}
+
+TD_TARGET("ssse3")
+static size_t unpack_rgb_ssse3(float* dst, const uint8_t* src, size_t n)
+{
+	const __m128 alpha = _mm_castsi128_ps(_mm_set_epi32(-1,0,0,0));
+	const __m128 one = _mm_and_ps(alpha,_mm_set1_ps(1.0f));
+	const __m128i expand = _mm_setr_epi8(0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1);
+	size_t i = 0;
+	// the 16 byte load reads 4 bytes beyond the 4 pixels
+	for(; i+6 <= n; i+=4)
+	{
+		const __m128i v = _mm_loadu_si128((const __m128i*)(src+3*i));
+		__m128 p[4];
+		ub16_ps(_mm_shuffle_epi8(v,expand),p[0],p[1],p[2],p[3]);
+		for(int k = 0 ; k < 4;k++)
+			_mm_storeu_ps(dst+4*(i+k),_mm_or_ps(_mm_andnot_ps(alpha,p[k]),one));
+	}
+	return i;
+}
+
+// expands 4 values to the pixels (v,v,v,1), (0,0,0,v) if ALPHA
+template<bool ALPHA>
+static inline void store_l4(float* d, __m128 v)
+{
+	const __m128 alpha = _mm_castsi128_ps(_mm_set_epi32(-1,0,0,0));
+	const __m128 one = _mm_and_ps(alpha,_mm_set1_ps(1.0f));
+	const __m128 p[4] = {_mm_shuffle_ps(v,v,_MM_SHUFFLE(0,0,0,0)),
+						 _mm_shuffle_ps(v,v,_MM_SHUFFLE(1,1,1,1)),
+						 _mm_shuffle_ps(v,v,_MM_SHUFFLE(2,2,2,2)),
+						 _mm_shuffle_ps(v,v,_MM_SHUFFLE(3,3,3,3))};
+	for(int k = 0 ; k < 4;k++)
+		_mm_storeu_ps(d+4*k,ALPHA ? _mm_and_ps(alpha,p[k])
+								  : _mm_or_ps(_mm_andnot_ps(alpha,p[k]),one));
+}
+
+template<bool ALPHA>
+static size_t unpack_l_sse2(float* dst, const uint8_t* src, size_t n)
+{
+	size_t i = 0;
+	for(; i+16 <= n; i+=16)
+	{
+		__m128 f0,f1,f2,f3;
+		ub16_ps(_mm_loadu_si128((const __m128i*)(src+i)),f0,f1,f2,f3);
+		store_l4<ALPHA>(dst+4*i,f0);
+		store_l4<ALPHA>(dst+4*i+16,f1);
+		store_l4<ALPHA>(dst+4*i+32,f2);
+		store_l4<ALPHA>(dst+4*i+48,f3);
+	}
+	return i;
+}
+
+static size_t unpack_la_sse2(float* dst, const uint8_t* src, size_t n)
+{
+	size_t i = 0;
+	for(; i+8 <= n; i+=8)
+	{
+		__m128 f[4];
+		ub16_ps(_mm_loadu_si128((const __m128i*)(src+2*i)),f[0],f[1],f[2],f[3]);
+		for(int k = 0 ; k < 4;k++)
+		{
+			_mm_storeu_ps(dst+4*(i+2*k),_mm_shuffle_ps(f[k],f[k],_MM_SHUFFLE(1,0,0,0)));
+			_mm_storeu_ps(dst+4*(i+2*k+1),_mm_shuffle_ps(f[k],f[k],_MM_SHUFFLE(3,2,2,2)));
+		}
+	}
+	return i;
+}
+
+static size_t unpack_sse2(float* dst, const uint8_t* src, size_t n, Format f, DType t)
+{
+	if(t == DType::UNSIGNED_SHORT_4_4_4_4)
+		return unpack_us_sse2<4,4,4,4>(dst,src,n);
+	if(t == DType::UNSIGNED_SHORT_5_5_5_1)
+		return unpack_us_sse2<5,5,5,1>(dst,src,n);
+	if(t == DType::UNSIGNED_SHORT_5_6_5)
+		return unpack_us_sse2<5,6,5,0>(dst,src,n);
+	if(f == Format::RGBA)
+		return unpack_rgba_sse2(dst,src,n);
+	if(f == Format::RGB)
+		return unpack_rgb_sse2(dst,src,n);
+	if(f == Format::LUMINANCE)
+		return unpack_l_sse2<false>(dst,src,n);
+	if(f == Format::ALPHA)
+		return unpack_l_sse2<true>(dst,src,n);
+	if(f == Format::LUMINANCE_ALPHA)
+		return unpack_la_sse2(dst,src,n);
+	return 0;
+}
+
+static size_t unpack_ssse3(float* dst, const uint8_t* src, size_t n, Format f, DType t)
+{
+	if(f == Format::RGB && t == DType::UNSIGNED_BYTE)
+		return unpack_rgb_ssse3(dst,src,n);
+	return unpack_sse2(dst,src,n,f,t);
+}
+#endif
+
+#if TD_SSE2
+
+TD_TARGET("avx2")
+static inline __m256 field_ps8(__m256i v, int shift, int bits)
+{
+	const __m256i f = _mm256_and_si256(_mm256_srli_epi32(v,shift),_mm256_set1_epi32((1<<bits)-1));
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(f),_mm256_set1_ps(1.0f/((1<<bits)-1)));
+}
+
+// inverse of load_soa8
+TD_TARGET("avx2")
+static inline void store_aos8(float* d, __m256 r, __m256 g, __m256 b, __m256 a)
+{
+	const __m256 t0 = _mm256_unpacklo_ps(r,g);
+	const __m256 t1 = _mm256_unpacklo_ps(b,a);
+	const __m256 t2 = _mm256_unpackhi_ps(r,g);
+	const __m256 t3 = _mm256_unpackhi_ps(b,a);
+	const __m256 p0 = _mm256_shuffle_ps(t0,t1,_MM_SHUFFLE(1,0,1,0)); // px 0 | 4
+	const __m256 p1 = _mm256_shuffle_ps(t0,t1,_MM_SHUFFLE(3,2,3,2)); // px 1 | 5
+	const __m256 p2 = _mm256_shuffle_ps(t2,t3,_MM_SHUFFLE(1,0,1,0)); // px 2 | 6
+	const __m256 p3 = _mm256_shuffle_ps(t2,t3,_MM_SHUFFLE(3,2,3,2)); // px 3 | 7
+	_mm256_storeu_ps(d,   _mm256_permute2f128_ps(p0,p1,0x20));
+	_mm256_storeu_ps(d+8, _mm256_permute2f128_ps(p2,p3,0x20));
+	_mm256_storeu_ps(d+16,_mm256_permute2f128_ps(p0,p1,0x31));
+	_mm256_storeu_ps(d+24,_mm256_permute2f128_ps(p2,p3,0x31));
+}
+
+template<int R, int G, int B, int A>
+TD_TARGET("avx2")
+static size_t unpack_us_avx2(float* dst, const uint8_t* src, size_t n)
+{
+	const int sr = 16-R, sg = sr-G, sb = sg-B;
+	size_t i = 0;
+	for(; i+8 <= n; i+=8)
+	{
+		const __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src+2*i)));
+		store_aos8(dst+4*i,field_ps8(v,sr,R),field_ps8(v,sg,G),field_ps8(v,sb,B),
+				   A ? field_ps8(v,0,A) : _mm256_set1_ps(1.0f));
+	}
+	return i;
+}
+
+TD_TARGET("avx2")
+static size_t unpack_rgba_avx2(float* dst, const uint8_t* src, size_t n)
+{
+	const __m256 s = _mm256_set1_ps(1.0f/255.0f);
+	size_t i = 0;
+	for(; i+2 <= n; i+=2)
+	{
+		__m128i v;
+		memcpy(&v,src+4*i,8);
+		_mm256_storeu_ps(dst+4*i,_mm256_mul_ps(s,_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v))));
+	}
+	return i;
+}
+
+TD_TARGET("avx2")
+static size_t unpack_avx2(float* dst, const uint8_t* src, size_t n, Format f, DType t)
+{
+	if(t == DType::UNSIGNED_SHORT_4_4_4_4)
+		return unpack_us_avx2<4,4,4,4>(dst,src,n);
+	if(t == DType::UNSIGNED_SHORT_5_5_5_1)
+		return unpack_us_avx2<5,5,5,1>(dst,src,n);
+	if(t == DType::UNSIGNED_SHORT_5_6_5)
+		return unpack_us_avx2<5,6,5,0>(dst,src,n);
+	if(f == Format::RGBA)
+		return unpack_rgba_avx2(dst,src,n);
+	return unpack_ssse3(dst,src,n,f,t);
+}
+#endif
+
+/*
+ * Per pixel codecs, specialised for each Format/DType combination. All
+ * branches on F are resolved at compile time.
+ */
+template<Format F, DType T>
+struct pixel;
+
+template<Format F>
+struct pixel<F,DType::UNSIGNED_BYTE>
+{
+	static const uint32_t size = size_per_pixel(F,DType::UNSIGNED_BYTE);
+
+	// saturates like the vectorised kernels, dithered values may exceed 1
+	static uint8_t ub(float v)
+	{
+		return std::min(std::max(0.0f,v),255.0f);
+	}
+
+	static void pack(uint8_t* c, const float* src)
+	{
+		if(F == Format::ALPHA)
+		{
+			c[0] = ub(src[3] * 255.0f+0.5f);
+		}
+		else if(F == Format::LUMINANCE || F == Format::LUMINANCE_ALPHA)
+		{
+			c[0] = ub((0.2126f*src[0] + 0.7152f*src[1] + 0.0722f*src[2])*255.0f + 0.5f);
+			if(F == Format::LUMINANCE_ALPHA)
+				c[1] = ub(src[3]*255.0f+0.5f);
+		}
+		else
+		{
+			for(uint32_t i = 0 ; i<size;i++)
+			{
+				c[i] = ub(src[i]*255.0f+0.5f);
+			}
+		}
+	}
+
+	static void unpack(float* dst, const uint8_t* c)
+	{
+		const float s = 1.0f/255.0f;
+		if(F == Format::ALPHA)
+		{
+			dst[0]=dst[1]=dst[2] = 0.0f;
+			dst[3] = s*c[0];
+		}
+		else if(F == Format::LUMINANCE || F == Format::LUMINANCE_ALPHA)
+		{
+			dst[0]=dst[1]=dst[2] = s*c[0];
+			dst[3] = F == Format::LUMINANCE_ALPHA ? s*c[1] : 1.0f;
+		}
+		else
+		{
+			dst[3] = 1.0f;
+			for(uint32_t i = 0 ; i<size;i++)
+			{
+				dst[i] = s*c[i];
+			}
+		}
+	}
+};
+
+#define TD_PIXEL_US(T,PACK,UNPACK) \
+template<Format F> \
+struct pixel<F,T> \
+{ \
+	static const uint32_t size = 2; \
+	static void pack(uint8_t* c, const float* src) {PACK(c,src);} \
+	static void unpack(float* dst, const uint8_t* c) {UNPACK(dst,c);} \
+};
+TD_PIXEL_US(DType::UNSIGNED_SHORT_5_6_5,pack_us_5_6_5,unpack_us_5_6_5)
+TD_PIXEL_US(DType::UNSIGNED_SHORT_4_4_4_4,pack_us_4_4_4_4,unpack_us_4_4_4_4)
+TD_PIXEL_US(DType::UNSIGNED_SHORT_5_5_5_1,pack_us_5_5_5_1,unpack_us_5_5_5_1)
+#undef TD_PIXEL_US
+
+/**
+ * @brief pack_bulk packs the bulk of n pixels using the vectorised kernels for
+ * the instruction set I, returns the number of pixels packed.
+ */
+template<ISA I>
+static inline size_t pack_bulk(uint8_t* dst, const float* src, size_t n, Format f, DType t)
+{
+#if TD_SSE2
+	if(I >= ISA::AVX2)
+		return pack_avx2(dst,src,n,f,t);
+	if(I == ISA::SSSE3)
+		return pack_ssse3(dst,src,n,f,t);
+	if(I == ISA::SSE2)
+		return pack_sse2(dst,src,n,f,t);
+#endif
+	(void)dst;(void)src;(void)n;(void)f;(void)t;
+	return 0;
+}
+
+/**
+ * @brief unpack_bulk is the counterpart of pack_bulk. Without vector
+ * instructions the 16 bit types are unpacked using the lookup tables.
+ */
+template<ISA I>
+static inline size_t unpack_bulk(float* dst, const uint8_t* src, size_t n, Format f, DType t)
+{
+#if TD_SSE2
+	if(I >= ISA::AVX2)
+		return unpack_avx2(dst,src,n,f,t);
+	if(I == ISA::SSSE3)
+		return unpack_ssse3(dst,src,n,f,t);
+	if(I == ISA::SSE2)
+		return unpack_sse2(dst,src,n,f,t);
+#endif
+	(void)f;
+	return unpack_lut(dst,src,n,t);
+}
+
+template<Format F, DType T, ISA I>
+static void pack_run(void* dst, const float* src, size_t n)
+{
+	uint8_t* op = (uint8_t*)dst;
+	size_t p = pack_bulk<I>(op,src,n,F,T);
+	for(op += p*pixel<F,T>::size, src += p*4; p < n; p++)
+	{
+		pixel<F,T>::pack(op,src);
+		op += pixel<F,T>::size;
+		src += 4;
+	}
+}
+
+template<Format F, DType T, ISA I>
+static void unpack_run(float* dst, const void* src, size_t n)
+{
+	const uint8_t* ip = (const uint8_t*)src;
+	size_t p = unpack_bulk<I>(dst,ip,n,F,T);
+	for(ip += p*pixel<F,T>::size, dst += p*4; p < n; p++)
+	{
+		pixel<F,T>::unpack(dst,ip);
+		ip += pixel<F,T>::size;
+		dst += 4;
+	}
+}
+
+static void pack_none(void*, const float*, size_t)
+{
+}
+
+static void unpack_none(float* dst, const void*, size_t n)
+{
+	memset(dst,0,n*4*sizeof(float));
+}
+
+const PixelKernels& pixel_kernels(Format f, DType t)
+{
+	// AVX512 uses the AVX2 kernels
+#define TD_ISA_KERNELS(F,T,I) {size_per_pixel(F,T),pack_run<F,T,I>,unpack_run<F,T,I>}
+#define TD_KERNELS(F,T) \
+	{ \
+		static const PixelKernels k[] = {TD_ISA_KERNELS(F,T,ISA::SCALAR), \
+										 TD_ISA_KERNELS(F,T,ISA::SSE2), \
+										 TD_ISA_KERNELS(F,T,ISA::SSSE3), \
+										 TD_ISA_KERNELS(F,T,ISA::AVX2), \
+										 TD_ISA_KERNELS(F,T,ISA::AVX2)}; \
+		return k[(int)active_isa()]; \
+	}
+	// the 16 bit types do not depend on the format
+	if(t == DType::UNSIGNED_SHORT_5_6_5)
+		TD_KERNELS(Format::RGB,DType::UNSIGNED_SHORT_5_6_5)
+	if(t == DType::UNSIGNED_SHORT_4_4_4_4)
+		TD_KERNELS(Format::RGBA,DType::UNSIGNED_SHORT_4_4_4_4)
+	if(t == DType::UNSIGNED_SHORT_5_5_5_1)
+		TD_KERNELS(Format::RGBA,DType::UNSIGNED_SHORT_5_5_5_1)
+	if(t == DType::UNSIGNED_BYTE)
+	{
+		if(f == Format::ALPHA)
+			TD_KERNELS(Format::ALPHA,DType::UNSIGNED_BYTE)
+		if(f == Format::LUMINANCE)
+			TD_KERNELS(Format::LUMINANCE,DType::UNSIGNED_BYTE)
+		if(f == Format::LUMINANCE_ALPHA)
+			TD_KERNELS(Format::LUMINANCE_ALPHA,DType::UNSIGNED_BYTE)
+		if(f == Format::RGB)
+			TD_KERNELS(Format::RGB,DType::UNSIGNED_BYTE)
+		if(f == Format::RGBA)
+			TD_KERNELS(Format::RGBA,DType::UNSIGNED_BYTE)
+	}
+#undef TD_KERNELS
+#undef TD_ISA_KERNELS
+	static const PixelKernels none = {size_per_pixel(f,t),pack_none,unpack_none};
+	return none;
+}
+
+void pack_ub(void *dst,const float *src, Format f)
+{
+	uint8_t* c = (uint8_t*) dst;
+	if(f == Format::ALPHA)
+		pixel<Format::ALPHA,DType::UNSIGNED_BYTE>::pack(c,src);
+	else if(f == Format::LUMINANCE)
+		pixel<Format::LUMINANCE,DType::UNSIGNED_BYTE>::pack(c,src);
+	else if(f == Format::LUMINANCE_ALPHA)
+		pixel<Format::LUMINANCE_ALPHA,DType::UNSIGNED_BYTE>::pack(c,src);
+	else if(f == Format::RGB)
+		pixel<Format::RGB,DType::UNSIGNED_BYTE>::pack(c,src);
+	else if(f == Format::RGBA)
+		pixel<Format::RGBA,DType::UNSIGNED_BYTE>::pack(c,src);
+}
+
+void unpack_ub(float *dst,const void *src, Format f)
+{
+	const uint8_t* c = (const uint8_t*) src;
+	if(f == Format::ALPHA)
+		pixel<Format::ALPHA,DType::UNSIGNED_BYTE>::unpack(dst,c);
+	else if(f == Format::LUMINANCE)
+		pixel<Format::LUMINANCE,DType::UNSIGNED_BYTE>::unpack(dst,c);
+	else if(f == Format::LUMINANCE_ALPHA)
+		pixel<Format::LUMINANCE_ALPHA,DType::UNSIGNED_BYTE>::unpack(dst,c);
+	else if(f == Format::RGB)
+		pixel<Format::RGB,DType::UNSIGNED_BYTE>::unpack(dst,c);
+	else if(f == Format::RGBA)
+		pixel<Format::RGBA,DType::UNSIGNED_BYTE>::unpack(dst,c);
+}
+
+void pack_pixels(void *dst, const float *src, size_t n, Format f, DType t)
+{
+	pixel_kernels(f,t).pack(dst,src,n);
+}
+
+void unpack_pixels(float *dst, const void *src, size_t n, Format f, DType t)
+{
+	pixel_kernels(f,t).unpack(dst,src,n);
+}
+
+/*
+ * Byte kernels of the direct 8 bit path. The luminance uses the weights of
+ * pack_ub in 15 bit fixed point (they sum up to 1<<15).
+ */
+static const int LUM_R = 6966;
+static const int LUM_G = 23436;
+static const int LUM_B = 2366;
+
+static inline uint8_t luminance8(const uint8_t* p)
+{
+	return (uint8_t)((LUM_R*p[0]+LUM_G*p[1]+LUM_B*p[2]+(1<<14))>>15);
+}
+
+static void pack_rgba8_scalar(uint8_t* dst, const uint8_t* src, size_t n, Format f)
+{
+	for(size_t i = 0 ; i < n;i++,src+=4)
+	{
+		if(f == Format::ALPHA)
+			*dst++ = src[3];
+		else if(f == Format::LUMINANCE)
+			*dst++ = luminance8(src);
+		else if(f == Format::LUMINANCE_ALPHA)
+		{
+			*dst++ = luminance8(src);
+			*dst++ = src[3];
+		}
+		else if(f == Format::RGB)
+		{
+			memcpy(dst,src,3);
+			dst+=3;
+		}
+	}
+}
+
+static void expand_rgba8_scalar(uint8_t* dst, const uint8_t* src, size_t n, int c)
+{
+	for(size_t i = 0 ; i < n;i++,dst+=4,src+=c)
+	{
+		if(c < 3)
+			dst[0] = dst[1] = dst[2] = src[0];
+		else
+			memcpy(dst,src,3);
+		dst[3] = c == 2 ? src[1] : c == 4 ? src[3] : 255;
+	}
+}
+
+#if TD_SSE2
+// the luminances of 4 RGBA8 pixels as 32 bit integers
+static inline __m128i luminance4_sse2(__m128i v)
+{
+	const __m128i z = _mm_setzero_si128();
+	const __m128i wgt = _mm_setr_epi16(LUM_R,LUM_G,LUM_B,0,LUM_R,LUM_G,LUM_B,0);
+	__m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(v,z),wgt);
+	__m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(v,z),wgt);
+	lo = _mm_add_epi32(lo,_mm_srli_epi64(lo,32));
+	hi = _mm_add_epi32(hi,_mm_srli_epi64(hi,32));
+	const __m128i l = _mm_unpacklo_epi64(_mm_shuffle_epi32(lo,_MM_SHUFFLE(3,1,2,0)),
+										 _mm_shuffle_epi32(hi,_MM_SHUFFLE(3,1,2,0)));
+	return _mm_srli_epi32(_mm_add_epi32(l,_mm_set1_epi32(1<<14)),15);
+}
+
+// packs 16 values in [0,255] held in 4 registers of 32 bit integers
+static inline __m128i pack_epi32_epu8(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+	return _mm_packus_epi16(_mm_packs_epi32(a,b),_mm_packs_epi32(c,d));
+}
+
+static size_t pack_rgba8_sse2(uint8_t* dst, const uint8_t* src, size_t n, Format f)
+{
+	size_t i = 0;
+	for(; i+16 <= n; i+=16)
+	{
+		__m128i v[4], l[4];
+		for(int j = 0 ; j < 4;j++)
+		{
+			v[j] = _mm_loadu_si128((const __m128i*)(src+4*i+16*j));
+			l[j] = luminance4_sse2(v[j]);
+			v[j] = _mm_srli_epi32(v[j],24);
+		}
+		const __m128i a = pack_epi32_epu8(v[0],v[1],v[2],v[3]);
+		const __m128i lum = pack_epi32_epu8(l[0],l[1],l[2],l[3]);
+		if(f == Format::ALPHA)
+			_mm_storeu_si128((__m128i*)(dst+i),a);
+		else if(f == Format::LUMINANCE)
+			_mm_storeu_si128((__m128i*)(dst+i),lum);
+		else if(f == Format::LUMINANCE_ALPHA)
+		{
+			_mm_storeu_si128((__m128i*)(dst+2*i),_mm_unpacklo_epi8(lum,a));
+			_mm_storeu_si128((__m128i*)(dst+2*i+16),_mm_unpackhi_epi8(lum,a));
+		}
+		else
+			return 0;
+	}
+	return i;
+}
+
+TD_TARGET("ssse3")
+static size_t pack_rgba8_ssse3(uint8_t* dst, const uint8_t* src, size_t n, Format f)
+{
+	if(f != Format::RGB)
+		return pack_rgba8_sse2(dst,src,n,f);
+
+	const __m128i drop_a = _mm_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+	size_t i = 0;
+	for(; i+16 <= n; i+=16)
+	{
+		const __m128i* s = (const __m128i*)(src+4*i);
+		const __m128i a = _mm_shuffle_epi8(_mm_loadu_si128(s),drop_a);
+		const __m128i b = _mm_shuffle_epi8(_mm_loadu_si128(s+1),drop_a);
+		const __m128i c = _mm_shuffle_epi8(_mm_loadu_si128(s+2),drop_a);
+		const __m128i d = _mm_shuffle_epi8(_mm_loadu_si128(s+3),drop_a);
+		__m128i* o = (__m128i*)(dst+3*i);
+		_mm_storeu_si128(o,  _mm_or_si128(a,_mm_slli_si128(b,12)));
+		_mm_storeu_si128(o+1,_mm_or_si128(_mm_srli_si128(b,4),_mm_slli_si128(c,8)));
+		_mm_storeu_si128(o+2,_mm_or_si128(_mm_srli_si128(c,8),_mm_slli_si128(d,4)));
+	}
+	return i;
+}
+
+TD_TARGET("ssse3")
+static size_t expand_rgba8_ssse3(uint8_t* dst, const uint8_t* src, size_t n, int c)
+{
+	const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+	__m128i* o = (__m128i*)dst;
+	size_t i = 0;
+	if(c == 3)
+	{
+		const __m128i add_a = _mm_setr_epi8(0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1);
+		for(; i+16 <= n; i+=16,o+=4)
+		{
+			const __m128i* s = (const __m128i*)(src+3*i);
+			const __m128i v0 = _mm_loadu_si128(s);
+			const __m128i v1 = _mm_loadu_si128(s+1);
+			const __m128i v2 = _mm_loadu_si128(s+2);
+			_mm_storeu_si128(o,  _mm_or_si128(_mm_shuffle_epi8(v0,add_a),alpha));
+			_mm_storeu_si128(o+1,_mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(v1,v0,12),add_a),alpha));
+			_mm_storeu_si128(o+2,_mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(v2,v1,8),add_a),alpha));
+			_mm_storeu_si128(o+3,_mm_or_si128(_mm_shuffle_epi8(_mm_srli_si128(v2,4),add_a),alpha));
+		}
+	}
+	else if(c == 2)
+	{
+		const __m128i la = _mm_setr_epi8(0,0,0,1,2,2,2,3,4,4,4,5,6,6,6,7);
+		for(; i+8 <= n; i+=8,o+=2)
+		{
+			const __m128i v = _mm_loadu_si128((const __m128i*)(src+2*i));
+			_mm_storeu_si128(o,  _mm_shuffle_epi8(v,la));
+			_mm_storeu_si128(o+1,_mm_shuffle_epi8(_mm_srli_si128(v,8),la));
+		}
+	}
+	else if(c == 1)
+	{
+		const __m128i l[4] = {_mm_setr_epi8(0,0,0,-1,1,1,1,-1,2,2,2,-1,3,3,3,-1),
+							  _mm_setr_epi8(4,4,4,-1,5,5,5,-1,6,6,6,-1,7,7,7,-1),
+							  _mm_setr_epi8(8,8,8,-1,9,9,9,-1,10,10,10,-1,11,11,11,-1),
+							  _mm_setr_epi8(12,12,12,-1,13,13,13,-1,14,14,14,-1,15,15,15,-1)};
+		for(; i+16 <= n; i+=16,o+=4)
+		{
+			const __m128i v = _mm_loadu_si128((const __m128i*)(src+i));
+			for(int j = 0 ; j < 4;j++)
+				_mm_storeu_si128(o+j,_mm_or_si128(_mm_shuffle_epi8(v,l[j]),alpha));
+		}
+	}
+	return i;
+}
+#endif
+
+typedef size_t (*pack_rgba8_fn)(uint8_t* dst, const uint8_t* src, size_t n, Format f);
+typedef size_t (*expand_rgba8_fn)(uint8_t* dst, const uint8_t* src, size_t n, int c);
+
+static size_t pack_rgba8_none(uint8_t*, const uint8_t*, size_t, Format)
+{
+	return 0;
+}
+
+static size_t expand_rgba8_none(uint8_t*, const uint8_t*, size_t, int)
+{
+	return 0;
+}
+
+static const KernelTable<pack_rgba8_fn> pack_rgba8_kernels = {{
+	pack_rgba8_none,
+#if TD_SSE2
+	pack_rgba8_sse2,pack_rgba8_ssse3
+#endif
+}};
+
+static const KernelTable<expand_rgba8_fn> expand_rgba8_kernels = {{
+	expand_rgba8_none,
+#if TD_SSE2
+	nullptr,expand_rgba8_ssse3
+#endif
+}};
+
+void pack_rgba8(uint8_t *dst, const uint8_t *src, size_t n, Format f)
+{
+	if(f == Format::RGBA)
+	{
+		memcpy(dst,src,n*4);
+		return;
+	}
+	const size_t i = pack_rgba8_kernels.select()(dst,src,n,f);
+	pack_rgba8_scalar(dst+i*size_per_pixel(f,DType::UNSIGNED_BYTE),src+4*i,n-i,f);
+}
+
+void expand_rgba8(uint8_t *dst, const uint8_t *src, size_t n, int c)
+{
+	if(c == 4)
+	{
+		memcpy(dst,src,n*4);
+		return;
+	}
+	const size_t i = expand_rgba8_kernels.select()(dst,src,n,c);
+	expand_rgba8_scalar(dst+4*i,src+c*i,n-i,c);
+}
+
+}
@@ -0,0 +1,125 @@
+#pragma once
+#include <cstddef>
+#include "td.h"
+namespace td {
+
+/**
+ * @brief pack_ub quantizes and packs one RGBA float pixel into f using
+ * unsigned bytes.
+ * @param dst
+ * @param src
+ * @param f
+ */
+void pack_ub(void *dst,const float *src, Format f);
+
+/**
+ * @brief pack_us_5_6_5 quantizes and packs one RGBA float pixel into a
+ * UNSIGNED_SHORT_5_6_5.
+ */
+void pack_us_5_6_5(void *dst, const float *src);
+
+/**
+ * @brief pack_us_4_4_4_4 quantizes and packs one RGBA float pixel into a
+ * UNSIGNED_SHORT_4_4_4_4.
+ */
+void pack_us_4_4_4_4(void *dst, const float *src);
+
+/**
+ * @brief pack_us_5_5_5_1 quantizes and packs one RGBA float pixel into a
+ * UNSIGNED_SHORT_5_5_5_1.
+ */
+void pack_us_5_5_5_1(void *dst, const float *src);
+
+/**
+ * @brief pack_pixels quantizes and packs n RGBA float pixels into dst using
+ * the format f and the type t. Vectorised kernels for active_isa() handle the
+ * bulk of the pixels, the scalar functions above the remainder. Both produce
+ * the same results for values in [0,1].
+ * @param dst - n*size_per_pixel(f,t) bytes.
+ * @param src - n*4 floats.
+ * @param n
+ * @param f
+ * @param t
+ */
+void pack_pixels(void* dst, const float* src, size_t n, Format f, DType t);
+
+/**
+ * @brief unpack_ub unpacks one pixel of format f stored in unsigned bytes to
+ * RGBA floats in [0,1].
+ */
+void unpack_ub(float *dst,const void *src, Format f);
+
+/**
+ * @brief unpack_us_5_6_5 unpacks one UNSIGNED_SHORT_5_6_5 to RGBA floats.
+ */
+void unpack_us_5_6_5(float *dst, const void *src);
+
+/**
+ * @brief unpack_us_4_4_4_4 unpacks one UNSIGNED_SHORT_4_4_4_4 to RGBA floats.
+ */
+void unpack_us_4_4_4_4(float *dst, const void *src);
+
+/**
+ * @brief unpack_us_5_5_5_1 unpacks one UNSIGNED_SHORT_5_5_5_1 to RGBA floats.
+ */
+void unpack_us_5_5_5_1(float *dst, const void *src);
+
+/**
+ * @brief unpack_pixels unpacks n pixels of format f and type t to RGBA floats
+ * in [0,1]. Vectorised kernels for active_isa() handle the bulk of the
+ * pixels. On the SCALAR level the 16 bit types are expanded using 65536-entry
+ * lookup tables. All paths produce the same results as the scalar functions
+ * above.
+ * @param dst - n*4 floats.
+ * @param src - n*size_per_pixel(f,t) bytes.
+ * @param n
+ * @param f
+ * @param t
+ */
+void unpack_pixels(float* dst, const void* src, size_t n, Format f, DType t);
+
+/**
+ * @brief The PixelKernels struct holds the pack/unpack functions specialised
+ * for one Format/DType combination. They process runs of n pixels and behave
+ * like pack_pixels/unpack_pixels.
+ */
+struct PixelKernels
+{
+	uint32_t size; // bytes per packed pixel
+	void (*pack)(void* dst, const float* src, size_t n);
+	void (*unpack)(float* dst, const void* src, size_t n);
+};
+
+/**
+ * @brief pixel_kernels selects the kernels for the format f, the type t and
+ * active_isa(). Select them once and call them for every run of pixels of a
+ * layer.
+ * @param f
+ * @param t
+ * @return
+ */
+const PixelKernels& pixel_kernels(Format f, DType t);
+
+/**
+ * @brief pack_rgba8 converts n RGBA pixels stored in unsigned bytes to the
+ * format f using unsigned bytes, without a detour through floats. The result
+ * is the same as unpacking and packing them with pack_pixels, except that the
+ * luminance is computed with 15 bit fixed point weights. RGBA is a memcpy.
+ * @param dst - n*size_per_pixel(f,UNSIGNED_BYTE) bytes.
+ * @param src - n*4 bytes.
+ * @param n
+ * @param f
+ */
+void pack_rgba8(uint8_t* dst, const uint8_t* src, size_t n, Format f);
+
+/**
+ * @brief expand_rgba8 converts n pixels with c (1-4) unsigned byte channels,
+ * as stored in an Image, to RGBA. Like FloatImage::from_image, 1 and 2
+ * channels are luminance (and alpha), a missing alpha is set to 255.
+ * @param dst - n*4 bytes.
+ * @param src - n*c bytes.
+ * @param n
+ * @param c
+ */
+void expand_rgba8(uint8_t* dst, const uint8_t* src, size_t n, int c);
+}
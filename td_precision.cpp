@@ -0,0 +1,216 @@
+#include "td_precision.h"
+#include "td_cpu.h"
+#include <algorithm>
+#include <cstring>
+
+#if TD_SSE2
+#include <immintrin.h>
+#endif
+
+namespace td
+{
+
+static inline uint32_t float_bits(float f)
+{
+	uint32_t u;
+	memcpy(&u,&f,sizeof(u));
+	return u;
+}
+
+static inline float bits_float(uint32_t u)
+{
+	float f;
+	memcpy(&f,&u,sizeof(f));
+	return f;
+}
+
+uint16_t float_to_half(float f)
+{
+	uint32_t x = float_bits(f);
+	const uint16_t sign = (x>>16)&0x8000;
+	x &= 0x7FFFFFFF;
+
+	if(x >= 0x7F800000) // inf, nan (quieted)
+		return sign | 0x7C00 | (x > 0x7F800000 ? 0x200 | ((x>>13)&0x3FF) : 0);
+	if(x >= 0x477FF000) // rounds to inf
+		return sign | 0x7C00;
+	if(x <= 0x33000000) // rounds to 0
+		return sign;
+
+	uint32_t h, rem, half;
+	if(x < 0x38800000)
+	{
+		// subnormal, the implicit 1 is shifted into the mantissa
+		const uint32_t shift = 126-(x>>23);
+		const uint32_t m = (x&0x7FFFFF)|0x800000;
+		h = m>>shift;
+		rem = m&((1u<<shift)-1);
+		half = 1u<<(shift-1);
+	}
+	else
+	{
+		// rebias the exponent, a carry of the rounding increments it
+		h = (x-0x38000000)>>13;
+		rem = x&0x1FFF;
+		half = 0x1000;
+	}
+	if(rem > half || (rem == half && (h&1)))
+		h++;
+	return sign | h;
+}
+
+float half_to_float(uint16_t h)
+{
+	const uint32_t sign = uint32_t(h&0x8000)<<16;
+	const uint32_t e = (h>>10)&0x1F;
+	const uint32_t m = h&0x3FF;
+	if(e == 0)
+	{
+		const float v = m*(1.0f/16777216.0f);
+		return sign ? -v : v;
+	}
+	if(e == 31) // inf, nan (quieted)
+		return bits_float(sign|0x7F800000|(m ? 0x400000|(m<<13) : 0));
+	return bits_float(sign|((e+112)<<23)|(m<<13));
+}
+
+static void encode_half_scalar(uint16_t* dst, const float* src, size_t n)
+{
+	for(size_t i = 0 ; i < n*4;i++)
+		dst[i] = float_to_half(src[i]);
+}
+
+static void decode_half_scalar(float* dst, const uint16_t* src, size_t n)
+{
+	for(size_t i = 0 ; i < n*4;i++)
+		dst[i] = half_to_float(src[i]);
+}
+
+static inline uint16_t to_unorm16(float v)
+{
+	return std::min(std::max(0.0f,v),1.0f)*65535.0f+0.5f;
+}
+
+static void encode_unorm_scalar(uint16_t* dst, const float* src, size_t n)
+{
+	for(size_t i = 0 ; i < n*4;i++)
+		dst[i] = to_unorm16(src[i]);
+}
+
+static void decode_unorm_scalar(float* dst, const uint16_t* src, size_t n)
+{
+	for(size_t i = 0 ; i < n*4;i++)
+		dst[i] = src[i]*(1.0f/65535.0f);
+}
+
+#if TD_SSE2
+
+// packs 2x4 values in [0,65535] to unsigned shorts
+static inline __m128i pack_u16(__m128i lo, __m128i hi)
+{
+	const __m128i bias = _mm_set1_epi32(32768);
+	return _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(lo,bias),_mm_sub_epi32(hi,bias)),
+						 _mm_set1_epi16(-32768));
+}
+
+static inline __m128i unorm_ps(__m128 v)
+{
+	v = _mm_min_ps(_mm_max_ps(v,_mm_setzero_ps()),_mm_set1_ps(1.0f)); // nan -> 0
+	return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v,_mm_set1_ps(65535.0f)),_mm_set1_ps(0.5f)));
+}
+
+static void encode_unorm_sse2(uint16_t* dst, const float* src, size_t n)
+{
+	size_t i = 0;
+	for(; i+8 <= n*4; i+=8)
+		_mm_storeu_si128((__m128i*)(dst+i),pack_u16(unorm_ps(_mm_loadu_ps(src+i)),
+													 unorm_ps(_mm_loadu_ps(src+i+4))));
+	for(; i < n*4;i++)
+		dst[i] = to_unorm16(src[i]);
+}
+
+static void decode_unorm_sse2(float* dst, const uint16_t* src, size_t n)
+{
+	const __m128 s = _mm_set1_ps(1.0f/65535.0f);
+	const __m128i z = _mm_setzero_si128();
+	size_t i = 0;
+	for(; i+8 <= n*4; i+=8)
+	{
+		const __m128i v = _mm_loadu_si128((const __m128i*)(src+i));
+		_mm_storeu_ps(dst+i,_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v,z)),s));
+		_mm_storeu_ps(dst+i+4,_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(v,z)),s));
+	}
+	for(; i < n*4;i++)
+		dst[i] = src[i]*(1.0f/65535.0f);
+}
+
+TD_TARGET("avx2,f16c")
+static void encode_half_f16c(uint16_t* dst, const float* src, size_t n)
+{
+	size_t i = 0;
+	for(; i+8 <= n*4; i+=8)
+		_mm_storeu_si128((__m128i*)(dst+i),
+						 _mm256_cvtps_ph(_mm256_loadu_ps(src+i),_MM_FROUND_TO_NEAREST_INT));
+	for(; i < n*4;i++)
+		dst[i] = float_to_half(src[i]);
+}
+
+TD_TARGET("avx2,f16c")
+static void decode_half_f16c(float* dst, const uint16_t* src, size_t n)
+{
+	size_t i = 0;
+	for(; i+8 <= n*4; i+=8)
+		_mm256_storeu_ps(dst+i,_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src+i))));
+	for(; i < n*4;i++)
+		dst[i] = half_to_float(src[i]);
+}
+#endif
+
+typedef void (*encode_fn)(uint16_t* dst, const float* src, size_t n);
+typedef void (*decode_fn)(float* dst, const uint16_t* src, size_t n);
+
+static const KernelTable<encode_fn> encode_half_kernels = {{
+	encode_half_scalar,
+#if TD_SSE2
+	nullptr,nullptr,encode_half_f16c
+#endif
+}};
+
+static const KernelTable<decode_fn> decode_half_kernels = {{
+	decode_half_scalar,
+#if TD_SSE2
+	nullptr,nullptr,decode_half_f16c
+#endif
+}};
+
+static const KernelTable<encode_fn> encode_unorm_kernels = {{
+	encode_unorm_scalar,
+#if TD_SSE2
+	encode_unorm_sse2
+#endif
+}};
+
+static const KernelTable<decode_fn> decode_unorm_kernels = {{
+	decode_unorm_scalar,
+#if TD_SSE2
+	decode_unorm_sse2
+#endif
+}};
+
+void encode_pixels(uint16_t *dst, const float *src, size_t n, Precision p)
+{
+	if(p == Precision::HALF)
+		encode_half_kernels.select()(dst,src,n);
+	else if(p == Precision::UNORM16)
+		encode_unorm_kernels.select()(dst,src,n);
+}
+
+void decode_pixels(float *dst, const uint16_t *src, size_t n, Precision p)
+{
+	if(p == Precision::HALF)
+		decode_half_kernels.select()(dst,src,n);
+	else if(p == Precision::UNORM16)
+		decode_unorm_kernels.select()(dst,src,n);
+}
+
+}
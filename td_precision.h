@@ -0,0 +1,49 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+namespace td {
+
+/**
+ * @brief The Precision enum selects how the working image stores a channel.
+ * FLOAT   - 32 bit float (FloatImage).
+ * HALF    - IEEE 754 half float (CompactImage).
+ * UNORM16 - 16 bit unsigned normalized fixed point, values are clamped to
+ *           [0,1] (CompactImage).
+ */
+enum class Precision
+{
+	FLOAT,
+	HALF,
+	UNORM16,
+};
+
+/**
+ * @brief float_to_half converts f to a half float, rounding to nearest even.
+ */
+uint16_t float_to_half(float f);
+
+/**
+ * @brief half_to_float converts the half float h to a float (exact).
+ */
+float half_to_float(uint16_t h);
+
+/**
+ * @brief encode_pixels converts n RGBA float pixels to the 16 bit
+ * representation p (HALF or UNORM16). Uses F16C/SSE2 if available, all paths
+ * produce the same results.
+ * @param dst - n*4 values.
+ * @param src - n*4 floats.
+ * @param n
+ * @param p
+ */
+void encode_pixels(uint16_t* dst, const float* src, size_t n, Precision p);
+
+/**
+ * @brief decode_pixels is the inverse of encode_pixels.
+ * @param dst - n*4 floats.
+ * @param src - n*4 values.
+ * @param n
+ * @param p
+ */
+void decode_pixels(float* dst, const uint16_t* src, size_t n, Precision p);
+}
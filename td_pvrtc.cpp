@@ -0,0 +1,572 @@
+#include "td_pvrtc.h"
+#include "td.h"
+#include "td_thread.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+namespace td
+{
+
+/*
+ * A PVRTC1 block is a little endian 64 bit word: the modulation data in the
+ * low 32 bits, then the mode bit and the colors A (bits 1-15 of the high
+ * word) and B (bits 16-31). A color with its top bit set is opaque, RGB 554
+ * (A) or 555 (B), otherwise ARGB 3443 (A) or 3444 (B). The channels are
+ * expanded to 5 bits, the alpha to 4 (15 if opaque).
+ * The colors of a pixel are interpolated bilinearly between the four blocks
+ * whose centers surround it, wrapping around the edges, and expanded to 8
+ * bits. Its modulation m (0-8) selects (A*(8-m)+B*m)/8.
+ * 4bpp: 2 bits per pixel at bit 2*(y*4+x) select 0, 3, 5 or 8, with the mode
+ * bit 0, 4, 4 with alpha 0 (punch-through) or 8.
+ * 2bpp: without the mode bit 1 bit per pixel at bit y*8+x selects 0 or 8.
+ * With it the pixels with even x+y store 2 bits (as for 4bpp), the others are
+ * interpolated from their neighbours (see unpack_modulation_2bpp).
+ * The blocks are stored in Morton order, y in the lowest bit, the remaining
+ * bits of the longer side on top.
+ */
+
+/**
+ * @brief The Layout struct describes the data of a PVRTC layer.
+ */
+struct Layout
+{
+	// width of the blocks, 4 or 8
+	int bw;
+	// size of the data in pixels and blocks
+	int w, h;
+	int nx, ny;
+	// log2 of the sum of the interpolation weights
+	int shift;
+
+	Layout(int iw, int ih, bool two_bpp)
+		:bw(two_bpp ? 8 : 4),
+		  w(pvrtc_extent(iw,bw)),h(pvrtc_extent(ih,4)),
+		  nx(w/bw),ny(h/4),shift(two_bpp ? 5 : 4)
+	{}
+};
+
+static uint32_t twiddle(uint32_t x, uint32_t y, uint32_t nx, uint32_t ny)
+{
+	const uint32_t m = std::min(nx,ny);
+	uint32_t r = 0;
+	int bits = 0;
+	for(uint32_t b = 1; b < m; b <<= 1, bits++)
+	{
+		if(y & b)
+			r |= 1u<<(2*bits);
+		if(x & b)
+			r |= 2u<<(2*bits);
+	}
+	return r | ((x|y)>>bits)<<(2*bits);
+}
+
+static inline int to5(int c, int bits)
+{
+	return bits == 5 ? c : bits == 4 ? c<<1|c>>3 : c<<2|c>>1;
+}
+
+static inline int expand8(int c, int bits, bool alpha)
+{
+	if(alpha)
+		return 17*(c<<1);
+	const int c5 = to5(c,bits);
+	return c5<<3|c5>>2;
+}
+
+/**
+ * @brief quantize returns the code of the given number of bits, whose value
+ * in 8 bits is nearest to v.
+ */
+static int quantize(float v, int bits, bool alpha)
+{
+	const int max = (1<<bits)-1;
+	const int c = std::min(max,std::max(0,int(v*max/255.0f+0.5f)));
+	int best = c;
+	float best_err = 1e30f;
+	for(int i = std::max(0,c-1); i <= std::min(max,c+1);i++)
+	{
+		const float e = std::fabs(expand8(i,bits,alpha)-v);
+		if(e < best_err)
+		{
+			best_err = e;
+			best = i;
+		}
+	}
+	return best;
+}
+
+/**
+ * @brief pack_color returns the 16 bits of color A (whose lowest bit is the
+ * mode) or B for the RGBA color v.
+ */
+static uint32_t pack_color(const float* v, bool opaque, bool b)
+{
+	if(opaque)
+		return 0x8000|quantize(v[0],5,false)<<10|quantize(v[1],5,false)<<5|
+			   (b ? quantize(v[2],5,false) : quantize(v[2],4,false)<<1);
+	return quantize(v[3],3,true)<<12|quantize(v[0],4,false)<<8|quantize(v[1],4,false)<<4|
+		   (b ? quantize(v[2],4,false) : quantize(v[2],3,false)<<1);
+}
+
+/**
+ * @brief unpack_colors expands A and B of the high word of a block to 5 bit
+ * RGB and 4 bit alpha.
+ * @param word
+ * @param c - A in c[0-3], B in c[4-7].
+ */
+static void unpack_colors(uint32_t word, int* c)
+{
+	for(int e = 0 ; e < 2;e++)
+	{
+		const uint32_t v = e ? word>>16 : word&0xfffe;
+		int* o = c+e*4;
+		if(v & 0x8000)
+		{
+			o[0] = v>>10&31;
+			o[1] = v>>5&31;
+			o[2] = e ? v&31 : to5(v>>1&15,4);
+			o[3] = 15;
+		}
+		else
+		{
+			o[0] = to5(v>>8&15,4);
+			o[1] = to5(v>>4&15,4);
+			o[2] = e ? to5(v&15,4) : to5(v>>1&7,3);
+			o[3] = (v>>12&7)<<1;
+		}
+	}
+}
+
+/**
+ * @brief corners returns the four blocks whose colors are interpolated for
+ * pixel (x,y) and their weights, which sum up to 1<<l.shift.
+ */
+static inline void corners(const Layout& l, int x, int y, int* b, int* wt)
+{
+	const int px = x+l.w-l.bw/2;
+	const int py = y+l.h-2;
+	const int fx = px%l.bw;
+	const int fy = py%4;
+	const int x0 = px/l.bw%l.nx;
+	const int y0 = py/4%l.ny;
+	const int x1 = (x0+1)%l.nx;
+	const int y1 = (y0+1)%l.ny;
+	b[0] = y0*l.nx+x0;
+	b[1] = y0*l.nx+x1;
+	b[2] = y1*l.nx+x0;
+	b[3] = y1*l.nx+x1;
+	wt[0] = (l.bw-fx)*(4-fy);
+	wt[1] = fx*(4-fy);
+	wt[2] = (l.bw-fx)*fy;
+	wt[3] = fx*fy;
+}
+
+/**
+ * @brief interpolate computes the colors A and B of pixel (x,y) in 8 bits.
+ * @param cols - the unpacked colors of all blocks.
+ * @param ab - A in ab[0-3], B in ab[4-7].
+ */
+static inline void interpolate(const Layout& l, const int* cols, int x, int y, int* ab)
+{
+	int b[4], wt[4];
+	corners(l,x,y,b,wt);
+	for(int i = 0 ; i < 8;i++)
+	{
+		const int v = wt[0]*cols[b[0]*8+i]+wt[1]*cols[b[1]*8+i]+
+					  wt[2]*cols[b[2]*8+i]+wt[3]*cols[b[3]*8+i];
+		ab[i] = (i&3) == 3 ? (v>>l.shift)+(v>>(l.shift-4)) : (v>>(l.shift+2))+(v>>(l.shift-3));
+	}
+}
+
+static inline int modulate(int a, int b, int m)
+{
+	return (a*(8-m)+b*m)/8;
+}
+
+/**
+ * @brief The PvrtcImage struct holds the pixels of a layer and their encoding.
+ */
+struct PvrtcImage
+{
+	Layout l;
+	// l.w x l.h RGBA pixels
+	std::vector<uint8_t> px;
+	// the high word of each block (the mode bit is always 0)
+	std::vector<uint32_t> color;
+	// its colors, see unpack_colors
+	std::vector<int> cols;
+	// blocks with any alpha below 255 use translucent colors
+	std::vector<uint8_t> translucent;
+	// the modulation of each pixel, 0-3 (4bpp) or 0-1 (2bpp)
+	std::vector<uint8_t> mod;
+
+	PvrtcImage(int w, int h, bool two_bpp)
+		:l(w,h,two_bpp),px(size_t(l.w)*l.h*4),color(size_t(l.nx)*l.ny),
+		  cols(color.size()*8),translucent(color.size()),mod(size_t(l.w)*l.h)
+	{}
+
+	const int* weights() const
+	{
+		static const int w4[4] = {0,3,5,8};
+		static const int w2[2] = {0,8};
+		return l.bw == 4 ? w4 : w2;
+	}
+};
+
+static void set_colors(PvrtcImage& im, int b, const float* a, const float* c)
+{
+	const bool opaque = !im.translucent[b];
+	im.color[b] = pack_color(a,opaque,false)|pack_color(c,opaque,true)<<16;
+	unpack_colors(im.color[b],&im.cols[size_t(b)*8]);
+}
+
+/**
+ * @brief fit_block sets the colors of block (bx,by) to the ends of the
+ * principal axis of its pixels.
+ */
+static void fit_block(PvrtcImage& im, int bx, int by)
+{
+	const Layout& l = im.l;
+	const int b = by*l.nx+bx;
+	const int n = l.bw*4;
+	std::vector<float> p(n*4);
+	float mean[4] = {0,0,0,0};
+	bool translucent = false;
+	for(int y = 0 ; y < 4;y++)
+		for(int x = 0 ; x < l.bw;x++)
+		{
+			const uint8_t* s = &im.px[(size_t(by*4+y)*l.w+bx*l.bw+x)*4];
+			for(int ch = 0 ; ch < 4;ch++)
+			{
+				p[(y*l.bw+x)*4+ch] = s[ch];
+				mean[ch] += s[ch];
+			}
+			translucent |= s[3] < 255;
+		}
+	im.translucent[b] = translucent;
+	for(int ch = 0 ; ch < 4;ch++)
+		mean[ch] /= float(n);
+
+	float cov[4][4] = {};
+	for(int i = 0 ; i < n;i++)
+		for(int r = 0 ; r < 4;r++)
+			for(int c = 0 ; c < 4;c++)
+				cov[r][c] += (p[i*4+r]-mean[r])*(p[i*4+c]-mean[c]);
+	float axis[4] = {1,1,1,1};
+	for(int it = 0 ; it < 8;it++)
+	{
+		float v[4] = {0,0,0,0};
+		for(int r = 0 ; r < 4;r++)
+			for(int c = 0 ; c < 4;c++)
+				v[r] += cov[r][c]*axis[c];
+		const float len = std::sqrt(v[0]*v[0]+v[1]*v[1]+v[2]*v[2]+v[3]*v[3]);
+		if(len < 1e-6f)
+			break;
+		for(int ch = 0 ; ch < 4;ch++)
+			axis[ch] = v[ch]/len;
+	}
+
+	float tmin = 0, tmax = 0;
+	for(int i = 0 ; i < n;i++)
+	{
+		float t = 0;
+		for(int ch = 0 ; ch < 4;ch++)
+			t += (p[i*4+ch]-mean[ch])*axis[ch];
+		tmin = std::min(tmin,t);
+		tmax = std::max(tmax,t);
+	}
+	float e[2][4];
+	for(int ch = 0 ; ch < 4;ch++)
+	{
+		e[0][ch] = std::min(255.0f,std::max(0.0f,mean[ch]+tmin*axis[ch]));
+		e[1][ch] = std::min(255.0f,std::max(0.0f,mean[ch]+tmax*axis[ch]));
+	}
+	set_colors(im,b,e[0],e[1]);
+}
+
+/**
+ * @brief modulate_row selects the modulation of the pixels of the row of
+ * blocks by with the lowest squared error.
+ */
+static void modulate_row(PvrtcImage& im, int by)
+{
+	const Layout& l = im.l;
+	const int* wts = im.weights();
+	const int n = l.bw == 4 ? 4 : 2;
+	for(int y = by*4 ; y < by*4+4;y++)
+		for(int x = 0 ; x < l.w;x++)
+		{
+			int ab[8];
+			interpolate(l,im.cols.data(),x,y,ab);
+			const uint8_t* p = &im.px[(size_t(y)*l.w+x)*4];
+			int best = 0, best_err = INT32_MAX;
+			for(int k = 0 ; k < n;k++)
+			{
+				int err = 0;
+				for(int ch = 0 ; ch < 4;ch++)
+				{
+					const int d = modulate(ab[ch],ab[4+ch],wts[k])-p[ch];
+					err += d*d;
+				}
+				if(err < best_err)
+				{
+					best_err = err;
+					best = k;
+				}
+			}
+			im.mod[size_t(y)*l.w+x] = best;
+		}
+}
+
+/**
+ * @brief refine_block fits the colors of block (bx,by) by least squares to
+ * the pixels they affect, keeping the modulation and the colors of the other
+ * blocks. The pixels are those between the centers of the neighbouring
+ * blocks, so blocks two apart can be refined concurrently.
+ */
+static void refine_block(PvrtcImage& im, int bx, int by)
+{
+	const Layout& l = im.l;
+	const int j = by*l.nx+bx;
+	const int* wts = im.weights();
+	const float scale = 1.0f/float(8<<l.shift);
+	int c8[8];
+	for(int i = 0 ; i < 8;i++)
+		c8[i] = (i&3) == 3 ? 17*im.cols[size_t(j)*8+i] : expand8(im.cols[size_t(j)*8+i],5,false);
+
+	// normal equations of A and B, the same for all channels
+	float aa = 0, ab = 0, bb = 0;
+	float xa[4] = {0,0,0,0}, xb[4] = {0,0,0,0};
+	const int cx = bx*l.bw+l.bw/2;
+	const int cy = by*4+2;
+	for(int dy = -3 ; dy <= 3;dy++)
+		for(int dx = 1-l.bw ; dx < l.bw;dx++)
+		{
+			const int x = (cx+dx+l.w)%l.w;
+			const int y = (cy+dy+l.h)%l.h;
+			int b[4], wt[4];
+			corners(l,x,y,b,wt);
+			const int m = wts[im.mod[size_t(y)*l.w+x]];
+			int wj = 0;
+			float rest[8] = {0,0,0,0,0,0,0,0};
+			for(int k = 0 ; k < 4;k++)
+			{
+				if(b[k] == j)
+				{
+					wj += wt[k];
+					continue;
+				}
+				const int* c = &im.cols[size_t(b[k])*8];
+				for(int i = 0 ; i < 8;i++)
+					rest[i] += wt[k]*((i&3) == 3 ? 17*c[i] : expand8(c[i],5,false));
+			}
+			if(!wj)
+				continue;
+			const float alpha = wj*(8-m)*scale;
+			const float beta = wj*m*scale;
+			aa += alpha*alpha;
+			ab += alpha*beta;
+			bb += beta*beta;
+			const uint8_t* p = &im.px[(size_t(y)*l.w+x)*4];
+			for(int ch = 0 ; ch < 4;ch++)
+			{
+				const float r = p[ch]-(rest[ch]*(8-m)+rest[4+ch]*m)*scale;
+				xa[ch] += alpha*r;
+				xb[ch] += beta*r;
+			}
+		}
+
+	// a small pull towards the current colors keeps the system solvable
+	// when all pixels have the same modulation
+	const float lambda = 1e-3f*(aa+bb)+1e-6f;
+	const float a = aa+lambda, d = bb+lambda;
+	const float det = a*d-ab*ab;
+	float e[2][4];
+	for(int ch = 0 ; ch < 4;ch++)
+	{
+		const float ra = xa[ch]+lambda*c8[ch];
+		const float rb = xb[ch]+lambda*c8[4+ch];
+		e[0][ch] = std::min(255.0f,std::max(0.0f,(d*ra-ab*rb)/det));
+		e[1][ch] = std::min(255.0f,std::max(0.0f,(a*rb-ab*ra)/det));
+	}
+	set_colors(im,j,e[0],e[1]);
+}
+
+static inline void store_le(uint8_t* dst, uint32_t v)
+{
+	dst[0] = v;
+	dst[1] = v>>8;
+	dst[2] = v>>16;
+	dst[3] = v>>24;
+}
+
+static inline uint32_t load_le(const uint8_t* src)
+{
+	return uint32_t(src[0])|uint32_t(src[1])<<8|uint32_t(src[2])<<16|uint32_t(src[3])<<24;
+}
+
+void pvrtc_encode(uint8_t* dst, const uint8_t* rgba, int w, int h, bool two_bpp, BlockQuality q)
+{
+	PvrtcImage im(w,h,two_bpp);
+	const Layout& l = im.l;
+	// the padding repeats the image
+	for(int y = 0 ; y < l.h;y++)
+		for(int x = 0 ; x < l.w;x++)
+			memcpy(&im.px[(size_t(y)*l.w+x)*4],rgba+(size_t(y%h)*w+x%w)*4,4);
+
+	parallel_for(0,l.ny,[&](int by)
+	{
+		for(int bx = 0 ; bx < l.nx;bx++)
+			fit_block(im,bx,by);
+	});
+	parallel_for(0,l.ny,[&](int by){modulate_row(im,by);});
+
+	const int rounds = q == BlockQuality::FAST ? 0 : q == BlockQuality::NORMAL ? 2 : 6;
+	for(int r = 0 ; r < rounds;r++)
+	{
+		// nx and ny are even, so blocks of the same phase never share pixels
+		for(int phase = 0 ; phase < 4;phase++)
+		{
+			parallel_for(0,l.ny/2,[&](int i)
+			{
+				const int by = 2*i+(phase>>1);
+				for(int bx = phase&1 ; bx < l.nx;bx += 2)
+					refine_block(im,bx,by);
+			});
+		}
+		parallel_for(0,l.ny,[&](int by){modulate_row(im,by);});
+	}
+
+	parallel_for(0,l.ny,[&](int by)
+	{
+		for(int bx = 0 ; bx < l.nx;bx++)
+		{
+			uint32_t bits = 0;
+			for(int y = 0 ; y < 4;y++)
+				for(int x = 0 ; x < l.bw;x++)
+				{
+					const uint32_t m = im.mod[size_t(by*4+y)*l.w+bx*l.bw+x];
+					bits |= two_bpp ? m<<(y*8+x) : m<<(2*(y*4+x));
+				}
+			uint8_t* d = dst+size_t(twiddle(bx,by,l.nx,l.ny))*8;
+			store_le(d,bits);
+			store_le(d+4,im.color[size_t(by)*l.nx+bx]);
+		}
+	});
+}
+
+/**
+ * @brief unpack_modulation_2bpp stores the modulation codes (0-3) of a 2bpp
+ * block and, for each pixel, 0 if its code is final or 1, 2 or 3 if it is
+ * interpolated from its four, horizontal or vertical neighbours.
+ */
+static void unpack_modulation_2bpp(uint32_t bits, bool mode, uint8_t* code, uint8_t* interp,
+								   size_t stride)
+{
+	if(!mode)
+	{
+		for(int y = 0 ; y < 4;y++)
+			for(int x = 0 ; x < 8;x++)
+			{
+				code[y*stride+x] = (bits>>(y*8+x)&1)*3;
+				interp[y*stride+x] = 0;
+			}
+		return;
+	}
+	int m = 1;
+	if(bits & 1)
+	{
+		// the low bit of the center pixel selects vertical or horizontal,
+		// it takes its high bit instead
+		m = bits & 1u<<20 ? 3 : 2;
+		bits = bits & 1u<<21 ? bits|1u<<20 : bits&~(1u<<20);
+	}
+	bits = bits & 2 ? bits|1 : bits&~1u;
+	for(int y = 0 ; y < 4;y++)
+		for(int x = 0 ; x < 8;x++)
+		{
+			if(((x^y)&1) == 0)
+			{
+				code[y*stride+x] = bits&3;
+				interp[y*stride+x] = 0;
+				bits >>= 2;
+			}
+			else
+				interp[y*stride+x] = m;
+		}
+}
+
+void pvrtc_decode(uint8_t* rgba, const uint8_t* src, int w, int h, bool two_bpp)
+{
+	const Layout l(w,h,two_bpp);
+	static const int values[4] = {0,3,5,8};
+	std::vector<int> cols(size_t(l.nx)*l.ny*8);
+	// the modulation of each pixel, 16 is added for punch-through
+	std::vector<uint8_t> mod(size_t(l.w)*l.h);
+	std::vector<uint8_t> code, interp;
+	if(two_bpp)
+	{
+		code.resize(mod.size());
+		interp.resize(mod.size());
+	}
+	parallel_for(0,l.ny,[&](int by)
+	{
+		for(int bx = 0 ; bx < l.nx;bx++)
+		{
+			const uint8_t* s = src+size_t(twiddle(bx,by,l.nx,l.ny))*8;
+			const uint32_t bits = load_le(s);
+			const uint32_t word = load_le(s+4);
+			unpack_colors(word,&cols[(size_t(by)*l.nx+bx)*8]);
+			const size_t p = size_t(by*4)*l.w+bx*l.bw;
+			if(two_bpp)
+			{
+				unpack_modulation_2bpp(bits,word&1,&code[p],&interp[p],l.w);
+				continue;
+			}
+			for(int i = 0 ; i < 16;i++)
+			{
+				const int c = bits>>(2*i)&3;
+				mod[p+size_t(i/4)*l.w+i%4] = !(word&1) ? values[c] : c == 2 ? 4+16 : c == 3 ? 8 : c*4;
+			}
+		}
+	});
+	if(two_bpp)
+	{
+		parallel_for(0,l.ny,[&](int by)
+		{
+			for(int y = by*4 ; y < by*4+4;y++)
+				for(int x = 0 ; x < l.w;x++)
+				{
+					const size_t i = size_t(y)*l.w+x;
+					const int left = values[code[size_t(y)*l.w+(x+l.w-1)%l.w]];
+					const int right = values[code[size_t(y)*l.w+(x+1)%l.w]];
+					const int up = values[code[size_t((y+l.h-1)%l.h)*l.w+x]];
+					const int down = values[code[size_t((y+1)%l.h)*l.w+x]];
+					switch(interp[i])
+					{
+					case 0: mod[i] = values[code[i]]; break;
+					case 1: mod[i] = (left+right+up+down+2)/4; break;
+					case 2: mod[i] = (left+right+1)/2; break;
+					default: mod[i] = (up+down+1)/2; break;
+					}
+				}
+		});
+	}
+	parallel_for(0,h,[&](int y)
+	{
+		for(int x = 0 ; x < w;x++)
+		{
+			int ab[8];
+			interpolate(l,cols.data(),x,y,ab);
+			const int m = mod[size_t(y)*l.w+x];
+			uint8_t* d = rgba+(size_t(y)*w+x)*4;
+			for(int ch = 0 ; ch < 4;ch++)
+				d[ch] = modulate(ab[ch],ab[4+ch],m&15);
+			if(m & 16)
+				d[3] = 0;
+		}
+	});
+}
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <cstdint>
+#include "td_block.h"
+namespace td {
+
+/**
+ * @brief pvrtc_encode encodes a w x h image to PVRTC1 with 4 bits (blocks of
+ * 4x4 pixels) or 2 bits per pixel (8x4). Each block stores two low resolution
+ * colors A and B, which are interpolated bilinearly between the neighbouring
+ * blocks, and the modulation of each pixel between them, so the whole layer
+ * is encoded at once. The colors are fitted to the principal axis of each
+ * block, NORMAL and BEST refine them by least squares over the pixels they
+ * affect (2 and 6 rounds). Both passes run on all threads.
+ * The data has pvrtc_extent(w) x pvrtc_extent(h) pixels, smaller images are
+ * repeated to fill it (as the texture wraps around).
+ * @param dst - layer_size(w,h,...) bytes.
+ * @param rgba - h rows of w RGBA pixels.
+ * @param w
+ * @param h
+ * @param two_bpp - use 2 bits per pixel.
+ * @param q
+ */
+void pvrtc_encode(uint8_t* dst, const uint8_t* rgba, int w, int h, bool two_bpp, BlockQuality q);
+
+/**
+ * @brief pvrtc_decode decodes a PVRTC1 layer to w x h RGBA pixels, the top
+ * left part of its data. All modulation modes are supported.
+ * @param rgba - h rows of w pixels.
+ * @param src - layer_size(w,h,...) bytes.
+ * @param w
+ * @param h
+ * @param two_bpp
+ */
+void pvrtc_decode(uint8_t* rgba, const uint8_t* src, int w, int h, bool two_bpp);
+}
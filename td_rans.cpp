@@ -0,0 +1,637 @@
+#include "td_rans.h"
+#include "td_codec.h"
+#include "td_cpu.h"
+#include "td_thread.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
+#if TD_SSE2
+#include <immintrin.h>
+#endif
+
+namespace td
+{
+
+/*
+ * A compressed chunk is
+ *   predictor of each field (1 byte)
+ *   frequencies of each field (a varint per symbol, summing up to PROB_ONE)
+ *   the 32 rANS states (32 bit)
+ *   the 16 bit words of the rANS streams
+ * The residuals of the fields are coded one field after the other, symbol i
+ * uses state i%32. Decoding symbol i renormalizes state i%32 right away, so
+ * the words are read in the same order when 32 symbols are decoded at once.
+ */
+static const int PROB_BITS = 12;
+static const uint32_t PROB_ONE = 1u<<PROB_BITS;
+static const uint32_t RANS_L = 1u<<16;
+static const int LANES = 32;
+
+enum Predictor : uint8_t
+{
+	PRED_NONE,
+	PRED_LEFT,
+	PRED_UP,
+	PRED_PAETH,
+	PRED_COUNT
+};
+
+// the predictor of PNG, selecting without branches
+static inline uint8_t paeth(int a, int b, int c)
+{
+	const int pa = std::abs(b-c);
+	const int pb = std::abs(a-c);
+	const int pc = std::abs(a+b-2*c);
+	const int sb = -int(pb <= pc);
+	const int sa = -int((pa <= pb)&(pa <= pc));
+	const int r = (b&sb)|(c&~sb);
+	return uint8_t((a&sa)|(r&~sa));
+}
+
+static inline uint8_t predict(Predictor pr, const uint8_t* row, const uint8_t* up, int x)
+{
+	const uint8_t a = x > 0 ? row[x-1] : 0;
+	const uint8_t b = up ? up[x] : 0;
+	const uint8_t c = x > 0 && up ? up[x-1] : 0;
+	switch(pr)
+	{
+	case PRED_LEFT: return a;
+	case PRED_UP: return b;
+	case PRED_PAETH: return paeth(a,b,c);
+	default: return 0;
+	}
+}
+
+static uint8_t* write_varint(uint8_t* p, uint32_t v)
+{
+	for(; v >= 0x80; v>>=7)
+		*p++ = uint8_t(v|0x80);
+	*p++ = uint8_t(v);
+	return p;
+}
+
+static bool read_varint(const uint8_t*& p, const uint8_t* end, uint32_t& v)
+{
+	v = 0;
+	for(int s = 0; s < 21; s+=7)
+	{
+		if(p == end)
+			return false;
+		const uint8_t b = *p++;
+		v |= uint32_t(b&0x7F)<<s;
+		if(!(b&0x80))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * @brief normalize scales the counts of the n symbols to frequencies summing
+ * up to PROB_ONE, every symbol that occurs keeps a frequency of at least 1.
+ */
+static void normalize(const uint32_t* count, int n, uint32_t* freq)
+{
+	uint64_t total = 0;
+	for(int s = 0 ; s < n;s++)
+		total += count[s];
+	uint32_t sum = 0;
+	for(int s = 0 ; s < n;s++)
+	{
+		freq[s] = count[s] ? std::max<uint32_t>(1,uint32_t(count[s]*uint64_t(PROB_ONE)/total)) : 0;
+		sum += freq[s];
+	}
+	// the rounding error is taken from (or given to) the largest frequencies
+	while(sum != PROB_ONE)
+	{
+		int m = int(std::max_element(freq,freq+n)-freq);
+		if(sum < PROB_ONE)
+		{
+			freq[m] += PROB_ONE-sum;
+			sum = PROB_ONE;
+		}
+		else
+		{
+			const uint32_t d = std::min(sum-PROB_ONE,freq[m]/2);
+			freq[m] -= d;
+			sum -= d;
+		}
+	}
+}
+
+// the estimated number of bits to code the symbols counted
+static double entropy(const uint32_t* count, int n)
+{
+	double total = 0, bits = 0;
+	for(int s = 0 ; s < n;s++)
+	{
+		total += count[s];
+		if(count[s])
+			bits -= count[s]*std::log2(double(count[s]));
+	}
+	return total > 0 ? bits+total*std::log2(total) : 0;
+}
+
+static inline uint32_t field_mask(const PixelFields& p, uint32_t f)
+{
+	return (1u<<p.bits[f])-1;
+}
+
+static inline uint32_t load_pixel(const uint8_t* s, uint32_t bytes)
+{
+	uint32_t v = 0;
+	memcpy(&v,s,bytes);
+	return v;
+}
+
+// extracts field f of n pixels
+static void extract_field(uint8_t* dst, const uint8_t* src, size_t n,
+						  const PixelFields& p, uint32_t f)
+{
+	const uint32_t m = field_mask(p,f);
+	for(size_t i = 0 ; i < n;i++)
+		dst[i] = (load_pixel(src+i*p.bytes,p.bytes)>>p.shift[f])&m;
+}
+
+/**
+ * @brief compress_chunk codes the w x h pixels of src to out.
+ * @return the size of the result.
+ */
+static size_t compress_chunk(std::vector<uint8_t>& out, const uint8_t* src, int w, int h,
+							 const PixelFields& p)
+{
+	const size_t n = size_t(w)*h;
+	std::vector<uint8_t> values(n);
+	std::vector<uint8_t> residuals(n*p.n);
+	std::vector<uint32_t> freqs(p.n*256);
+	uint8_t predictors[4];
+
+	for(uint32_t f = 0 ; f < p.n;f++)
+	{
+		extract_field(values.data(),src,n,p,f);
+		const uint32_t m = field_mask(p,f);
+		const int symbols = 1<<p.bits[f];
+
+		// the predictor with the lowest entropy of the residuals is used
+		std::vector<uint32_t> count(PRED_COUNT*256,0);
+		for(int y = 0 ; y < h;y++)
+		{
+			const uint8_t* row = values.data()+size_t(y)*w;
+			const uint8_t* up = y > 0 ? row-w : nullptr;
+			for(int x = 0 ; x < w;x++)
+				for(int pr = 0 ; pr < PRED_COUNT;pr++)
+					count[pr*256+((row[x]-predict(Predictor(pr),row,up,x))&m)]++;
+		}
+		int best = 0;
+		double best_bits = entropy(count.data(),symbols);
+		for(int pr = 1 ; pr < PRED_COUNT;pr++)
+		{
+			const double bits = entropy(count.data()+pr*256,symbols);
+			if(bits < best_bits)
+			{
+				best = pr;
+				best_bits = bits;
+			}
+		}
+		predictors[f] = uint8_t(best);
+		normalize(count.data()+best*256,symbols,freqs.data()+f*256);
+
+		uint8_t* r = residuals.data()+f*n;
+		for(int y = 0 ; y < h;y++)
+		{
+			const uint8_t* row = values.data()+size_t(y)*w;
+			const uint8_t* up = y > 0 ? row-w : nullptr;
+			for(int x = 0 ; x < w;x++)
+				*r++ = (row[x]-predict(Predictor(best),row,up,x))&m;
+		}
+	}
+
+	// rANS codes the symbols backwards, the words are reversed afterwards
+	std::vector<uint32_t> cum(p.n*256);
+	for(uint32_t f = 0 ; f < p.n;f++)
+		for(int s = 1 ; s < 256;s++)
+			cum[f*256+s] = cum[f*256+s-1]+freqs[f*256+s-1];
+	uint32_t x[LANES];
+	std::fill(x,x+LANES,RANS_L);
+	std::vector<uint16_t> words;
+	words.reserve(n*p.n/2);
+	for(size_t i = n*p.n; i-- > 0;)
+	{
+		const size_t f = i/n;
+		const uint8_t s = residuals[i];
+		const uint32_t fr = freqs[f*256+s];
+		uint32_t& xi = x[i%LANES];
+		if(xi >= (uint64_t(RANS_L>>PROB_BITS)<<16)*fr)
+		{
+			words.push_back(uint16_t(xi));
+			xi >>= 16;
+		}
+		xi = ((xi/fr)<<PROB_BITS)+xi%fr+cum[f*256+s];
+	}
+	std::reverse(words.begin(),words.end());
+
+	out.resize(p.n+p.n*256*2+sizeof(x)+words.size()*sizeof(uint16_t));
+	uint8_t* o = out.data();
+	for(uint32_t f = 0 ; f < p.n;f++)
+		*o++ = predictors[f];
+	for(uint32_t f = 0 ; f < p.n;f++)
+		for(int s = 0 ; s < (1<<p.bits[f]);s++)
+			o = write_varint(o,freqs[f*256+s]);
+	memcpy(o,x,sizeof(x));
+	o += sizeof(x);
+	if(!words.empty())
+		memcpy(o,words.data(),words.size()*sizeof(uint16_t));
+	o += words.size()*sizeof(uint16_t);
+	out.resize(o-out.data());
+	return out.size();
+}
+
+/**
+ * @brief unpredict adds the predictions to the residuals of a w x h field
+ * plane v, in place (see unpaeth for PRED_PAETH).
+ */
+static void unpredict(uint8_t* v, int w, int h, Predictor pr, uint32_t m)
+{
+	for(int y = 0 ; y < h;y++)
+	{
+		uint8_t* row = v+size_t(y)*w;
+		const uint8_t* up = row-w;
+		if(pr == PRED_LEFT)
+		{
+			// the left neighbour is kept in a register
+			for(int x = 1, l = row[0]; x < w;x++)
+				row[x] = l = (row[x]+l)&m;
+		}
+		else if(pr == PRED_UP && y > 0)
+		{
+			for(int x = 0 ; x < w;x++)
+				row[x] = (row[x]+up[x])&m;
+		}
+	}
+}
+
+static inline int unpaeth_step(uint8_t* row, const uint8_t* up, int x, int l, uint32_t m)
+{
+	return row[x] = uint8_t((row[x]+paeth(l,up[x],up[x-1]))&m);
+}
+
+/**
+ * @brief unpaeth undoes PRED_PAETH for N field planes v at once. Each pixel
+ * depends on its left neighbour, so the fields are interleaved to process
+ * their chains in parallel (unrolled, so the left neighbours stay in
+ * registers).
+ */
+template<int N>
+static void unpaeth(uint8_t* const* v, const uint32_t* m, int w, int h)
+{
+	for(int y = 0 ; y < h;y++)
+	{
+		uint8_t* row[4];
+		const uint8_t* up[4];
+		int l[4];
+		for(int k = 0 ; k < N;k++)
+		{
+			row[k] = v[k]+size_t(y)*w;
+			up[k] = row[k]-w;
+			// paeth(0,b,0) = b
+			if(y > 0)
+				row[k][0] = (row[k][0]+up[k][0])&m[k];
+			l[k] = row[k][0];
+		}
+		if(y == 0)
+		{
+			// paeth(a,0,0) = a
+			for(int k = 0 ; k < N;k++)
+				for(int x = 1 ; x < w;x++)
+					row[k][x] = l[k] = (row[k][x]+l[k])&m[k];
+			continue;
+		}
+		for(int x = 1 ; x < w;x++)
+		{
+			l[0] = unpaeth_step(row[0],up[0],x,l[0],m[0]);
+			if(N > 1)
+				l[1] = unpaeth_step(row[1],up[1],x,l[1],m[1]);
+			if(N > 2)
+				l[2] = unpaeth_step(row[2],up[2],x,l[2],m[2]);
+			if(N > 3)
+				l[3] = unpaeth_step(row[3],up[3],x,l[3],m[3]);
+		}
+	}
+}
+
+// a decoding table entry is freq-1 | (slot-cum)<<12 | symbol<<24
+static inline bool decode_symbol(uint32_t& x, const uint32_t* t, const uint16_t*& w,
+								 const uint16_t* end, uint8_t& s)
+{
+	const uint32_t e = t[x&(PROB_ONE-1)];
+	s = uint8_t(e>>24);
+	x = ((e&0xFFF)+1)*(x>>PROB_BITS)+((e>>12)&0xFFF);
+	if(x < RANS_L)
+	{
+		if(w == end)
+			return false;
+		x = (x<<16)|*w++;
+	}
+	return true;
+}
+
+/*
+ * decode kernels decode the n symbols of a field while enough words are left,
+ * starting with state 0. They return the number of symbols decoded.
+ */
+typedef size_t (*decode_fn)(uint32_t* x, const uint16_t*& w, const uint16_t* end,
+							const uint32_t* t, uint8_t* out, size_t n);
+
+static size_t decode_scalar(uint32_t* x, const uint16_t*& w, const uint16_t* end,
+							const uint32_t* t, uint8_t* out, size_t n)
+{
+	size_t i = 0;
+	for(; i+LANES <= n && end-w >= LANES; i+=LANES)
+		for(int l = 0 ; l < LANES;l++)
+			decode_symbol(x[l],t,w,end,out[i+l]);
+	return i;
+}
+
+#if TD_SSE2
+struct RenormTable
+{
+	// lane k of 8 renormalized states takes word perm[mask][k]
+	alignas(32) uint32_t perm[256][8];
+	uint8_t count[256];
+	RenormTable()
+	{
+		for(int m = 0 ; m < 256;m++)
+		{
+			int c = 0;
+			for(int k = 0 ; k < 8;k++)
+			{
+				perm[m][k] = c;
+				if(m&(1<<k))
+					c++;
+			}
+			count[m] = uint8_t(c);
+		}
+	}
+};
+
+// the states are held in 4 vectors of 8, which are independent, so the
+// latencies of the gathers overlap
+TD_TARGET("avx2")
+static size_t decode_avx2(uint32_t* xs, const uint16_t*& w, const uint16_t* end,
+						  const uint32_t* t, uint8_t* out, size_t n)
+{
+	static const RenormTable rt;
+	const __m256i slot = _mm256_set1_epi32(PROB_ONE-1);
+	const __m256i m12 = _mm256_set1_epi32(0xFFF);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i lm1 = _mm256_set1_epi32(RANS_L-1);
+	const __m256i low = _mm256_setr_epi32(0,4,0,0,0,0,0,0);
+	__m256i x[4];
+	for(int v = 0 ; v < 4;v++)
+		x[v] = _mm256_loadu_si256((const __m256i*)(xs+v*8));
+	size_t i = 0;
+	for(; i+LANES <= n && end-w >= LANES; i+=LANES)
+	{
+		for(int v = 0 ; v < 4;v++)
+		{
+			const __m256i e = _mm256_i32gather_epi32((const int*)t,_mm256_and_si256(x[v],slot),4);
+			const __m256i f = _mm256_add_epi32(_mm256_and_si256(e,m12),one);
+			const __m256i b = _mm256_and_si256(_mm256_srli_epi32(e,12),m12);
+			x[v] = _mm256_add_epi32(_mm256_mullo_epi32(f,_mm256_srli_epi32(x[v],PROB_BITS)),b);
+
+			__m256i s = _mm256_srli_epi32(e,24);
+			s = _mm256_packus_epi16(_mm256_packus_epi32(s,s),s);
+			s = _mm256_permutevar8x32_epi32(s,low);
+			_mm_storel_epi64((__m128i*)(out+i+v*8),_mm256_castsi256_si128(s));
+		}
+		// the states below RANS_L take the next words in lane order
+		for(int v = 0 ; v < 4;v++)
+		{
+			const __m256i lt = _mm256_cmpeq_epi32(_mm256_min_epu32(x[v],lm1),x[v]);
+			const int m = _mm256_movemask_ps(_mm256_castsi256_ps(lt));
+			const __m256i wd = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)w));
+			const __m256i wl = _mm256_permutevar8x32_epi32(wd,_mm256_load_si256((const __m256i*)rt.perm[m]));
+			x[v] = _mm256_blendv_epi8(x[v],_mm256_or_si256(_mm256_slli_epi32(x[v],16),wl),lt);
+			w += rt.count[m];
+		}
+	}
+	for(int v = 0 ; v < 4;v++)
+		_mm256_storeu_si256((__m256i*)(xs+v*8),x[v]);
+	return i;
+}
+#endif
+
+static const KernelTable<decode_fn> decode_kernels = {{
+	decode_scalar,
+#if TD_SSE2
+	nullptr,nullptr,decode_avx2
+#endif
+}};
+
+/**
+ * @brief decompress_chunk decodes the w x h pixels of dst from the size bytes
+ * of src.
+ */
+static bool decompress_chunk(uint8_t* dst, int w, int h, const PixelFields& p,
+							 const uint8_t* src, size_t size)
+{
+	const size_t n = size_t(w)*h;
+	const uint8_t* const end = src+size;
+	if(size < p.n)
+		return false;
+	uint8_t predictors[4];
+	for(uint32_t f = 0 ; f < p.n;f++)
+	{
+		predictors[f] = *src++;
+		if(predictors[f] >= PRED_COUNT)
+			return false;
+	}
+
+	std::vector<uint32_t> tables(p.n*PROB_ONE);
+	for(uint32_t f = 0 ; f < p.n;f++)
+	{
+		uint32_t* t = tables.data()+f*PROB_ONE;
+		uint32_t cum = 0;
+		for(int s = 0 ; s < (1<<p.bits[f]);s++)
+		{
+			uint32_t fr;
+			if(!read_varint(src,end,fr) || fr > PROB_ONE-cum)
+				return false;
+			for(uint32_t k = 0 ; k < fr;k++)
+				t[cum+k] = (fr-1)|(k<<12)|(uint32_t(s)<<24);
+			cum += fr;
+		}
+		if(cum != PROB_ONE)
+			return false;
+	}
+
+	uint32_t x[LANES];
+	if(size_t(end-src) < sizeof(x) || (end-src-sizeof(x))%sizeof(uint16_t))
+		return false;
+	memcpy(x,src,sizeof(x));
+	src += sizeof(x);
+	for(uint32_t xi : x)
+		if(xi < RANS_L)
+			return false;
+	// the words are copied, as they may not be aligned
+	std::vector<uint16_t> words((end-src)/sizeof(uint16_t));
+	if(!words.empty())
+		memcpy(words.data(),src,end-src);
+	const uint16_t* wp = words.data();
+	const uint16_t* wend = wp+(end-src)/sizeof(uint16_t);
+
+	std::vector<uint8_t> values(n*p.n);
+	uint8_t* paeth_planes[4];
+	uint32_t paeth_masks[4];
+	int n_paeth = 0;
+	const decode_fn decode = decode_kernels.select();
+	for(uint32_t f = 0 ; f < p.n;f++)
+	{
+		const uint32_t* t = tables.data()+f*PROB_ONE;
+		uint8_t* v = values.data()+f*n;
+		size_t i = f*n;
+		const size_t e = i+n;
+		// the kernel starts with state 0
+		for(; i < e && i%LANES; i++)
+			if(!decode_symbol(x[i%LANES],t,wp,wend,values[i]))
+				return false;
+		if(e-i >= LANES)
+			i += decode(x,wp,wend,t,values.data()+i,e-i);
+		for(; i < e; i++)
+			if(!decode_symbol(x[i%LANES],t,wp,wend,values[i]))
+				return false;
+
+		if(predictors[f] == PRED_PAETH)
+		{
+			paeth_planes[n_paeth] = v;
+			paeth_masks[n_paeth++] = field_mask(p,f);
+		}
+		else
+			unpredict(v,w,h,Predictor(predictors[f]),field_mask(p,f));
+	}
+	switch(n_paeth)
+	{
+	case 1: unpaeth<1>(paeth_planes,paeth_masks,w,h); break;
+	case 2: unpaeth<2>(paeth_planes,paeth_masks,w,h); break;
+	case 3: unpaeth<3>(paeth_planes,paeth_masks,w,h); break;
+	case 4: unpaeth<4>(paeth_planes,paeth_masks,w,h); break;
+	}
+	// the encoder started with all states at RANS_L
+	if(wp != wend)
+		return false;
+	for(uint32_t xi : x)
+		if(xi != RANS_L)
+			return false;
+
+	if(p.bytes == 2 && p.n >= 3)
+	{
+		// all 16 bit types have 3 or 4 fields, which are gathered in one pass
+		const uint8_t* v0 = values.data();
+		const uint8_t* v1 = v0+n;
+		const uint8_t* v2 = v1+n;
+		const uint8_t* v3 = p.n == 4 ? v2+n : nullptr;
+		for(size_t i = 0 ; i < n;i++)
+		{
+			uint16_t px = uint16_t(v0[i]<<p.shift[0]|v1[i]<<p.shift[1]|v2[i]<<p.shift[2]);
+			if(v3)
+				px |= uint16_t(v3[i]<<p.shift[3]);
+			memcpy(dst+i*2,&px,2);
+		}
+	}
+	else
+	{
+		// the fields are the bytes
+		for(uint32_t f = 0 ; f < p.n;f++)
+			for(size_t i = 0 ; i < n;i++)
+				dst[i*p.bytes+p.shift[f]/8] = values[f*n+i];
+	}
+	return true;
+}
+
+uint32_t field_chunk_size(int w, const PixelFields &p)
+{
+	const uint32_t row = std::max(1u,uint32_t(w)*p.bytes);
+	return std::max(1u,TD_CHUNK_SIZE/row)*row;
+}
+
+void compress_field_chunks(const void *src, int w, int h, const PixelFields &p,
+						   uint32_t chunk_size, std::vector<uint32_t> &sizes,
+						   std::vector<uint8_t> &data)
+{
+	const uint8_t* s = static_cast<const uint8_t*>(src);
+	const size_t row = size_t(w)*p.bytes;
+	const int rows = int(chunk_size/row);
+	const int count = (h+rows-1)/rows;
+	std::vector<std::vector<uint8_t>> chunks(count);
+	parallel_for(0,count,[&](int i)
+	{
+		const int y0 = i*rows;
+		const int n = std::min(rows,h-y0);
+		const uint8_t* c = s+y0*row;
+		if(compress_chunk(chunks[i],c,w,n,p) >= n*row)
+			chunks[i].assign(c,c+n*row);
+	});
+	for(const auto& c : chunks)
+	{
+		sizes.push_back(uint32_t(c.size()));
+		data.insert(data.end(),c.begin(),c.end());
+	}
+}
+
+bool compress_fields(std::vector<uint8_t> &payload, const void *src, int w, int h,
+					 const PixelFields &p, uint32_t chunk_size)
+{
+	std::vector<uint32_t> sizes;
+	payload.clear();
+	if(w <= 0 || h <= 0)
+		return false;
+	compress_field_chunks(src,w,h,p,chunk_size,sizes,payload);
+	const size_t pos = payload.size();
+	payload.resize(pos+sizes.size()*sizeof(uint32_t));
+	memcpy(payload.data()+pos,sizes.data(),sizes.size()*sizeof(uint32_t));
+	return payload.size() < uint64_t(w)*h*p.bytes;
+}
+
+bool decompress_fields(void *dst, int w, int h, const PixelFields &p,
+					   const void *payload, uint64_t size, uint32_t chunk_size)
+{
+	const uint64_t row = uint64_t(w)*p.bytes;
+	if(w <= 0 || h <= 0 || chunk_size == 0 || chunk_size%row)
+		return false;
+	const int rows = int(chunk_size/row);
+	const int count = (h+rows-1)/rows;
+	if(uint64_t(count) > size/sizeof(uint32_t))
+		return false;
+
+	// the offsets of the chunks, from the table at the end
+	const uint8_t* s = static_cast<const uint8_t*>(payload);
+	const uint8_t* table = s+size-count*sizeof(uint32_t);
+	std::vector<uint64_t> offsets(count+1,0);
+	for(int i = 0 ; i < count;i++)
+	{
+		uint32_t cs;
+		memcpy(&cs,table+i*sizeof(cs),sizeof(cs));
+		offsets[i+1] = offsets[i]+cs;
+	}
+	if(offsets[count] != size-count*sizeof(uint32_t))
+		return false;
+
+	uint8_t* d = static_cast<uint8_t*>(dst);
+	std::atomic<bool> ok(true);
+	parallel_for(0,count,[&](int i)
+	{
+		const int y0 = i*rows;
+		const int n = std::min(rows,h-y0);
+		const size_t len = size_t(n*row);
+		const size_t stored = size_t(offsets[i+1]-offsets[i]);
+		// chunks which did not get smaller are stored raw
+		if(stored == len)
+			memcpy(d+y0*row,s+offsets[i],len);
+		else if(stored > len || !decompress_chunk(d+y0*row,w,n,p,s+offsets[i],stored))
+			ok = false;
+	});
+	return ok.load();
+}
+
+}
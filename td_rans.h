@@ -0,0 +1,74 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+namespace td {
+
+/**
+ * @brief The PixelFields struct describes the bit fields of a pixel, which is
+ * a little endian integer of 1 to 4 bytes, e.g. the R, G and B fields of
+ * UNSIGNED_SHORT_5_6_5 or the channels of UNSIGNED_BYTE.
+ */
+struct PixelFields
+{
+	uint32_t bytes;
+	uint32_t n;
+	uint8_t shift[4];
+	uint8_t bits[4]; // at most 8
+};
+
+/**
+ * @brief field_chunk_size returns the number of raw bytes per chunk of a w
+ * pixel wide image, which is a number of whole rows close to TD_CHUNK_SIZE.
+ */
+uint32_t field_chunk_size(int w, const PixelFields& p);
+
+/**
+ * @brief compress_field_chunks compresses the h rows of src in chunks of
+ * chunk_size bytes (see field_chunk_size) in parallel, appending the results
+ * to data and their sizes to sizes. Each field of a chunk is predicted from
+ * its neighbours (left, up, paeth or none, whichever gives the lowest entropy)
+ * and the residuals are coded with 32 interleaved rANS streams. Chunks which do
+ * not get smaller are stored as they are.
+ * @param src
+ * @param w
+ * @param h
+ * @param p
+ * @param chunk_size
+ * @param sizes
+ * @param data
+ */
+void compress_field_chunks(const void* src, int w, int h, const PixelFields& p,
+						   uint32_t chunk_size, std::vector<uint32_t>& sizes,
+						   std::vector<uint8_t>& data);
+
+/**
+ * @brief compress_fields compresses a w x h image to a payload, which are the
+ * chunks followed by a table of their 32 bit sizes (as compress_payload).
+ * @param payload - the result.
+ * @param src
+ * @param w
+ * @param h
+ * @param p
+ * @param chunk_size
+ * @return false if the payload is not smaller than the image.
+ */
+bool compress_fields(std::vector<uint8_t>& payload, const void* src, int w, int h,
+					 const PixelFields& p, uint32_t chunk_size);
+
+/**
+ * @brief decompress_fields is the inverse of compress_fields, the chunks are
+ * decompressed in parallel. The rANS streams are decoded with AVX2 if
+ * available.
+ * @param dst - the w x h image.
+ * @param w
+ * @param h
+ * @param p
+ * @param payload
+ * @param size - of the payload.
+ * @param chunk_size
+ * @return false if the payload is corrupted.
+ */
+bool decompress_fields(void* dst, int w, int h, const PixelFields& p,
+					   const void* payload, uint64_t size, uint32_t chunk_size);
+}
@@ -0,0 +1,115 @@
+#include "td_thread.h"
+#include <atomic>
+#include <algorithm>
+
+namespace td
+{
+
+static std::atomic<unsigned> g_thread_count(0);
+
+unsigned hardware_threads()
+{
+	return std::max(1u,std::thread::hardware_concurrency());
+}
+
+void set_thread_count(unsigned n)
+{
+	g_thread_count = n;
+}
+
+unsigned thread_count()
+{
+	const unsigned n = g_thread_count;
+	return n ? n : hardware_threads();
+}
+
+ThreadPool::ThreadPool(unsigned n_threads):pending(0),stop(false)
+{
+	if(n_threads == 0)
+		n_threads = thread_count();
+	for(unsigned i = 0 ; i < n_threads;i++)
+		workers.emplace_back(&ThreadPool::work,this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	wait();
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stop = true;
+	}
+	job_cv.notify_all();
+	for(auto& w : workers)
+		w.join();
+}
+
+void ThreadPool::enqueue(std::function<void()> job)
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		jobs.push(std::move(job));
+		pending++;
+	}
+	job_cv.notify_one();
+}
+
+void ThreadPool::wait()
+{
+	std::unique_lock<std::mutex> lock(mtx);
+	done_cv.wait(lock,[this]{return pending == 0;});
+}
+
+void ThreadPool::work()
+{
+	for(;;)
+	{
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			job_cv.wait(lock,[this]{return stop || !jobs.empty();});
+			if(jobs.empty())
+				return;
+			job = std::move(jobs.front());
+			jobs.pop();
+		}
+
+		job();
+
+		std::lock_guard<std::mutex> lock(mtx);
+		if(--pending == 0)
+			done_cv.notify_all();
+	}
+}
+
+void parallel_for(int begin, int end, const std::function<void(int)>& f,
+				  unsigned n_threads)
+{
+	if(end <= begin)
+		return;
+	if(n_threads == 0)
+		n_threads = thread_count();
+	n_threads = std::min<unsigned>(n_threads,end-begin);
+
+	if(n_threads <= 1)
+	{
+		for(int i = begin; i < end;i++)
+			f(i);
+		return;
+	}
+
+	std::atomic<int> next(begin);
+	auto worker = [&]()
+	{
+		for(int i = next++; i < end; i = next++)
+			f(i);
+	};
+
+	std::vector<std::thread> threads;
+	for(unsigned t = 1 ; t < n_threads;t++)
+		threads.emplace_back(worker);
+	worker();
+	for(auto& t : threads)
+		t.join();
+}
+
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+namespace td {
+
+/**
+ * @brief hardware_threads returns the number of hardware threads available
+ * (at least 1).
+ */
+unsigned hardware_threads();
+
+/**
+ * @brief set_thread_count sets the number of threads used by the parallel
+ * algorithms of td. 0 means "use all hardware threads".
+ * @param n
+ */
+void set_thread_count(unsigned n);
+
+/**
+ * @brief thread_count returns the number of threads the parallel algorithms of
+ * td will use (at least 1).
+ */
+unsigned thread_count();
+
+/**
+ * @brief The ThreadPool class is a fixed size set of worker threads processing
+ * jobs in the order they were enqueued.
+ */
+class ThreadPool
+{
+	std::vector<std::thread> workers;
+	std::queue<std::function<void()>> jobs;
+	std::mutex mtx;
+	std::condition_variable job_cv;
+	std::condition_variable done_cv;
+	size_t pending;
+	bool stop;
+
+	void work();
+public:
+	/**
+	 * @brief ThreadPool starts n_threads workers. 0 uses thread_count().
+	 * @param n_threads
+	 */
+	ThreadPool(unsigned n_threads = 0);
+	/**
+	 * @brief Note: ~ThreadPool() waits for all enqueued jobs to finish!
+	 */
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	/**
+	 * @brief enqueue adds a job, which will be executed by one of the workers.
+	 * @param job
+	 */
+	void enqueue(std::function<void()> job);
+
+	/**
+	 * @brief wait blocks until all enqueued jobs are finished.
+	 */
+	void wait();
+
+	unsigned size() const {return static_cast<unsigned>(workers.size());}
+};
+
+/**
+ * @brief parallel_for calls f(i) for all i in [begin,end) using up to
+ * n_threads threads (0 uses thread_count()). Indices are handed out
+ * dynamically, so f may be called in any order. With one thread or a single
+ * index everything runs on the calling thread.
+ * @param begin
+ * @param end
+ * @param f
+ * @param n_threads
+ */
+void parallel_for(int begin, int end, const std::function<void(int)>& f,
+				  unsigned n_threads = 0);
+}
@@ -0,0 +1,300 @@
+#include "td_view.h"
+#include <cstdio>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace td
+{
+
+MappedFile::MappedFile()
+	:map(nullptr),map_size(0)
+#ifdef _WIN32
+	  ,file(INVALID_HANDLE_VALUE),mapping(nullptr)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open(const std::string &path)
+{
+	close();
+#ifdef _WIN32
+	file = CreateFileA(path.c_str(),GENERIC_READ,FILE_SHARE_READ,nullptr,
+					   OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,nullptr);
+	LARGE_INTEGER size;
+	if(file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file,&size))
+	{
+		fprintf(stderr,"Could not open '%s'\n",path.c_str());
+		close();
+		return false;
+	}
+	map_size = size.QuadPart;
+	if(map_size > 0)
+	{
+		mapping = CreateFileMappingA(file,nullptr,PAGE_READONLY,0,0,nullptr);
+		if(mapping)
+			map = (const uint8_t*)MapViewOfFile(mapping,FILE_MAP_READ,0,0,0);
+	}
+#else
+	const int fd = ::open(path.c_str(),O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd,&st) != 0)
+	{
+		fprintf(stderr,"Could not open '%s'\n",path.c_str());
+		if(fd >= 0)
+			::close(fd);
+		return false;
+	}
+	map_size = st.st_size;
+	if(map_size > 0)
+	{
+		void* m = mmap(nullptr,map_size,PROT_READ,MAP_PRIVATE,fd,0);
+		map = m == MAP_FAILED ? nullptr : (const uint8_t*)m;
+	}
+	// the mapping stays valid without the descriptor
+	::close(fd);
+#endif
+	if(!map && map_size > 0)
+	{
+		fprintf(stderr,"Could not map '%s'\n",path.c_str());
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+	if(map)
+		UnmapViewOfFile(map);
+	if(mapping)
+		CloseHandle(mapping);
+	if(file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	mapping = nullptr;
+	file = INVALID_HANDLE_VALUE;
+#else
+	if(map)
+		munmap((void*)map,map_size);
+#endif
+	map = nullptr;
+	map_size = 0;
+}
+
+TextureDataView::TextureDataView()
+	:version_(0)
+{
+}
+
+TextureDataView::~TextureDataView()
+{
+	close();
+}
+
+bool TextureDataView::open(const std::string &path)
+{
+	close();
+	if(!file.open(path))
+		return false;
+	if(!parse())
+	{
+		fprintf(stderr,"'%s' is no valid .td file\n",path.c_str());
+		close();
+		return false;
+	}
+	return true;
+}
+
+void TextureDataView::close()
+{
+	layers.clear();
+	checksums.clear();
+	version_ = 0;
+	file.close();
+}
+
+/**
+ * See td.h for the layouts of v1 and v2 files.
+ */
+bool TextureDataView::parse()
+{
+	const uint8_t* map = file.data();
+	const uint64_t map_size = file.size();
+	uint32_t first = 0;
+	if(map_size < sizeof(first))
+		return false;
+	memcpy(&first,map,sizeof(first));
+	return first == TD_MAGIC ? parse_table() : parse_v1();
+}
+
+bool TextureDataView::parse_table()
+{
+	const uint8_t* map = file.data();
+	const uint64_t map_size = file.size();
+	FileHeader fh;
+	if(map_size < sizeof(fh))
+		return false;
+	memcpy(&fh,map,sizeof(fh));
+	if(fh.version < 2 || fh.version > TD_VERSION ||
+	   fh.alignment == 0 || (fh.alignment&(fh.alignment-1)))
+		return false;
+	const uint32_t es = entry_size(fh.version);
+	if(fh.n_layers > (map_size-sizeof(fh))/es)
+		return false;
+	version_ = fh.version;
+
+	const uint8_t* table = map+sizeof(fh);
+	layers.resize(fh.n_layers);
+	checksums.resize(fh.n_layers);
+	for(uint32_t i = 0 ; i < fh.n_layers;i++)
+	{
+		LayerEntry e;
+		e.codec = Codec::NONE;
+		e.chunk_size = 0;
+		memcpy(&e,table+i*es,es);
+		if(e.w < 0 || e.h < 0 || !valid_format(e.frmt) || !valid_type(e.type))
+			return false;
+		if(e.codec != Codec::NONE && e.codec != Codec::LZ && e.codec != Codec::PREDICTIVE)
+			return false;
+		TextureLayerView& l = layers[i];
+		l = {e.lvl,e.w,e.h,e.frmt,e.type,nullptr,e.codec,nullptr,e.size,e.chunk_size};
+		if((e.codec == Codec::NONE && e.size != l.size()) ||
+		   e.offset > map_size || map_size-e.offset < e.size)
+			return false;
+		l.payload = map+e.offset;
+		if(e.codec == Codec::NONE)
+			l.data = l.payload;
+		checksums[i] = e.checksum;
+	}
+	return true;
+}
+
+bool TextureDataView::parse_v1()
+{
+	const uint8_t* map = file.data();
+	const uint64_t map_size = file.size();
+	uint64_t pos = 0;
+	auto read = [&](void* dst, uint64_t n)
+	{
+		if(map_size-pos < n)
+			return false;
+		memcpy(dst,map+pos,n);
+		pos += n;
+		return true;
+	};
+
+	uint32_t n_layers = 0;
+	if(!read(&n_layers,sizeof(n_layers)))
+		return false;
+	// every layer needs at least its header
+	if(n_layers > (map_size-pos)/20)
+		return false;
+	version_ = 1;
+
+	layers.resize(n_layers);
+	for(auto& l : layers)
+	{
+		if(!read(&l.lvl,sizeof(l.lvl)) || !read(&l.w,sizeof(l.w)) ||
+		   !read(&l.h,sizeof(l.h)) || !read(&l.frmt,sizeof(l.frmt)) ||
+		   !read(&l.type,sizeof(l.type)))
+			return false;
+		if(l.w < 0 || l.h < 0 || !valid_format(l.frmt) || !valid_type(l.type))
+			return false;
+		if(map_size-pos < l.size())
+			return false;
+		l.data = l.payload = map+pos;
+		l.codec = Codec::NONE;
+		l.payload_size = l.size();
+		l.chunk_size = 0;
+		pos += l.size();
+	}
+	return true;
+}
+
+bool TextureDataView::verify(size_t i) const
+{
+	const TextureLayerView& l = layers[i];
+	return version_ < 2 || crc32(l.payload,l.payload_size) == checksums[i];
+}
+
+bool TextureDataView::decompress(size_t i, void *dst) const
+{
+	const TextureLayerView& l = layers[i];
+	return decompress_layer(dst,l.w,l.h,l.frmt,l.type,l.codec,l.payload,l.payload_size,
+							l.chunk_size);
+}
+
+bool KtxView::open(const std::string &path)
+{
+	close();
+	if(!file.open(path))
+		return false;
+	if(!parse())
+	{
+		fprintf(stderr,"'%s' is no supported KTX file\n",path.c_str());
+		close();
+		return false;
+	}
+	return true;
+}
+
+void KtxView::close()
+{
+	levels.clear();
+	header_ = KtxHeader();
+	file.close();
+}
+
+bool KtxView::parse()
+{
+	const uint8_t* map = file.data();
+	const uint64_t map_size = file.size();
+	Format frmt;
+	DType type;
+	uint32_t n;
+	if(map_size < sizeof(header_))
+		return false;
+	memcpy(&header_,map,sizeof(header_));
+	if(!ktx_layout(header_,frmt,type,n) || header_.key_value_bytes > map_size-sizeof(header_))
+		return false;
+
+	Format kf;
+	if(is_compressed(type) && ktx_key_format(map+sizeof(header_),header_.key_value_bytes,kf))
+		frmt = kf;
+	uint64_t pos = sizeof(header_)+header_.key_value_bytes;
+	levels.resize(n);
+	for(uint32_t i = 0 ; i < n;i++)
+	{
+		KtxLevel& l = levels[i];
+		l.lvl = i;
+		l.w = std::max(1u,header_.pixel_width>>i);
+		l.h = std::max(1u,header_.pixel_height>>i);
+		l.frmt = frmt;
+		l.type = type;
+		if(map_size-pos < sizeof(l.size))
+			return false;
+		memcpy(&l.size,map+pos,sizeof(l.size));
+		pos += sizeof(l.size);
+		if(l.size != ktx_image_size(l.w,l.h,frmt,type) || map_size-pos < l.size)
+			return false;
+		l.data = map+pos;
+		// levels are padded to 4 bytes, the last one may end the file
+		pos = std::min<uint64_t>(map_size,(pos+l.size+3)/4*4);
+	}
+	return true;
+}
+
+}
@@ -0,0 +1,201 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "td.h"
+namespace td {
+
+/**
+ * @brief The MappedFile class maps a whole file read-only into memory.
+ */
+class MappedFile
+{
+	const uint8_t* map;
+	uint64_t map_size;
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#endif
+
+public:
+	MappedFile();
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	/**
+	 * @brief open maps the file at path, closing a previously opened one.
+	 * @param path
+	 * @return false if the file could not be opened or mapped.
+	 */
+	bool open(const std::string& path);
+
+	/**
+	 * @brief close unmaps the file.
+	 */
+	void close();
+
+	const uint8_t* data() const {return map;}
+	uint64_t size() const {return map_size;}
+};
+
+/**
+ * @brief The TextureLayerView struct describes a TextureLayer of a mapped
+ * .td file. data points into the mapping and stays valid as long as the
+ * TextureDataView it belongs to is open. Compressed layers have no data, see
+ * TextureDataView::decompress.
+ */
+struct TextureLayerView
+{
+	int32_t lvl;
+	int32_t w;
+	int32_t h;
+	Format frmt;
+	DType type;
+	const void* data;
+
+	Codec codec;
+	const void* payload; // the stored bytes (data for Codec::NONE)
+	uint64_t payload_size;
+	uint32_t chunk_size;
+
+	/**
+	 * @brief size returns the number of bytes of data.
+	 */
+	uint64_t size() const
+	{
+		return layer_size(w,h,frmt,type);
+	}
+};
+
+/**
+ * @brief The TextureDataView class is a read-only alternative to TextureData,
+ * which maps a .td file into memory instead of reading it. The layers point
+ * into the mapping, so opening a file neither copies nor allocates the pixel
+ * data, and pages are only loaded when they are accessed (e.g. by
+ * glTexImage2D). The layer table is validated against the file length.
+ * v3, v2 and v1 files are supported, in v2 and later any layer is found
+ * without touching the others. Checksums are only verified on request.
+ */
+class TextureDataView
+{
+	std::vector<TextureLayerView> layers;
+	std::vector<uint32_t> checksums;
+	MappedFile file;
+	uint32_t version_;
+
+	bool parse();
+	bool parse_v1();
+	bool parse_table();
+
+public:
+
+	TextureDataView();
+	~TextureDataView();
+	TextureDataView(const TextureDataView&) = delete;
+	TextureDataView& operator=(const TextureDataView&) = delete;
+
+	/**
+	 * @brief open maps the .td file at path, closing a previously opened one.
+	 * @param path
+	 * @return false if the file could not be mapped or is no valid .td file.
+	 */
+	bool open(const std::string& path);
+
+	/**
+	 * @brief close unmaps the file, all TextureLayerViews become invalid.
+	 */
+	void close();
+
+	/**
+	 * @brief verify checks the checksum of layer i (always true for v1 files,
+	 * which have none). This reads the whole layer.
+	 * @param i
+	 * @return
+	 */
+	bool verify(size_t i) const;
+
+	/**
+	 * @brief decompress writes the pixels of layer i to dst, which has to hold
+	 * operator[](i).size() bytes. Uncompressed layers are copied.
+	 * @param i
+	 * @param dst
+	 * @return false if the payload is corrupted.
+	 */
+	bool decompress(size_t i, void* dst) const;
+
+	/**
+	 * @brief version returns the version of the file (1 to 3), 0 if none is
+	 * open.
+	 */
+	uint32_t version() const {return version_;}
+
+	size_t size() const {return layers.size();}
+	const TextureLayerView& operator[](size_t i) const {return layers[i];}
+
+	auto begin() const -> decltype(layers.cbegin()){return layers.cbegin();}
+	auto end() const -> decltype(layers.cend()){return layers.cend();}
+};
+
+/**
+ * @brief The KtxLevel struct describes a mip-map-level of a mapped KTX file.
+ * data points into the mapping and holds size bytes, as they are passed to
+ * glTexImage2D (rows padded to 4 bytes) or glCompressedTexImage2D.
+ */
+struct KtxLevel
+{
+	int32_t lvl;
+	int32_t w;
+	int32_t h;
+	Format frmt;
+	DType type;
+	const void* data;
+	uint32_t size;
+};
+
+/**
+ * @brief The KtxView class maps a KTX 1.1 file (see KtxHeader) and points to
+ * its levels, so they can be uploaded without copying. The levels are
+ * validated against the file length when it is opened.
+ */
+class KtxView
+{
+	std::vector<KtxLevel> levels;
+	KtxHeader header_;
+	MappedFile file;
+
+	bool parse();
+
+public:
+
+	KtxView():header_() {}
+	KtxView(const KtxView&) = delete;
+	KtxView& operator=(const KtxView&) = delete;
+
+	/**
+	 * @brief open maps the KTX file at path, closing a previously opened one.
+	 * @param path
+	 * @return false if the file could not be mapped or is no supported KTX
+	 * file (see ktx_layout).
+	 */
+	bool open(const std::string& path);
+
+	/**
+	 * @brief close unmaps the file, all KtxLevels become invalid.
+	 */
+	void close();
+
+	/**
+	 * @brief header returns the header of the file, e.g. for the GL enums
+	 * (gl_internal_format, gl_format and gl_type).
+	 */
+	const KtxHeader& header() const {return header_;}
+
+	size_t size() const {return levels.size();}
+	const KtxLevel& operator[](size_t i) const {return levels[i];}
+
+	auto begin() const -> decltype(levels.cbegin()){return levels.cbegin();}
+	auto end() const -> decltype(levels.cend()){return levels.cend();}
+};
+}